@@ -0,0 +1,396 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <stdint.h>
+#include "protodec.h"
+#include "bench_utils.h"
+
+// Allocations made by the benchmarked code, counted by replacing the global operator new
+static uint64_t allocCount = 0;
+static uint64_t allocBytes = 0;
+
+void *operator new(std::size_t size)
+{
+    allocCount++;
+    allocBytes += size;
+    void *p = std::malloc(size > 0 ? size : 1);
+    if (p == nullptr) {throw std::bad_alloc();}
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+/// Parameters of the synthetic corpora, set from the command line
+struct Options
+{
+    size_t fields = 64;       // Fields of the wide, string heavy and adversarial messages
+    size_t depth = 32;        // Nesting of the deep and adversarial messages
+    size_t values = 256;      // Values of each packed field
+    size_t stringSize = 64;   // Length of the strings
+    uint32_t seed = 1;        // Seed of the random bytes in the adversarial message
+    double minTime = 0.2;     // Seconds each repetition of a benchmark runs at least
+    int repetitions = 5;      // Repetitions of each benchmark, the median is reported
+    std::string filter;       // Only run benchmarks whose "name/corpus" contains this
+    bool json = false;        // Write the results as JSON
+};
+
+/// Synthetic message with the shape of a corpus
+struct Corpus
+{
+    std::string name;
+    std::string data;
+
+    Buffer buffer() const
+    {
+        Buffer b;
+        b.start = (const uint8_t *)data.data();
+        b.end = b.start + data.size();
+        return b;
+    }
+};
+
+/// Many fields of all wire types side by side
+static Corpus wideCorpus(const Options &options)
+{
+    Corpus corpus = {"wide", ""};
+    for (size_t i = 1; i <= options.fields; i++)
+    {
+        switch (i % 4)
+        {
+        case 0: corpus.data += utils::encodeInt(i, (int64_t)(i * 1000003)); break;
+        case 1: corpus.data += utils::encodeStr(i, "value " + std::to_string(i)); break;
+        case 2: corpus.data += utils::encodeDouble(i, i * 0.5); break;
+        case 3: corpus.data += utils::encodeFloat(i, i * 0.25f); break;
+        }
+    }
+    return corpus;
+}
+
+/// Messages nested in field 2 of their parent, each level has a number in field 1
+static Corpus deepCorpus(const Options &options)
+{
+    std::string message = utils::encodeInt(1, 42) + utils::encodeStr(3, "leaf");
+    for (size_t i = 0; i < options.depth; i++)
+    {
+        message = utils::encodeInt(1, (int64_t)i) + utils::encodeStr(2, message);
+    }
+    return Corpus{"deep", message};
+}
+
+/// Packed repeated varint, fixed32 and fixed64 fields
+static Corpus packedCorpus(const Options &options)
+{
+    std::string varints, fixed32, fixed64;
+    for (size_t i = 0; i < options.values; i++)
+    {
+        utils::appendVarint(i * 37, varints);
+        utils::appendFixed((uint32_t)i, fixed32);
+        utils::appendFixed((double)i, fixed64);
+    }
+    Corpus corpus = {"packed", ""};
+    corpus.data = utils::encodeStr(1, varints) + utils::encodeStr(2, fixed32) + utils::encodeStr(3, fixed64);
+    return corpus;
+}
+
+/// Text fields, which are also tried as sub messages
+static Corpus stringCorpus(const Options &options)
+{
+    static const char *words[] = {"lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit"};
+    Corpus corpus = {"string", ""};
+    for (size_t i = 1; i <= options.fields; i++)
+    {
+        std::string text;
+        for (size_t j = i; text.size() < options.stringSize; j++)
+        {
+            text += words[j % 8];
+            text += ' ';
+        }
+        text.resize(options.stringSize);
+        corpus.data += utils::encodeStr(i, text);
+    }
+    return corpus;
+}
+
+/// Length delimited fields that make speculative decoding do as much work as possible before
+/// failing: random bytes, runs of valid fields ending with an invalid tag, and a chain of
+/// nested fields where every level ends with an invalid tag
+static Corpus adversarialCorpus(const Options &options)
+{
+    Corpus corpus = {"adversarial", ""};
+    uint32_t state = options.seed;
+    for (size_t i = 1; i <= options.fields; i++)
+    {
+        std::string value;
+        if (i % 2 == 0)
+        {
+            while (value.size() < options.stringSize)
+            {
+                state = state * 1664525u + 1013904223u;
+                value.push_back((char)(state >> 24));
+            }
+        }
+        else
+        {
+            while (value.size() + 3 <= options.stringSize) {value += "\x08\x01";}
+            value.push_back('\0');
+        }
+        corpus.data += utils::encodeStr(i, value);
+    }
+
+    std::string chain = "\x08\x01";
+    for (size_t i = 0; i < options.depth; i++)
+    {
+        chain = utils::encodeStr(1, chain) + std::string(1, '\0');
+    }
+    corpus.data += utils::encodeStr(options.fields + 1, chain);
+    return corpus;
+}
+
+/// Result of a benchmark, times are the median of the repetitions
+struct Result
+{
+    std::string name;
+    std::string corpus;
+    uint64_t iterations;
+    double nsPerOp;
+    double bytesPerSecond;
+    double allocsPerOp;
+    double allocBytesPerOp;
+};
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// Run an operation until it has taken the minimum time, then measure the repetitions with the
+/// same number of iterations. Each call of op is one operation on bytesPerOp bytes.
+template<typename Op>
+static bool runBenchmark(const Options &options, const char *name, const Corpus &corpus, double bytesPerOp, Op op, std::vector<Result> &results)
+{
+    std::string id = std::string(name) + "/" + corpus.name;
+    if (id.find(options.filter) == std::string::npos) {return false;}
+
+    // Find the number of iterations that takes the minimum time
+    uint64_t iterations = 1;
+    while (true)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < iterations; i++) {op();}
+        double elapsed = seconds(start);
+        if (elapsed >= options.minTime || iterations >= (1ull << 40)) {break;}
+        double scale = elapsed > 0 ? options.minTime / elapsed * 1.2 : 100;
+        iterations = (uint64_t)(iterations * std::min(std::max(scale, 2.0), 100.0));
+    }
+
+    std::vector<double> times;
+    uint64_t count = allocCount;
+    uint64_t bytes = allocBytes;
+    for (int r = 0; r < options.repetitions; r++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < iterations; i++) {op();}
+        times.push_back(seconds(start) * 1e9 / iterations);
+    }
+    uint64_t ops = iterations * options.repetitions;
+    std::sort(times.begin(), times.end());
+
+    Result result;
+    result.name = name;
+    result.corpus = corpus.name;
+    result.iterations = iterations;
+    result.nsPerOp = times[times.size() / 2];
+    result.bytesPerSecond = bytesPerOp * 1e9 / result.nsPerOp;
+    result.allocsPerOp = (double)(allocCount - count) / ops;
+    result.allocBytesPerOp = (double)(allocBytes - bytes) / ops;
+    results.push_back(result);
+
+    if (!options.json)
+    {
+        printf("%-14s %-12s %12.1f ns/op %10.1f MB/s %9.2f allocs/op %11.1f B/op\n", name, corpus.name.c_str(),
+               result.nsPerOp, result.bytesPerSecond / 1e6, result.allocsPerOp, result.allocBytesPerOp);
+    }
+    return true;
+}
+
+/// Collect the fields with sub fields, and the length delimited fields without
+static void collectFields(Field *field, std::vector<Field *> &parents, std::vector<Field *> &leaves)
+{
+    if (!field->subFields.empty()) {parents.push_back(field);}
+    else if (field->wireType == WIRETYPE_LEN) {leaves.push_back(field);}
+    for (Field &subField : field->subFields) {collectFields(&subField, parents, leaves);}
+}
+
+static volatile uint64_t sink;
+
+/// Write strings as JSON, one string per operation
+static void runStrings(const Options &options, const char *name, const Corpus &corpus, const std::vector<Field *> &strings, std::vector<Result> &results)
+{
+    if (strings.empty()) {return;}
+    double size = 0;
+    for (Field *field : strings) {size += field->value.size();}
+
+    size_t next = 0;
+    std::ostringstream os;
+    runBenchmark(options, name, corpus, size / strings.size(), [&]() {
+        os.str(std::string());
+        toJson(strings[next++ % strings.size()], os, false);
+        sink = sink + os.tellp();
+    }, results);
+}
+
+static void runCorpus(const Options &options, const Corpus &corpus, std::vector<Result> &results)
+{
+    Buffer buffer = corpus.buffer();
+    double size = (double)buffer.size();
+
+    runBenchmark(options, "decode", corpus, size, [&]() {
+        Field field = decodeProtobuf(buffer, false);
+        sink = sink + field.subFields.size();
+    }, results);
+
+    runBenchmark(options, "decode_packed", corpus, size, [&]() {
+        Field field = decodeProtobuf(buffer, true);
+        sink = sink + field.subFields.size();
+    }, results);
+
+    runBenchmark(options, "is_message", corpus, size, [&]() {
+        sink = sink + isMessage(buffer);
+    }, results);
+
+    Field root = decodeProtobuf(buffer, false);
+    std::vector<Field *> parents, leaves;
+    collectFields(&root, parents, leaves);
+
+    // Look up each field of each message in turn
+    std::vector< std::pair<Field *, Field *> > lookups;
+    for (Field *parent : parents)
+    {
+        for (Field &subField : parent->subFields) {lookups.push_back(std::make_pair(parent, &subField));}
+    }
+    size_t next = 0;
+    if (!lookups.empty())
+    {
+        runBenchmark(options, "get_sub_field", corpus, 0, [&]() {
+            const std::pair<Field *, Field *> &lookup = lookups[next++ % lookups.size()];
+            sink = sink + (lookup.first->getSubField(lookup.second->fieldNum, (WireType)lookup.second->wireType, 0) != nullptr);
+        }, results);
+    }
+
+    runBenchmark(options, "to_json", corpus, size, [&]() {
+        std::ostringstream os;
+        toJson(&root, os, false);
+        sink = sink + os.tellp();
+    }, results);
+
+    if (leaves.empty()) {return;}
+    double leafSize = 0;
+    for (Field *leaf : leaves) {leafSize += leaf->value.size();}
+    leafSize /= leaves.size();
+
+    next = 0;
+    runBenchmark(options, "is_text", corpus, leafSize, [&]() {
+        sink = sink + isText(leaves[next++ % leaves.size()]->value);
+    }, results);
+
+    // Strings are written as they are when printable and base64 encoded otherwise
+    std::vector<Field *> printable, binary;
+    for (Field *leaf : leaves)
+    {
+        const uint8_t *p = leaf->value.start;
+        while (p < leaf->value.end && isprint(*p)) {p++;}
+        (p == leaf->value.end ? printable : binary).push_back(leaf);
+    }
+    runStrings(options, "printable", corpus, printable, results);
+    runStrings(options, "base64", corpus, binary, results);
+}
+
+static void runPacked(const Options &options, const Corpus &corpus, std::vector<Result> &results)
+{
+    // Values are read by index from the packed varint field, as protobuf_extract does
+    Field root = decodeProtobuf(corpus.buffer(), false);
+    Field *packed = root.getSubField(1, WIRETYPE_LEN, 0);
+    if (packed == nullptr || options.values == 0) {return;}
+
+    int64_t index = 0;
+    runBenchmark(options, "get_varint", corpus, (double)packed->value.size(), [&]() {
+        int64_t value;
+        sink = sink + getInt64(&packed->value, &value, index++ % (int64_t)options.values);
+    }, results);
+}
+
+static void printJson(const Options &options, const std::vector<Result> &results)
+{
+    printf("{\"parameters\":{\"fields\":%zu,\"depth\":%zu,\"values\":%zu,\"string_size\":%zu,\"seed\":%u,\"min_time\":%g,\"repetitions\":%d},\n",
+           options.fields, options.depth, options.values, options.stringSize, options.seed, options.minTime, options.repetitions);
+    printf("\"benchmarks\":[");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result &r = results[i];
+        printf("%s\n{\"name\":\"%s\",\"corpus\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.3f,\"bytes_per_second\":%.0f,\"allocs_per_op\":%.3f,\"alloc_bytes_per_op\":%.1f}",
+               i > 0 ? "," : "", r.name.c_str(), r.corpus.c_str(), (unsigned long long)r.iterations,
+               r.nsPerOp, r.bytesPerSecond, r.allocsPerOp, r.allocBytesPerOp);
+    }
+    printf("\n]}\n");
+}
+
+static void usage()
+{
+    std::cerr << "usage: bench_protodec [--json] [--filter=TEXT] [--min-time=SECONDS] [--repetitions=N]\n"
+                 "                      [--fields=N] [--depth=N] [--values=N] [--string-size=N] [--seed=N]\n";
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq);
+        const char *value = eq == std::string::npos ? "" : argv[i] + eq + 1;
+
+        if (key == "--json") {options.json = true;}
+        else if (key == "--filter") {options.filter = value;}
+        else if (key == "--min-time") {options.minTime = atof(value);}
+        else if (key == "--repetitions") {options.repetitions = std::max(1, atoi(value));}
+        else if (key == "--fields") {options.fields = strtoul(value, nullptr, 10);}
+        else if (key == "--depth") {options.depth = strtoul(value, nullptr, 10);}
+        else if (key == "--values") {options.values = strtoul(value, nullptr, 10);}
+        else if (key == "--string-size") {options.stringSize = strtoul(value, nullptr, 10);}
+        else if (key == "--seed") {options.seed = (uint32_t)strtoul(value, nullptr, 10);}
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    runCorpus(options, wideCorpus(options), results);
+    runCorpus(options, deepCorpus(options), results);
+    Corpus packed = packedCorpus(options);
+    runCorpus(options, packed, results);
+    runPacked(options, packed, results);
+    runCorpus(options, stringCorpus(options), results);
+    runCorpus(options, adversarialCorpus(options), results);
+
+    if (options.json) {printJson(options, results);}
+    return 0;
+}
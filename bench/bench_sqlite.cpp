@@ -0,0 +1,449 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <sqlite3.h>
+#include "bench_utils.h"
+
+// Path of the built extension, set by CMake
+#ifndef SQLITE_PROTOBUF_EXTENSION
+#define SQLITE_PROTOBUF_EXTENSION "./sqlite_protobuf"
+#endif
+
+/// Parameters of the benchmark, set from the command line
+struct Options
+{
+    std::string db = "bench_sqlite.db";             // Database file, created unless reused
+    std::string extension = SQLITE_PROTOBUF_EXTENSION;
+    int64_t rows = 1000000;  // Rows of the generated table
+    size_t fields = 8;       // Scalar fields after the fixed fields of each message
+    size_t depth = 3;        // Nesting of the sub message in field 3
+    size_t repeated = 4;     // Occurrences of the repeated sub message in field 4
+    size_t stringSize = 16;  // Length of the strings
+    int repetitions = 3;     // Warm runs of each query, the median is reported
+    std::string filter;      // Only run queries whose name contains this
+    std::vector<int> threads; // Thread counts to measure the scaling of protobuf_extract with, instead of the queries
+    double seconds = 2;      // Time each thread count runs for
+    int64_t chunk = 1000;    // Rows read by each query of the scaling benchmark
+    bool reuse = false;      // Keep the table of an earlier run if the database has one
+    bool json = false;       // Write the results as JSON
+};
+
+/// Message of a row: 1 row number, 2 string, 3 nested sub message, 4 repeated sub message,
+/// then scalar fields from 5 on
+static std::string makeMessage(const Options &options, int64_t row)
+{
+    std::string text = "name " + std::to_string(row);
+    text.resize(std::max(options.stringSize, text.size()), '.');
+
+    std::string nested = utils::encodeInt(1, row + (int64_t)options.depth) + utils::encodeStr(2, text);
+    for (size_t d = options.depth; d > 1; d--)
+    {
+        nested = utils::encodeInt(1, row + (int64_t)d - 1) + utils::encodeStr(2, text) + utils::encodeStr(3, nested);
+    }
+
+    std::string message = utils::encodeInt(1, row) + utils::encodeStr(2, text);
+    if (options.depth > 0) {message += utils::encodeStr(3, nested);}
+    for (size_t i = 0; i < options.repeated; i++)
+    {
+        message += utils::encodeStr(4, utils::encodeInt(1, row * (int64_t)options.repeated + (int64_t)i) + utils::encodeStr(2, "item " + std::to_string(i)));
+    }
+    for (size_t i = 0; i < options.fields; i++)
+    {
+        message += utils::encodeInt(5 + (uint32_t)i, row * (int64_t)(i + 1));
+    }
+    return message;
+}
+
+static void fail(sqlite3 *db, const char *what)
+{
+    fprintf(stderr, "%s: %s\n", what, db != nullptr ? sqlite3_errmsg(db) : "out of memory");
+    exit(1);
+}
+
+static void exec(sqlite3 *db, const std::string &sql)
+{
+    char *error = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &error) != SQLITE_OK)
+    {
+        fprintf(stderr, "%s: %s\n", sql.c_str(), error != nullptr ? error : "");
+        exit(1);
+    }
+}
+
+/// Open a connection to the database and load the extension into it
+static sqlite3 *openDatabase(const Options &options)
+{
+    sqlite3 *db = nullptr;
+    if (sqlite3_open(options.db.c_str(), &db) != SQLITE_OK) {fail(db, "Could not open database");}
+    sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 1, nullptr);
+
+    char *error = nullptr;
+    if (sqlite3_load_extension(db, options.extension.c_str(), nullptr, &error) != SQLITE_OK)
+    {
+        fprintf(stderr, "Could not load %s: %s\n", options.extension.c_str(), error != nullptr ? error : "");
+        exit(1);
+    }
+    return db;
+}
+
+/// Run a query to completion, returning the number of result rows
+static int64_t runQuery(sqlite3 *db, const std::string &sql)
+{
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {fail(db, sql.c_str());}
+    int64_t rows = 0;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {rows++;}
+    if (rc != SQLITE_DONE) {fail(db, sql.c_str());}
+    sqlite3_finalize(stmt);
+    return rows;
+}
+
+static int64_t queryInt(sqlite3 *db, const std::string &sql)
+{
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {fail(db, sql.c_str());}
+    int64_t value = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+/// Create the table of messages, unless an existing one is reused
+static void generate(const Options &options)
+{
+    sqlite3 *db = openDatabase(options);
+    if (options.reuse && queryInt(db, "SELECT count(*) FROM sqlite_master WHERE name = 'messages'") > 0)
+    {
+        sqlite3_close(db);
+        return;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    exec(db, "PRAGMA journal_mode = WAL; PRAGMA synchronous = OFF; DROP TABLE IF EXISTS messages;"
+             "CREATE TABLE messages(id INTEGER PRIMARY KEY, data BLOB); BEGIN;");
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "INSERT INTO messages(id, data) VALUES (?1, ?2)", -1, &stmt, nullptr) != SQLITE_OK) {fail(db, "INSERT");}
+    for (int64_t row = 1; row <= options.rows; row++)
+    {
+        std::string message = makeMessage(options, row);
+        sqlite3_bind_int64(stmt, 1, row);
+        sqlite3_bind_blob(stmt, 2, message.data(), (int)message.size(), SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {fail(db, "INSERT");}
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    exec(db, "COMMIT; PRAGMA wal_checkpoint(TRUNCATE);");
+    sqlite3_close(db);
+
+    if (!options.json)
+    {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("generated %lld rows in %.2f s\n", (long long)options.rows, elapsed);
+    }
+}
+
+/// Decode cache counters of protobuf_extract, all -1 when the statistics are compiled out
+struct CacheCounters
+{
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+};
+
+static CacheCounters cacheCounters(sqlite3 *db)
+{
+    CacheCounters counters = {-1, -1, -1};
+    sqlite3_stmt *stmt = nullptr;
+    const char *sql = "SELECT cache_hits, cache_misses, cache_evictions FROM protobuf_stats WHERE function = 'protobuf_extract' AND path IS NULL";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        counters.hits = sqlite3_column_int64(stmt, 0);
+        counters.misses = sqlite3_column_int64(stmt, 1);
+        counters.evictions = sqlite3_column_int64(stmt, 2);
+    }
+    sqlite3_finalize(stmt);
+    return counters;
+}
+
+struct Query
+{
+    std::string name;
+    std::string sql;
+};
+
+/// Result of a query run on a new connection (cold) or again on the same connection (warm)
+struct Result
+{
+    std::string name;
+    std::string mode;
+    double seconds;
+    double rowsPerSecond;
+    double cacheHitRatio; // Decode cache hits of protobuf_extract per lookup, -1 without statistics
+};
+
+static double measure(sqlite3 *db, const Query &query, CacheCounters &delta)
+{
+    CacheCounters before = cacheCounters(db);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    runQuery(db, query.sql);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    CacheCounters after = cacheCounters(db);
+    delta.hits = before.hits < 0 ? -1 : after.hits - before.hits;
+    delta.misses = before.misses < 0 ? -1 : after.misses - before.misses;
+    delta.evictions = before.evictions < 0 ? -1 : after.evictions - before.evictions;
+    return elapsed;
+}
+
+static void addResult(const Options &options, const Query &query, const char *mode, double seconds, const CacheCounters &delta, std::vector<Result> &results)
+{
+    Result result;
+    result.name = query.name;
+    result.mode = mode;
+    result.seconds = seconds;
+    result.rowsPerSecond = options.rows / seconds;
+    result.cacheHitRatio = delta.hits < 0 || delta.hits + delta.misses == 0 ? -1 : (double)delta.hits / (delta.hits + delta.misses);
+    results.push_back(result);
+
+    if (!options.json)
+    {
+        printf("%-16s %-5s %10.3f s %14.0f rows/s", query.name.c_str(), mode, seconds, result.rowsPerSecond);
+        if (result.cacheHitRatio >= 0) {printf(" %6.1f%% cache hits", result.cacheHitRatio * 100);}
+        printf("\n");
+    }
+}
+
+static std::vector<Query> queries(const Options &options)
+{
+    // Path of the number at the bottom of the nested sub message
+    std::string deepest = "$";
+    for (size_t d = 0; d < options.depth; d++) {deepest += ".3";}
+    deepest += ".1";
+    std::string scalar = options.fields > 0 ? "$.5" : "$.1";
+
+    std::vector<Query> list = {
+        {"extract_single", "SELECT sum(protobuf_extract(data, '$.1', 'int64')) FROM messages"},
+        {"extract_multi", "SELECT sum(protobuf_extract(data, '$.1', 'int64')), sum(length(protobuf_extract(data, '$.2', 'string'))), "
+                          "sum(protobuf_extract(data, '" + deepest + "', 'int64')), sum(protobuf_extract(data, '$.4[-1].1', 'int64')) FROM messages"},
+        {"extract_filter", "SELECT count(*) FROM messages WHERE protobuf_extract(data, '" + scalar + "', 'int64') % 10 = 0"},
+        {"to_json", "SELECT sum(length(protobuf_to_json(data))) FROM messages"},
+        {"each_join", "SELECT count(*), sum(protobuf_extract(e.value, '$.1', 'int64')) FROM messages, protobuf_each(messages.data) AS e WHERE e.field = 4"},
+        {"each_filter", "SELECT count(*) FROM messages, protobuf_each(messages.data, '$.3') AS e WHERE e.field = 1 AND e.as_int % 2 = 0"},
+    };
+    return list;
+}
+
+/// Throughput of protobuf_extract with a number of threads
+struct Scaling
+{
+    int threads;
+    double rowsPerSecond;
+    double cacheHitRatio;
+};
+
+/// Run protobuf_extract over chunks of rows on each thread, with a connection per thread to the
+/// WAL database, until the time is up, and return the rows read per second by all threads
+static double runThreads(const Options &options, const std::string &sql, int numThreads)
+{
+    int64_t numChunks = (options.rows + options.chunk - 1) / options.chunk;
+    std::atomic<int> ready(0);
+    std::atomic<bool> start(false);
+    std::atomic<bool> stop(false);
+    std::atomic<int64_t> nextChunk(0);
+    std::atomic<int64_t> rows(0);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++)
+    {
+        threads.push_back(std::thread([&]() {
+            sqlite3 *db = openDatabase(options);
+            sqlite3_stmt *stmt = nullptr;
+            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {fail(db, sql.c_str());}
+            ready++;
+            while (!start) {std::this_thread::yield();}
+
+            int64_t count = 0;
+            while (!stop)
+            {
+                int64_t first = (nextChunk++ % numChunks) * options.chunk + 1;
+                sqlite3_bind_int64(stmt, 1, first);
+                sqlite3_bind_int64(stmt, 2, first + options.chunk - 1);
+                while (sqlite3_step(stmt) == SQLITE_ROW) {}
+                if (sqlite3_reset(stmt) != SQLITE_OK) {fail(db, sql.c_str());}
+                count += std::min(options.chunk, options.rows - first + 1);
+            }
+            rows += count;
+            sqlite3_finalize(stmt);
+            sqlite3_close(db);
+        }));
+    }
+
+    while (ready < numThreads) {std::this_thread::yield();}
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    start = true;
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.seconds));
+    stop = true;
+    for (std::thread &thread : threads) {thread.join();}
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return rows / elapsed;
+}
+
+static void runScaling(const Options &options, std::vector<Scaling> &results)
+{
+    // Several fields of each row, so the decode cache of each connection is hit as well as missed
+    std::string sql;
+    for (const Query &query : queries(options))
+    {
+        if (query.name == "extract_multi") {sql = query.sql + " WHERE id BETWEEN ?1 AND ?2";}
+    }
+
+    sqlite3 *db = openDatabase(options);
+    for (int threads : options.threads)
+    {
+        CacheCounters before = cacheCounters(db);
+        Scaling result;
+        result.threads = threads;
+        result.rowsPerSecond = runThreads(options, sql, threads);
+        CacheCounters after = cacheCounters(db);
+        int64_t hits = after.hits - before.hits;
+        int64_t misses = after.misses - before.misses;
+        result.cacheHitRatio = before.hits < 0 || hits + misses == 0 ? -1 : (double)hits / (hits + misses);
+        results.push_back(result);
+
+        if (!options.json)
+        {
+            double speedup = result.rowsPerSecond / results[0].rowsPerSecond * results[0].threads;
+            printf("%3d threads %14.0f rows/s %7.2fx speedup %6.1f%% efficiency", threads, result.rowsPerSecond, speedup, speedup / threads * 100);
+            if (result.cacheHitRatio >= 0) {printf(" %6.1f%% cache hits", result.cacheHitRatio * 100);}
+            printf("\n");
+        }
+    }
+    sqlite3_close(db);
+}
+
+static void printJson(const Options &options, const std::vector<Result> &results)
+{
+    printf("{\"parameters\":{\"rows\":%lld,\"fields\":%zu,\"depth\":%zu,\"repeated\":%zu,\"string_size\":%zu,\"repetitions\":%d,\"sqlite\":\"%s\"},\n",
+           (long long)options.rows, options.fields, options.depth, options.repeated, options.stringSize, options.repetitions, sqlite3_libversion());
+    printf("\"queries\":[");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result &r = results[i];
+        printf("%s\n{\"name\":\"%s\",\"mode\":\"%s\",\"seconds\":%.6f,\"rows_per_second\":%.0f,\"cache_hit_ratio\":",
+               i > 0 ? "," : "", r.name.c_str(), r.mode.c_str(), r.seconds, r.rowsPerSecond);
+        if (r.cacheHitRatio >= 0) {printf("%.4f}", r.cacheHitRatio);}
+        else {printf("null}");}
+    }
+    printf("\n]}\n");
+}
+
+static void printScalingJson(const Options &options, const std::vector<Scaling> &results)
+{
+    printf("{\"parameters\":{\"rows\":%lld,\"fields\":%zu,\"depth\":%zu,\"repeated\":%zu,\"string_size\":%zu,\"seconds\":%g,\"chunk\":%lld,\"sqlite\":\"%s\"},\n",
+           (long long)options.rows, options.fields, options.depth, options.repeated, options.stringSize, options.seconds, (long long)options.chunk, sqlite3_libversion());
+    printf("\"scaling\":[");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Scaling &r = results[i];
+        double speedup = r.rowsPerSecond / results[0].rowsPerSecond * results[0].threads;
+        printf("%s\n{\"threads\":%d,\"rows_per_second\":%.0f,\"speedup\":%.3f,\"cache_hit_ratio\":",
+               i > 0 ? "," : "", r.threads, r.rowsPerSecond, speedup);
+        if (r.cacheHitRatio >= 0) {printf("%.4f}", r.cacheHitRatio);}
+        else {printf("null}");}
+    }
+    printf("\n]}\n");
+}
+
+static void usage()
+{
+    std::cerr << "usage: bench_sqlite [--db=FILE] [--extension=PATH] [--reuse] [--json] [--filter=TEXT] [--repetitions=N]\n"
+                 "                    [--rows=N] [--fields=N] [--depth=N] [--repeated=N] [--string-size=N]\n"
+                 "                    [--threads=N,N,...] [--seconds=SECONDS] [--chunk=ROWS]\n";
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq);
+        const char *value = eq == std::string::npos ? "" : argv[i] + eq + 1;
+
+        if (key == "--db") {options.db = value;}
+        else if (key == "--extension") {options.extension = value;}
+        else if (key == "--reuse") {options.reuse = true;}
+        else if (key == "--json") {options.json = true;}
+        else if (key == "--filter") {options.filter = value;}
+        else if (key == "--repetitions") {options.repetitions = std::max(1, atoi(value));}
+        else if (key == "--rows") {options.rows = std::max(1ll, atoll(value));}
+        else if (key == "--fields") {options.fields = strtoul(value, nullptr, 10);}
+        else if (key == "--depth") {options.depth = strtoul(value, nullptr, 10);}
+        else if (key == "--repeated") {options.repeated = strtoul(value, nullptr, 10);}
+        else if (key == "--string-size") {options.stringSize = strtoul(value, nullptr, 10);}
+        else if (key == "--seconds") {options.seconds = atof(value);}
+        else if (key == "--chunk") {options.chunk = std::max(1ll, atoll(value));}
+        else if (key == "--threads")
+        {
+            for (const char *p = value; *p != '\0'; p += strcspn(p, ","), p += *p == ',')
+            {
+                options.threads.push_back(std::max(1, atoi(p)));
+            }
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    generate(options);
+    sqlite3 *db = openDatabase(options);
+    options.rows = queryInt(db, "SELECT count(*) FROM messages");
+    sqlite3_close(db);
+
+    if (!options.threads.empty())
+    {
+        std::vector<Scaling> scaling;
+        runScaling(options, scaling);
+        if (options.json) {printScalingJson(options, scaling);}
+        return 0;
+    }
+
+    std::vector<Result> results;
+    for (const Query &query : queries(options))
+    {
+        if (query.name.find(options.filter) == std::string::npos) {continue;}
+        CacheCounters delta;
+
+        // The first run on a new connection reads the pages and compiles the paths
+        db = openDatabase(options);
+        double cold = measure(db, query, delta);
+        addResult(options, query, "cold", cold, delta, results);
+
+        std::vector<double> times;
+        CacheCounters total = {0, 0, 0};
+        for (int r = 0; r < options.repetitions; r++)
+        {
+            times.push_back(measure(db, query, delta));
+            total.hits += delta.hits;
+            total.misses += delta.misses;
+            total.evictions += delta.evictions;
+        }
+        if (delta.hits < 0) {total.hits = -1;}
+        std::sort(times.begin(), times.end());
+        addResult(options, query, "warm", times[times.size() / 2], total, results);
+        sqlite3_close(db);
+    }
+
+    if (options.json) {printJson(options, results);}
+    return 0;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+// Encoding of protobuf fields for the synthetic messages of the benchmarks
+namespace utils
+{
+    inline void appendVarint(uint64_t n, std::string& buf)
+    {
+        char val;
+        do {
+            val = (n & 0xFF);
+            if (n > 0b01111111) {val = val | 0b10000000;}
+            n = n >> 7;
+            buf.append(1, val);
+        } while (n);
+    }
+
+    template<typename T>
+    inline void appendFixed(T n, std::string& buf)
+    {
+        buf.append((const char *)&n, sizeof(T)); // Little endian hosts only, like the tests
+    }
+
+    inline std::string encodeInt(uint32_t fieldNumber, int64_t num)
+    {
+        std::string buf;
+        appendVarint((fieldNumber << 3) | 0, buf);
+        appendVarint(num, buf);
+        return buf;
+    }
+
+    inline std::string encodeStr(uint32_t fieldNumber, const std::string& str)
+    {
+        std::string buf;
+        appendVarint((fieldNumber << 3) | 2, buf);
+        appendVarint(str.size(), buf);
+        buf.append(str);
+        return buf;
+    }
+
+    inline std::string encodeDouble(uint32_t fieldNumber, double num)
+    {
+        std::string buf;
+        appendVarint((fieldNumber << 3) | 1, buf);
+        appendFixed(num, buf);
+        return buf;
+    }
+
+    inline std::string encodeFloat(uint32_t fieldNumber, float num)
+    {
+        std::string buf;
+        appendVarint((fieldNumber << 3) | 5, buf);
+        appendFixed(num, buf);
+        return buf;
+    }
+}
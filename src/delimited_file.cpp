@@ -0,0 +1,169 @@
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 // Map files larger than 2 GB on 32 bit systems
+#endif
+
+#include "delimited_file.h"
+
+#include <string>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace sqlite_protobuf
+{
+
+#ifdef _WIN32
+    static std::wstring widen(const std::string &path)
+    {
+        std::wstring wpath(MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, NULL, 0), 0);
+        MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wpath[0], (int)wpath.size());
+        return wpath;
+    }
+#else
+    /// Modification time in nanoseconds, whole seconds would miss changes within the same second
+    static int64_t stat_mtime(const struct stat &st)
+    {
+#ifdef __APPLE__
+        return (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    }
+#endif
+
+    bool framing_from_string(const std::string &name, Framing *framing)
+    {
+        if (name == "varint") {*framing = FRAMING_VARINT; return true;}
+        if (name == "fixed32") {*framing = FRAMING_FIXED32; return true;}
+        if (name == "fixed32be") {*framing = FRAMING_FIXED32_BE; return true;}
+        return false;
+    }
+
+    bool file_stat(const std::string &path, int64_t *size, int64_t *mtime, uint64_t *inode)
+    {
+#ifdef _WIN32
+        // The file index is only available from an open handle, directories can not be opened without FILE_FLAG_BACKUP_SEMANTICS
+        HANDLE hFile = CreateFileW(widen(path).c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {return false;}
+        BY_HANDLE_FILE_INFORMATION info;
+        bool ok = GetFileInformationByHandle(hFile, &info) && !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+        CloseHandle(hFile);
+        if (!ok) {return false;}
+        *size = ((int64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+        *mtime = ((int64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+        *inode = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+        return true;
+#else
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {return false;}
+        *size = (int64_t)st.st_size;
+        *mtime = stat_mtime(st);
+        *inode = (uint64_t)st.st_ino;
+        return true;
+#endif
+    }
+
+    bool file_map(const std::string &path, FileMap *map)
+    {
+        map->data = nullptr;
+        map->handles[0] = map->handles[1] = nullptr;
+        if (!file_stat(path, &map->size, &map->mtime, &map->inode)) {return false;}
+#ifdef _WIN32
+        HANDLE hFile = CreateFileW(widen(path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {return false;}
+        map->handles[0] = hFile;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(hFile, &size)) {file_unmap(map); return false;}
+        map->size = size.QuadPart;
+        if (map->size == 0) {return true;}
+
+        HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMapping == NULL) {file_unmap(map); return false;}
+        map->handles[1] = hMapping;
+        map->data = (const uint8_t *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        if (map->data == nullptr) {file_unmap(map); return false;}
+        return true;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {return false;}
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {close(fd); return false;}
+        map->size = (int64_t)st.st_size;
+        map->mtime = stat_mtime(st);
+        map->inode = (uint64_t)st.st_ino;
+        if (map->size == 0) {close(fd); return true;}
+
+        void *data = mmap(nullptr, (size_t)map->size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {return false;}
+        map->data = (const uint8_t *)data;
+        return true;
+#endif
+    }
+
+    void file_unmap(FileMap *map)
+    {
+#ifdef _WIN32
+        if (map->data != nullptr) {UnmapViewOfFile(map->data);}
+        if (map->handles[1] != nullptr) {CloseHandle((HANDLE)map->handles[1]);}
+        if (map->handles[0] != nullptr) {CloseHandle((HANDLE)map->handles[0]);}
+#else
+        if (map->data != nullptr) {munmap((void *)map->data, (size_t)map->size);}
+#endif
+        map->data = nullptr;
+        map->handles[0] = map->handles[1] = nullptr;
+    }
+
+    void file_advise(const FileMap *map, bool sequential)
+    {
+#ifndef _WIN32
+        if (map->data != nullptr) {madvise((void *)map->data, (size_t)map->size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);}
+#endif
+    }
+
+    bool read_delimited(const uint8_t *data, int64_t size, Framing framing, int64_t *offset, Buffer *message)
+    {
+        int64_t pos = *offset;
+        if (pos >= size) {return false;}
+
+        uint64_t length = 0;
+        switch (framing)
+        {
+        case FRAMING_VARINT:
+            for (int shift = 0; ; shift += 7)
+            {
+                if (pos >= size || shift >= 64) {return false;}
+                uint8_t byte = data[pos++];
+                length |= (uint64_t)(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) {break;}
+            }
+            break;
+        case FRAMING_FIXED32:
+            if (size - pos < 4) {return false;}
+            length = (uint64_t)data[pos] | ((uint64_t)data[pos + 1] << 8) | ((uint64_t)data[pos + 2] << 16) | ((uint64_t)data[pos + 3] << 24);
+            pos += 4;
+            break;
+        default:
+            if (size - pos < 4) {return false;}
+            length = ((uint64_t)data[pos] << 24) | ((uint64_t)data[pos + 1] << 16) | ((uint64_t)data[pos + 2] << 8) | (uint64_t)data[pos + 3];
+            pos += 4;
+            break;
+        }
+        if (length > (uint64_t)(size - pos)) {return false;}
+
+        message->start = data + pos;
+        message->end = message->start + length;
+        *offset = pos + (int64_t)length;
+        return true;
+    }
+
+} // namespace sqlite_protobuf
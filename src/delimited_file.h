@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "protodec.h"
+
+namespace sqlite_protobuf
+{
+
+    /// Length prefix before each message in a file of length delimited messages
+    enum Framing
+    {
+        FRAMING_VARINT,     // Length as a varint, like writeDelimitedTo in the protobuf libraries
+        FRAMING_FIXED32,    // Length as a little endian 32 bit integer
+        FRAMING_FIXED32_BE, // Length as a big endian 32 bit integer
+        FRAMING_COUNT,
+    };
+
+    /// Look up a framing by name, "varint", "fixed32" or "fixed32be"
+    ///
+    /// @returns false if the name is not a valid framing
+    bool framing_from_string(const std::string &name, Framing *framing);
+
+    /// File mapped read only into memory
+    struct FileMap
+    {
+        const uint8_t *data; // Mapped file, or nullptr if the file is empty
+        int64_t size;        // Size of the file when it was mapped
+        int64_t mtime;       // Modification time of the file when it was mapped, in nanoseconds (100 ns on Windows)
+        uint64_t inode;      // Inode of the file, or the file index on Windows
+        void *handles[2];    // Handles of the file and the mapping on Windows
+    };
+
+    /// Get the size, modification time and inode of a regular file, together they tell if
+    /// the file was changed or replaced since it was mapped
+    ///
+    /// @returns false if the file does not exist or is not a regular file
+    bool file_stat(const std::string &path, int64_t *size, int64_t *mtime, uint64_t *inode);
+
+    /// Map a file read only into memory, the file must not be truncated while it is mapped
+    ///
+    /// @returns false if the file could not be mapped
+    bool file_map(const std::string &path, FileMap *map);
+    void file_unmap(FileMap *map);
+
+    /// Tell the operating system how the mapping will be read, so that it reads ahead
+    /// when scanning and does not when seeking
+    void file_advise(const FileMap *map, bool sequential);
+
+    /// Read the length delimited message at the offset
+    ///
+    /// @param[in,out] offset offset of the length prefix, moved to the next length prefix
+    /// @param[out] message the message
+    /// @returns false at the end of the data, or if the message is truncated
+    bool read_delimited(const uint8_t *data, int64_t size, Framing framing, int64_t *offset, Buffer *message);
+
+} // namespace sqlite_protobuf
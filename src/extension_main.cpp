@@ -5,6 +5,19 @@
 #include "protobuf_foreach.h"
 #include "protobuf_extract.h"
 #include "protobuf_json.h"
+#include "protobuf_contains_text.h"
+#include "protobuf_tree.h"
+#include "protobuf_shred.h"
+#include "protobuf_file.h"
+#include "protobuf_import.h"
+#include "protobuf_scan.h"
+#include "protobuf_convert_table.h"
+#include "protobuf_view.h"
+#include "protobuf_materialize.h"
+#include "protobuf_index.h"
+#include "protobuf_tokenizer.h"
+#include "protobuf_stats.h"
+#include "protobuf_trace.h"
 
 namespace sqlite_protobuf
 {
@@ -30,6 +43,19 @@ namespace sqlite_protobuf
             register_protobuf_extract,
             register_protobuf_json,
             register_protobuf_foreach,
+            register_protobuf_contains_text,
+            register_protobuf_tree,
+            register_protobuf_shred,
+            register_protobuf_file,
+            register_protobuf_import,
+            register_protobuf_scan,
+            register_protobuf_convert_table,
+            register_protobuf_view,
+            register_protobuf_materialize,
+            register_protobuf_index,
+            register_protobuf_tokenizer,
+            register_protobuf_stats,
+            register_protobuf_trace,
         };
 
         int nfuncs = sizeof(register_fns) / sizeof(register_fns[0]);
@@ -0,0 +1,166 @@
+#include "protobuf_column.h"
+#include "sqlite3ext.h"
+
+#include <cctype>
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    namespace
+    {
+        /// Split the next token of a column definition, quoted tokens are kept together
+        std::string next_token(const char **pz)
+        {
+            const char *z = *pz;
+            while (*z == ' ' || *z == '\t' || *z == '\n' || *z == '\r') {z++;}
+            const char *start = z;
+            char quote = *z == '[' ? ']' : *z;
+            if (quote == '"' || quote == '\'' || quote == '`' || quote == ']')
+            {
+                for (z++; *z != 0; z++)
+                {
+                    if (*z != quote) {continue;}
+                    if (quote != ']' && z[1] == quote) {z++; continue;}
+                    z++;
+                    break;
+                }
+            }
+            else
+            {
+                while (*z != 0 && *z != ' ' && *z != '\t' && *z != '\n' && *z != '\r') {z++;}
+            }
+            *pz = z;
+            return std::string(start, z - start);
+        }
+    } // namespace
+
+    std::string sql_dequote(const std::string &text)
+    {
+        if (text.size() < 2) {return text;}
+        char quote = text[0];
+        if (quote == '[') {return text.back() == ']' ? text.substr(1, text.size() - 2) : text;}
+        if ((quote != '"' && quote != '\'' && quote != '`') || text.back() != quote) {return text;}
+
+        std::string out;
+        for (size_t i = 1; i + 1 < text.size(); i++)
+        {
+            out += text[i];
+            if (text[i] == quote && text[i + 1] == quote) {i++;}
+        }
+        return out;
+    }
+
+    bool column_init(ColumnDefinition &column, const std::string &path, const std::string &type, std::string &error)
+    {
+        if (!path_compile(path, column.path, error))
+        {
+            return false;
+        }
+        column.path.text = path;
+        column.type = type_from_string(type);
+        if (column.type == TYPE_UNKNOWN)
+        {
+            error = "Type not valid, try type '' or check documentation";
+            return false;
+        }
+        column.wireTypes = wire_types_from_type(column.type, &column.numWireTypes, &column.packed);
+        return true;
+    }
+
+    bool column_parse(const char *zArg, ColumnDefinition &column, std::string &error)
+    {
+        const char *z = zArg;
+        column.name = sql_dequote(next_token(&z));
+        std::string path = next_token(&z);
+        std::string type = next_token(&z);
+        std::string extra = next_token(&z);
+
+        if (column.name.empty() || path.size() < 2 || path[0] != '\'' || !extra.empty())
+        {
+            error = std::string("Column not valid, expected name '$.path' type but got: ") + zArg;
+            return false;
+        }
+        return column_init(column, sql_dequote(path), sql_dequote(type), error);
+    }
+
+    bool column_parse_declared(const char *zArg, ColumnDefinition &column, std::string &declared, std::string &type, std::string &error)
+    {
+        const char *z = zArg;
+        column.name = sql_dequote(next_token(&z));
+        std::string path = next_token(&z);
+        declared.clear();
+        while (!path.empty() && path[0] != '\'')
+        {
+            declared += (declared.empty() ? "" : " ") + path;
+            path = next_token(&z);
+        }
+        std::string token = next_token(&z);
+        std::string extra = next_token(&z);
+
+        if (column.name.empty() || path.size() < 2 || !extra.empty())
+        {
+            error = std::string("Column not valid, expected name TYPE '$.path' type but got: ") + zArg;
+            return false;
+        }
+        type = sql_dequote(token);
+        if (token.empty())
+        {
+            // Type affinity rules of SQLite, see https://www.sqlite.org/datatype3.html
+            std::string upper;
+            for (size_t i = 0; i < declared.size(); i++) {upper += (char)toupper((unsigned char)declared[i]);}
+            if (upper.find("INT") != std::string::npos) {type = "int64";}
+            else if (upper.find("CHAR") != std::string::npos || upper.find("CLOB") != std::string::npos || upper.find("TEXT") != std::string::npos) {type = "string";}
+            else if (upper.find("REAL") != std::string::npos || upper.find("FLOA") != std::string::npos || upper.find("DOUB") != std::string::npos) {type = "double";}
+            else {type = "";}
+        }
+        return column_init(column, sql_dequote(path), type, error);
+    }
+
+    const char* sql_type_from_type(Type type)
+    {
+        switch (type)
+        {
+        case TYPE_DOUBLE: case TYPE_FLOAT: return "REAL";
+        case TYPE_STRING: return "TEXT";
+        case TYPE_BYTES: return "BLOB";
+        case TYPE_BUFFER: case TYPE_UNKNOWN: return "";
+        default: return "INTEGER";
+        }
+    }
+
+    void column_extract(const ColumnDefinition &column, const Buffer &message, Field *root, std::vector<Field> &matches, Value *value, std::string &json)
+    {
+        value->type = SQLITE_NULL;
+
+        // The root path selects the message itself
+        if (column.path.steps[0].fieldNumber == 0)
+        {
+            value_from_buffer(column.type, message, 0, value);
+            return;
+        }
+
+        if (!column.path.multi)
+        {
+            int32_t index = 0;
+            Field *field = traverse_path(root, column.path.steps.data(), column.type, &index);
+            if (field != nullptr) {value_from_buffer(column.type, field->value, index, value);}
+            return;
+        }
+
+        matches.clear();
+        path_match(&column.path, message, column.wireTypes, column.numWireTypes, column.packed, matches);
+
+        json = "[";
+        for (size_t k = 0; k < matches.size(); k++)
+        {
+            if (k > 0) {json += ',';}
+            json_append_value(json, column.type, matches[k]);
+        }
+        json += ']';
+        value->type = SQLITE_TEXT;
+        value->bytes.start = (const uint8_t *)json.data();
+        value->bytes.end = value->bytes.start + json.size();
+    }
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "protodec.h"
+#include "protobuf_path.h"
+#include "protobuf_type.h"
+
+namespace sqlite_protobuf
+{
+
+    /// Column of a virtual table or target table, a path into the messages and the type of its values
+    struct ColumnDefinition
+    {
+        std::string name;           // Column name
+        CompiledPath path;          // Path of the values in the messages
+        Type type;                  // Type the values are decoded as
+        const WireType *wireTypes;  // Wire types accepted by the last entry of the path
+        size_t numWireTypes;
+        int packed;                 // Wire type of packed repeated values, or -1
+    };
+
+    /// Remove the quotes around an SQL identifier or string
+    std::string sql_dequote(const std::string &text);
+
+    /// Compile the path and look up the type of a column
+    ///
+    /// @returns false and sets the error if the path or type is not valid
+    bool column_init(ColumnDefinition &column, const std::string &path, const std::string &type, std::string &error);
+
+    /// Parse a column definition of the form: name '$.path' type
+    ///
+    /// @returns false and sets the error if the definition is not valid
+    bool column_parse(const char *zArg, ColumnDefinition &column, std::string &error);
+
+    /// Parse a column definition of the form: name TYPE '$.path' type, where TYPE is the declared SQL
+    /// type of the column. The protobuf type is optional and follows the affinity of the declared type
+    /// when it is left out, int64 for INTEGER, double for REAL, string for TEXT and '' otherwise.
+    ///
+    /// @param[out] declared declared SQL type of the column
+    /// @param[out] type protobuf type of the column, as given or inferred
+    /// @returns false and sets the error if the definition is not valid
+    bool column_parse_declared(const char *zArg, ColumnDefinition &column, std::string &declared, std::string &type, std::string &error);
+
+    /// Declared SQL type of values of a type: INTEGER, REAL, TEXT, BLOB, or none for the raw buffer
+    const char* sql_type_from_type(Type type);
+
+    /// Extract the value of a column from a message, decoded like protobuf_extract(message, path, type).
+    /// The root is the message decoded with decodeProtobuf, so that it is decoded once for all columns.
+    /// Paths matching several fields give a JSON array, which is written to json and which the value
+    /// then points into, so json must not be moved while the value is used.
+    void column_extract(const ColumnDefinition &column, const Buffer &message, Field *root, std::vector<Field> &matches, Value *value, std::string &json);
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,158 @@
+#include "protobuf_contains_text.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <cstring>
+#include <vector>
+
+#include "protodec.h"
+#include "protobuf_path.h"
+#include "protobuf_stats.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    namespace
+    {
+        std::string string_from_sqlite3_value(sqlite3_value *value)
+        {
+            const char *text = static_cast<const char *>(sqlite3_value_blob(value));
+            size_t text_size = static_cast<size_t>(sqlite3_value_bytes(value));
+            return std::string(text, text_size);
+        }
+
+        /// Search for needle in haystack, memchr is vectorized by the C library so
+        /// candidate positions for the first byte are found using SIMD instructions
+        bool contains(const Buffer &haystack, const Buffer &needle)
+        {
+            size_t n = needle.size();
+            if (n == 0) {return true;}
+
+            const uint8_t *p = haystack.start;
+            while (haystack.end - p >= (ptrdiff_t)n)
+            {
+                p = (const uint8_t *)memchr(p, needle.start[0], (haystack.end - p) - n + 1);
+                if (p == nullptr) {return false;}
+                if (memcmp(p + 1, needle.start + 1, n - 1) == 0) {return true;}
+                p++;
+            }
+            return false;
+        }
+
+        /// Search all text fields of a message, tags, lengths and numeric 
+        /// fields are skipped so they never produce a match
+        bool message_contains_text(const Buffer &message, const Buffer &needle)
+        {
+            Buffer b = message;
+            Field field;
+            while (b.start < b.end && readField(&b, &field))
+            {
+                switch (field.wireType)
+                {
+                case WIRETYPE_LEN:
+                    // A string or sub message containing the needle must contain the raw bytes of it. Like
+                    // the decoder, bytes that parse as a sub message are a sub message even if they are text
+                    if (!contains(field.value, needle)) {break;}
+                    if (field.value.size() > 0 && isMessage(field.value)) {if (message_contains_text(field.value, needle)) {return true;}}
+                    else if (isText(field.value)) {return true;}
+                    break;
+                case WIRETYPE_SGROUP:
+                    if (message_contains_text(field.value, needle)) {return true;}
+                    break;
+                default:
+                    break;
+                }
+            }
+            return false;
+        }
+
+        /// Check if any string field in the message contains the given text
+        ///
+        ///     SELECT protobuf_contains_text(data, "needle", "$.1.2[0]");
+        ///
+        /// @returns 1 if the text was found and 0 otherwise
+        void protobuf_contains_text(sqlite3_context *context, int argc, sqlite3_value **argv)
+        {
+            if(argc < 2 || argc > 3)
+            {
+                sqlite3_result_error(context, "Wrong number of arguments", -1);
+                return;
+            }
+
+            if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL)
+            {
+                return;
+            }
+
+            PROTOBUF_STATS(StatsScope stats(STATS_CONTAINS_TEXT, (uint64_t)sqlite3_value_bytes(argv[0])));
+
+            // Load protobuf data and needle into buffers
+            Buffer buffer;
+            buffer.start = static_cast<const uint8_t *>(sqlite3_value_blob(argv[0]));
+            buffer.end = buffer.start + static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+
+            Buffer needle;
+            needle.start = static_cast<const uint8_t *>(sqlite3_value_blob(argv[1]));
+            needle.end = needle.start + static_cast<size_t>(sqlite3_value_bytes(argv[1]));
+
+            // Look up compiled path from aux data, or from the path cache of the connection
+            bool setPathAuxData = false;
+            CompiledPath* path = argc > 2 ? (CompiledPath*)sqlite3_get_auxdata(context, 2) : nullptr;
+            if (argc > 2 && path == nullptr)
+            {
+                std::string error;
+                path = path_lookup((PathCache*)sqlite3_user_data(context), string_from_sqlite3_value(argv[2]), error);
+                if (path == nullptr)
+                {
+                    sqlite3_result_error(context, error.c_str(), -1);
+                    return;
+                }
+                setPathAuxData = true;
+            }
+
+            // Fast path, no need to walk the message if the bytes are not there at all
+            bool found = contains(buffer, needle) && isMessage(buffer);
+
+            // Traverse path to the desired sub message
+            static const WireType message[] = {WIRETYPE_LEN, WIRETYPE_SGROUP};
+            Field field;
+            if (path != nullptr && path->multi && found)
+            {
+                // Search each of the sub messages matched by the path
+                std::vector<Field> matches;
+                path_match(path, buffer, message, 2, -1, matches);
+                found = false;
+                for (size_t i = 0; i < matches.size() && !found; i++)
+                {
+                    found = (matches[i].wireType == WIRETYPE_SGROUP || isMessage(matches[i].value)) && message_contains_text(matches[i].value, needle);
+                }
+            }
+            else
+            {
+                for (size_t i = 0; path != nullptr && path->steps[i].fieldNumber != 0 && found; i++)
+                {
+                    found = findField(&buffer, path->steps[i].fieldNumber, message, 2, path->steps[i].fieldIndex, &field);
+                    if (found) {buffer = field.value;}
+                    found = found && isMessage(buffer);
+                }
+                found = found && message_contains_text(buffer, needle);
+            }
+
+            if (setPathAuxData)
+            {
+                sqlite3_set_auxdata(context, 2, path, path_release);
+            }
+
+            sqlite3_result_int(context, found ? 1 : 0);
+        }
+    } // namespace
+
+    int register_protobuf_contains_text(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        return sqlite3_create_function_v2(db, "protobuf_contains_text", -1,
+                                          SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                          path_cache_acquire(db), protobuf_contains_text, nullptr, nullptr, path_cache_release);
+    }
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,371 @@
+#include "protobuf_convert_table.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <sstream>
+#include <condition_variable>
+
+#include "protodec.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    namespace
+    {
+        // Number of rows converted before they are handed to the writer
+        #define PROTOBUF_CONVERT_BATCH_SIZE 1024
+
+        // Number of batches waiting for the writer for each reader thread
+        #define PROTOBUF_CONVERT_BATCHES_PER_THREAD 4
+
+        // Number of rowid ranges for each reader thread, so that threads finishing early take over ranges
+        #define PROTOBUF_CONVERT_RANGES_PER_THREAD 8
+
+        // Largest number of reader threads for each hardware thread, larger requests are clamped
+        #define PROTOBUF_CONVERT_MAX_THREADS_PER_CORE 4
+
+        // Milliseconds the read connections wait for a lock on the database file
+        #define PROTOBUF_CONVERT_BUSY_TIMEOUT 5000
+
+        std::string string_from_sqlite3_value(sqlite3_value *value)
+        {
+            const char *text = static_cast<const char *>(sqlite3_value_blob(value));
+            size_t text_size = static_cast<size_t>(sqlite3_value_bytes(value));
+            return std::string(text, text_size);
+        }
+
+        /// Rows converted by a reader thread
+        struct ConvertBatch
+        {
+            std::vector<sqlite3_int64> rowids;
+            std::vector<std::string> json;
+        };
+
+        /// Rowid ranges of the source table shared by the reader threads, and the batches they
+        /// hand to the writer
+        struct ConvertState
+        {
+            std::string file;           // Database file of the source table
+            std::string table;
+            std::string column;
+            sqlite3_int64 first;        // Smallest rowid of the source table
+            uint64_t span;              // Largest rowid minus the smallest rowid
+            uint64_t step;              // Number of rowids in each range
+            size_t numRanges;
+            std::atomic<size_t> nextRange;
+
+            std::mutex mutex;           // Protects the fields below
+            std::condition_variable changed; // Signals batches that are queued or written
+            std::deque<ConvertBatch*> batches;
+            size_t maxBatches;
+            size_t running;             // Number of reader threads still running
+            bool stop;                  // Writer failed, the readers should stop
+            int rc;                     // First error of a reader thread
+            std::string error;
+        };
+
+        /// Hand a batch to the writer, waiting while the writer is behind
+        ///
+        /// @returns false if the writer asked the readers to stop
+        bool queue_batch(ConvertState *state, ConvertBatch *batch)
+        {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            while (!state->stop && state->batches.size() >= state->maxBatches) {condition_wait(state->changed, lock);}
+            if (state->stop) {return false;}
+            state->batches.push_back(batch);
+            state->changed.notify_all();
+            return true;
+        }
+
+        /// Body of a reader thread, the rowid ranges are taken one at a time and read on a read
+        /// only connection of the thread, and the messages are converted with toJson
+        void convert_ranges(ConvertState *state)
+        {
+            sqlite3 *reader = nullptr;
+            sqlite3_stmt *pStmt = nullptr;
+            int rc = sqlite3_open_v2(state->file.c_str(), &reader, SQLITE_OPEN_READONLY, nullptr);
+            if (rc == SQLITE_OK)
+            {
+                sqlite3_busy_timeout(reader, PROTOBUF_CONVERT_BUSY_TIMEOUT);
+                char *zSql = sqlite3_mprintf("SELECT rowid, \"%w\".\"%w\" FROM \"%w\" WHERE rowid BETWEEN ? AND ?",
+                                             state->table.c_str(), state->column.c_str(), state->table.c_str());
+                rc = zSql == nullptr ? SQLITE_NOMEM : sqlite3_prepare_v2(reader, zSql, -1, &pStmt, 0);
+                sqlite3_free(zSql);
+            }
+
+            ConvertBatch *batch = nullptr;
+            bool stopped = false;
+            for (size_t range = state->nextRange++; rc == SQLITE_OK && !stopped && range < state->numRanges; range = state->nextRange++)
+            {
+                uint64_t lower = range * state->step;
+                if (lower > state->span) {continue;}
+                uint64_t upper = range + 1 == state->numRanges || state->span - lower < state->step ? state->span : lower + state->step - 1;
+                sqlite3_bind_int64(pStmt, 1, (sqlite3_int64)((uint64_t)state->first + lower));
+                sqlite3_bind_int64(pStmt, 2, (sqlite3_int64)((uint64_t)state->first + upper));
+                while (sqlite3_step(pStmt) == SQLITE_ROW)
+                {
+                    Buffer buffer;
+                    buffer.start = static_cast<const uint8_t *>(sqlite3_column_blob(pStmt, 1));
+                    buffer.end = buffer.start + static_cast<size_t>(sqlite3_column_bytes(pStmt, 1));
+                    Field field = decodeProtobuf(buffer, false);
+                    std::ostringstream os;
+                    {
+                        PROTOBUF_TRACE_SPAN("toJson");
+                        toJson(&field, os, false);
+                    }
+
+                    if (batch == nullptr) {batch = new ConvertBatch();}
+                    batch->rowids.push_back(sqlite3_column_int64(pStmt, 0));
+                    batch->json.push_back(os.str());
+                    if (batch->rowids.size() < PROTOBUF_CONVERT_BATCH_SIZE) {continue;}
+
+                    stopped = !queue_batch(state, batch);
+                    if (stopped) {delete batch;}
+                    batch = nullptr;
+                    if (stopped) {break;}
+                }
+                rc = sqlite3_reset(pStmt);
+            }
+            if (batch != nullptr && (rc != SQLITE_OK || stopped || !queue_batch(state, batch)))
+            {
+                delete batch;
+            }
+
+            std::string error = rc != SQLITE_OK ? sqlite3_errmsg(reader) : "";
+            sqlite3_finalize(pStmt);
+            sqlite3_close(reader);
+
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->running--;
+            if (rc != SQLITE_OK && state->rc == SQLITE_OK)
+            {
+                state->rc = rc;
+                state->error = error;
+            }
+            state->changed.notify_all();
+        }
+
+        /// Check that the database is in WAL mode, so that the read connections do not block the writer
+        bool is_wal_mode(sqlite3 *db)
+        {
+            sqlite3_stmt *pStmt = nullptr;
+            bool wal = false;
+            if (sqlite3_prepare_v2(db, "PRAGMA main.journal_mode", -1, &pStmt, 0) == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW)
+            {
+                const char *mode = (const char *)sqlite3_column_text(pStmt, 0);
+                wal = mode != nullptr && sqlite3_stricmp(mode, "wal") == 0;
+            }
+            sqlite3_finalize(pStmt);
+            return wal;
+        }
+
+        /// Convert the messages in a column of a table to JSON, like protobuf_to_json, and write
+        /// them to a column of the same table or of a target table. The messages are read and
+        /// converted by several threads, each with a read connection of its own, and the calling
+        /// thread writes the results in the transaction of the statement
+        ///
+        ///     SELECT protobuf_convert_table('events', 'data', 'events', 'json');
+        ///     SELECT protobuf_convert_table('events', 'data', 'events_json', 'json', 'jsonb', 16);
+        ///
+        /// @returns the number of rows converted
+        void protobuf_convert_table(sqlite3_context *context, int argc, sqlite3_value **argv)
+        {
+            if (argc < 4 || argc > 6)
+            {
+                sqlite3_result_error(context, "Wrong number of arguments", -1);
+                return;
+            }
+
+            sqlite3 *db = sqlite3_context_db_handle(context);
+            std::string table = string_from_sqlite3_value(argv[0]);
+            std::string column = string_from_sqlite3_value(argv[1]);
+            std::string target = string_from_sqlite3_value(argv[2]);
+            std::string targetColumn = string_from_sqlite3_value(argv[3]);
+            std::string format = argc > 4 ? string_from_sqlite3_value(argv[4]) : "json";
+            sqlite3_int64 numThreads = argc > 5 ? sqlite3_value_int64(argv[5]) : 0;
+
+            bool jsonb = sqlite3_stricmp(format.c_str(), "jsonb") == 0;
+            if (!jsonb && sqlite3_stricmp(format.c_str(), "json") != 0)
+            {
+                sqlite3_result_error(context, "Format not valid, try 'json' or 'jsonb'", -1);
+                return;
+            }
+            if (jsonb && sqlite3_libversion_number() < 3045000)
+            {
+                sqlite3_result_error(context, "Format 'jsonb' requires SQLite 3.45.0 or later", -1);
+                return;
+            }
+            const char *zFile = sqlite3_db_filename(db, "main");
+            if (zFile == nullptr || zFile[0] == 0 || !is_wal_mode(db) || sqlite3_threadsafe() == 0)
+            {
+                sqlite3_result_error(context, "protobuf_convert_table requires a database file in WAL mode and SQLite compiled with thread support", -1);
+                return;
+            }
+
+            // The readers use their own connections, which cannot see rows the transaction has not committed
+            if (!sqlite3_get_autocommit(db))
+            {
+                sqlite3_result_error(context, "protobuf_convert_table can not be used inside a transaction, since the rows are read on other connections", -1);
+                return;
+            }
+
+            // Rows of the source table are updated in place, other target tables get one new row for each source row
+            const char *zValue = jsonb ? "jsonb(?1)" : "?1";
+            char *zSql = sqlite3_stricmp(target.c_str(), table.c_str()) == 0
+                ? sqlite3_mprintf("UPDATE \"%w\" SET \"%w\" = %s WHERE rowid = ?2", target.c_str(), targetColumn.c_str(), zValue)
+                : sqlite3_mprintf("INSERT INTO \"%w\"(rowid, \"%w\") VALUES (?2, %s)", target.c_str(), targetColumn.c_str(), zValue);
+            if (zSql == nullptr)
+            {
+                sqlite3_result_error_nomem(context);
+                return;
+            }
+            sqlite3_stmt *write = nullptr;
+            int rc = sqlite3_prepare_v2(db, zSql, -1, &write, nullptr);
+            sqlite3_free(zSql);
+
+            // Split the rowids of the source table into ranges
+            ConvertState state;
+            state.file = zFile;
+            state.table = table;
+            state.column = column;
+            state.first = 0;
+            state.span = 0;
+            state.numRanges = 0;
+            bool empty = true;
+            sqlite3_stmt *pStmt = nullptr;
+            zSql = sqlite3_mprintf("SELECT min(rowid), max(rowid) FROM main.\"%w\"", table.c_str());
+            if (rc == SQLITE_OK) {rc = zSql == nullptr ? SQLITE_NOMEM : sqlite3_prepare_v2(db, zSql, -1, &pStmt, nullptr);}
+            sqlite3_free(zSql);
+            if (rc == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW && sqlite3_column_type(pStmt, 0) != SQLITE_NULL)
+            {
+                empty = false;
+                state.first = sqlite3_column_int64(pStmt, 0);
+                state.span = (uint64_t)sqlite3_column_int64(pStmt, 1) - (uint64_t)state.first;
+            }
+            sqlite3_finalize(pStmt);
+            if (rc != SQLITE_OK)
+            {
+                sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+                sqlite3_finalize(write);
+                return;
+            }
+
+            sqlite3_int64 numCores = std::thread::hardware_concurrency();
+            if (numCores <= 0) {numCores = 1;}
+            if (numThreads <= 0) {numThreads = numCores;}
+            if (numThreads > numCores * PROTOBUF_CONVERT_MAX_THREADS_PER_CORE) {numThreads = numCores * PROTOBUF_CONVERT_MAX_THREADS_PER_CORE;}
+            state.numRanges = empty ? 0 : (size_t)numThreads * PROTOBUF_CONVERT_RANGES_PER_THREAD;
+            state.step = empty ? 1 : state.span / state.numRanges + 1;
+            state.nextRange = 0;
+            state.maxBatches = (size_t)numThreads * PROTOBUF_CONVERT_BATCHES_PER_THREAD;
+            state.running = 0;
+            state.stop = false;
+            state.rc = SQLITE_OK;
+
+            // Write all rows in one savepoint, otherwise every row is committed on its own when the
+            // statement runs outside a transaction, and an error rolls back the whole conversion
+            rc = sqlite3_exec(db, "SAVEPOINT protobuf_convert_table", nullptr, nullptr, nullptr);
+
+            // A reader is counted before it starts, and a thread that cannot be started fails the conversion
+            std::vector<std::thread> readers;
+            size_t numCounted = 0;
+            try
+            {
+                readers.reserve((size_t)numThreads);
+                for (sqlite3_int64 i = 0; i < numThreads && !empty && rc == SQLITE_OK; i++)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(state.mutex);
+                        state.running++;
+                    }
+                    numCounted++;
+                    readers.push_back(std::thread(convert_ranges, &state));
+                }
+            }
+            catch (const std::exception &e)
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                state.running -= numCounted - readers.size();
+                state.rc = SQLITE_ERROR;
+                state.error = std::string("could not start the reader threads: ") + e.what();
+                state.changed.notify_all();
+            }
+
+            // Write the batches in the order they are converted
+            sqlite3_int64 numRows = 0;
+            while (rc == SQLITE_OK)
+            {
+                ConvertBatch *batch = nullptr;
+                {
+                    std::unique_lock<std::mutex> lock(state.mutex);
+                    while (state.batches.empty() && state.running > 0) {condition_wait(state.changed, lock);}
+                    if (state.batches.empty() || state.rc != SQLITE_OK) {break;}
+                    batch = state.batches.front();
+                    state.batches.pop_front();
+                    state.changed.notify_all();
+                }
+                for (size_t i = 0; i < batch->rowids.size() && rc == SQLITE_OK; i++, numRows++)
+                {
+                    sqlite3_bind_text(write, 1, batch->json[i].data(), (int)batch->json[i].size(), SQLITE_STATIC);
+                    sqlite3_bind_int64(write, 2, batch->rowids[i]);
+                    sqlite3_step(write);
+                    rc = sqlite3_reset(write);
+                }
+                delete batch;
+                if (rc != SQLITE_OK) {break;}
+            }
+
+            // Stop the readers after an error, and free the batches they queued
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                state.stop = true;
+            }
+            state.changed.notify_all();
+            for (size_t i = 0; i < readers.size(); i++) {readers[i].join();}
+            for (size_t i = 0; i < state.batches.size(); i++) {delete state.batches[i];}
+
+            if (rc != SQLITE_OK)
+            {
+                sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+                sqlite3_result_error_code(context, rc);
+            }
+            else if (state.rc != SQLITE_OK)
+            {
+                std::string error = "protobuf_convert_table: " + state.error;
+                sqlite3_result_error(context, error.c_str(), -1);
+                sqlite3_result_error_code(context, state.rc);
+            }
+            else if ((rc = sqlite3_exec(db, "RELEASE protobuf_convert_table", nullptr, nullptr, nullptr)) != SQLITE_OK)
+            {
+                sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+                sqlite3_result_error_code(context, rc);
+            }
+            if (rc != SQLITE_OK || state.rc != SQLITE_OK)
+            {
+                sqlite3_exec(db, "ROLLBACK TO protobuf_convert_table; RELEASE protobuf_convert_table", nullptr, nullptr, nullptr);
+            }
+            else
+            {
+                sqlite3_result_int64(context, numRows);
+            }
+            sqlite3_finalize(write);
+        }
+
+    } // namespace
+
+    int register_protobuf_convert_table(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        // Reading and writing tables is only allowed from top level SQL, not from triggers and views in the schema
+        int flags = SQLITE_UTF8 | (sqlite3_libversion_number() >= 3030000 ? SQLITE_DIRECTONLY : 0);
+        return sqlite3_create_function(db, "protobuf_convert_table", -1, flags, nullptr, protobuf_convert_table, nullptr, nullptr);
+    }
+
+} // namespace sqlite_protobuf
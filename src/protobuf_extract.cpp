@@ -2,9 +2,16 @@
 #include "sqlite3ext.h"
 
 #include <string>
+#include <vector>
 #include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <new>
 
 #include "protodec.h"
+#include "protobuf_path.h"
+#include "protobuf_type.h"
+#include "protobuf_stats.h"
 
 namespace sqlite_protobuf
 {
@@ -12,24 +19,35 @@ namespace sqlite_protobuf
 
     namespace
     {
-        struct Path
-        {
-            uint32_t fieldNumber;
-            int32_t fieldIndex;
-        };
-
-        // Create a global cache for saving data
+        // Largest message kept in the decode cache
         #define PROTOBUF_CACHE_BUFFER_SIZE 4096
 
-        struct Cache
+        /// Cache of a connection, shared by protobuf_extract and protobuf_locate. Calls on a
+        /// connection are serialized by its database mutex, so the decode cache needs no lock of
+        /// its own, and threads with their own connections do not evict each other's messages.
+        /// Statements of a connection may interleave, so a cached message is only used after its
+        /// bytes are compared with the message of the call.
+        struct ExtractCache
         {
+            int refs;
+            PathCache *paths;
+
             // Protobuf decode cache
             Field field;
             size_t length;
             uint8_t buffer[PROTOBUF_CACHE_BUFFER_SIZE];
         };
 
-        Cache cache = {0};
+        void extract_cache_release(void *p)
+        {
+            ExtractCache *cache = (ExtractCache *)p;
+            if (--cache->refs > 0)
+            {
+                return;
+            }
+            path_cache_release(cache->paths);
+            delete cache;
+        }
 
         std::string string_from_sqlite3_value(sqlite3_value *value)
         {
@@ -38,128 +56,59 @@ namespace sqlite_protobuf
             return std::string(text, text_size);
         }
         
-        Path* path_from_string(const std::string &pathString)
+        /// Decode message, the decoded message is cached so that consecutive calls 
+        /// on the same message (e.g. extracting several fields) only decode it once
+        Field* decode_cached(ExtractCache &cache, const Buffer &buffer, StatsFunction function)
         {
-            // Check that the path begins with $, representing the root of the tree
-            if (pathString.length() == 0 || pathString[0] != '$')
+            size_t length = buffer.size();
+            Field* root = nullptr;
+            if (cache.length != 0 && cache.length == length && memcmp(&cache.buffer, buffer.start, length) == 0)
             {
-                return nullptr;
+                // Chache hit -> use the decoded field from cache
+                PROTOBUF_STATS(stats_add(function, STATS_CACHE_HITS, 1));
+                return &cache.field;
             }
 
-            size_t capacity = 1; // Start with 1 as initial capacity
-            size_t length = 0; // Initialize path length 0
-            Path* path = (Path*)sqlite3_malloc64(sizeof(Path) * capacity);
-
-            int fieldNumber, fieldIndex;
-
-            // Parse the path string and traverse the message
-            size_t fieldStart = pathString.find(".", 0);
-            while(fieldStart < pathString.size())
+            PROTOBUF_STATS(stats_add(function, STATS_CACHE_MISSES, 1));
+            PROTOBUF_STATS(if (cache.length != 0) {stats_add(function, STATS_CACHE_EVICTIONS, 1);});
+            if (length <= PROTOBUF_CACHE_BUFFER_SIZE)
             {
-                size_t fieldEnd = pathString.find(".", fieldStart + 1);
-                size_t indexStart = pathString.find("[", fieldStart + 1);
-                size_t indexEnd = pathString.find("]", fieldStart + 1);
-
-                fieldEnd = (fieldEnd == std::string::npos) ? pathString.size() : fieldEnd;
-
-                if (indexStart < fieldEnd && indexEnd < fieldEnd) // Both field and index supplied
-                {
-                    fieldNumber = std::atoi(pathString.substr(fieldStart + 1, indexStart - fieldStart - 1).c_str());
-                    fieldIndex  = std::atoi(pathString.substr(indexStart + 1, indexEnd - indexStart - 1).c_str());
-                }
-                else // Only field supplied
-                {
-                    fieldNumber = std::atoi(pathString.substr(fieldStart + 1, fieldEnd - fieldStart - 1).c_str());
-                    fieldIndex  = 0; 
-                }
-
-                // Add path entry to end of list
-                if (path != nullptr)
-                {
-                    path[length].fieldNumber = fieldNumber;
-                    path[length].fieldIndex = fieldIndex;
-                    length++;
-                    if (length >= capacity)
-                    {
-                        // Double the capacity of the path vector
-                        capacity = capacity * 2;
-                        path = (Path*)sqlite3_realloc64(path, sizeof(Path) * capacity);
-                    }
-                }
-
-                // Move path ponter forward
-                fieldStart = fieldEnd;
+                // Chache miss and buffer fits in cache -> decode protobuf and cache result
+                memcpy(cache.buffer, buffer.start, length);
+                cache.field = decodeProtobuf(buffer, false);
+                cache.length = length;
+                root = &cache.field;
             }
-
-            // Set fieldNumber to the reserved number 0 to indicate end of path 
-            if (path != nullptr) {path[length].fieldNumber = 0;}
-
-            return path;          
+            else
+            {
+                // Chache miss, but buffer does not fit in cache -> decode protobuf and invalidate cache
+                cache.length = 0;
+                cache.field = decodeProtobuf(buffer, false);
+                root = &cache.field;
+            }
+            PROTOBUF_STATS(stats_decoded(function, *root));
+            return root;
         }
 
-        enum Type 
+        /// Return all elements matched by a path with wildcards, slices, filters or 
+        /// recursive descent as a JSON array, the message is traversed once without decoding it
+        void extract_all(sqlite3_context *context, Type type, const CompiledPath *path, const Buffer &buffer)
         {
-            // SPECIAL TYPES
-            TYPE_UNKNOWN,
-            TYPE_BUFFER,
-            // WIRETYPE VARINT
-            TYPE_INT32,
-            TYPE_INT64,
-            TYPE_UINT32,
-            TYPE_UINT64,
-            TYPE_SINT32,
-            TYPE_SINT64,
-            TYPE_BOOL,
-            TYPE_ENUM,
-            // WIRETYPE I64
-            TYPE_FIXED64,
-            TYPE_SFIXED64,
-            TYPE_DOUBLE,
-            // WIRETYPE LEN
-            TYPE_STRING,
-            TYPE_BYTES,
-            // WIRETYPE I32
-            TYPE_FIXED32, 
-            TYPE_SFIXED32, 
-            TYPE_FLOAT,
-        };
+            size_t numWireTypes;
+            int packed;
+            const WireType *wireTypes = wire_types_from_type(type, &numWireTypes, &packed);
 
-        Type type_from_string(const std::string &type)
-        {
-            
-            switch (type.length())
-            {
-            case 0: // ""
-                return TYPE_BUFFER;
-            case 4: // bool
-                if (type == "bool") {return TYPE_BOOL;}
-                if (type == "enum") {return TYPE_ENUM;}
-                return TYPE_UNKNOWN;
-            case 5: // bytes, int32, int64, float
-                if (type == "bytes") {return TYPE_BYTES;}
-                if (type == "int32") {return TYPE_INT32;}
-                if (type == "int64") {return TYPE_INT64;}
-                if (type == "float") {return TYPE_FLOAT;}
-                return TYPE_UNKNOWN;
-            case 6: // string, uint32, uint64, sint32, sint64, double
-                if (type == "string") {return TYPE_STRING;}
-                if (type == "uint32") {return TYPE_UINT32;}
-                if (type == "uint64") {return TYPE_UINT64;}
-                if (type == "sint32") {return TYPE_SINT32;}
-                if (type == "sint64") {return TYPE_SINT64;}
-                if (type == "double") {return TYPE_DOUBLE;}
-                return TYPE_UNKNOWN;
-            case 7: // fixed64, fixed32
-                if (type == "fixed64") {return TYPE_FIXED64;}
-                if (type == "fixed32") {return TYPE_FIXED32;}
-                return TYPE_UNKNOWN;
-            case 8: // sfixed64, sfixed32
-                if (type == "sfixed64") {return TYPE_SFIXED64;}
-                if (type == "sfixed32") {return TYPE_SFIXED32;}
-                return TYPE_UNKNOWN;
-            default:
-                return TYPE_UNKNOWN;
+            std::vector<Field> matches;
+            path_match(path, buffer, wireTypes, numWireTypes, packed, matches);
+
+            std::string json = "[";
+            for (size_t i = 0; i < matches.size(); i++)
+            {
+                if (i > 0) {json += ',';}
+                json_append_value(json, type, matches[i]);
             }
+            json += ']';
+            sqlite3_result_text(context, json.data(), (int)json.size(), SQLITE_TRANSIENT);
         }
 
         /// Return the element (or elements)
@@ -169,6 +118,7 @@ namespace sqlite_protobuf
         /// @returns a Protobuf-encoded BLOB or the appropriate SQL datatype
         static void protobuf_extract(sqlite3_context *context, int argc, sqlite3_value **argv)
         {
+            PROTOBUF_STATS(StatsScope stats(STATS_EXTRACT, (uint64_t)sqlite3_value_bytes(argv[0])));
 
             // Look up type from aux data
             Type type;
@@ -197,21 +147,22 @@ namespace sqlite_protobuf
                 return;
             }
 
-            // Look up path from aux data
+            // Look up compiled path from aux data, or from the path cache of the connection
             bool setPathAuxData = false;
-            Path* path = (Path*)sqlite3_get_auxdata(context, 1);
+            ExtractCache *cache = (ExtractCache*)sqlite3_user_data(context);
+            CompiledPath* path = (CompiledPath*)sqlite3_get_auxdata(context, 1);
             if (path == nullptr)
             {
-                const std::string pathString = string_from_sqlite3_value(argv[1]);
-                path = path_from_string(pathString);
+                std::string error;
+                path = path_lookup(cache->paths, string_from_sqlite3_value(argv[1]), error);
+                if (path == nullptr)
+                {
+                    sqlite3_result_error(context, error.c_str(), -1);
+                    return;
+                }
                 setPathAuxData = true;
             }
-
-            // Check validity of path
-            if (path == nullptr){
-                sqlite3_result_error(context, "Path not valid, path should start with $", -1);
-                return;
-            }
+            PROTOBUF_STATS(stats.set_path(path->text));
             
             // Load protobuf data into a buffer
             Buffer buffer;
@@ -219,57 +170,291 @@ namespace sqlite_protobuf
             buffer.start = static_cast<const uint8_t *>(sqlite3_value_blob(argv[0]));
             buffer.end = buffer.start + length;
 
+            if (path->multi)
+            {
+                if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {extract_all(context, type, path, buffer);}
+                if (setPathAuxData) {sqlite3_set_auxdata(context, 1, path, path_release);}
+                return;
+            }
+
             // Look up message in cache
-            Field* root = nullptr;
-            if (cache.length != 0 && cache.length == length && memcmp(&cache.buffer, buffer.start, length) == 0)
+            Field* root = decode_cached(*cache, buffer, STATS_EXTRACT);
+
+            // Traverse path to the desired field
+            int32_t index = 0;
+            Field *field = traverse_path(root, path->steps.data(), type, &index);
+
+            // Set path aux data, needs to be done after path no longer is needed (see sqlite documentation)
+            if (setPathAuxData)
             {
-                // Chache hit -> use the decoded field from cache
-                root = &cache.field;
+                sqlite3_set_auxdata(context, 1, path, path_release);
             }
-            else if (length <= PROTOBUF_CACHE_BUFFER_SIZE)
+
+            // Create result buffer pointing to correct memmory address
+            if (field == nullptr) {return;}
+            Buffer result;
+            result.start = field->value.start + (buffer.start - root->value.start);
+            result.end = field->value.end + (buffer.start - root->value.start);
+
+            result_from_buffer(context, type, result, index, SQLITE_STATIC);
+        }
+
+        /// Return the location of the element inside the protobuf message
+        ///
+        ///     SELECT protobuf_locate(data, "$.1.2[0].3");
+        ///
+        /// @returns a JSON array [offset, length] with the byte offset and length of the element value
+        static void protobuf_locate(sqlite3_context *context, int argc, sqlite3_value **argv)
+        {
+            PROTOBUF_STATS(StatsScope stats(STATS_LOCATE, (uint64_t)sqlite3_value_bytes(argv[0])));
+            // Look up compiled path from aux data, or from the path cache of the connection
+            bool setPathAuxData = false;
+            ExtractCache *cache = (ExtractCache*)sqlite3_user_data(context);
+            CompiledPath* path = (CompiledPath*)sqlite3_get_auxdata(context, 1);
+            if (path == nullptr)
             {
-                // Chache miss and buffer fits in cache -> decode protobuf and cache result
-                memcpy(cache.buffer, buffer.start, length);
-                cache.field = decodeProtobuf(buffer, false);
-                cache.length = length;
-                root = &cache.field;
+                std::string error;
+                path = path_lookup(cache->paths, string_from_sqlite3_value(argv[1]), error);
+                if (path == nullptr)
+                {
+                    sqlite3_result_error(context, error.c_str(), -1);
+                    return;
+                }
+                setPathAuxData = true;
             }
-            else
+
+            // Load protobuf data into a buffer
+            Buffer buffer;
+            size_t length = static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+            buffer.start = static_cast<const uint8_t *>(sqlite3_value_blob(argv[0]));
+            buffer.end = buffer.start + length;
+
+            if (path->multi)
             {
-                // Chache miss, but buffer does not fit in cache -> decode protobuf and invalidate cache
-                cache.length = 0;
-                cache.field = decodeProtobuf(buffer, false);
-                root = &cache.field;
+                // Locate all matching elements, JSON array of [offset, length] pairs
+                static const WireType any[] = {WIRETYPE_LEN, WIRETYPE_SGROUP, WIRETYPE_VARINT, WIRETYPE_I64, WIRETYPE_I32};
+                std::vector<Field> matches;
+                path_match(path, buffer, any, 5, -1, matches);
+                if (setPathAuxData) {sqlite3_set_auxdata(context, 1, path, path_release);}
+                if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {return;}
+
+                std::string json = "[";
+                for (size_t i = 0; i < matches.size(); i++)
+                {
+                    if (i > 0) {json += ',';}
+                    json += "[" + std::to_string(matches[i].value.start - buffer.start) + "," + std::to_string(matches[i].value.size()) + "]";
+                }
+                json += ']';
+                sqlite3_result_text(context, json.data(), (int)json.size(), SQLITE_TRANSIENT);
+                return;
             }
-            
-            // Traverse path to the desired field
-            Field *field = root;
-            Field *parent = nullptr;
+
+            // Look up message in cache and traverse path to the desired field
+            Field* root = decode_cached(*cache, buffer, STATS_LOCATE);
             int32_t index = 0;
+            Field *field = traverse_path(root, path->steps.data(), TYPE_BUFFER, &index);
+
+            // Set path aux data, needs to be done after path no longer is needed (see sqlite documentation)
+            if (setPathAuxData)
+            {
+                sqlite3_set_auxdata(context, 1, path, path_release);
+            }
+
+            if (field == nullptr) {return;}
+            sqlite3_int64 offset = field->value.start - root->value.start;
+            sqlite3_int64 size = field->value.size();
+
+            char *json = sqlite3_mprintf("[%lld,%lld]", offset, size);
+            if (json == nullptr)
+            {
+                sqlite3_result_error_nomem(context);
+                return;
+            }
+            sqlite3_result_text(context, json, -1, sqlite3_free);
+        }
+
+        // Size of the window used for reading field headers from incremental blobs
+        #define PROTOBUF_BLOB_WINDOW_SIZE 4096
+
+        /// Reader for incremental blob I/O, only the bytes that are needed are read from 
+        /// the database, and reads of field headers are batched using a small window
+        struct BlobReader
+        {
+            sqlite3_blob *blob;
+            int64_t size;
+            int64_t windowOffset;
+            int64_t windowLength;
+            uint8_t window[PROTOBUF_BLOB_WINDOW_SIZE];
+
+            bool read(int64_t offset, int64_t length, std::string &out)
+            {
+                if (offset < 0 || length < 0 || offset + length > size) {return false;}
+                out.resize(length);
+                return length == 0 || sqlite3_blob_read(blob, &out[0], (int)length, (int)offset) == SQLITE_OK;
+            }
+
+            bool readVarint(int64_t *offset, int64_t end, uint64_t *out, int maxBytes)
+            {
+                *out = 0;
+                for (int i = 0; i < maxBytes && *offset < end; i++)
+                {
+                    // Move window if byte is outside of it
+                    if (*offset < windowOffset || *offset >= windowOffset + windowLength)
+                    {
+                        windowOffset = *offset;
+                        windowLength = size - *offset < PROTOBUF_BLOB_WINDOW_SIZE ? size - *offset : PROTOBUF_BLOB_WINDOW_SIZE;
+                        if (sqlite3_blob_read(blob, window, (int)windowLength, (int)windowOffset) != SQLITE_OK)
+                        {
+                            windowLength = 0;
+                            return false;
+                        }
+                    }
+
+                    uint8_t byte = window[*offset - windowOffset];
+                    *out |= (uint64_t)(byte & 0b01111111) << (i * 7);
+                    (*offset)++;
+                    if (byte < 0b10000000) {return true;}
+                }
+                return false;
+            }
+        };
+
+        struct BlobField
+        {
+            uint32_t wireType;
+            int64_t start;
+            int64_t end;
+        };
+
+        /// Read the field at offset from the blob and move offset past it, the 
+        /// value of length delimited fields is skipped without being read
+        bool blob_read_field(BlobReader *reader, int64_t *offset, int64_t end, uint32_t *tag, BlobField *field)
+        {
+            uint64_t n;
+            if (!reader->readVarint(offset, end, &n, 5)) {return false;}
+            *tag = (uint32_t)n;
+            field->wireType = *tag & 0x7;
+            field->start = *offset;
+
+            // Check validity of field tag
+            if ((*tag >> 3) == 0) {return false;}
+
+            switch (field->wireType)
+            {
+            case WIRETYPE_VARINT:
+                if (!reader->readVarint(offset, end, &n, 10)) {return false;}
+                break;
+            case WIRETYPE_I64:
+                *offset += sizeof(int64_t);
+                break;
+            case WIRETYPE_I32:
+                *offset += sizeof(int32_t);
+                break;
+            case WIRETYPE_LEN:
+                if (!reader->readVarint(offset, end, &n, 5)) {return false;}
+                field->start = *offset;
+                *offset += n;
+                break;
+            case WIRETYPE_SGROUP:
+                while (*offset < end)
+                {
+                    // Check if we have reached end of the group, and that it matches group start tag
+                    int64_t groupEnd = *offset;
+                    uint32_t subTag;
+                    BlobField subField;
+                    if (!reader->readVarint(&groupEnd, end, &n, 5)) {return false;}
+                    if ((n & 0x7) == WIRETYPE_EGROUP)
+                    {
+                        if (n != ((*tag & ~0x7u) | WIRETYPE_EGROUP)) {return false;}
+                        field->end = *offset;
+                        *offset = groupEnd;
+                        return true;
+                    }
+                    if (!blob_read_field(reader, offset, end, &subTag, &subField)) {return false;}
+                }
+                return false;
+            default:
+                return false;
+            }
+
+            field->end = *offset;
+            return *offset <= end;
+        }
+
+        /// Find sub field in the message stored in the blob between start and end, 
+        /// the message is scanned once and the wire types are tried in the given order 
+        bool blob_find_field(BlobReader *reader, int64_t start, int64_t end, uint32_t fieldNumber, 
+                             const WireType *wireTypes, size_t numWireTypes, int64_t index, BlobField *out)
+        {
+            std::vector<BlobField> matches;
+            BlobField field;
+            uint32_t tag;
+
+            // Scan message, all fields must be well formed for the buffer to be a message
+            int64_t offset = start;
+            while (offset < end)
+            {
+                if (!blob_read_field(reader, &offset, end, &tag, &field)) {return false;}
+                if ((tag >> 3) == fieldNumber) {matches.push_back(field);}
+            }
+
+            for (size_t i = 0; i < numWireTypes; i++)
+            {
+                int64_t count = 0;
+                for (size_t j = 0; j < matches.size(); j++) {count += matches[j].wireType == (uint32_t)wireTypes[i];}
+
+                int64_t n = index < 0 ? index + count : index; // Wrap arround
+                if (n < 0 || n >= count) {continue;}
+
+                for (size_t j = 0; j < matches.size(); j++)
+                {
+                    if (matches[j].wireType == (uint32_t)wireTypes[i] && n-- == 0)
+                    {
+                        *out = matches[j];
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        /// Traverse path to the desired field in the blob, see traverse_path
+        bool blob_traverse_path(BlobReader *reader, const Path *path, Type type, int32_t *index, BlobField *field)
+        {
+            static const WireType message[] = {WIRETYPE_LEN, WIRETYPE_SGROUP};
+            static const WireType any[] = {WIRETYPE_LEN, WIRETYPE_SGROUP, WIRETYPE_VARINT, WIRETYPE_I64, WIRETYPE_I32};
+            static const WireType len[] = {WIRETYPE_LEN};
+            static const WireType varint[] = {WIRETYPE_VARINT};
+            static const WireType i64[] = {WIRETYPE_I64};
+            static const WireType i32[] = {WIRETYPE_I32};
+
+            field->wireType = WIRETYPE_LEN;
+            field->start = 0;
+            field->end = reader->size;
+            *index = 0;
+
             for (size_t i = 0; path[i].fieldNumber != 0; i++)
             {
-                parent = field;
-                field = nullptr;
+                int64_t start = field->start, end = field->end;
+                uint32_t fieldNumber = path[i].fieldNumber;
+                int32_t fieldIndex = path[i].fieldIndex;
+                bool found = false;
+
                 if (path[i+1].fieldNumber != 0) // Not at end of path
                 {
-                    if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_LEN, path[i].fieldIndex);}
-                    if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_SGROUP, path[i].fieldIndex);}
+                    found = blob_find_field(reader, start, end, fieldNumber, message, 2, fieldIndex, field);
                 }
                 else
                 {
+                    const WireType *packed = nullptr;
                     switch (type)
                     {
                     case TYPE_BUFFER:
-                        // We don't know the wire type, so try all until one succeeds
-                        if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_LEN, path[i].fieldIndex);}
-                        if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_SGROUP, path[i].fieldIndex);}
-                        if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_VARINT, path[i].fieldIndex);}
-                        if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_I64, path[i].fieldIndex);}
-                        if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_I32, path[i].fieldIndex);}
+                        found = blob_find_field(reader, start, end, fieldNumber, any, 5, fieldIndex, field);
                         break;
                     case TYPE_STRING:
                     case TYPE_BYTES:
-                        field = parent->getSubField(path[i].fieldNumber, WIRETYPE_LEN, path[i].fieldIndex);
+                        found = blob_find_field(reader, start, end, fieldNumber, len, 1, fieldIndex, field);
                         break;
                     case TYPE_INT32:
                     case TYPE_INT64:
@@ -279,113 +464,194 @@ namespace sqlite_protobuf
                     case TYPE_SINT64:
                     case TYPE_BOOL:
                     case TYPE_ENUM:
-                        field = parent->getSubField(path[i].fieldNumber, WIRETYPE_VARINT, path[i].fieldIndex);
-                        if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_LEN, 0); index = path[i].fieldIndex;} // Packed repeated
+                        packed = varint;
                         break;
                     case TYPE_FIXED64:
                     case TYPE_SFIXED64:
                     case TYPE_DOUBLE:
-                        field = parent->getSubField(path[i].fieldNumber, WIRETYPE_I64, path[i].fieldIndex);
-                        if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_LEN, 0); index = path[i].fieldIndex;} // Packed repeated
+                        packed = i64;
                         break;
                     case TYPE_FIXED32:
                     case TYPE_SFIXED32:
                     case TYPE_FLOAT:
-                        field = parent->getSubField(path[i].fieldNumber, WIRETYPE_I32, path[i].fieldIndex);
-                        if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_LEN, 0); index = path[i].fieldIndex;} // Packed repeated
+                        packed = i32;
                         break;
                     default:
-                        field = nullptr;
                         break;
                     }
+
+                    if (packed != nullptr)
+                    {
+                        found = blob_find_field(reader, start, end, fieldNumber, packed, 1, fieldIndex, field);
+                        if (!found) {found = blob_find_field(reader, start, end, fieldNumber, len, 1, 0, field); *index = fieldIndex;} // Packed repeated
+                    }
                 }
 
-                if (field == nullptr) {break;}
+                if (!found) {return false;}
             }
+            return true;
+        }
 
-            // Set path aux data, needs to be done after path no longer is needed (see sqlite documentation)
-            if (setPathAuxData)
+        /// Return the element from a protobuf message stored in a table, using 
+        /// incremental blob I/O so only the bytes on the path are read
+        ///
+        ///     SELECT protobuf_extract_blob(table, column, rowid, "$.1.2[0].3", type);
+        ///
+        /// @returns a Protobuf-encoded BLOB or the appropriate SQL datatype
+        static void protobuf_extract_blob(sqlite3_context *context, int argc, sqlite3_value **argv)
+        {
+            // Look up type from aux data
+            Type type;
+            Type* typePtr = (Type*)sqlite3_get_auxdata(context, 4);
+            if (typePtr == nullptr)
+            {
+                const std::string typeString = string_from_sqlite3_value(argv[4]);
+                type = type_from_string(typeString);
+                typePtr = (Type*)sqlite3_malloc64(sizeof(Type));
+                if (typePtr != nullptr)
+                {
+                    *typePtr = type;
+                    // Set type aux data since we no longer need the type pointer
+                    sqlite3_set_auxdata(context, 4, typePtr, sqlite3_free);
+                }
+            }
+            else
             {
-                sqlite3_set_auxdata(context, 1, path, sqlite3_free);
+                type = *typePtr;
             }
 
-            // Create result buffer pointing to correct memmory address
-            if (field == nullptr) {return;}
-            Buffer result;
-            result.start = field->value.start + (buffer.start - root->value.start);
-            result.end = field->value.end + (buffer.start - root->value.start);
+            // Check validity of type
+            if (type == TYPE_UNKNOWN)
+            {
+                sqlite3_result_error(context, "Type not valid, try type '' or check documentation", -1);
+                return;
+            }
 
-            // Extract data from buffer based on selected type
-            int32_t valueInt32 = 0;
-            int64_t valueInt64 = 0;
-            uint32_t valueUint32 = 0;
-            uint64_t valueUint64 = 0;
-            double valueDouble = 0;
-            float valueFloat = 0;
-            bool valueBool = 0;
+            // Look up compiled path from aux data, or from the path cache of the connection
+            bool setPathAuxData = false;
+            CompiledPath* path = (CompiledPath*)sqlite3_get_auxdata(context, 3);
+            if (path == nullptr)
+            {
+                std::string error;
+                path = path_lookup((PathCache*)sqlite3_user_data(context), string_from_sqlite3_value(argv[3]), error);
+                if (path == nullptr)
+                {
+                    sqlite3_result_error(context, error.c_str(), -1);
+                    return;
+                }
+                setPathAuxData = true;
+            }
 
-            switch (type)
+            // Incremental reads follow a single field, use protobuf_extract for paths selecting several fields
+            if (path->multi)
             {
-            case TYPE_BUFFER:
-                sqlite3_result_blob(context, (char *)result.start, result.size(), SQLITE_STATIC);
+                if (setPathAuxData) {path_release(path);}
+                sqlite3_result_error(context, "Path not valid, protobuf_extract_blob does not support wildcards, slices, filters or '..'", -1);
                 return;
-            case TYPE_STRING:
-                sqlite3_result_text(context, (char *)result.start, result.size(), SQLITE_STATIC);
-                return;
-            case TYPE_BYTES:
-                sqlite3_result_blob(context, (char *)result.start, result.size(), SQLITE_STATIC);
-                return;
-            case TYPE_ENUM:
-            case TYPE_INT32:
-                if (getInt32(&result, &valueInt32, index)) {sqlite3_result_int(context, valueInt32);}
-                return;
-            case TYPE_INT64:
-                if (getInt64(&result, &valueInt64, index)) {sqlite3_result_int64(context, valueInt64);}
-                return;
-            case TYPE_UINT32:
-                if (getUint32(&result, &valueUint32, index)) {sqlite3_result_int64(context, valueUint32);}
-                return;
-            case TYPE_UINT64:
-                if (getUint64(&result, &valueUint64, index)) {sqlite3_result_int64(context, valueUint64);}
-                if (valueUint64 > INT64_MAX) {sqlite3_log(SQLITE_WARNING,"Protobuf type is unsigned, but SQLite does not support unsigned types. Value %llu doesn't fit in an int64.", valueUint64);}
-                return;
-            case TYPE_SINT32:
-                if (getSint32(&result, &valueInt32, index)) {sqlite3_result_int(context, valueInt32);}
-                return;
-            case TYPE_SINT64:
-                if (getSint64(&result, &valueInt64, index)) {sqlite3_result_int64(context, valueInt64);}
-                return;
-            case TYPE_BOOL:
-                if (getBool(&result, &valueBool, index)) {sqlite3_result_int(context, valueBool ? 1 : 0);}
-                return;
-            case TYPE_FIXED64:
-                if (getFixed64(&result, &valueUint64, index)) {sqlite3_result_int64(context, valueUint64);}
-                if (valueUint64 > INT64_MAX) {sqlite3_log(SQLITE_WARNING,"Protobuf type is unsigned, but SQLite does not support unsigned types. Value %llu doesn't fit in an int64.", valueUint64);}
-                return;
-            case TYPE_SFIXED64:
-                if (getSfixed64(&result, &valueInt64, index)) {sqlite3_result_int64(context, valueInt64);}
-                return;
-            case TYPE_DOUBLE:
-                if (getDouble(&result, &valueDouble, index)) {sqlite3_result_double(context, valueDouble);}
-                return;
-            case TYPE_FIXED32:
-                if (getFixed32(&result, &valueUint32, index)) {sqlite3_result_int64(context, valueUint32);}
-                return;
-            case TYPE_SFIXED32:
-                if (getSfixed32(&result, &valueInt32, index)) {sqlite3_result_int(context, valueInt32);}
+            }
+
+            if (sqlite3_value_type(argv[2]) == SQLITE_NULL)
+            {
+                if (setPathAuxData) {path_release(path);}
                 return;
-            case TYPE_FLOAT:
-                if (getFloat(&result, &valueFloat, index)) {sqlite3_result_double(context, valueFloat);}
+            }
+
+            // Split table into schema and table name, unqualified names are looked up in temp and then main
+            sqlite3 *db = sqlite3_context_db_handle(context);
+            std::string table = string_from_sqlite3_value(argv[0]);
+            std::string schema;
+            size_t dot = table.find('.');
+            if (dot != std::string::npos)
+            {
+                schema = table.substr(0, dot);
+                table = table.substr(dot + 1);
+            }
+            const char *column = (const char *)sqlite3_value_text(argv[1]);
+
+            // Open the blob for incremental I/O
+            BlobReader *reader = (BlobReader *)sqlite3_malloc64(sizeof(BlobReader));
+            if (reader == nullptr)
+            {
+                if (setPathAuxData) {path_release(path);}
+                sqlite3_result_error_nomem(context);
                 return;
-            default:
+            }
+            memset(reader, 0, sizeof(BlobReader));
+
+            int rc;
+            if (!schema.empty())
+            {
+                rc = sqlite3_blob_open(db, schema.c_str(), table.c_str(), column, sqlite3_value_int64(argv[2]), 0, &reader->blob);
+            }
+            else
+            {
+                rc = sqlite3_blob_open(db, "temp", table.c_str(), column, sqlite3_value_int64(argv[2]), 0, &reader->blob);
+                if (rc != SQLITE_OK && strstr(sqlite3_errmsg(db), "no such table") != nullptr)
+                {
+                    rc = sqlite3_blob_open(db, "main", table.c_str(), column, sqlite3_value_int64(argv[2]), 0, &reader->blob);
+                }
+            }
+            if (rc != SQLITE_OK)
+            {
+                // A NULL value has nothing to extract, any other failure is reported as an error
+                const char *error = sqlite3_errmsg(db);
+                if (strstr(error, "type null") == nullptr)
+                {
+                    sqlite3_result_error(context, error, -1);
+                }
+                sqlite3_blob_close(reader->blob);
+                sqlite3_free(reader);
+                if (setPathAuxData) {path_release(path);}
                 return;
             }
+            reader->size = sqlite3_blob_bytes(reader->blob);
+
+            // Traverse path to the desired field and read only the bytes of its value
+            int32_t index = 0;
+            BlobField field;
+            std::string value;
+            bool found = blob_traverse_path(reader, path->steps.data(), type, &index, &field) && reader->read(field.start, field.end - field.start, value);
+
+            sqlite3_blob_close(reader->blob);
+            sqlite3_free(reader);
+
+            // Set path aux data, needs to be done after path no longer is needed (see sqlite documentation)
+            if (setPathAuxData)
+            {
+                sqlite3_set_auxdata(context, 3, path, path_release);
+            }
+
+            if (!found) {return;}
+            Buffer result;
+            result.start = (const uint8_t *)value.data();
+            result.end = result.start + value.size();
+            result_from_buffer(context, type, result, index, SQLITE_TRANSIENT);
         }
     } // namespace
 
     int register_protobuf_extract(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
     {
-        return sqlite3_create_function(db, "protobuf_extract", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, protobuf_extract, 0, 0);
+        int rc;
+
+        // protobuf_extract and protobuf_locate share the caches of the connection, each holds a reference
+        ExtractCache *cache = new (std::nothrow) ExtractCache();
+        if (cache == nullptr)
+            return SQLITE_NOMEM;
+        cache->refs = 1;
+        cache->paths = path_cache_acquire(db);
+
+        cache->refs++;
+        rc = sqlite3_create_function_v2(db, "protobuf_extract", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, cache, protobuf_extract, 0, 0, extract_cache_release);
+        if (rc == SQLITE_OK)
+        {
+            cache->refs++;
+            rc = sqlite3_create_function_v2(db, "protobuf_locate", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, cache, protobuf_locate, 0, 0, extract_cache_release);
+        }
+        extract_cache_release(cache);
+        if (rc != SQLITE_OK)
+            return rc;
+
+        return sqlite3_create_function_v2(db, "protobuf_extract_blob", 5, SQLITE_UTF8, path_cache_acquire(db), protobuf_extract_blob, 0, 0, path_cache_release);
     }
 
 } // namespace sqlite_protobuf
\ No newline at end of file
@@ -0,0 +1,555 @@
+#include "protobuf_file.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <vector>
+#include <new>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "protodec.h"
+#include "delimited_file.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    namespace
+    {
+        std::string string_from_sqlite3_value(sqlite3_value *value)
+        {
+            const char *text = static_cast<const char *>(sqlite3_value_blob(value));
+            size_t text_size = static_cast<size_t>(sqlite3_value_bytes(value));
+            return std::string(text, text_size);
+        }
+    } // namespace
+
+    /* Every 2^SHIFT message the offset is added to the sparse index used to seek to a rowid */
+    #define PROTOBUF_FILE_INDEX_SHIFT 10
+
+    /* Number of unused mappings kept open, so that repeated queries on the same files do not map them again */
+    #define PROTOBUF_FILE_CACHE_SIZE 4
+
+    /* Number of mappings that may be pinned, the blobs of the messages of other mappings are copied */
+    #define PROTOBUF_FILE_PINNED_SIZE 16
+
+    /*
+    ** File mapped into memory, shared by all cursors reading the file. SQLite may keep a blob
+    ** after the cursor has moved on, so blobs only point into a mapping once it is pinned, and
+    ** pinned mappings stay open as long as the table is
+    */
+    typedef struct ProtobufFileMapping ProtobufFileMapping;
+    struct ProtobufFileMapping
+    {
+        std::string path;           // Path of the file
+        FileMap map;                // Mapped file
+        int refs;                   // Number of cursors using the mapping
+        bool stale;                 // File has changed since it was mapped
+        bool pinned;                // Blobs pointing into the mapping were returned
+        std::vector<int64_t> index[FRAMING_COUNT]; // Offset of every 2^PROTOBUF_FILE_INDEX_SHIFT message
+    };
+
+    /*
+    ** Define virtual table data structure containg data needed for virtual table
+    */
+    typedef struct ProtobufFileVtab ProtobufFileVtab;
+    struct ProtobufFileVtab
+    {
+        sqlite3_vtab base;          // Base class - must be first
+        std::vector<ProtobufFileMapping*> mappings; // Open mappings
+    };
+
+    /*
+    ** Define cursor data structure, used to iterate over the messages of the file
+    */
+    typedef struct ProtobufFileCursor ProtobufFileCursor;
+    struct ProtobufFileCursor
+    {
+        sqlite3_vtab_cursor base;   // Base class - must be first
+        ProtobufFileMapping *mapping; // Mapped file
+        Framing framing;            // Framing of the messages
+        std::string framingName;    // Framing as given in the query
+        int64_t next;               // Offset of the length prefix of the next message
+        int64_t offset;             // Offset of the current message
+        int64_t size;               // Size of the current message
+        sqlite3_int64 iMessage;     // Index of the current message, the rowid is iMessage + 1
+        sqlite3_int64 iLast;        // Index of the last message to return
+        bool eof;
+    };
+
+    static void protobufFileUnmap(ProtobufFileMapping *mapping)
+    {
+        file_unmap(&mapping->map);
+        delete mapping;
+    }
+
+    /*
+    ** Get a mapping of the file, an open mapping is reused unless the file has changed
+    */
+    static ProtobufFileMapping* protobufFileAcquire(ProtobufFileVtab *pTab, const std::string &path)
+    {
+        int64_t size, mtime;
+        uint64_t inode;
+        if (!file_stat(path, &size, &mtime, &inode)) {return nullptr;}
+
+        ProtobufFileMapping *mapping = nullptr;
+        for (size_t i = 0; i < pTab->mappings.size(); i++)
+        {
+            ProtobufFileMapping *m = pTab->mappings[i];
+            if (m->stale || m->path != path) {continue;}
+            if (m->map.size == size && m->map.mtime == mtime && m->map.inode == inode) {mapping = m; break;}
+            m->stale = true;
+        }
+
+        if (mapping == nullptr)
+        {
+            mapping = new (std::nothrow) ProtobufFileMapping();
+            if (mapping == nullptr) {return nullptr;}
+            if (!file_map(path, &mapping->map))
+            {
+                delete mapping;
+                return nullptr;
+            }
+            mapping->path = path;
+            mapping->refs = 0;
+            mapping->stale = false;
+            mapping->pinned = false;
+            pTab->mappings.push_back(mapping);
+        }
+        mapping->refs++;
+
+        // Close stale mappings, and the oldest unused mappings when there are too many
+        size_t unused = 0;
+        for (size_t i = pTab->mappings.size(); i-- > 0;)
+        {
+            ProtobufFileMapping *m = pTab->mappings[i];
+            if (m->refs > 0 || m->pinned) {continue;}
+            if (m->stale || ++unused > PROTOBUF_FILE_CACHE_SIZE)
+            {
+                protobufFileUnmap(m);
+                pTab->mappings.erase(pTab->mappings.begin() + i);
+            }
+        }
+        return mapping;
+    }
+
+    static void protobufFileRelease(ProtobufFileVtab *pTab, ProtobufFileMapping *mapping)
+    {
+        if (mapping == nullptr) {return;}
+        mapping->refs--;
+    }
+
+    /*
+    ** Pin a mapping so that blobs can point into it, unless too many mappings are pinned already
+    */
+    static bool protobufFilePin(ProtobufFileVtab *pTab, ProtobufFileMapping *mapping)
+    {
+        if (mapping->pinned) {return true;}
+        size_t pinned = 0;
+        for (size_t i = 0; i < pTab->mappings.size(); i++)
+        {
+            pinned += pTab->mappings[i]->pinned ? 1 : 0;
+        }
+        mapping->pinned = pinned < PROTOBUF_FILE_PINNED_SIZE;
+        return mapping->pinned;
+    }
+
+    /*
+    ** Constructor for ProtobufFileVtab objects.
+    */
+    static int protobufFileConnect(sqlite3 *db, void *pAux, int argc, const char *const*argv, sqlite3_vtab **ppVtab, char **pzErr)
+    {
+        /* For convenience, define symbolic names for the index to each column. */
+        #define PROTOBUF_FILE_MESSAGE  0
+        #define PROTOBUF_FILE_OFFSET   1
+        #define PROTOBUF_FILE_SIZE     2
+        #define PROTOBUF_FILE_PATH     3 // First argument (marked as HIDDEN) path of the file
+        #define PROTOBUF_FILE_FRAMING  4 // Second argument (marked as HIDDEN) framing of the messages
+
+        /* Flags of idxNum, telling xFilter which arguments are supplied */
+        #define PROTOBUF_FILE_PLAN_PATH    1
+        #define PROTOBUF_FILE_PLAN_FRAMING 2
+
+        // Tell SQLite what the result set of queries against the virtual table will look like.
+        int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(message,offset,size,path HIDDEN,framing HIDDEN)");
+        if (rc != SQLITE_OK) {return rc;}
+
+        // Reading files is only allowed from top level SQL, not from triggers and views in the schema
+        if (sqlite3_libversion_number() >= 3031000)
+        {
+            sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+        }
+
+        ProtobufFileVtab *pNew = new (std::nothrow) ProtobufFileVtab();
+        if (pNew == nullptr) {return SQLITE_NOMEM;}
+        *ppVtab = &pNew->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for ProtobufFileVtab objects, the mappings are closed.
+    */
+    static int protobufFileDisconnect(sqlite3_vtab *pVtab)
+    {
+        ProtobufFileVtab *p = (ProtobufFileVtab*)pVtab;
+        for (size_t i = 0; i < p->mappings.size(); i++)
+        {
+            protobufFileUnmap(p->mappings[i]);
+        }
+        delete p;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Constructor for a new ProtobufFileCursor object.
+    */
+    static int protobufFileOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+    {
+        ProtobufFileCursor *pCur = new (std::nothrow) ProtobufFileCursor();
+        if (pCur == nullptr) {return SQLITE_NOMEM;}
+        pCur->mapping = nullptr;
+        pCur->eof = true;
+        *ppCursor = &pCur->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for a ProtobufFileCursor.
+    */
+    static int protobufFileClose(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufFileCursor *pCur = (ProtobufFileCursor*)cur;
+        protobufFileRelease((ProtobufFileVtab *)cur->pVtab, pCur->mapping);
+        delete pCur;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Read the message starting at the next offset, and add it to the sparse index
+    **
+    ** @returns false at the end of the file, or if the last message is truncated
+    */
+    static bool protobufFileRead(ProtobufFileCursor *pCur)
+    {
+        ProtobufFileMapping *mapping = pCur->mapping;
+        Buffer message;
+        int64_t pos = pCur->next;
+        if (!read_delimited(mapping->map.data, mapping->map.size, pCur->framing, &pos, &message))
+        {
+            if (pCur->next < mapping->map.size)
+            {
+                sqlite3_log(SQLITE_WARNING, "protobuf_file: message at offset %lld of %s is truncated", (long long)pCur->next, mapping->path.c_str());
+            }
+            return false;
+        }
+
+        std::vector<int64_t> &index = mapping->index[pCur->framing];
+        pCur->iMessage++;
+        if ((pCur->iMessage & ((1 << PROTOBUF_FILE_INDEX_SHIFT) - 1)) == 0 && (size_t)(pCur->iMessage >> PROTOBUF_FILE_INDEX_SHIFT) == index.size())
+        {
+            index.push_back(pCur->next);
+        }
+        pCur->offset = message.start - mapping->map.data;
+        pCur->size = (int64_t)message.size();
+        pCur->next = pos;
+        return true;
+    }
+
+    /*
+    ** Advance a ProtobufFileCursor to its next row of output.
+    */
+    static int protobufFileNext(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufFileCursor *pCur = (ProtobufFileCursor*)cur;
+        pCur->eof = pCur->iMessage >= pCur->iLast || !protobufFileRead(pCur);
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return value at given column and row (ProtobufFileCursor), the message points into the
+    ** mapping if it is pinned and is copied otherwise.
+    */
+    static int protobufFileColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+    {
+        ProtobufFileCursor *pCur = (ProtobufFileCursor *)cur;
+        switch (col)
+        {
+        case PROTOBUF_FILE_MESSAGE:
+        {
+            bool pinned = protobufFilePin((ProtobufFileVtab *)cur->pVtab, pCur->mapping);
+            sqlite3_result_blob64(ctx, pCur->mapping->map.data + pCur->offset, (sqlite3_uint64)pCur->size, pinned ? SQLITE_STATIC : SQLITE_TRANSIENT);
+            break;
+        }
+        case PROTOBUF_FILE_OFFSET:
+            sqlite3_result_int64(ctx, pCur->offset);
+            break;
+        case PROTOBUF_FILE_SIZE:
+            sqlite3_result_int64(ctx, pCur->size);
+            break;
+        case PROTOBUF_FILE_PATH:
+            sqlite3_result_text(ctx, pCur->mapping->path.c_str(), (int)pCur->mapping->path.size(), SQLITE_TRANSIENT);
+            break;
+        case PROTOBUF_FILE_FRAMING:
+            sqlite3_result_text(ctx, pCur->framingName.c_str(), (int)pCur->framingName.size(), SQLITE_TRANSIENT);
+            break;
+        default:
+            break;
+        }
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return the rowid for the current row, the position of the message in the file starting at 1.
+    */
+    static int protobufFileRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+    {
+        ProtobufFileCursor *pCur = (ProtobufFileCursor*)cur;
+        *pRowid = pCur->iMessage + 1;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return TRUE if the cursor has been moved off of the last row of output.
+    */
+    static int protobufFileEof(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufFileCursor *pCur = (ProtobufFileCursor*)cur;
+        return pCur->eof;
+    }
+
+    /*
+    ** Narrow the range of message indexes with a constraint on the rowid, only numeric values are used
+    */
+    static void protobufFileLimitRowid(sqlite3_int64 *iFirst, sqlite3_int64 *iLast, char op, sqlite3_value *value)
+    {
+        int type = sqlite3_value_type(value);
+        if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) {return;}
+
+        double x = sqlite3_value_double(value);
+        if (type == SQLITE_FLOAT && fabs(x) >= 9e18) {return;}
+        sqlite3_int64 lower = type == SQLITE_INTEGER ? sqlite3_value_int64(value) : (sqlite3_int64)ceil(x);
+        sqlite3_int64 upper = type == SQLITE_INTEGER ? sqlite3_value_int64(value) : (sqlite3_int64)floor(x);
+        if (op == 'g' && upper == INT64_MAX) {*iLast = -1; return;}
+
+        // Rowids below 1 are no row or no lower bound, which keeps the subtractions below from overflowing
+        if ((op == 'e' || op == 'l') && lower <= 0) {*iLast = -1; return;}
+        if (op == 'L' && upper <= 0) {*iLast = -1; return;}
+        if (op == 'G' && lower <= 0) {return;}
+
+        // Message indexes start at 0 for rowid 1
+        switch (op)
+        {
+        case 'e': if (lower - 1 > *iFirst) {*iFirst = lower - 1;} if (upper - 1 < *iLast) {*iLast = upper - 1;} break;
+        case 'g': if (upper > *iFirst) {*iFirst = upper;} break;
+        case 'G': if (lower - 1 > *iFirst) {*iFirst = lower - 1;} break;
+        case 'l': if (lower - 2 < *iLast) {*iLast = lower - 2;} break;
+        case 'L': if (upper - 1 < *iLast) {*iLast = upper - 1;} break;
+        default: break;
+        }
+    }
+
+    /*
+    ** This method is called to "rewind" the ProtobufFileCursor object back
+    ** to the first row of output. The file is mapped, and the cursor seeks to the
+    ** first rowid using the sparse index, extending the index as it goes.
+    */
+    static int protobufFileFilter(sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv)
+    {
+        ProtobufFileCursor *pCur = (ProtobufFileCursor *)cur;
+        ProtobufFileVtab *pTab = (ProtobufFileVtab *)cur->pVtab;
+        protobufFileRelease(pTab, pCur->mapping);
+        pCur->mapping = nullptr;
+        pCur->eof = true;
+
+        // Query strategy 0, no path supplied
+        if ((idxNum & PROTOBUF_FILE_PLAN_PATH) == 0)
+        {
+            return SQLITE_OK;
+        }
+
+        int iArg = 1;
+        pCur->framing = FRAMING_VARINT;
+        pCur->framingName = "varint";
+        if (idxNum & PROTOBUF_FILE_PLAN_FRAMING)
+        {
+            pCur->framingName = string_from_sqlite3_value(argv[iArg++]);
+            if (!framing_from_string(pCur->framingName, &pCur->framing))
+            {
+                sqlite3_free(pTab->base.zErrMsg);
+                pTab->base.zErrMsg = sqlite3_mprintf("Framing not valid, try 'varint', 'fixed32' or 'fixed32be'");
+                return SQLITE_ERROR;
+            }
+        }
+
+        sqlite3_int64 iFirst = 0;
+        pCur->iLast = INT64_MAX;
+        for (const char *c = idxStr; c != nullptr && *c != 0 && iArg < argc; c++, iArg++)
+        {
+            protobufFileLimitRowid(&iFirst, &pCur->iLast, *c, argv[iArg]);
+        }
+
+        const std::string path = string_from_sqlite3_value(argv[0]);
+        pCur->mapping = protobufFileAcquire(pTab, path);
+        if (pCur->mapping == nullptr)
+        {
+            sqlite3_free(pTab->base.zErrMsg);
+            pTab->base.zErrMsg = sqlite3_mprintf("Unable to open file: %s", path.c_str());
+            return SQLITE_ERROR;
+        }
+        if (iFirst > pCur->iLast) {return SQLITE_OK;}
+
+        // Seek to the closest indexed message before the first message
+        const std::vector<int64_t> &index = pCur->mapping->index[pCur->framing];
+        size_t iIndex = (size_t)(iFirst >> PROTOBUF_FILE_INDEX_SHIFT);
+        if (iIndex >= index.size()) {iIndex = index.size() > 0 ? index.size() - 1 : 0;}
+        pCur->next = index.empty() ? 0 : index[iIndex];
+        pCur->iMessage = ((sqlite3_int64)iIndex << PROTOBUF_FILE_INDEX_SHIFT) - 1;
+        file_advise(&pCur->mapping->map, pCur->iLast - iFirst >= (1 << PROTOBUF_FILE_INDEX_SHIFT));
+
+        pCur->eof = false;
+        while (!pCur->eof && pCur->iMessage < iFirst)
+        {
+            pCur->eof = !protobufFileRead(pCur);
+        }
+        return SQLITE_OK;
+    }
+
+    /*
+    ** SQLite will invoke this method one or more times while planning a query
+    ** that uses the virtual table.  This routine needs to create a query plan
+    ** for each invocation and compute an estimated cost for that plan.
+    ** The query strategy here is to look for an equality constraint on the path
+    ** column.  Without such a constraint, the table cannot operate.  idxNum
+    ** is 1 if the path is found, 3 if the path and framing are found, and 0
+    ** otherwise. Constraints on the rowid are listed in idxStr.
+    */
+    static int protobufFileBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo)
+    {
+        int aIdx[2];          // Index of constraints for PATH and FRAMING
+        int unusableMask = 0; // Mask of unusable PATH and FRAMING constraints
+        int idxMask = 0;      // Mask of usable == constraints PATH and FRAMING
+        std::string idxStr;   // Constraints on the rowid
+        std::vector<int> aRowid; // Index of constraints on the rowid
+        double nRows = 1000000.0;
+        const struct sqlite3_index_info::sqlite3_index_constraint *pConstraint;
+
+        // This implementation assumes that PATH and FRAMING are the last two columns in the table
+        aIdx[0] = aIdx[1] = -1;
+        pConstraint = pIdxInfo->aConstraint;
+        for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++)
+        {
+            int iCol = pConstraint->iColumn - PROTOBUF_FILE_PATH;
+            int iMask = 1 << iCol;
+            if (iCol >= 0)
+            {
+                if (pConstraint->usable == 0)
+                {
+                    unusableMask |= iMask;
+                }
+                else if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ)
+                {
+                    aIdx[iCol] = i;
+                    idxMask |= iMask;
+                }
+                continue;
+            }
+            if (pConstraint->usable == 0 || pConstraint->iColumn >= 0) {continue;}
+
+            char c = 0;
+            switch (pConstraint->op)
+            {
+            case SQLITE_INDEX_CONSTRAINT_EQ: c = 'e'; nRows = 1; break;
+            case SQLITE_INDEX_CONSTRAINT_GT: c = 'g'; nRows *= 0.25; break;
+            case SQLITE_INDEX_CONSTRAINT_GE: c = 'G'; nRows *= 0.25; break;
+            case SQLITE_INDEX_CONSTRAINT_LT: c = 'l'; nRows *= 0.25; break;
+            case SQLITE_INDEX_CONSTRAINT_LE: c = 'L'; nRows *= 0.25; break;
+            default: break;
+            }
+            if (c == 0) {continue;}
+            idxStr += c;
+            aRowid.push_back(i);
+        }
+
+        if ((unusableMask & ~idxMask) != 0)
+        {
+            // If there are any unusable constraints on PATH or FRAMING, then reject this entire plan
+            return SQLITE_CONSTRAINT;
+        }
+        if (aIdx[0] < 0)
+        {
+            // No PATH input. Leave estimatedCost at the huge initial value to discourage query planner from using this plan.
+            pIdxInfo->idxNum = 0;
+            return SQLITE_OK;
+        }
+
+        pIdxInfo->aConstraintUsage[aIdx[0]].argvIndex = 1;
+        pIdxInfo->aConstraintUsage[aIdx[0]].omit = 1;
+        pIdxInfo->idxNum = PROTOBUF_FILE_PLAN_PATH;
+        int argvIndex = 2;
+        if (aIdx[1] >= 0)
+        {
+            pIdxInfo->aConstraintUsage[aIdx[1]].argvIndex = argvIndex++;
+            pIdxInfo->aConstraintUsage[aIdx[1]].omit = 1;
+            pIdxInfo->idxNum |= PROTOBUF_FILE_PLAN_FRAMING;
+        }
+
+        // Constraints on the rowid are not omitted, SQLite still checks them
+        for (size_t i = 0; i < aRowid.size(); i++)
+        {
+            pIdxInfo->aConstraintUsage[aRowid[i]].argvIndex = argvIndex++;
+        }
+        if (!idxStr.empty())
+        {
+            pIdxInfo->idxStr = sqlite3_mprintf("%s", idxStr.c_str());
+            pIdxInfo->needToFreeIdxStr = 1;
+            if (pIdxInfo->idxStr == nullptr) {return SQLITE_NOMEM;}
+        }
+
+        // Rows are returned in rowid order
+        if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn < 0 && pIdxInfo->aOrderBy[0].desc == 0)
+        {
+            pIdxInfo->orderByConsumed = 1;
+        }
+        pIdxInfo->estimatedCost = nRows;
+        pIdxInfo->estimatedRows = (sqlite3_int64)nRows + 1;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Define all the methods for the module (virtual table).
+    */
+    static sqlite3_module protobufFileModule = {
+        /* iVersion    */ 0,
+        /* xCreate     */ 0,
+        /* xConnect    */ protobufFileConnect,
+        /* xBestIndex  */ protobufFileBestIndex,
+        /* xDisconnect */ protobufFileDisconnect,
+        /* xDestroy    */ 0,
+        /* xOpen       */ protobufFileOpen,
+        /* xClose      */ protobufFileClose,
+        /* xFilter     */ protobufFileFilter,
+        /* xNext       */ protobufFileNext,
+        /* xEof        */ protobufFileEof,
+        /* xColumn     */ protobufFileColumn,
+        /* xRowid      */ protobufFileRowid,
+        /* xUpdate     */ 0,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ 0,
+        /* xSavepoint  */ //0, // iVersion >= 2
+        /* xRelease    */ //0, // iVersion >= 2
+        /* xRollbackTo */ //0, // iVersion >= 2
+        /* xShadowName */ //0, // iVersion >= 3
+        /* xIntegrity  */ //0, // iVersion >= 4
+    };
+
+    int register_protobuf_file(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        return sqlite3_create_module(db, "protobuf_file", &protobufFileModule, 0);
+    }
+
+} // namespace sqlite_protobuf
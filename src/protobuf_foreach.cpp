@@ -2,9 +2,17 @@
 #include "sqlite3ext.h"
 
 #include <string>
+#include <vector>
+#include <new>
+#include <algorithm>
+#include <iterator>
+#include <cctype>
+#include <cmath>
 #include <cstring>
 
 #include "protodec.h"
+#include "protobuf_path.h"
+#include "protobuf_stats.h"
 
 namespace sqlite_protobuf
 {
@@ -24,21 +32,58 @@ namespace sqlite_protobuf
     struct ProtobufForeachVtab 
     {
         sqlite3_vtab base;  // Base class - must be first
+        PathCache *cache;   // Path cache of the connection
     };
 
     /*
-    ** Define cursor data structure, used to iterate over virtual table rows
+    ** Define cursor data structure, used to iterate over virtual table rows. The fields
+    ** are read one at a time as the cursor advances, and the buffers are reused across
+    ** calls to xFilter
     */
+    typedef struct ProtobufForeachRow ProtobufForeachRow;
+    struct ProtobufForeachRow
+    {
+        uint32_t tag;               // Tag of the sub field
+        uint32_t fieldNum;          // Field number of the sub field
+        uint32_t wireType;          // Wire type of the sub field
+        Buffer value;               // Value of the sub field
+        sqlite3_int64 rowid;        // Position of the sub field among all sub fields of the message
+        size_t root;                // Index of the message the sub field belongs to
+    };
+
     typedef struct ProtobufForeachCursor ProtobufForeachCursor;
     struct ProtobufForeachCursor 
     {
         sqlite3_vtab_cursor base;   // Base class - must be first
-        sqlite3_int64 iRowid;       // The rowid
         std::string path;           // Path to root field
-        Field field;                // Decoded protobuf message
-        Field *root;                // Root field
+        Buffer buffer;              // Protobuf message
+        std::vector<Buffer> roots;  // Messages whose fields are returned as rows
+        size_t iRoot;               // Index of the message currently being read
+        Buffer remaining;           // Unread part of the current message
+        std::vector<ProtobufForeachRow> pending; // Rows read from the current field, packed values followed by the field itself
+        size_t iPending;            // Index of the current row in pending
+        sqlite3_int64 nextRowid;    // Rowid of the next sub field read from the message
+        sqlite3_int64 rowsLeft;     // Rows left before LIMIT and OFFSET are satisfied, or -1 if unlimited
+        bool constrained[3];        // Rows must match values of TAG, FIELD and WIRETYPE column
+        std::vector<sqlite3_int64> values[3]; // Sorted values allowed by the == and IN constraints on each column
+#ifndef SQLITE_PROTOBUF_NO_STATS
+        StatsCall stats;            // Current call, recorded once all rows have been read
+        bool statsActive;
+#endif
     };
 
+#ifndef SQLITE_PROTOBUF_NO_STATS
+    /*
+    ** Record the current call in the statistics, the time of the call is the time spent in
+    ** xFilter and xNext, and the fields read are its nodes
+    */
+    static void protobufForeachRecord(ProtobufForeachCursor *pCur)
+    {
+        if (pCur->statsActive) {stats_record(pCur->stats);}
+        pCur->statsActive = false;
+    }
+#endif
+
     /*
     ** Constructor for ProtobufForeachVtab objects.
     */
@@ -52,10 +97,32 @@ namespace sqlite_protobuf
         #define PROTOBUF_FOREACH_PARENT   4
         #define PROTOBUF_FOREACH_BUFFER   5 // First argument (marked as HIDDEN) protobuf buffer
         #define PROTOBUF_FOREACH_ROOT     6 // Second argument (marked as HIDDEN) root path
+        #define PROTOBUF_FOREACH_AS_INT    7 // Value decoded as int32, int64, uint32, uint64, bool or enum (marked as HIDDEN)
+        #define PROTOBUF_FOREACH_AS_SINT   8 // Value decoded as sint32 or sint64 (marked as HIDDEN)
+        #define PROTOBUF_FOREACH_AS_DOUBLE 9 // Value decoded as double (marked as HIDDEN)
+        #define PROTOBUF_FOREACH_AS_FLOAT 10 // Value decoded as float (marked as HIDDEN)
+        #define PROTOBUF_FOREACH_AS_TEXT  11 // Value decoded as string (marked as HIDDEN)
+        #define PROTOBUF_FOREACH_AS_FIXED 12 // Value decoded as fixed32 or fixed64 (marked as HIDDEN)
+
+        /* Flags of idxNum, telling xFilter which arguments are supplied */
+        #define PROTOBUF_FOREACH_PLAN_BUFFER 1
+        #define PROTOBUF_FOREACH_PLAN_ROOT   2
+        #define PROTOBUF_FOREACH_PLAN_LIMIT  4
+        #define PROTOBUF_FOREACH_PLAN_OFFSET 8
+        #define PROTOBUF_FOREACH_PLAN_ORDER  16 // Rows are sorted by field number
+        #define PROTOBUF_FOREACH_PLAN_DESC   32 // Sort order is descending
+
+        /* Characters of idxStr for constraints on TAG, FIELD and WIRETYPE, upper case for IN lists */
+        #define PROTOBUF_FOREACH_IDXSTR "tfw"
+
+        /* Guesses used to estimate the number of rows */
+        #define PROTOBUF_FOREACH_DEFAULT_BYTES   1024.0 // Size of message when it is not known while planning
+        #define PROTOBUF_FOREACH_BYTES_PER_FIELD 8.0    // Average size of a sub field
 
         // Tell SQLite what the result set of queries against the virtual table will look like.
         ProtobufForeachVtab *pNew;
-        int rc = sqlite3_declare_vtab(db,"CREATE TABLE x(tag,field,wiretype,value,parent,buffer HIDDEN,root HIDDEN)");
+        int rc = sqlite3_declare_vtab(db,"CREATE TABLE x(tag,field,wiretype,value,parent,buffer HIDDEN,root HIDDEN,"
+                                         "as_int HIDDEN,as_sint HIDDEN,as_double HIDDEN,as_float HIDDEN,as_text HIDDEN,as_fixed HIDDEN)");
 
         if( rc==SQLITE_OK )
         {
@@ -64,6 +131,7 @@ namespace sqlite_protobuf
             *ppVtab = (sqlite3_vtab*)pNew;
             if( pNew==0 ) return SQLITE_NOMEM;
             memset(pNew, 0, sizeof(*pNew));
+            pNew->cache = (PathCache *)pAux;
         }
 
         return rc;
@@ -85,11 +153,11 @@ namespace sqlite_protobuf
     static int protobufForeachOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
     {
         ProtobufForeachCursor *pCur;
-        pCur = (ProtobufForeachCursor *)sqlite3_malloc( sizeof(*pCur) );
+        pCur = new (std::nothrow) ProtobufForeachCursor();
         if( pCur==0 ) return SQLITE_NOMEM;
-        memset(pCur, 0, sizeof(*pCur));
         *ppCursor = &pCur->base;
         pCur->path = "$";
+        PROTOBUF_STATS(pCur->statsActive = false);
         return SQLITE_OK;
     }
 
@@ -99,10 +167,114 @@ namespace sqlite_protobuf
     static int protobufForeachClose(sqlite3_vtab_cursor *cur)
     {
         ProtobufForeachCursor *pCur = (ProtobufForeachCursor*)cur;
-        sqlite3_free(pCur);
+        PROTOBUF_STATS(protobufForeachRecord(pCur));
+        delete pCur;
         return SQLITE_OK;
     }
 
+    /*
+    ** Start reading the fields of the message at index iRoot. A message that is not
+    ** well formed produces no rows, the check only reads the field headers.
+    */
+    static void protobufForeachStartRoot(ProtobufForeachCursor *pCur)
+    {
+        pCur->remaining = pCur->roots[pCur->iRoot];
+        if (!isMessage(pCur->remaining))
+        {
+            pCur->remaining.end = pCur->remaining.start;
+        }
+    }
+
+    /*
+    ** Check if a row matches the == and IN constraints on the TAG, FIELD and WIRETYPE columns.
+    */
+    static bool protobufForeachMatch(const ProtobufForeachCursor *pCur, const ProtobufForeachRow &row)
+    {
+        const sqlite3_int64 columns[3] = {row.tag, row.fieldNum, row.wireType};
+        for (int i = 0; i < 3; i++)
+        {
+            if (pCur->constrained[i] && !std::binary_search(pCur->values[i].begin(), pCur->values[i].end(), columns[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /*
+    ** Read the next field of the current message and append the matching rows to pending. 
+    ** A length delimited field that is not a message may be a packed repeated field, the 
+    ** values it can be decoded as are returned as rows before the field itself (same order 
+    ** as decodeProtobuf). Rows that do not match the constraints are skipped, but still 
+    ** count towards the rowid so that the rowid of a sub field does not depend on the query.
+    */
+    static void protobufForeachReadField(ProtobufForeachCursor *pCur)
+    {
+        static const WireType packed[] = {WIRETYPE_VARINT, WIRETYPE_I64, WIRETYPE_I32};
+
+        Field field;
+        if (!readField(&pCur->remaining, &field)) 
+        {
+            pCur->remaining.start = pCur->remaining.end;
+            return;
+        }
+        PROTOBUF_STATS(pCur->stats.nodes++);
+
+        ProtobufForeachRow row;
+        row.fieldNum = field.fieldNum;
+        row.root = pCur->iRoot;
+
+        if (field.wireType == WIRETYPE_LEN && !isMessage(field.value))
+        {
+            PROTOBUF_STATS(pCur->stats.failures++);
+            for (size_t i = 0; i < sizeof(packed) / sizeof(packed[0]); i++)
+            {
+                size_t sizeBeforeDecode = pCur->pending.size();
+                sqlite3_int64 rowidBeforeDecode = pCur->nextRowid;
+                Buffer b = field.value;
+                row.tag = (field.fieldNum << 3) | packed[i];
+                row.wireType = packed[i];
+                bool match = protobufForeachMatch(pCur, row);
+                while (b.start < b.end && readPacked(&b, packed[i], &row.value))
+                {
+                    row.rowid = pCur->nextRowid++;
+                    if (match) {pCur->pending.push_back(row);}
+                }
+                if (b.start < b.end)
+                {
+                    // Remove the values that were added since it can not be a packed repeated field
+                    pCur->pending.resize(sizeBeforeDecode);
+                    pCur->nextRowid = rowidBeforeDecode;
+                }
+            }
+        }
+
+        row.tag = field.tag;
+        row.wireType = field.wireType;
+        row.value = field.value;
+        row.rowid = pCur->nextRowid++;
+        if (protobufForeachMatch(pCur, row)) {pCur->pending.push_back(row);}
+    }
+
+    /*
+    ** Move to the next row, reading the next field or moving to the next message when needed.
+    */
+    static void protobufForeachStep(ProtobufForeachCursor *pCur)
+    {
+        while (pCur->iPending >= pCur->pending.size() && pCur->iRoot < pCur->roots.size())
+        {
+            if (pCur->remaining.start < pCur->remaining.end)
+            {
+                pCur->pending.clear();
+                pCur->iPending = 0;
+                protobufForeachReadField(pCur);
+            }
+            else if (++pCur->iRoot < pCur->roots.size())
+            {
+                protobufForeachStartRoot(pCur);
+            }
+        }
+    }
 
     /*
     ** Advance a ProtobufForeachCursor to its next row of output.
@@ -110,17 +282,58 @@ namespace sqlite_protobuf
     static int protobufForeachNext(sqlite3_vtab_cursor *cur)
     {
         ProtobufForeachCursor *pCur = (ProtobufForeachCursor*)cur;
-        pCur->iRowid++;
+        {
+            PROTOBUF_STATS(StatsTimer timer(pCur->stats));
+            pCur->iPending++;
+            if (pCur->rowsLeft > 0) {pCur->rowsLeft--;}
+            if (pCur->rowsLeft != 0) {protobufForeachStep(pCur);}
+        }
+        PROTOBUF_STATS(if (pCur->rowsLeft == 0 || pCur->iPending >= pCur->pending.size()) {protobufForeachRecord(pCur);});
         return SQLITE_OK;
     }
 
+    /*
+    ** Return the value of the row decoded as the type of a typed column, or NULL when the
+    ** wire type does not match the type. Only the bytes of the value are decoded.
+    */
+    static void protobufForeachDecodedColumn(sqlite3_context *ctx, const ProtobufForeachRow *field, int col)
+    {
+        int64_t valueInt64;
+        uint64_t valueUint64;
+        uint32_t valueUint32;
+        double valueDouble;
+        float valueFloat;
+
+        switch (field->wireType)
+        {
+        case WIRETYPE_VARINT:
+            if (col == PROTOBUF_FOREACH_AS_INT && getInt64(&field->value, &valueInt64, 0)) {sqlite3_result_int64(ctx, valueInt64);}
+            if (col == PROTOBUF_FOREACH_AS_SINT && getSint64(&field->value, &valueInt64, 0)) {sqlite3_result_int64(ctx, valueInt64);}
+            break;
+        case WIRETYPE_I64:
+            if (col == PROTOBUF_FOREACH_AS_DOUBLE && getDouble(&field->value, &valueDouble, 0)) {sqlite3_result_double(ctx, valueDouble);}
+            if (col == PROTOBUF_FOREACH_AS_FIXED && getFixed64(&field->value, &valueUint64, 0)) {sqlite3_result_int64(ctx, valueUint64);}
+            break;
+        case WIRETYPE_I32:
+            if (col == PROTOBUF_FOREACH_AS_FLOAT && getFloat(&field->value, &valueFloat, 0)) {sqlite3_result_double(ctx, valueFloat);}
+            if (col == PROTOBUF_FOREACH_AS_FIXED && getFixed32(&field->value, &valueUint32, 0)) {sqlite3_result_int64(ctx, valueUint32);}
+            break;
+        case WIRETYPE_LEN:
+            if (col == PROTOBUF_FOREACH_AS_TEXT) {sqlite3_result_text(ctx, (char*)field->value.start, field->value.size(), SQLITE_STATIC);}
+            break;
+        default:
+            break;
+        }
+    }
+
     /*
     ** Return value at given column and row (ProtobufForeachCursor).
     */
     static int protobufForeachColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
     {
         ProtobufForeachCursor *pCur = (ProtobufForeachCursor *)cur;
-        Field *field = &pCur->root->subFields[pCur->iRowid];
+        const ProtobufForeachRow *field = &pCur->pending[pCur->iPending];
+        const Buffer &parent = pCur->roots[field->root];
         
         switch (col)
         {
@@ -137,15 +350,16 @@ namespace sqlite_protobuf
             sqlite3_result_blob(ctx, (char*)field->value.start, field->value.size(), SQLITE_STATIC);
             break;
         case PROTOBUF_FOREACH_PARENT:
-            sqlite3_result_blob(ctx, (char*)pCur->root->value.start, pCur->root->value.size(), SQLITE_STATIC);
+            sqlite3_result_blob(ctx, (char*)parent.start, parent.size(), SQLITE_STATIC);
             break;
         case PROTOBUF_FOREACH_BUFFER:
-            sqlite3_result_blob(ctx, (char*)pCur->field.value.start, pCur->field.value.size(), SQLITE_STATIC);
+            sqlite3_result_blob(ctx, (char*)pCur->buffer.start, pCur->buffer.size(), SQLITE_STATIC);
             break;
         case PROTOBUF_FOREACH_ROOT:
             sqlite3_result_text(ctx, pCur->path.c_str(), pCur->path.size(), SQLITE_TRANSIENT);
             break;
         default:
+            protobufForeachDecodedColumn(ctx, field, col);
             break;
         }
         return SQLITE_OK;
@@ -157,7 +371,7 @@ namespace sqlite_protobuf
     static int protobufForeachRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
     {
         ProtobufForeachCursor *pCur = (ProtobufForeachCursor*)cur;
-        *pRowid = pCur->iRowid;
+        *pRowid = pCur->pending[pCur->iPending].rowid;
         return SQLITE_OK;
     }
 
@@ -167,7 +381,24 @@ namespace sqlite_protobuf
     static int protobufForeachEof(sqlite3_vtab_cursor *cur)
     {
         ProtobufForeachCursor *pCur = (ProtobufForeachCursor*)cur;
-        return pCur->root == nullptr || pCur->iRowid >= pCur->root->subFields.size();
+        return pCur->rowsLeft == 0 || pCur->iPending >= pCur->pending.size();
+    }
+
+    /*
+    ** Add the value of a constraint to the allowed values, the columns are integers so 
+    ** values of other types (like text without affinity) never compare equal.
+    */
+    static void protobufForeachAppendValue(sqlite3_value *value, std::vector<sqlite3_int64> &values)
+    {
+        if (sqlite3_value_type(value) == SQLITE_INTEGER)
+        {
+            values.push_back(sqlite3_value_int64(value));
+        }
+        else if (sqlite3_value_type(value) == SQLITE_FLOAT)
+        {
+            double number = sqlite3_value_double(value);
+            if (fabs(number) < 9e18 && number == (double)(sqlite3_int64)number) {values.push_back((sqlite3_int64)number);}
+        }
     }
 
     /*
@@ -180,75 +411,140 @@ namespace sqlite_protobuf
     {
 
         ProtobufForeachCursor *pCur = (ProtobufForeachCursor *)cur;
-        pCur->iRowid = 0;
+        PROTOBUF_STATS(protobufForeachRecord(pCur));
+        pCur->path = "$";
+        pCur->buffer.start = pCur->buffer.end = nullptr;
+        pCur->roots.clear();
+        pCur->iRoot = 0;
+        pCur->pending.clear();
+        pCur->iPending = 0;
+        pCur->nextRowid = 0;
+        pCur->rowsLeft = -1;
 
         // Query strategy 0, no buffer supplied
-        if(idxNum==0)
+        if((idxNum & PROTOBUF_FOREACH_PLAN_BUFFER) == 0)
         {
             return SQLITE_OK;
         }
 
-        // Decode protobuf message
+        // Stop once LIMIT + OFFSET rows have been returned, SQLite skips the OFFSET rows itself
+        int iArg = (idxNum & PROTOBUF_FOREACH_PLAN_ROOT) ? 2 : 1;
+        if (idxNum & PROTOBUF_FOREACH_PLAN_LIMIT)
+        {
+            sqlite3_int64 limit = sqlite3_value_int64(argv[iArg++]);
+            sqlite3_int64 offset = (idxNum & PROTOBUF_FOREACH_PLAN_OFFSET) ? sqlite3_value_int64(argv[iArg++]) : 0;
+            if (limit >= 0) {pCur->rowsLeft = limit + (offset > 0 ? offset : 0);}
+        }
+
+        // Values of == and IN constraints on TAG, FIELD and WIRETYPE, one character per argument in idxStr
+        for (int i = 0; i < 3; i++)
+        {
+            pCur->constrained[i] = false;
+            pCur->values[i].clear();
+        }
+        for (const char *c = idxStr; c != nullptr && *c != 0 && iArg < argc; c++, iArg++)
+        {
+            int iCol = strchr(PROTOBUF_FOREACH_IDXSTR, tolower(*c)) - PROTOBUF_FOREACH_IDXSTR;
+            std::vector<sqlite3_int64> values;
+            if (isupper(*c))
+            {
+                // All values of an IN list at once (SQLite 3.38+)
+                sqlite3_value *value;
+                for (int rc = sqlite3_vtab_in_first(argv[iArg], &value); rc == SQLITE_OK && value != nullptr; rc = sqlite3_vtab_in_next(argv[iArg], &value))
+                {
+                    protobufForeachAppendValue(value, values);
+                }
+            }
+            else
+            {
+                protobufForeachAppendValue(argv[iArg], values);
+            }
+
+            // Several constraints on the same column must all be satisfied
+            std::sort(values.begin(), values.end());
+            if (pCur->constrained[iCol])
+            {
+                std::vector<sqlite3_int64> both;
+                std::set_intersection(values.begin(), values.end(), pCur->values[iCol].begin(), pCur->values[iCol].end(), std::back_inserter(both));
+                values.swap(both);
+            }
+            pCur->values[iCol].swap(values);
+            pCur->constrained[iCol] = true;
+        }
+
         Buffer buffer;
         buffer.start = static_cast<const uint8_t*>(sqlite3_value_blob(argv[0]));
         buffer.end = buffer.start + static_cast<size_t>(sqlite3_value_bytes(argv[0]));
-        pCur->field = decodeProtobuf(buffer, true);
-        pCur->root = &pCur->field;
+        pCur->buffer = buffer;
+        PROTOBUF_STATS(stats_begin(pCur->stats, STATS_EACH, buffer.size()));
+        PROTOBUF_STATS(pCur->statsActive = true);
+        PROTOBUF_STATS(StatsTimer timer(pCur->stats));
         
         // Query strategy 3, path supplied perform search to find root
-        if(idxNum==3)
+        const std::string path = (idxNum & PROTOBUF_FOREACH_PLAN_ROOT) ? string_from_sqlite3_value(argv[1]) : std::string();
+        if (path.length() != 0)
         {
-            // Get path from argument
-            const std::string path = string_from_sqlite3_value(argv[1]);
-            
-            if (path.length() == 0) 
-            {
-                return SQLITE_OK;
-            }
-            
-            if (path[0] != '$')
+            // Look up compiled path in the path cache of the connection
+            std::string error;
+            CompiledPath *compiled = path_lookup(((ProtobufForeachVtab *)cur->pVtab)->cache, path, error);
+            if (compiled == nullptr)
             {
                 sqlite3_free(cur->pVtab->zErrMsg);
-                cur->pVtab->zErrMsg = sqlite3_mprintf("Invalid path");
+                cur->pVtab->zErrMsg = sqlite3_mprintf("%s", error.c_str());
                 return SQLITE_ERROR;
             }
 
             pCur->path = path;
+            PROTOBUF_STATS(stats_path(pCur->stats, path));
 
-            // Parse the path string and traverse the message
-            int fieldNumber, fieldIndex;
-            size_t fieldStart = path.find(".", 0);
-            Field* parent = nullptr;
-            while(fieldStart < path.size())
+            // Traverse the message, only the field headers along the path are read
+            static const WireType message[] = {WIRETYPE_LEN, WIRETYPE_SGROUP};
+            if (compiled->multi)
             {
-                size_t fieldEnd = path.find(".", fieldStart + 1);
-                size_t indexStart = path.find("[", fieldStart + 1);
-                size_t indexEnd = path.find("]", fieldStart + 1);
-
-                fieldEnd = fieldEnd == std::string::npos ? path.size() : fieldEnd;
-
-                if (indexStart < fieldEnd && indexEnd < fieldEnd) // Both field and index supplied
+                // Iterate over the fields of every sub message matched by the path
+                std::vector<Field> matches;
+                path_match(compiled, buffer, message, 2, -1, matches);
+                for (size_t i = 0; i < matches.size(); i++)
                 {
-                    fieldNumber = std::atoi(path.substr(fieldStart + 1, indexStart - fieldStart - 1).c_str());
-                    fieldIndex  = std::atoi(path.substr(indexStart + 1, indexEnd - indexStart - 1).c_str());
+                    pCur->roots.push_back(matches[i].value);
                 }
-                else // Only field supplied
+            }
+            else
+            {
+                Field field;
+                bool found = true;
+                for (size_t i = 0; compiled->steps[i].fieldNumber != 0 && found; i++)
                 {
-                    fieldNumber = std::atoi(path.substr(fieldStart + 1, fieldEnd - fieldStart - 1).c_str());
-                    fieldIndex  = 0; 
+                    found = isMessage(buffer) && findField(&buffer, compiled->steps[i].fieldNumber, message, 2, compiled->steps[i].fieldIndex, &field);
+                    if (found) {buffer = field.value;}
                 }
-
-                // Move path ponter forward
-                fieldStart = fieldEnd;
-
-                parent = pCur->root;
-                pCur->root = nullptr;
-                if (pCur->root == nullptr) {pCur->root = parent->getSubField(fieldNumber, WIRETYPE_LEN, fieldIndex);}
-                if (pCur->root == nullptr) {pCur->root = parent->getSubField(fieldNumber, WIRETYPE_SGROUP, fieldIndex);}
-                if (pCur->root == nullptr) {break;}
+                if (found) {pCur->roots.push_back(buffer);}
             }
+            path_release(compiled);
+        }
+        else
+        {
+            pCur->roots.push_back(buffer);
         }
 
+        if (!pCur->roots.empty() && (idxNum & PROTOBUF_FOREACH_PLAN_ORDER))
+        {
+            // Read all rows up front and sort them by field number, rows with the same field keep message order
+            for (pCur->iRoot = 0; pCur->iRoot < pCur->roots.size(); pCur->iRoot++)
+            {
+                protobufForeachStartRoot(pCur);
+                while (pCur->remaining.start < pCur->remaining.end) {protobufForeachReadField(pCur);}
+            }
+            bool desc = (idxNum & PROTOBUF_FOREACH_PLAN_DESC) != 0;
+            std::stable_sort(pCur->pending.begin(), pCur->pending.end(), [desc](const ProtobufForeachRow &a, const ProtobufForeachRow &b) {
+                return desc ? a.fieldNum > b.fieldNum : a.fieldNum < b.fieldNum;
+            });
+        }
+        else if (!pCur->roots.empty())
+        {
+            protobufForeachStartRoot(pCur);
+            protobufForeachStep(pCur);
+        }
         return SQLITE_OK;
     }
 
@@ -259,15 +555,25 @@ namespace sqlite_protobuf
     ** The query strategy here is to look for an equality constraint on the buffer
     ** column.  Without such a constraint, the table cannot operate.  idxNum 
     ** represents the strategy, and is 1 if the constraint is found, 3 if the 
-    ** constraint and root are found, and 0 otherwise.
+    ** constraint and root are found, and 0 otherwise. LIMIT and OFFSET
+    ** (SQLite 3.38+) are passed on to xFilter so the cursor can stop early, unless
+    ** SQLite has to sort the rows, and == and IN constraints on the tag, field and
+    ** wiretype columns are checked by the cursor while reading the message, the
+    ** columns are listed in idxStr.
     */
     static int protobufForeachBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo)
     {
         int aIdx[2];          // Index of constraints for BUFFER and ROOT
+        int iLimit = -1;      // Index of LIMIT constraint
+        int iOffset = -1;     // Index of OFFSET constraint
         int unusableMask = 0; // Mask of unusable BUFFER and ROOT constraints
         int idxMask = 0;      // Mask of usable == constraints BUFFER and ROOT
+        std::vector<int> aColumn; // Index of usable == constraints on TAG, FIELD and WIRETYPE
         const struct sqlite3_index_info::sqlite3_index_constraint *pConstraint;
 
+        // The IN and right hand side interfaces are only available in SQLite 3.38+
+        bool hasVtabIn = sqlite3_libversion_number() >= 3038000;
+
         // This implementation assumes that BUFFER and ROOT are the last two columns in the table
         aIdx[0] = aIdx[1] = -1;
         pConstraint = pIdxInfo->aConstraint;
@@ -275,7 +581,15 @@ namespace sqlite_protobuf
         {
             int iCol = pConstraint->iColumn - PROTOBUF_FOREACH_BUFFER;
             int iMask = 1 << iCol;
-            if (iCol >= 0)
+            if (pConstraint->usable && pConstraint->op == SQLITE_INDEX_CONSTRAINT_LIMIT)
+            {
+                iLimit = i;
+            }
+            else if (pConstraint->usable && pConstraint->op == SQLITE_INDEX_CONSTRAINT_OFFSET)
+            {
+                iOffset = i;
+            }
+            else if (iCol >= 0 && pConstraint->iColumn <= PROTOBUF_FOREACH_ROOT)
             {
                 if (pConstraint->usable == 0)
                 {
@@ -287,10 +601,10 @@ namespace sqlite_protobuf
                     idxMask |= iMask;
                 }
             }
-        }
-        if (pIdxInfo->nOrderBy > 0 && pIdxInfo->aOrderBy[0].iColumn < 0 && pIdxInfo->aOrderBy[0].desc == 0)
-        {
-            pIdxInfo->orderByConsumed = 1;
+            else if (pConstraint->usable && pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ && pConstraint->iColumn >= PROTOBUF_FOREACH_TAG && pConstraint->iColumn <= PROTOBUF_FOREACH_WIRETYPE)
+            {
+                aColumn.push_back(i);
+            }
         }
 
         if ((unusableMask & ~idxMask) != 0)
@@ -302,23 +616,84 @@ namespace sqlite_protobuf
         {
             // No BUFFER input. Leave estimatedCost at the huge initial value to discourage query planner from using this plan.
             pIdxInfo->idxNum = 0;
+            return SQLITE_OK;
+        }
+
+        pIdxInfo->aConstraintUsage[aIdx[0]].argvIndex = 1;
+        pIdxInfo->aConstraintUsage[aIdx[0]].omit = 1;
+        if (aIdx[1] < 0)
+        {
+            pIdxInfo->idxNum = 1; // Only BUFFER supplied.  Plan 1
         }
         else
         {
-            pIdxInfo->estimatedCost = 1.0;
-            pIdxInfo->aConstraintUsage[aIdx[0]].argvIndex = 1;
-            pIdxInfo->aConstraintUsage[aIdx[0]].omit = 1;
-            if (aIdx[1] < 0)
-            {
-                pIdxInfo->idxNum = 1; // Only BUFFER supplied.  Plan 1
-            }
-            else
+            pIdxInfo->aConstraintUsage[aIdx[1]].argvIndex = 2;
+            pIdxInfo->aConstraintUsage[aIdx[1]].omit = 1;
+            pIdxInfo->idxNum = 3; // Both BUFFER and ROOT are supplied.  Plan 3
+        }
+
+        // Rows are returned in rowid order, or sorted by field number when requested
+        bool orderByField = false;
+        if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn < 0 && pIdxInfo->aOrderBy[0].desc == 0)
+        {
+            pIdxInfo->orderByConsumed = 1;
+        }
+        else if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn == PROTOBUF_FOREACH_FIELD)
+        {
+            pIdxInfo->orderByConsumed = 1;
+            orderByField = true;
+            pIdxInfo->idxNum |= PROTOBUF_FOREACH_PLAN_ORDER;
+            if (pIdxInfo->aOrderBy[0].desc) {pIdxInfo->idxNum |= PROTOBUF_FOREACH_PLAN_DESC;}
+        }
+
+        // LIMIT and OFFSET are not omitted, SQLite still applies them to the rows returned. They
+        // can only stop the cursor early when the rows come in the requested order, otherwise
+        // SQLite sorts all rows before applying them.
+        int argvIndex = (pIdxInfo->idxNum & PROTOBUF_FOREACH_PLAN_ROOT) ? 3 : 2;
+        if (iLimit >= 0 && (pIdxInfo->nOrderBy == 0 || pIdxInfo->orderByConsumed))
+        {
+            pIdxInfo->aConstraintUsage[iLimit].argvIndex = argvIndex++;
+            pIdxInfo->idxNum |= PROTOBUF_FOREACH_PLAN_LIMIT;
+            if (iOffset >= 0)
             {
-                pIdxInfo->aConstraintUsage[aIdx[1]].argvIndex = 2;
-                pIdxInfo->aConstraintUsage[aIdx[1]].omit = 1;
-                pIdxInfo->idxNum = 3; // Both BUFFER and ROOT are supplied.  Plan 3
+                pIdxInfo->aConstraintUsage[iOffset].argvIndex = argvIndex++;
+                pIdxInfo->idxNum |= PROTOBUF_FOREACH_PLAN_OFFSET;
             }
         }
+
+        // Estimate the number of sub fields from the size of the message when it is known up front
+        double nBytes = PROTOBUF_FOREACH_DEFAULT_BYTES;
+        sqlite3_value *pBuffer = nullptr;
+        if (hasVtabIn && sqlite3_vtab_rhs_value(pIdxInfo, aIdx[0], &pBuffer) == SQLITE_OK && pBuffer != nullptr)
+        {
+            nBytes = sqlite3_value_bytes(pBuffer);
+        }
+        double nScanned = nBytes / PROTOBUF_FOREACH_BYTES_PER_FIELD + 1;
+        double nRows = nScanned;
+
+        // Constraints on TAG, FIELD and WIRETYPE are checked by the cursor, IN lists are passed all at once
+        std::string idxStr;
+        for (size_t i = 0; i < aColumn.size(); i++)
+        {
+            int iCol = pIdxInfo->aConstraint[aColumn[i]].iColumn;
+            pIdxInfo->aConstraintUsage[aColumn[i]].argvIndex = argvIndex++;
+            pIdxInfo->aConstraintUsage[aColumn[i]].omit = 1;
+            char c = PROTOBUF_FOREACH_IDXSTR[iCol];
+            idxStr += hasVtabIn && sqlite3_vtab_in(pIdxInfo, aColumn[i], 1) ? (char)toupper(c) : c;
+            nRows *= iCol == PROTOBUF_FOREACH_WIRETYPE ? 0.5 : 0.1;
+        }
+        if (!idxStr.empty())
+        {
+            pIdxInfo->idxStr = sqlite3_mprintf("%s", idxStr.c_str());
+            pIdxInfo->needToFreeIdxStr = 1;
+            if (pIdxInfo->idxStr == nullptr) {return SQLITE_NOMEM;}
+        }
+
+        double nSort = orderByField ? nRows * log2(nRows + 1) : 0;
+
+        // Reading a field header is cheap compared to returning a row
+        pIdxInfo->estimatedCost = 0.1 * nScanned + nRows + nSort;
+        pIdxInfo->estimatedRows = (sqlite3_int64)nRows + 1;
         return SQLITE_OK;
     }
 
@@ -357,8 +732,8 @@ namespace sqlite_protobuf
     int register_protobuf_foreach(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
     {
         int rc = SQLITE_OK;
-        if(rc == SQLITE_OK) {rc = sqlite3_create_module(db, "protobuf_foreach", &protobufForeachModule, 0);}
-        if(rc == SQLITE_OK) {rc = sqlite3_create_module(db, "protobuf_each", &protobufForeachModule, 0);}
+        if(rc == SQLITE_OK) {rc = sqlite3_create_module_v2(db, "protobuf_foreach", &protobufForeachModule, path_cache_acquire(db), path_cache_release);}
+        if(rc == SQLITE_OK) {rc = sqlite3_create_module_v2(db, "protobuf_each", &protobufForeachModule, path_cache_acquire(db), path_cache_release);}
         return rc;
     }
 
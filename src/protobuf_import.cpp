@@ -0,0 +1,255 @@
+#include "protobuf_import.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include "protodec.h"
+#include "protobuf_path.h"
+#include "protobuf_type.h"
+#include "protobuf_column.h"
+#include "delimited_file.h"
+#include "thread_pool.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    namespace
+    {
+        // Number of messages decoded by one task
+        #define PROTOBUF_IMPORT_BATCH_SIZE 1024
+
+        // Number of batches decoded ahead of the writer for each worker thread
+        #define PROTOBUF_IMPORT_BATCHES_PER_THREAD 4
+
+        std::string string_from_sqlite3_value(sqlite3_value *value)
+        {
+            const char *text = static_cast<const char *>(sqlite3_value_blob(value));
+            size_t text_size = static_cast<size_t>(sqlite3_value_bytes(value));
+            return std::string(text, text_size);
+        }
+
+        /// Messages decoded by one task, the values of message i are values[i * columns ... (i + 1) * columns - 1]
+        struct ImportBatch
+        {
+            std::vector<Buffer> messages;
+            std::vector<Value> values;
+            std::vector<std::string> texts; // JSON arrays for paths matching several fields
+            bool done;
+        };
+
+        /// Signals the writer when a batch has been decoded
+        struct ImportState
+        {
+            std::mutex mutex;
+            std::condition_variable decoded;
+        };
+
+        /// Decode the values of all columns for the messages of a batch, this runs on a worker
+        /// thread and only uses the batch and the columns, which are not modified while importing
+        void decode_batch(const std::vector<ColumnDefinition> &columns, ImportBatch *batch)
+        {
+            size_t numMulti = 0;
+            for (size_t c = 0; c < columns.size(); c++) {numMulti += columns[c].path.multi ? 1 : 0;}
+            bool decode = numMulti < columns.size(); // Single field paths are looked up in the decoded message
+            batch->values.resize(batch->messages.size() * columns.size());
+            batch->texts.reserve(batch->messages.size() * numMulti); // Values point into the texts, so they must not be reallocated
+
+            std::vector<Field> matches;
+            std::string unused; // Paths matching one field do not write JSON
+            for (size_t i = 0; i < batch->messages.size(); i++)
+            {
+                Field root = decode ? decodeProtobuf(batch->messages[i], false) : Field();
+                for (size_t c = 0; c < columns.size(); c++)
+                {
+                    if (columns[c].path.multi) {batch->texts.push_back(std::string());}
+                    std::string &json = columns[c].path.multi ? batch->texts.back() : unused;
+                    column_extract(columns[c], batch->messages[i], &root, matches, &batch->values[i * columns.size() + c], json);
+                }
+            }
+        }
+
+        /// Bind the values of a message to the insert statement and run it
+        int insert_row(sqlite3_stmt *insert, const Value *values, size_t numValues)
+        {
+            for (size_t c = 0; c < numValues; c++)
+            {
+                const Value &value = values[c];
+                int i = (int)c + 1;
+                switch (value.type)
+                {
+                case SQLITE_INTEGER: sqlite3_bind_int64(insert, i, value.integer); break;
+                case SQLITE_FLOAT: sqlite3_bind_double(insert, i, value.real); break;
+                case SQLITE_TEXT: sqlite3_bind_text(insert, i, (const char *)value.bytes.start, (int)value.bytes.size(), SQLITE_STATIC); break;
+                case SQLITE_BLOB: sqlite3_bind_blob(insert, i, value.bytes.start, (int)value.bytes.size(), SQLITE_STATIC); break;
+                default: sqlite3_bind_null(insert, i); break;
+                }
+            }
+            sqlite3_step(insert);
+            return sqlite3_reset(insert);
+        }
+
+        /// Import a file of length delimited messages into a table. The messages are decoded
+        /// on one worker thread per core, and the rows are inserted by the calling thread in
+        /// the transaction of the statement
+        ///
+        ///     SELECT protobuf_import('capture.bin', 'varint', 'events', 'id', '$.1', 'int64', 'name', '$.2', 'string');
+        ///
+        /// @returns the number of rows inserted
+        static void protobuf_import(sqlite3_context *context, int argc, sqlite3_value **argv)
+        {
+            if (argc < 6 || (argc - 3) % 3 != 0)
+            {
+                sqlite3_result_error(context, "protobuf_import requires a file, a framing, a table and one or more column, path and type arguments", -1);
+                return;
+            }
+
+            Framing framing;
+            if (!framing_from_string(string_from_sqlite3_value(argv[1]), &framing))
+            {
+                sqlite3_result_error(context, "Framing not valid, try 'varint', 'fixed32' or 'fixed32be'", -1);
+                return;
+            }
+
+            // Compile the paths, the insert statement lists the columns in the same order
+            std::vector<ColumnDefinition> columns((argc - 3) / 3);
+            std::string table = string_from_sqlite3_value(argv[2]);
+            char *zSql = sqlite3_mprintf("INSERT INTO \"%w\"(", table.c_str());
+            for (size_t c = 0; c < columns.size(); c++)
+            {
+                ColumnDefinition &column = columns[c];
+                std::string error;
+                column.name = string_from_sqlite3_value(argv[3 + 3 * c]);
+                if (!column_init(column, string_from_sqlite3_value(argv[4 + 3 * c]), string_from_sqlite3_value(argv[5 + 3 * c]), error))
+                {
+                    sqlite3_free(zSql);
+                    sqlite3_result_error(context, error.c_str(), -1);
+                    return;
+                }
+                zSql = sqlite3_mprintf("%z%s\"%w\"", zSql, c > 0 ? "," : "", column.name.c_str());
+            }
+            zSql = sqlite3_mprintf("%z) VALUES (", zSql);
+            for (size_t c = 0; c < columns.size(); c++)
+            {
+                zSql = sqlite3_mprintf("%z%s?", zSql, c > 0 ? "," : "");
+            }
+            zSql = sqlite3_mprintf("%z)", zSql);
+            if (zSql == nullptr)
+            {
+                sqlite3_result_error_nomem(context);
+                return;
+            }
+
+            sqlite3 *db = sqlite3_context_db_handle(context);
+            sqlite3_stmt *insert = nullptr;
+            int rc = sqlite3_prepare_v2(db, zSql, -1, &insert, nullptr);
+            sqlite3_free(zSql);
+            if (rc != SQLITE_OK)
+            {
+                sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+                return;
+            }
+
+            const std::string path = string_from_sqlite3_value(argv[0]);
+            FileMap map;
+            if (!file_map(path, &map))
+            {
+                sqlite3_finalize(insert);
+                std::string error = "Unable to open file: " + path;
+                sqlite3_result_error(context, error.c_str(), -1);
+                return;
+            }
+            file_advise(&map, true);
+
+            // Insert all rows in one savepoint, otherwise every row is committed on its own when
+            // the statement runs outside a transaction, and an error rolls back the whole import
+            rc = sqlite3_exec(db, "SAVEPOINT protobuf_import", nullptr, nullptr, nullptr);
+
+            // Split the file into batches that are decoded ahead of the writer, and insert them in file order
+            ImportState state;
+            std::deque<ImportBatch*> pending;
+            sqlite3_int64 numRows = 0;
+            int64_t offset = 0;
+            bool more = true;
+            {
+                ThreadPool pool;
+                size_t maxPending = pool.size() * PROTOBUF_IMPORT_BATCHES_PER_THREAD;
+                while (rc == SQLITE_OK && (more || !pending.empty()))
+                {
+                    while (more && pending.size() < maxPending)
+                    {
+                        ImportBatch *batch = new ImportBatch();
+                        batch->done = false;
+                        Buffer message;
+                        while (batch->messages.size() < PROTOBUF_IMPORT_BATCH_SIZE && (more = read_delimited(map.data, map.size, framing, &offset, &message)))
+                        {
+                            batch->messages.push_back(message);
+                        }
+                        if (batch->messages.empty())
+                        {
+                            delete batch;
+                            break;
+                        }
+                        pending.push_back(batch);
+                        pool.submit([&columns, &state, batch]()
+                        {
+                            decode_batch(columns, batch);
+                            std::lock_guard<std::mutex> lock(state.mutex);
+                            batch->done = true;
+                            state.decoded.notify_all();
+                        });
+                    }
+                    if (pending.empty()) {break;}
+
+                    ImportBatch *batch = pending.front();
+                    {
+                        std::unique_lock<std::mutex> lock(state.mutex);
+                        while (!batch->done) {condition_wait(state.decoded, lock);}
+                    }
+                    for (size_t i = 0; i < batch->messages.size() && rc == SQLITE_OK; i++, numRows++)
+                    {
+                        rc = insert_row(insert, &batch->values[i * columns.size()], columns.size());
+                    }
+                    pending.pop_front();
+                    delete batch;
+                }
+            } // The pool waits for the batches still being decoded after an error
+
+            if (offset < map.size && rc == SQLITE_OK)
+            {
+                sqlite3_log(SQLITE_WARNING, "protobuf_import: message at offset %lld of %s is truncated", (long long)offset, path.c_str());
+            }
+            for (size_t i = 0; i < pending.size(); i++) {delete pending[i];}
+            file_unmap(&map);
+
+            if (rc != SQLITE_OK)
+            {
+                sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+                sqlite3_result_error_code(context, rc);
+                sqlite3_exec(db, "ROLLBACK TO protobuf_import; RELEASE protobuf_import", nullptr, nullptr, nullptr);
+            }
+            else if ((rc = sqlite3_exec(db, "RELEASE protobuf_import", nullptr, nullptr, nullptr)) != SQLITE_OK)
+            {
+                sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+                sqlite3_result_error_code(context, rc);
+            }
+            else
+            {
+                sqlite3_result_int64(context, numRows);
+            }
+            sqlite3_finalize(insert);
+        }
+    } // namespace
+
+    int register_protobuf_import(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        // Reading files and writing tables is only allowed from top level SQL, not from triggers and views in the schema
+        int flags = SQLITE_UTF8 | (sqlite3_libversion_number() >= 3030000 ? SQLITE_DIRECTONLY : 0);
+        return sqlite3_create_function(db, "protobuf_import", -1, flags, nullptr, protobuf_import, nullptr, nullptr);
+    }
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,799 @@
+#include "protobuf_index.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <vector>
+#include <new>
+#include <cstdarg>
+#include <cstdlib>
+#include <map>
+
+#include "protodec.h"
+#include "protobuf_path.h"
+#include "protobuf_type.h"
+#include "protobuf_column.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    /* Estimated number of values in the index, and of the values matching an equality */
+    #define PROTOBUF_INDEX_ROWS 1000000.0
+    #define PROTOBUF_INDEX_EQ_ROWS 10.0
+
+    /* Columns of the table, the rowid is the rowid of the source row */
+    #define PROTOBUF_INDEX_VALUE 0
+    #define PROTOBUF_INDEX_OCCURRENCE 1
+    #define PROTOBUF_INDEX_COMMAND 2
+
+    /*
+    ** Define virtual table data structure containg data needed for virtual table. The values
+    ** are kept in the table name_values(value, source, occurrence), a B-tree ordered by value
+    ** with an index on the rowid of the source row.
+    */
+    typedef struct ProtobufIndexVtab ProtobufIndexVtab;
+    struct ProtobufIndexVtab
+    {
+        sqlite3_vtab base;          // Base class - must be first
+        sqlite3 *db;                // Database connection
+        std::string schema;         // Schema of the table, the source table and the shadow table
+        std::string name;           // Name of the table, prefix of the shadow table
+        std::string source;         // Source table
+        std::string column;         // Column of the source table holding the messages
+        std::string path;           // Path of the indexed values, as given
+        std::string type;           // Type of the indexed values, as given
+        ColumnDefinition definition; // Path of the indexed values and their type
+    };
+
+    /*
+    ** Define cursor data structure, the values are read from the shadow table
+    */
+    typedef struct ProtobufIndexCursor ProtobufIndexCursor;
+    struct ProtobufIndexCursor
+    {
+        sqlite3_vtab_cursor base;   // Base class - must be first
+        sqlite3_stmt *pStmt;        // Statement reading the values
+        std::string sql;            // SQL of the statement, which is reused while it does not change
+        bool eof;
+    };
+
+    /*
+    ** Run an SQL statement formatted with sqlite3_mprintf
+    */
+    static int protobufIndexExec(sqlite3 *db, char **pzErr, const char *zFormat, ...)
+    {
+        va_list ap;
+        va_start(ap, zFormat);
+        char *zSql = sqlite3_vmprintf(zFormat, ap);
+        va_end(ap);
+        if (zSql == nullptr) {return SQLITE_NOMEM;}
+
+        int rc = sqlite3_exec(db, zSql, 0, 0, pzErr);
+        sqlite3_free(zSql);
+        return rc;
+    }
+
+    /*
+    ** Prepare an SQL statement formatted with sqlite3_mprintf
+    */
+    static int protobufIndexPrepare(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zFormat, ...)
+    {
+        va_list ap;
+        va_start(ap, zFormat);
+        char *zSql = sqlite3_vmprintf(zFormat, ap);
+        va_end(ap);
+        if (zSql == nullptr) {return SQLITE_NOMEM;}
+
+        int rc = sqlite3_prepare_v2(db, zSql, -1, ppStmt, 0);
+        sqlite3_free(zSql);
+        return rc;
+    }
+
+    /*
+    ** Constructor for ProtobufIndexVtab objects, the arguments are the source table, the column
+    ** holding the messages, the path of the values and their type, which defaults to ''.
+    */
+    static int protobufIndexConnect(sqlite3 *db, void *pAux, int argc, const char *const*argv, sqlite3_vtab **ppVtab, char **pzErr)
+    {
+        if (argc < 6 || argc > 7)
+        {
+            *pzErr = sqlite3_mprintf("protobuf_index requires a source table, a column, a path and optionally a type");
+            return SQLITE_ERROR;
+        }
+
+        ProtobufIndexVtab *pNew = new (std::nothrow) ProtobufIndexVtab();
+        if (pNew == nullptr) {return SQLITE_NOMEM;}
+        pNew->db = db;
+        pNew->schema = argv[1];
+        pNew->name = argv[2];
+        pNew->source = sql_dequote(argv[3]);
+        pNew->column = sql_dequote(argv[4]);
+        pNew->path = sql_dequote(argv[5]);
+        pNew->type = argc > 6 ? sql_dequote(argv[6]) : "";
+
+        // The table has the value and its occurrence in the message, and a hidden column with the name of the table for commands
+        std::string error;
+        char *zSchema = nullptr;
+        if (column_init(pNew->definition, pNew->path, pNew->type, error))
+        {
+            zSchema = sqlite3_mprintf("CREATE TABLE x(value %s, occurrence INTEGER, \"%w\" HIDDEN)", sql_type_from_type(pNew->definition.type), argv[2]);
+        }
+
+        int rc = SQLITE_OK;
+        if (!error.empty())
+        {
+            *pzErr = sqlite3_mprintf("%s", error.c_str());
+            rc = SQLITE_ERROR;
+        }
+        else if (zSchema == nullptr)
+        {
+            rc = SQLITE_NOMEM;
+        }
+        else
+        {
+            rc = sqlite3_declare_vtab(db, zSchema);
+        }
+        sqlite3_free(zSchema);
+
+        if (rc != SQLITE_OK)
+        {
+            delete pNew;
+            return rc;
+        }
+        *ppVtab = &pNew->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for ProtobufIndexVtab objects.
+    */
+    static int protobufIndexDisconnect(sqlite3_vtab *pVtab)
+    {
+        ProtobufIndexVtab *p = (ProtobufIndexVtab*)pVtab;
+        sqlite3_free(p->base.zErrMsg);
+        delete p;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Create the triggers that index the values of changed source rows. They decode the messages
+    ** with protobuf_index_decode and write the values table directly, rather than through the
+    ** table, which is not innocuous, so that the source table can still be written with
+    ** trusted_schema=OFF
+    */
+    static int protobufIndexCreateTriggers(ProtobufIndexVtab *p, const char *zName, char **pzErr)
+    {
+        const char *zSchema = p->schema.c_str();
+        const char *zSource = p->source.c_str();
+        const char *zColumn = p->column.c_str();
+        const char *zPath = p->path.c_str();
+        const char *zType = p->type.c_str();
+        int rc = protobufIndexExec(p->db, pzErr,
+            "CREATE TRIGGER \"%w\".\"%w_insert\" AFTER INSERT ON \"%w\" BEGIN "
+            "INSERT OR IGNORE INTO \"%w_values\"(value, source, occurrence) SELECT value, new.rowid, occurrence FROM protobuf_index_decode(new.\"%w\", %Q, %Q); END;"
+            "CREATE TRIGGER \"%w\".\"%w_update\" AFTER UPDATE ON \"%w\" WHEN old.rowid IS NOT new.rowid OR old.\"%w\" IS NOT new.\"%w\" BEGIN "
+            "DELETE FROM \"%w_values\" WHERE source = old.rowid; "
+            "INSERT OR IGNORE INTO \"%w_values\"(value, source, occurrence) SELECT value, new.rowid, occurrence FROM protobuf_index_decode(new.\"%w\", %Q, %Q); END;"
+            "CREATE TRIGGER \"%w\".\"%w_delete\" AFTER DELETE ON \"%w\" BEGIN "
+            "DELETE FROM \"%w_values\" WHERE source = old.rowid; END;",
+            zSchema, zName, zSource, zName, zColumn, zPath, zType,
+            zSchema, zName, zSource, zColumn, zColumn, zName, zName, zColumn, zPath, zType,
+            zSchema, zName, zSource, zName);
+        return rc;
+    }
+
+    static int protobufIndexDropTriggers(ProtobufIndexVtab *p, const char *zName, char **pzErr)
+    {
+        const char *zSchema = p->schema.c_str();
+        return protobufIndexExec(p->db, pzErr,
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_insert\";"
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_update\";"
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_delete\";",
+            zSchema, zName, zSchema, zName, zSchema, zName);
+    }
+
+    /*
+    ** Index the whole source table, replacing all values
+    */
+    static int protobufIndexRebuild(ProtobufIndexVtab *p, char **pzErr)
+    {
+        const char *zSchema = p->schema.c_str();
+        const char *zName = p->name.c_str();
+        return protobufIndexExec(p->db, pzErr,
+            "DELETE FROM \"%w\".\"%w_values\";"
+            "INSERT OR IGNORE INTO \"%w\".\"%w_values\"(value, source, occurrence) SELECT d.value, s.rowid, d.occurrence "
+            "FROM \"%w\".\"%w\" AS s, protobuf_index_decode(s.\"%w\", %Q, %Q) AS d;",
+            zSchema, zName, zSchema, zName, zSchema, p->source.c_str(), p->column.c_str(), p->path.c_str(), p->type.c_str());
+    }
+
+    /*
+    ** Create a new table, the values table and triggers are created and the source table is indexed
+    */
+    static int protobufIndexCreate(sqlite3 *db, void *pAux, int argc, const char *const*argv, sqlite3_vtab **ppVtab, char **pzErr)
+    {
+        int rc = protobufIndexConnect(db, pAux, argc, argv, ppVtab, pzErr);
+        if (rc != SQLITE_OK) {return rc;}
+
+        ProtobufIndexVtab *p = (ProtobufIndexVtab*)*ppVtab;
+        rc = protobufIndexExec(db, pzErr,
+            "CREATE TABLE \"%w\".\"%w_values\"(value, source INTEGER, occurrence INTEGER, PRIMARY KEY(value, source, occurrence)) WITHOUT ROWID;"
+            "CREATE INDEX \"%w\".\"%w_source\" ON \"%w_values\"(source);",
+            p->schema.c_str(), p->name.c_str(), p->schema.c_str(), p->name.c_str(), p->name.c_str());
+        if (rc == SQLITE_OK) {rc = protobufIndexCreateTriggers(p, p->name.c_str(), pzErr);}
+        if (rc == SQLITE_OK) {rc = protobufIndexRebuild(p, pzErr);}
+        if (rc != SQLITE_OK)
+        {
+            if (*pzErr == nullptr) {*pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));}
+            protobufIndexDisconnect(*ppVtab);
+            *ppVtab = nullptr;
+        }
+        return rc;
+    }
+
+    /*
+    ** Drop the table together with the values table and triggers
+    */
+    static int protobufIndexDestroy(sqlite3_vtab *pVtab)
+    {
+        ProtobufIndexVtab *p = (ProtobufIndexVtab*)pVtab;
+        int rc = protobufIndexDropTriggers(p, p->name.c_str(), nullptr);
+        if (rc == SQLITE_OK)
+        {
+            rc = protobufIndexExec(p->db, nullptr, "DROP TABLE IF EXISTS \"%w\".\"%w_values\";", p->schema.c_str(), p->name.c_str());
+        }
+        if (rc == SQLITE_OK) {protobufIndexDisconnect(pVtab);}
+        return rc;
+    }
+
+    /*
+    ** Rename the values table and triggers together with the table
+    */
+    static int protobufIndexRename(sqlite3_vtab *pVtab, const char *zNew)
+    {
+        ProtobufIndexVtab *p = (ProtobufIndexVtab*)pVtab;
+        int rc = protobufIndexDropTriggers(p, p->name.c_str(), nullptr);
+        if (rc == SQLITE_OK)
+        {
+            rc = protobufIndexExec(p->db, nullptr, "ALTER TABLE \"%w\".\"%w_values\" RENAME TO \"%w_values\";",
+                                   p->schema.c_str(), p->name.c_str(), zNew);
+        }
+        if (rc == SQLITE_OK) {rc = protobufIndexCreateTriggers(p, zNew, nullptr);}
+        if (rc == SQLITE_OK) {p->name = zNew;}
+        return rc;
+    }
+
+    /*
+    ** The table is maintained by the triggers on the source table, and is otherwise read only
+    ** except for the command 'rebuild', which indexes all source rows again
+    **
+    **     INSERT INTO tags(tags) VALUES ('rebuild');
+    */
+    static int protobufIndexUpdate(sqlite3_vtab *pVtab, int argc, sqlite3_value **argv, sqlite3_int64 *pRowid)
+    {
+        ProtobufIndexVtab *p = (ProtobufIndexVtab*)pVtab;
+        sqlite3_free(p->base.zErrMsg);
+        p->base.zErrMsg = nullptr;
+
+        const char *zCommand = nullptr;
+        if (argc > 2 + PROTOBUF_INDEX_COMMAND && sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        {
+            zCommand = (const char *)sqlite3_value_text(argv[2 + PROTOBUF_INDEX_COMMAND]);
+        }
+
+        if (zCommand != nullptr && sqlite3_stricmp(zCommand, "rebuild") == 0)
+        {
+            return protobufIndexRebuild(p, &p->base.zErrMsg);
+        }
+        p->base.zErrMsg = sqlite3_mprintf(zCommand != nullptr ? "Unknown protobuf_index command: %s" : "protobuf_index tables are maintained by triggers, modify the source table \"%s\" instead",
+                                          zCommand != nullptr ? zCommand : p->source.c_str());
+        return SQLITE_ERROR;
+    }
+
+    /*
+    ** Constructor for a new ProtobufIndexCursor object.
+    */
+    static int protobufIndexOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+    {
+        ProtobufIndexCursor *pCur = new (std::nothrow) ProtobufIndexCursor();
+        if (pCur == nullptr) {return SQLITE_NOMEM;}
+        pCur->pStmt = nullptr;
+        pCur->eof = true;
+        *ppCursor = &pCur->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for a ProtobufIndexCursor.
+    */
+    static int protobufIndexClose(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufIndexCursor *pCur = (ProtobufIndexCursor*)cur;
+        sqlite3_finalize(pCur->pStmt);
+        delete pCur;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Advance a ProtobufIndexCursor to its next row of output.
+    */
+    static int protobufIndexNext(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufIndexCursor *pCur = (ProtobufIndexCursor*)cur;
+        int rc = sqlite3_step(pCur->pStmt);
+        if (rc == SQLITE_ROW) {return SQLITE_OK;}
+
+        pCur->eof = true;
+        if (rc == SQLITE_DONE) {return SQLITE_OK;}
+        ProtobufIndexVtab *p = (ProtobufIndexVtab*)cur->pVtab;
+        sqlite3_free(p->base.zErrMsg);
+        p->base.zErrMsg = sqlite3_mprintf("protobuf_index: %s", sqlite3_errmsg(p->db));
+        return rc;
+    }
+
+    /*
+    ** Return value at given column and row (ProtobufIndexCursor).
+    */
+    static int protobufIndexColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+    {
+        ProtobufIndexCursor *pCur = (ProtobufIndexCursor *)cur;
+        if (col == PROTOBUF_INDEX_VALUE) {sqlite3_result_value(ctx, sqlite3_column_value(pCur->pStmt, 0));}
+        if (col == PROTOBUF_INDEX_OCCURRENCE) {sqlite3_result_int64(ctx, sqlite3_column_int64(pCur->pStmt, 2));}
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return the rowid for the current row, which is the rowid of the source row.
+    */
+    static int protobufIndexRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+    {
+        ProtobufIndexCursor *pCur = (ProtobufIndexCursor*)cur;
+        *pRowid = sqlite3_column_int64(pCur->pStmt, 1);
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return TRUE if the cursor has been moved off of the last row of output.
+    */
+    static int protobufIndexEof(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufIndexCursor *pCur = (ProtobufIndexCursor*)cur;
+        return pCur->eof;
+    }
+
+    /*
+    ** Apply the affinity of the value column to a value compared with it, like SQLite does when
+    ** it checks the constraint. The values in the shadow table have no affinity, so the converted
+    ** value compares the same way there.
+    */
+    static void protobufIndexBind(ProtobufIndexVtab *p, sqlite3_stmt *pStmt, int i, sqlite3_value *value)
+    {
+        int type = sqlite3_value_type(value);
+        switch (p->definition.type)
+        {
+        case TYPE_STRING:
+            if (type == SQLITE_INTEGER || type == SQLITE_FLOAT) {sqlite3_bind_text(pStmt, i, (const char *)sqlite3_value_text(value), -1, SQLITE_TRANSIENT); return;}
+            break;
+        case TYPE_BYTES: case TYPE_BUFFER: case TYPE_UNKNOWN:
+            break;
+        default:
+            if (type == SQLITE_TEXT) {sqlite3_value_numeric_type(value);}
+            break;
+        }
+        sqlite3_bind_value(pStmt, i, value);
+    }
+
+    /*
+    ** This method is called to "rewind" the ProtobufIndexCursor object back to the first row of
+    ** output. The constraints listed in idxStr are added to the query of the shadow table.
+    */
+    static int protobufIndexFilter(sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv)
+    {
+        ProtobufIndexCursor *pCur = (ProtobufIndexCursor *)cur;
+        ProtobufIndexVtab *p = (ProtobufIndexVtab*)cur->pVtab;
+
+        // idxStr lists an operator and a column for each argument, such as "G0;l0;" or "e-1;"
+        bool byValue = false;
+        char *zSql = sqlite3_mprintf("SELECT value, source, occurrence FROM \"%w\".\"%w_values\" WHERE 1", p->schema.c_str(), p->name.c_str());
+        const char *z = idxStr != nullptr ? idxStr : "";
+        for (int i = 0; *z != 0 && i < argc; i++)
+        {
+            char op = *z++;
+            int col = (int)strtol(z, (char **)&z, 10);
+            if (*z == ';') {z++;}
+
+            const char *zOp = op == 'e' ? "=" : op == 'g' ? ">" : op == 'G' ? ">=" : op == 'l' ? "<" : "<=";
+            zSql = sqlite3_mprintf("%z AND %s %s ?", zSql, col < 0 ? "source" : "value", zOp);
+            byValue = byValue || col >= 0;
+        }
+        zSql = sqlite3_mprintf("%z%s", zSql, byValue || argc == 0 ? " ORDER BY value, source, occurrence" : "");
+        if (zSql == nullptr) {return SQLITE_NOMEM;}
+
+        // Statements of joins are filtered once for each outer row, and are only prepared once
+        int rc = SQLITE_OK;
+        if (pCur->pStmt == nullptr || pCur->sql != zSql)
+        {
+            sqlite3_finalize(pCur->pStmt);
+            pCur->pStmt = nullptr;
+            pCur->sql = zSql;
+            rc = sqlite3_prepare_v2(p->db, zSql, -1, &pCur->pStmt, 0);
+        }
+        else
+        {
+            sqlite3_reset(pCur->pStmt);
+        }
+        sqlite3_free(zSql);
+        if (rc != SQLITE_OK)
+        {
+            pCur->sql.clear();
+            sqlite3_free(p->base.zErrMsg);
+            p->base.zErrMsg = sqlite3_mprintf("protobuf_index: %s", sqlite3_errmsg(p->db));
+            return rc;
+        }
+
+        z = idxStr != nullptr ? idxStr : "";
+        for (int i = 0; *z != 0 && i < argc; i++)
+        {
+            z++;
+            int col = (int)strtol(z, (char **)&z, 10);
+            if (*z == ';') {z++;}
+            if (col < 0) {sqlite3_bind_value(pCur->pStmt, i + 1, argv[i]);}
+            else {protobufIndexBind(p, pCur->pStmt, i + 1, argv[i]);}
+        }
+
+        pCur->eof = false;
+        return protobufIndexNext(cur);
+    }
+
+    /*
+    ** SQLite will invoke this method one or more times while planning a query that uses the
+    ** virtual table. Equality and range constraints on the value are searched in the B-tree of
+    ** the shadow table, otherwise an equality on the rowid uses its index on the source row.
+    ** The constraints are listed in idxStr and still checked by SQLite.
+    */
+    static int protobufIndexBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo)
+    {
+        ProtobufIndexVtab *p = (ProtobufIndexVtab*)tab;
+        bool text = p->definition.type == TYPE_STRING;
+
+        // Search by value when possible, otherwise by rowid
+        bool byValue = false;
+        bool byRowid = false;
+        const struct sqlite3_index_info::sqlite3_index_constraint *pConstraint = pIdxInfo->aConstraint;
+        for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++)
+        {
+            if (pConstraint->usable == 0) {continue;}
+            bool eq = pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ;
+            bool range = pConstraint->op == SQLITE_INDEX_CONSTRAINT_GT || pConstraint->op == SQLITE_INDEX_CONSTRAINT_GE
+                      || pConstraint->op == SQLITE_INDEX_CONSTRAINT_LT || pConstraint->op == SQLITE_INDEX_CONSTRAINT_LE;
+            if (pConstraint->iColumn == PROTOBUF_INDEX_VALUE && (eq || range))
+            {
+                // Text is ordered with the binary collation in the shadow table
+                if (text && (sqlite3_libversion_number() < 3022000 || sqlite3_stricmp(sqlite3_vtab_collation(pIdxInfo, i), "BINARY") != 0)) {continue;}
+                byValue = true;
+            }
+            byRowid = byRowid || (pConstraint->iColumn < 0 && eq);
+        }
+
+        std::string idxStr;
+        int numArgs = 0;
+        double nRows = PROTOBUF_INDEX_ROWS;
+        pConstraint = pIdxInfo->aConstraint;
+        for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++)
+        {
+            if (pConstraint->usable == 0) {continue;}
+            if (byValue && pConstraint->iColumn != PROTOBUF_INDEX_VALUE) {continue;}
+            if (!byValue && (!byRowid || pConstraint->iColumn >= 0 || pConstraint->op != SQLITE_INDEX_CONSTRAINT_EQ)) {continue;}
+            if (byValue && text && (sqlite3_libversion_number() < 3022000 || sqlite3_stricmp(sqlite3_vtab_collation(pIdxInfo, i), "BINARY") != 0)) {continue;}
+
+            char c = 0;
+            switch (pConstraint->op)
+            {
+            case SQLITE_INDEX_CONSTRAINT_EQ: c = 'e'; break;
+            case SQLITE_INDEX_CONSTRAINT_GT: c = 'g'; break;
+            case SQLITE_INDEX_CONSTRAINT_GE: c = 'G'; break;
+            case SQLITE_INDEX_CONSTRAINT_LT: c = 'l'; break;
+            case SQLITE_INDEX_CONSTRAINT_LE: c = 'L'; break;
+            default: break;
+            }
+            if (c == 0) {continue;}
+            if (c == 'e') {nRows = nRows < PROTOBUF_INDEX_EQ_ROWS ? nRows : PROTOBUF_INDEX_EQ_ROWS;}
+            else {nRows *= 0.25;}
+
+            idxStr += c + std::to_string(pConstraint->iColumn < 0 ? -1 : pConstraint->iColumn) + ";";
+            pIdxInfo->aConstraintUsage[i].argvIndex = ++numArgs;
+        }
+        if (!idxStr.empty())
+        {
+            pIdxInfo->idxStr = sqlite3_mprintf("%s", idxStr.c_str());
+            pIdxInfo->needToFreeIdxStr = 1;
+            if (pIdxInfo->idxStr == nullptr) {return SQLITE_NOMEM;}
+        }
+
+        // Rows are returned in value order, unless they are looked up by rowid
+        if (!byRowid || byValue)
+        {
+            if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn == PROTOBUF_INDEX_VALUE && pIdxInfo->aOrderBy[0].desc == 0)
+            {
+                pIdxInfo->orderByConsumed = 1;
+            }
+        }
+
+        // Searching the B-tree costs the logarithm of the number of values
+        pIdxInfo->estimatedCost = numArgs > 0 ? nRows + 20.0 : nRows;
+        pIdxInfo->estimatedRows = (sqlite3_int64)nRows + 1;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Define all the methods for the module (virtual table).
+    */
+    static sqlite3_module protobufIndexModule = {
+        /* iVersion    */ 1,
+        /* xCreate     */ protobufIndexCreate,
+        /* xConnect    */ protobufIndexConnect,
+        /* xBestIndex  */ protobufIndexBestIndex,
+        /* xDisconnect */ protobufIndexDisconnect,
+        /* xDestroy    */ protobufIndexDestroy,
+        /* xOpen       */ protobufIndexOpen,
+        /* xClose      */ protobufIndexClose,
+        /* xFilter     */ protobufIndexFilter,
+        /* xNext       */ protobufIndexNext,
+        /* xEof        */ protobufIndexEof,
+        /* xColumn     */ protobufIndexColumn,
+        /* xRowid      */ protobufIndexRowid,
+        /* xUpdate     */ protobufIndexUpdate,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ protobufIndexRename,
+        /* xSavepoint  */ 0, // iVersion >= 2
+        /* xRelease    */ 0, // iVersion >= 2
+        /* xRollbackTo */ 0, // iVersion >= 2
+        /* xShadowName */ 0, // iVersion >= 3
+        /* xIntegrity  */ //0, // iVersion >= 4
+    };
+
+    /* Columns of protobuf_index_decode, the arguments are the hidden columns after the occurrence */
+    #define PROTOBUF_INDEX_DECODE_MESSAGE 2
+    #define PROTOBUF_INDEX_DECODE_PATH    3
+    #define PROTOBUF_INDEX_DECODE_TYPE    4
+
+    /* Number of path and type pairs kept compiled by protobuf_index_decode */
+    #define PROTOBUF_INDEX_DECODE_CACHE_SIZE 16
+
+    /*
+    ** Define virtual table data structure for protobuf_index_decode, the table valued function
+    ** used by the triggers, with the compiled paths and types it was called with
+    */
+    typedef struct ProtobufIndexDecodeVtab ProtobufIndexDecodeVtab;
+    struct ProtobufIndexDecodeVtab
+    {
+        sqlite3_vtab base;          // Base class - must be first
+        std::map<std::string, ColumnDefinition> definitions; // Keyed by the path, a 0 byte and the type
+    };
+
+    /*
+    ** Define cursor data structure, the values matching the path are decoded when filtering
+    */
+    typedef struct ProtobufIndexDecodeCursor ProtobufIndexDecodeCursor;
+    struct ProtobufIndexDecodeCursor
+    {
+        sqlite3_vtab_cursor base;   // Base class - must be first
+        std::string message;        // Copy of the message, which the values point into
+        std::vector<Field> matches;
+        std::vector<Value> values;
+        std::vector<sqlite3_int64> occurrences; // Occurrence of each value among the matches
+        size_t iValue;              // Current value
+    };
+
+    /*
+    ** Constructor for ProtobufIndexDecodeVtab objects.
+    */
+    static int protobufIndexDecodeConnect(sqlite3 *db, void *pAux, int argc, const char *const*argv, sqlite3_vtab **ppVtab, char **pzErr)
+    {
+        int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(value, occurrence INTEGER, message HIDDEN, path HIDDEN, type HIDDEN)");
+        if (rc != SQLITE_OK) {return rc;}
+
+        ProtobufIndexDecodeVtab *pNew = new (std::nothrow) ProtobufIndexDecodeVtab();
+        if (pNew == nullptr) {return SQLITE_NOMEM;}
+#if SQLITE_VERSION_NUMBER >= 3031000
+        // Decoding has no side effects, so the table may be used in triggers when the schema is not trusted
+        if (sqlite3_libversion_number() >= 3031000) {sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);}
+#endif
+        *ppVtab = &pNew->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for ProtobufIndexDecodeVtab objects.
+    */
+    static int protobufIndexDecodeDisconnect(sqlite3_vtab *pVtab)
+    {
+        ProtobufIndexDecodeVtab *p = (ProtobufIndexDecodeVtab*)pVtab;
+        sqlite3_free(p->base.zErrMsg);
+        delete p;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Constructor for a new ProtobufIndexDecodeCursor object.
+    */
+    static int protobufIndexDecodeOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+    {
+        ProtobufIndexDecodeCursor *pCur = new (std::nothrow) ProtobufIndexDecodeCursor();
+        if (pCur == nullptr) {return SQLITE_NOMEM;}
+        pCur->iValue = 0;
+        *ppCursor = &pCur->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for a ProtobufIndexDecodeCursor.
+    */
+    static int protobufIndexDecodeClose(sqlite3_vtab_cursor *cur)
+    {
+        delete (ProtobufIndexDecodeCursor*)cur;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Advance a ProtobufIndexDecodeCursor to its next value.
+    */
+    static int protobufIndexDecodeNext(sqlite3_vtab_cursor *cur)
+    {
+        ((ProtobufIndexDecodeCursor*)cur)->iValue++;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return value at given column and row (ProtobufIndexDecodeCursor), the values are already decoded.
+    */
+    static int protobufIndexDecodeColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+    {
+        ProtobufIndexDecodeCursor *pCur = (ProtobufIndexDecodeCursor *)cur;
+        if (col == PROTOBUF_INDEX_VALUE) {result_from_value(ctx, pCur->values[pCur->iValue], SQLITE_TRANSIENT);}
+        if (col == PROTOBUF_INDEX_OCCURRENCE) {sqlite3_result_int64(ctx, pCur->occurrences[pCur->iValue]);}
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return the rowid for the current row, the position of the value starting at 1.
+    */
+    static int protobufIndexDecodeRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+    {
+        *pRowid = (sqlite3_int64)((ProtobufIndexDecodeCursor*)cur)->iValue + 1;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return TRUE if the cursor has been moved off of the last row of output.
+    */
+    static int protobufIndexDecodeEof(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufIndexDecodeCursor *pCur = (ProtobufIndexDecodeCursor*)cur;
+        return pCur->iValue >= pCur->values.size();
+    }
+
+    /*
+    ** This method is called to "rewind" the ProtobufIndexDecodeCursor object back to the first
+    ** row of output. The values matching the path are decoded like protobuf_index indexes them,
+    ** numbered by their occurrence in the message and leaving out the values of another type.
+    */
+    static int protobufIndexDecodeFilter(sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv)
+    {
+        ProtobufIndexDecodeCursor *pCur = (ProtobufIndexDecodeCursor *)cur;
+        ProtobufIndexDecodeVtab *p = (ProtobufIndexDecodeVtab*)cur->pVtab;
+        pCur->values.clear();
+        pCur->occurrences.clear();
+        pCur->iValue = 0;
+        if (argc < 2 || sqlite3_value_type(argv[0]) == SQLITE_NULL) {return SQLITE_OK;}
+
+        const char *zPath = (const char *)sqlite3_value_text(argv[1]);
+        const char *zType = argc > 2 ? (const char *)sqlite3_value_text(argv[2]) : "";
+        std::string path = zPath != nullptr ? zPath : "";
+        std::string type = zType != nullptr ? zType : "";
+        std::string key = path + '\0' + type;
+        std::map<std::string, ColumnDefinition>::iterator it = p->definitions.find(key);
+        if (it == p->definitions.end())
+        {
+            ColumnDefinition definition;
+            std::string error;
+            if (!column_init(definition, path, type, error))
+            {
+                sqlite3_free(p->base.zErrMsg);
+                p->base.zErrMsg = sqlite3_mprintf("%s", error.c_str());
+                return SQLITE_ERROR;
+            }
+            if (p->definitions.size() >= PROTOBUF_INDEX_DECODE_CACHE_SIZE) {p->definitions.clear();}
+            it = p->definitions.insert(std::make_pair(key, definition)).first;
+        }
+        const ColumnDefinition &definition = it->second;
+
+        const char *message = (const char *)sqlite3_value_blob(argv[0]);
+        pCur->message.assign(message != nullptr ? message : "", (size_t)sqlite3_value_bytes(argv[0]));
+        Buffer buffer;
+        buffer.start = (const uint8_t *)pCur->message.data();
+        buffer.end = buffer.start + pCur->message.size();
+
+        pCur->matches.clear();
+        path_match(&definition.path, buffer, definition.wireTypes, definition.numWireTypes, definition.packed, pCur->matches);
+        for (size_t i = 0; i < pCur->matches.size(); i++)
+        {
+            Value value;
+            if (!value_from_buffer(definition.type, pCur->matches[i].value, 0, &value)) {continue;}
+            pCur->values.push_back(value);
+            pCur->occurrences.push_back((sqlite3_int64)i);
+        }
+        return SQLITE_OK;
+    }
+
+    /*
+    ** SQLite will invoke this method one or more times while planning a query that uses the
+    ** virtual table. The table is a table valued function, which needs the message and the
+    ** path arguments, and optionally the type.
+    */
+    static int protobufIndexDecodeBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo)
+    {
+        int aIdx[3] = {-1, -1, -1}; // Constraints on the message, path and type
+        const struct sqlite3_index_info::sqlite3_index_constraint *pConstraint = pIdxInfo->aConstraint;
+        for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++)
+        {
+            int iCol = pConstraint->iColumn - PROTOBUF_INDEX_DECODE_MESSAGE;
+            if (iCol < 0 || pConstraint->op != SQLITE_INDEX_CONSTRAINT_EQ) {continue;}
+            if (pConstraint->usable == 0) {return SQLITE_CONSTRAINT;}
+            aIdx[iCol] = i;
+        }
+
+        // Without a message and a path there are no rows
+        int numArgs = 0;
+        for (int i = 0; i < 3 && aIdx[i] >= 0; i++)
+        {
+            pIdxInfo->aConstraintUsage[aIdx[i]].argvIndex = ++numArgs;
+            pIdxInfo->aConstraintUsage[aIdx[i]].omit = 1;
+        }
+        pIdxInfo->estimatedCost = 10;
+        pIdxInfo->estimatedRows = 10;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Define all the methods for the module (virtual table).
+    */
+    static sqlite3_module protobufIndexDecodeModule = {
+        /* iVersion    */ 0,
+        /* xCreate     */ 0, // Eponymous only, like a table valued function
+        /* xConnect    */ protobufIndexDecodeConnect,
+        /* xBestIndex  */ protobufIndexDecodeBestIndex,
+        /* xDisconnect */ protobufIndexDecodeDisconnect,
+        /* xDestroy    */ protobufIndexDecodeDisconnect,
+        /* xOpen       */ protobufIndexDecodeOpen,
+        /* xClose      */ protobufIndexDecodeClose,
+        /* xFilter     */ protobufIndexDecodeFilter,
+        /* xNext       */ protobufIndexDecodeNext,
+        /* xEof        */ protobufIndexDecodeEof,
+        /* xColumn     */ protobufIndexDecodeColumn,
+        /* xRowid      */ protobufIndexDecodeRowid,
+        /* xUpdate     */ 0,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ 0,
+        /* xSavepoint  */ 0, // iVersion >= 2
+        /* xRelease    */ 0, // iVersion >= 2
+        /* xRollbackTo */ 0, // iVersion >= 2
+        /* xShadowName */ 0, // iVersion >= 3
+        /* xIntegrity  */ //0, // iVersion >= 4
+    };
+
+    int register_protobuf_index(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        int rc = sqlite3_create_module(db, "protobuf_index_decode", &protobufIndexDecodeModule, 0);
+        if (rc != SQLITE_OK) {return rc;}
+        return sqlite3_create_module(db, "protobuf_index", &protobufIndexModule, 0);
+    }
+
+} // namespace sqlite_protobuf
@@ -5,6 +5,8 @@
 #include <sstream>
 
 #include "protodec.h"
+#include "protobuf_stats.h"
+#include "trace.h"
 
 namespace sqlite_protobuf
 {
@@ -28,6 +30,7 @@ namespace sqlite_protobuf
 
             // Load in arguments
             sqlite3_value *data = argv[0];
+            PROTOBUF_STATS(StatsScope stats(STATS_TO_JSON, (uint64_t)sqlite3_value_bytes(data)));
             int64_t mode = argc > 1 ? sqlite3_value_int64(argv[1]) : 0;
 
             // Decode message
@@ -35,10 +38,14 @@ namespace sqlite_protobuf
             buffer.start = static_cast<const uint8_t *>(sqlite3_value_blob(data));
             buffer.end = buffer.start + static_cast<size_t>(sqlite3_value_bytes(data));
             Field field = decodeProtobuf(buffer, mode > 1);
+            PROTOBUF_STATS(stats_decoded(STATS_TO_JSON, field));
 
             // Convert to json
             std::ostringstream os;
-            toJson(&field, os, mode > 0);
+            {
+                PROTOBUF_TRACE_SPAN("toJson");
+                toJson(&field, os, mode > 0);
+            }
             std::string json = os.str();
 
             // Return result
@@ -0,0 +1,585 @@
+#include "protobuf_materialize.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <vector>
+#include <new>
+#include <cctype>
+
+#include "protodec.h"
+#include "protobuf_type.h"
+#include "protobuf_column.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    /*
+    ** Define virtual table data structure containg data needed for virtual table
+    */
+    typedef struct ProtobufProjectVtab ProtobufProjectVtab;
+    struct ProtobufProjectVtab
+    {
+        sqlite3_vtab base;          // Base class - must be first
+        std::vector<ColumnDefinition> columns;
+    };
+
+    /*
+    ** Define cursor data structure, the cursor returns one row with the values of the message
+    ** given to the table valued function, which is decoded once for all columns
+    */
+    typedef struct ProtobufProjectCursor ProtobufProjectCursor;
+    struct ProtobufProjectCursor
+    {
+        sqlite3_vtab_cursor base;   // Base class - must be first
+        std::string message;        // Copy of the message
+        bool null;                  // Message is NULL, all values are NULL
+        std::vector<Value> values;
+        std::vector<std::string> texts; // JSON arrays for paths matching several fields
+        std::vector<Field> matches;
+        bool eof;
+    };
+
+    /*
+    ** Constructor for ProtobufProjectVtab objects, the arguments are one column definition for
+    ** each column of the table. The message is the hidden column "message".
+    */
+    static int protobufProjectConnect(sqlite3 *db, void *pAux, int argc, const char *const*argv, sqlite3_vtab **ppVtab, char **pzErr)
+    {
+        if (argc < 4)
+        {
+            *pzErr = sqlite3_mprintf("protobuf_project requires at least one column definition");
+            return SQLITE_ERROR;
+        }
+
+        ProtobufProjectVtab *pNew = new (std::nothrow) ProtobufProjectVtab();
+        if (pNew == nullptr) {return SQLITE_NOMEM;}
+
+        std::string error;
+        char *zSchema = sqlite3_mprintf("CREATE TABLE x(");
+        for (int i = 3; i < argc && error.empty(); i++)
+        {
+            ColumnDefinition column;
+            if (!column_parse(argv[i], column, error)) {break;}
+            pNew->columns.push_back(column);
+            zSchema = sqlite3_mprintf("%z\"%w\",", zSchema, column.name.c_str());
+        }
+        zSchema = sqlite3_mprintf("%zmessage HIDDEN)", zSchema);
+
+        int rc = SQLITE_OK;
+        if (!error.empty())
+        {
+            *pzErr = sqlite3_mprintf("%s", error.c_str());
+            rc = SQLITE_ERROR;
+        }
+        else if (zSchema == nullptr)
+        {
+            rc = SQLITE_NOMEM;
+        }
+        else
+        {
+            rc = sqlite3_declare_vtab(db, zSchema);
+        }
+        sqlite3_free(zSchema);
+
+        if (rc != SQLITE_OK)
+        {
+            delete pNew;
+            return rc;
+        }
+#if SQLITE_VERSION_NUMBER >= 3031000
+        // Decoding has no side effects, so the table may be used in triggers when the schema is not trusted
+        if (sqlite3_libversion_number() >= 3031000) {sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);}
+#endif
+        *ppVtab = &pNew->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for ProtobufProjectVtab objects.
+    */
+    static int protobufProjectDisconnect(sqlite3_vtab *pVtab)
+    {
+        ProtobufProjectVtab *p = (ProtobufProjectVtab*)pVtab;
+        sqlite3_free(p->base.zErrMsg);
+        delete p;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Constructor for a new ProtobufProjectCursor object.
+    */
+    static int protobufProjectOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+    {
+        ProtobufProjectCursor *pCur = new (std::nothrow) ProtobufProjectCursor();
+        if (pCur == nullptr) {return SQLITE_NOMEM;}
+        pCur->null = true;
+        pCur->eof = true;
+        *ppCursor = &pCur->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for a ProtobufProjectCursor.
+    */
+    static int protobufProjectClose(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufProjectCursor *pCur = (ProtobufProjectCursor*)cur;
+        delete pCur;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Advance a ProtobufProjectCursor to its next row of output, there is only one row.
+    */
+    static int protobufProjectNext(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufProjectCursor *pCur = (ProtobufProjectCursor*)cur;
+        pCur->eof = true;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return value at given column and row (ProtobufProjectCursor), the values are already decoded.
+    */
+    static int protobufProjectColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+    {
+        ProtobufProjectCursor *pCur = (ProtobufProjectCursor *)cur;
+        if (pCur->null || col < 0) {return SQLITE_OK;}
+
+        if ((size_t)col >= pCur->values.size())
+        {
+            sqlite3_result_blob(ctx, pCur->message.data(), (int)pCur->message.size(), SQLITE_TRANSIENT);
+            return SQLITE_OK;
+        }
+        result_from_value(ctx, pCur->values[col], SQLITE_TRANSIENT);
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return the rowid for the current row, the only row is row 1.
+    */
+    static int protobufProjectRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+    {
+        *pRowid = 1;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return TRUE if the cursor has been moved off of the last row of output.
+    */
+    static int protobufProjectEof(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufProjectCursor *pCur = (ProtobufProjectCursor*)cur;
+        return pCur->eof;
+    }
+
+    /*
+    ** This method is called to "rewind" the ProtobufProjectCursor object back to the first row of
+    ** output. The message is decoded once and the values of all columns are extracted from it.
+    */
+    static int protobufProjectFilter(sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv)
+    {
+        ProtobufProjectCursor *pCur = (ProtobufProjectCursor *)cur;
+        ProtobufProjectVtab *p = (ProtobufProjectVtab*)cur->pVtab;
+        pCur->eof = argc < 1;
+        pCur->null = argc < 1 || sqlite3_value_type(argv[0]) == SQLITE_NULL;
+        if (pCur->null) {return SQLITE_OK;}
+
+        const char *message = (const char *)sqlite3_value_blob(argv[0]);
+        pCur->message.assign(message != nullptr ? message : "", (size_t)sqlite3_value_bytes(argv[0]));
+        Buffer buffer;
+        buffer.start = (const uint8_t *)pCur->message.data();
+        buffer.end = buffer.start + pCur->message.size();
+
+        size_t numMulti = 0;
+        bool decode = false; // Single field paths are looked up in the decoded message
+        for (size_t c = 0; c < p->columns.size(); c++)
+        {
+            numMulti += p->columns[c].path.multi ? 1 : 0;
+            decode = decode || !p->columns[c].path.multi;
+        }
+        pCur->values.resize(p->columns.size());
+        pCur->texts.clear();
+        pCur->texts.reserve(numMulti); // Values point into the texts, so they must not be reallocated
+
+        Field root = decode ? decodeProtobuf(buffer, false) : Field();
+        std::string unused; // Paths matching one field do not write JSON
+        for (size_t c = 0; c < p->columns.size(); c++)
+        {
+            if (p->columns[c].path.multi) {pCur->texts.push_back(std::string());}
+            std::string &json = p->columns[c].path.multi ? pCur->texts.back() : unused;
+            column_extract(p->columns[c], buffer, &root, pCur->matches, &pCur->values[c], json);
+        }
+        return SQLITE_OK;
+    }
+
+    /*
+    ** SQLite will invoke this method one or more times while planning a query that uses the
+    ** virtual table. The table is a table valued function, which needs the message argument.
+    */
+    static int protobufProjectBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo)
+    {
+        ProtobufProjectVtab *p = (ProtobufProjectVtab*)tab;
+        const struct sqlite3_index_info::sqlite3_index_constraint *pConstraint = pIdxInfo->aConstraint;
+        for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++)
+        {
+            if (pConstraint->iColumn != (int)p->columns.size() || pConstraint->op != SQLITE_INDEX_CONSTRAINT_EQ) {continue;}
+            if (pConstraint->usable == 0) {return SQLITE_CONSTRAINT;}
+            pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+            pIdxInfo->aConstraintUsage[i].omit = 1;
+            pIdxInfo->estimatedCost = 1;
+            pIdxInfo->estimatedRows = 1;
+            return SQLITE_OK;
+        }
+
+        // Without a message there are no rows
+        pIdxInfo->estimatedCost = 1;
+        pIdxInfo->estimatedRows = 1;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Define all the methods for the module (virtual table).
+    */
+    static sqlite3_module protobufProjectModule = {
+        /* iVersion    */ 0,
+        /* xCreate     */ protobufProjectConnect,
+        /* xConnect    */ protobufProjectConnect,
+        /* xBestIndex  */ protobufProjectBestIndex,
+        /* xDisconnect */ protobufProjectDisconnect,
+        /* xDestroy    */ protobufProjectDisconnect,
+        /* xOpen       */ protobufProjectOpen,
+        /* xClose      */ protobufProjectClose,
+        /* xFilter     */ protobufProjectFilter,
+        /* xNext       */ protobufProjectNext,
+        /* xEof        */ protobufProjectEof,
+        /* xColumn     */ protobufProjectColumn,
+        /* xRowid      */ protobufProjectRowid,
+        /* xUpdate     */ 0,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ 0,
+        /* xSavepoint  */ 0, // iVersion >= 2
+        /* xRelease    */ 0, // iVersion >= 2
+        /* xRollbackTo */ 0, // iVersion >= 2
+        /* xShadowName */ 0, // iVersion >= 3
+        /* xIntegrity  */ //0, // iVersion >= 4
+    };
+
+    namespace
+    {
+        std::string string_from_sqlite3_value(sqlite3_value *value)
+        {
+            const char *text = static_cast<const char *>(sqlite3_value_blob(value));
+            size_t text_size = static_cast<size_t>(sqlite3_value_bytes(value));
+            return std::string(text, text_size);
+        }
+
+        /// Column of a projection, such as '$.1:int64 AS user_id'
+        struct Projection
+        {
+            std::string name;
+            std::string path;
+            std::string type;
+            std::string declared;   // Declared SQL type of the column of the side table
+        };
+
+        std::string trim(const std::string &text)
+        {
+            size_t start = 0, end = text.size();
+            while (start < end && isspace((unsigned char)text[start])) {start++;}
+            while (end > start && isspace((unsigned char)text[end - 1])) {end--;}
+            return text.substr(start, end - start);
+        }
+
+        /// Split a projection list on the commas that are not inside brackets, parentheses or quotes
+        std::vector<std::string> split_projections(const std::string &spec)
+        {
+            std::vector<std::string> items;
+            std::string item;
+            int depth = 0;
+            char quote = 0;
+            for (size_t i = 0; i < spec.size(); i++)
+            {
+                char c = spec[i];
+                if (quote != 0) {quote = c == quote ? 0 : quote;}
+                else if (c == '\'' || c == '"') {quote = c;}
+                else if (c == '[' || c == '(') {depth++;}
+                else if (c == ']' || c == ')') {depth--;}
+                else if (c == ',' && depth == 0)
+                {
+                    items.push_back(item);
+                    item.clear();
+                    continue;
+                }
+                item += c;
+            }
+            items.push_back(item);
+            return items;
+        }
+
+        /// Parse a projection list of the form '$.1:int64 AS user_id, $.2:string AS name', the type
+        /// after the last colon outside brackets is optional and defaults to ''
+        bool parse_projections(const std::string &spec, std::vector<Projection> &projections, std::string &error)
+        {
+            std::vector<std::string> items = split_projections(spec);
+            for (size_t i = 0; i < items.size(); i++)
+            {
+                std::string item = trim(items[i]);
+                Projection projection;
+
+                // The name follows the last AS, which is not part of a path
+                size_t as = std::string::npos;
+                for (size_t k = 0; k + 4 <= item.size(); k++)
+                {
+                    if (isspace((unsigned char)item[k]) && toupper((unsigned char)item[k + 1]) == 'A'
+                        && toupper((unsigned char)item[k + 2]) == 'S' && isspace((unsigned char)item[k + 3])) {as = k;}
+                }
+                if (as != std::string::npos)
+                {
+                    projection.name = sql_dequote(trim(item.substr(as + 4)));
+                    item = trim(item.substr(0, as));
+                }
+
+                int depth = 0;
+                size_t colon = std::string::npos;
+                for (size_t k = 0; k < item.size(); k++)
+                {
+                    if (item[k] == '[' || item[k] == '(') {depth++;}
+                    else if (item[k] == ']' || item[k] == ')') {depth--;}
+                    else if (item[k] == ':' && depth == 0) {colon = k;}
+                }
+                projection.path = trim(item.substr(0, colon));
+                projection.type = colon != std::string::npos ? sql_dequote(trim(item.substr(colon + 1))) : "";
+
+                ColumnDefinition column;
+                if (projection.name.empty() || projection.path.empty())
+                {
+                    error = "Projection not valid, expected '$.path:type AS name' but got: " + trim(items[i]);
+                    return false;
+                }
+                if (!column_init(column, projection.path, projection.type, error)) {return false;}
+                projection.declared = column.path.multi ? "TEXT" : sql_type_from_type(column.type); // Paths matching several fields are JSON arrays
+                projections.push_back(projection);
+            }
+            return true;
+        }
+
+        /// Run an SQL statement that is freed afterwards
+        int exec(sqlite3 *db, char *zSql)
+        {
+            if (zSql == nullptr) {return SQLITE_NOMEM;}
+            int rc = sqlite3_exec(db, zSql, nullptr, nullptr, nullptr);
+            sqlite3_free(zSql);
+            return rc;
+        }
+
+        /// Run a query returning one integer, rc is SQLITE_ROW if there is a row and SQLITE_DONE if there is not
+        int query_int64(sqlite3 *db, char *zSql, sqlite3_int64 bind1, sqlite3_int64 bind2, sqlite3_int64 *result)
+        {
+            if (zSql == nullptr) {return SQLITE_NOMEM;}
+            sqlite3_stmt *pStmt = nullptr;
+            int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, nullptr);
+            sqlite3_free(zSql);
+            if (rc != SQLITE_OK) {return rc;}
+            if (sqlite3_bind_parameter_count(pStmt) >= 1) {sqlite3_bind_int64(pStmt, 1, bind1);}
+            if (sqlite3_bind_parameter_count(pStmt) >= 2) {sqlite3_bind_int64(pStmt, 2, bind2);}
+            rc = sqlite3_step(pStmt);
+            if (rc == SQLITE_ROW) {*result = sqlite3_column_int64(pStmt, 0);}
+            int rcFinalize = sqlite3_finalize(pStmt);
+            return rc == SQLITE_ROW || rc == SQLITE_DONE ? (rcFinalize == SQLITE_OK ? rc : rcFinalize) : rc;
+        }
+
+        /// Create the side table, the projection and the triggers keeping the side table in sync
+        int materialize_create(sqlite3 *db, const std::string &table, const std::string &column, const std::string &side, const std::vector<Projection> &projections)
+        {
+            std::string decode = side + "_decode";
+            char *zColumns = sqlite3_mprintf("%s", "");
+            char *zTable = sqlite3_mprintf("CREATE TABLE \"%w\"(", side.c_str());
+            char *zDecode = sqlite3_mprintf("CREATE VIRTUAL TABLE \"%w\" USING protobuf_project(", decode.c_str());
+            for (size_t i = 0; i < projections.size(); i++)
+            {
+                const Projection &projection = projections[i];
+                const char *zSep = i > 0 ? ", " : "";
+                zColumns = sqlite3_mprintf("%z%s\"%w\"", zColumns, zSep, projection.name.c_str());
+                zTable = sqlite3_mprintf("%z%s\"%w\" %s", zTable, zSep, projection.name.c_str(), projection.declared.c_str());
+                zDecode = sqlite3_mprintf("%z%s\"%w\" %Q %Q", zDecode, zSep, projection.name.c_str(), projection.path.c_str(), projection.type.c_str());
+            }
+            zTable = sqlite3_mprintf("%z)", zTable);
+            zDecode = sqlite3_mprintf("%z)", zDecode);
+
+            int rc = zColumns == nullptr ? SQLITE_NOMEM : SQLITE_OK;
+            if (rc == SQLITE_OK) {rc = exec(db, zTable); zTable = nullptr;}
+            if (rc == SQLITE_OK) {rc = exec(db, zDecode); zDecode = nullptr;}
+
+            // Rows are inserted with a single decode of the message by the projection
+            const char *zT = table.c_str(), *zC = column.c_str(), *zS = side.c_str(), *zD = decode.c_str();
+            if (rc == SQLITE_OK)
+            {
+                rc = exec(db, sqlite3_mprintf(
+                    "CREATE TRIGGER \"%w_insert\" AFTER INSERT ON \"%w\" BEGIN "
+                    "INSERT OR REPLACE INTO \"%w\"(rowid, %s) SELECT NEW.rowid, %s FROM \"%w\"(NEW.\"%w\"); END",
+                    zS, zT, zS, zColumns, zColumns, zD, zC));
+            }
+            if (rc == SQLITE_OK)
+            {
+                rc = exec(db, sqlite3_mprintf(
+                    "CREATE TRIGGER \"%w_update\" AFTER UPDATE ON \"%w\" WHEN OLD.rowid IS NOT NEW.rowid OR OLD.\"%w\" IS NOT NEW.\"%w\" BEGIN "
+                    "DELETE FROM \"%w\" WHERE rowid = OLD.rowid; "
+                    "INSERT OR REPLACE INTO \"%w\"(rowid, %s) SELECT NEW.rowid, %s FROM \"%w\"(NEW.\"%w\"); END",
+                    zS, zT, zC, zC, zS, zS, zColumns, zColumns, zD, zC));
+            }
+            if (rc == SQLITE_OK)
+            {
+                rc = exec(db, sqlite3_mprintf(
+                    "CREATE TRIGGER \"%w_delete\" AFTER DELETE ON \"%w\" BEGIN DELETE FROM \"%w\" WHERE rowid = OLD.rowid; END",
+                    zS, zT, zS));
+            }
+
+            // The rows already in the table are backfilled from the smallest rowid on
+            if (rc == SQLITE_OK)
+            {
+                rc = exec(db, sqlite3_mprintf("CREATE TABLE \"%w_backfill\"(next INTEGER); INSERT INTO \"%w_backfill\" SELECT min(rowid) FROM \"%w\"",
+                                              zS, zS, zT));
+            }
+            sqlite3_free(zColumns);
+            sqlite3_free(zTable);
+            sqlite3_free(zDecode);
+            return rc;
+        }
+
+        /// Drop the side table, the projection and the triggers
+        int materialize_drop(sqlite3 *db, const std::string &side)
+        {
+            const char *zS = side.c_str();
+            return exec(db, sqlite3_mprintf(
+                "DROP TRIGGER IF EXISTS \"%w_insert\"; DROP TRIGGER IF EXISTS \"%w_update\"; DROP TRIGGER IF EXISTS \"%w_delete\"; "
+                "DROP TABLE IF EXISTS \"%w_backfill\"; DROP TABLE IF EXISTS \"%w_decode\"; DROP TABLE IF EXISTS \"%w\"",
+                zS, zS, zS, zS, zS, zS));
+        }
+
+        /// Backfill the next rows of the table, at most batch rows if batch is positive. The rows are
+        /// inserted from the rowid in the backfill table on, which is dropped when all rows are done.
+        int materialize_backfill(sqlite3 *db, const std::string &table, const std::string &column, const std::string &side,
+                                 const std::vector<Projection> &projections, sqlite3_int64 batch, sqlite3_int64 *numRows)
+        {
+            const char *zT = table.c_str(), *zC = column.c_str(), *zS = side.c_str();
+            *numRows = 0;
+            sqlite3_int64 backfilling = 0;
+            int rc = query_int64(db, sqlite3_mprintf("SELECT count(*) FROM sqlite_master WHERE type = 'table' AND name = '%q_backfill'", zS), 0, 0, &backfilling);
+            if (rc != SQLITE_ROW) {return rc;}
+            if (!backfilling) {return SQLITE_OK;}
+
+            sqlite3_int64 next = 0;
+            rc = query_int64(db, sqlite3_mprintf("SELECT next FROM \"%w_backfill\" WHERE next IS NOT NULL", zS), 0, 0, &next);
+            if (rc == SQLITE_DONE) {return exec(db, sqlite3_mprintf("DROP TABLE \"%w_backfill\"", zS));}
+            if (rc != SQLITE_ROW) {return rc;}
+
+            // The batch ends before the first rowid after batch rows
+            sqlite3_int64 end = 0;
+            bool bounded = false;
+            if (batch > 0)
+            {
+                rc = query_int64(db, sqlite3_mprintf("SELECT rowid FROM \"%w\" WHERE rowid >= ?1 ORDER BY rowid LIMIT 1 OFFSET ?2", zT), next, batch, &end);
+                if (rc != SQLITE_ROW && rc != SQLITE_DONE) {return rc;}
+                bounded = rc == SQLITE_ROW;
+            }
+
+            char *zColumns = sqlite3_mprintf("%s", "");
+            char *zValues = sqlite3_mprintf("%s", "");
+            for (size_t i = 0; i < projections.size(); i++)
+            {
+                zColumns = sqlite3_mprintf("%z, \"%w\"", zColumns, projections[i].name.c_str());
+                zValues = sqlite3_mprintf("%z, d.\"%w\"", zValues, projections[i].name.c_str());
+            }
+            char *zSql = sqlite3_mprintf(
+                "INSERT OR IGNORE INTO \"%w\"(rowid%s) SELECT s.rowid%s FROM \"%w\" AS s, \"%w_decode\"(s.\"%w\") AS d WHERE s.rowid >= %lld",
+                zS, zColumns, zValues, zT, zS, zC, next);
+            if (bounded) {zSql = sqlite3_mprintf("%z AND s.rowid < %lld", zSql, end);}
+            rc = zColumns == nullptr || zValues == nullptr ? SQLITE_NOMEM : exec(db, zSql);
+            sqlite3_free(zColumns);
+            sqlite3_free(zValues);
+            if (rc != SQLITE_OK) {return rc;}
+            *numRows = sqlite3_changes(db);
+
+            if (bounded) {return exec(db, sqlite3_mprintf("UPDATE \"%w_backfill\" SET next = %lld", zS, end));}
+            return exec(db, sqlite3_mprintf("DROP TABLE \"%w_backfill\"", zS));
+        }
+
+        /// Materialize fields of the messages in a column as ordinary columns of a side table named
+        /// table_materialized, which triggers keep in sync with the table. The rows already in the
+        /// table are backfilled, at most batch rows for each call if a batch size is given, and
+        /// calling the function again continues the backfill. A NULL projection drops the side table.
+        ///
+        ///     SELECT protobuf_materialize('events', 'data', '$.1:int64 AS user_id, $.2:string AS name');
+        ///     SELECT protobuf_materialize('events', 'data', '$.1:int64 AS user_id, $.2:string AS name', 10000);
+        ///
+        /// @returns the number of rows backfilled
+        static void protobuf_materialize(sqlite3_context *context, int argc, sqlite3_value **argv)
+        {
+            std::string table = string_from_sqlite3_value(argv[0]);
+            std::string column = string_from_sqlite3_value(argv[1]);
+            std::string side = table + "_materialized";
+            sqlite3_int64 batch = argc > 3 ? sqlite3_value_int64(argv[3]) : 0;
+            sqlite3 *db = sqlite3_context_db_handle(context);
+
+            std::vector<Projection> projections;
+            std::string error;
+            bool drop = sqlite3_value_type(argv[2]) == SQLITE_NULL;
+            if (!drop && !parse_projections(string_from_sqlite3_value(argv[2]), projections, error))
+            {
+                sqlite3_result_error(context, error.c_str(), -1);
+                return;
+            }
+
+            // Create the side table and backfill in one savepoint, so an error leaves no partial side table behind
+            sqlite3_int64 numRows = 0;
+            sqlite3_int64 exists = 0;
+            int rc = sqlite3_exec(db, "SAVEPOINT protobuf_materialize", nullptr, nullptr, nullptr);
+            if (rc == SQLITE_OK && drop)
+            {
+                rc = materialize_drop(db, side);
+            }
+            else if (rc == SQLITE_OK)
+            {
+                rc = query_int64(db, sqlite3_mprintf("SELECT count(*) FROM sqlite_master WHERE type = 'table' AND name = %Q", side.c_str()), 0, 0, &exists);
+                rc = rc == SQLITE_ROW ? SQLITE_OK : rc;
+                if (rc == SQLITE_OK && !exists) {rc = materialize_create(db, table, column, side, projections);}
+                if (rc == SQLITE_OK) {rc = materialize_backfill(db, table, column, side, projections, batch, &numRows);}
+            }
+
+            if (rc != SQLITE_OK)
+            {
+                sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+                sqlite3_result_error_code(context, rc);
+                sqlite3_exec(db, "ROLLBACK TO protobuf_materialize; RELEASE protobuf_materialize", nullptr, nullptr, nullptr);
+            }
+            else if ((rc = sqlite3_exec(db, "RELEASE protobuf_materialize", nullptr, nullptr, nullptr)) != SQLITE_OK)
+            {
+                sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+                sqlite3_result_error_code(context, rc);
+            }
+            else
+            {
+                sqlite3_result_int64(context, numRows);
+            }
+        }
+    } // namespace
+
+    int register_protobuf_materialize(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        int rc = sqlite3_create_module(db, "protobuf_project", &protobufProjectModule, 0);
+        if (rc != SQLITE_OK) {return rc;}
+
+        // Changing the schema is only allowed from top level SQL, not from triggers and views in the schema
+        int flags = SQLITE_UTF8 | (sqlite3_libversion_number() >= 3030000 ? SQLITE_DIRECTONLY : 0);
+        rc = sqlite3_create_function(db, "protobuf_materialize", 3, flags, nullptr, protobuf_materialize, nullptr, nullptr);
+        if (rc != SQLITE_OK) {return rc;}
+        return sqlite3_create_function(db, "protobuf_materialize", 4, flags, nullptr, protobuf_materialize, nullptr, nullptr);
+    }
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,682 @@
+#include "protobuf_path.h"
+#include "sqlite3ext.h"
+
+#include <algorithm>
+#include <list>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+#include "protobuf_stats.h"
+#include "trace.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    // Number of compiled paths kept in the cache of each connection
+    #define PROTOBUF_PATH_CACHE_SIZE 64
+
+    // Largest field number allowed by protobuf
+    #define PROTOBUF_MAX_FIELD_NUMBER 536870911
+
+    struct PathCache
+    {
+        int refs;
+        sqlite3 *db;
+        std::list<CompiledPath *> lru; // Most recently used path first
+        std::unordered_map<std::string, std::list<CompiledPath *>::iterator> paths;
+    };
+
+    namespace
+    {
+        std::mutex cachesMutex;
+        std::map<sqlite3 *, PathCache *> caches;
+
+        bool parse_number(const std::string &text, size_t *pos, bool allowSign, int64_t max, int64_t *out)
+        {
+            bool negative = false;
+            if (allowSign && *pos < text.size() && text[*pos] == '-')
+            {
+                negative = true;
+                (*pos)++;
+            }
+
+            size_t start = *pos;
+            int64_t number = 0;
+            while (*pos < text.size() && text[*pos] >= '0' && text[*pos] <= '9')
+            {
+                number = number * 10 + (text[*pos] - '0');
+                if (number > max + negative) {return false;}
+                (*pos)++;
+            }
+
+            *out = negative ? -number : number;
+            return *pos > start;
+        }
+
+        Path empty_step()
+        {
+            Path step;
+            memset(&step, 0, sizeof(step));
+            step.selector = SELECT_INDEX;
+            return step;
+        }
+
+        void skip_spaces(const std::string &text, size_t *pos)
+        {
+            while (*pos < text.size() && text[*pos] == ' ') {(*pos)++;}
+        }
+
+        /// Parse field number of a path entry
+        bool parse_simple_step(const std::string &text, size_t *pos, Path &step, std::string &error)
+        {
+            int64_t number;
+            if (!parse_number(text, pos, false, PROTOBUF_MAX_FIELD_NUMBER, &number) || number == 0)
+            {
+                error = "Path not valid, expected field number between 1 and " + std::to_string(PROTOBUF_MAX_FIELD_NUMBER) + " at position " + std::to_string(*pos);
+                return false;
+            }
+            step.fieldNumber = (uint32_t)number;
+            return true;
+        }
+
+        /// Parse number literal of a filter, a decimal integer like "-12" or a decimal float like
+        /// "0.5" or "1e-3". Other syntax that strtod accepts, like hex, inf and nan, is an error,
+        /// and so are numbers out of range
+        bool parse_literal_number(const std::string &text, size_t *pos, Filter &filter, std::string &error)
+        {
+            size_t start = *pos;
+            size_t end = start;
+            bool integer = true;
+            if (end < text.size() && (text[end] == '-' || text[end] == '+')) {end++;}
+            size_t digits = end;
+            while (end < text.size() && isdigit((unsigned char)text[end])) {end++;}
+            if (end == digits)
+            {
+                error = "Path not valid, expected number or string at position " + std::to_string(start);
+                return false;
+            }
+            if (end < text.size() && text[end] == '.')
+            {
+                integer = false;
+                end++;
+                while (end < text.size() && isdigit((unsigned char)text[end])) {end++;}
+            }
+            if (end < text.size() && (text[end] == 'e' || text[end] == 'E'))
+            {
+                integer = false;
+                end++;
+                if (end < text.size() && (text[end] == '-' || text[end] == '+')) {end++;}
+                size_t exponent = end;
+                while (end < text.size() && isdigit((unsigned char)text[end])) {end++;}
+                if (end == exponent)
+                {
+                    error = "Path not valid, expected exponent at position " + std::to_string(end);
+                    return false;
+                }
+            }
+            if (end < text.size() && (isalnum((unsigned char)text[end]) || text[end] == '.' || text[end] == '_'))
+            {
+                error = "Path not valid, expected decimal number at position " + std::to_string(end);
+                return false;
+            }
+
+            // The syntax is checked, so strtoll and strtod read the whole literal
+            std::string literal = text.substr(start, end - start);
+            errno = 0;
+            if (integer)
+            {
+                filter.literalInt = strtoll(literal.c_str(), nullptr, 10);
+                filter.literalFloat = (double)filter.literalInt;
+            }
+            else
+            {
+                filter.literalInt = 0;
+                filter.literalFloat = strtod(literal.c_str(), nullptr);
+            }
+            if (errno == ERANGE && (integer || std::isinf(filter.literalFloat)))
+            {
+                error = "Path not valid, number out of range at position " + std::to_string(start);
+                return false;
+            }
+            filter.literalType = integer ? SQLITE_INTEGER : SQLITE_FLOAT;
+            *pos = end;
+            return true;
+        }
+
+        /// Parse predicate of a filter, "@.2 == 5" or ".2.1 != 'text'"
+        bool parse_filter(const std::string &text, size_t *pos, Filter &filter, std::string &error)
+        {
+            skip_spaces(text, pos);
+            if (*pos < text.size() && text[*pos] == '@') {(*pos)++;}
+
+            // Relative path to the compared field
+            while (*pos < text.size() && text[*pos] == '.')
+            {
+                Path step = empty_step();
+                int64_t number;
+                (*pos)++;
+                if (!parse_simple_step(text, pos, step, error)) {return false;}
+                if (*pos < text.size() && text[*pos] == '[')
+                {
+                    (*pos)++;
+                    if (!parse_number(text, pos, true, INT32_MAX, &number) || *pos >= text.size() || text[*pos] != ']')
+                    {
+                        error = "Path not valid, expected index followed by ']' at position " + std::to_string(*pos);
+                        return false;
+                    }
+                    step.fieldIndex = (int32_t)number;
+                    (*pos)++;
+                }
+                filter.steps.push_back(step);
+            }
+
+            // Comparison operator
+            skip_spaces(text, pos);
+            static const struct {const char *token; FilterOp op;} ops[] = {
+                {"==", FILTER_EQ}, {"!=", FILTER_NE}, {"<=", FILTER_LE}, {">=", FILTER_GE}, {"<", FILTER_LT}, {">", FILTER_GT},
+            };
+            size_t i;
+            for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+            {
+                if (text.compare(*pos, strlen(ops[i].token), ops[i].token) == 0)
+                {
+                    filter.op = ops[i].op;
+                    *pos += strlen(ops[i].token);
+                    break;
+                }
+            }
+            if (i == sizeof(ops) / sizeof(ops[0]))
+            {
+                error = "Path not valid, expected comparison operator at position " + std::to_string(*pos);
+                return false;
+            }
+
+            // Literal to compare with, either a quoted string or a number
+            skip_spaces(text, pos);
+            if (*pos < text.size() && (text[*pos] == '\'' || text[*pos] == '"'))
+            {
+                char quote = text[(*pos)++];
+                filter.literalType = SQLITE_TEXT;
+                while (*pos < text.size() && text[*pos] != quote)
+                {
+                    if (text[*pos] == '\\' && *pos + 1 < text.size()) {(*pos)++;}
+                    filter.literalText.push_back(text[(*pos)++]);
+                }
+                if (*pos >= text.size())
+                {
+                    error = "Path not valid, unterminated string at position " + std::to_string(*pos);
+                    return false;
+                }
+                (*pos)++;
+            }
+            else if (!parse_literal_number(text, pos, filter, error))
+            {
+                return false;
+            }
+            skip_spaces(text, pos);
+            return true;
+        }
+
+        /// Parse selector of a path entry, "[i]", "[*]", "[a:b]" or "[?(predicate)]"
+        bool parse_selector(const std::string &text, size_t *pos, Path &step, CompiledPath &path, std::string &error)
+        {
+            int64_t number;
+            (*pos)++;
+
+            if (text.compare(*pos, 2, "*]") == 0)
+            {
+                step.selector = SELECT_ALL;
+                *pos += 2;
+                return true;
+            }
+
+            if (text.compare(*pos, 2, "?(") == 0)
+            {
+                Filter filter;
+                *pos += 2;
+                if (!parse_filter(text, pos, filter, error)) {return false;}
+                if (text.compare(*pos, 2, ")]") != 0)
+                {
+                    error = "Path not valid, expected ')]' at position " + std::to_string(*pos);
+                    return false;
+                }
+                *pos += 2;
+                step.selector = SELECT_FILTER;
+                step.filter = (uint32_t)path.filters.size();
+                path.filters.push_back(filter);
+                return true;
+            }
+
+            step.hasSliceStart = parse_number(text, pos, true, INT32_MAX, &number);
+            step.fieldIndex = step.hasSliceStart ? (int32_t)number : 0;
+
+            if (*pos < text.size() && text[*pos] == ':')
+            {
+                (*pos)++;
+                step.selector = SELECT_SLICE;
+                step.hasSliceEnd = parse_number(text, pos, true, INT32_MAX, &number);
+                step.sliceEnd = step.hasSliceEnd ? (int32_t)number : 0;
+            }
+            else if (!step.hasSliceStart)
+            {
+                error = "Path not valid, expected index, '*', slice or filter at position " + std::to_string(*pos);
+                return false;
+            }
+
+            if (*pos >= text.size() || text[*pos] != ']')
+            {
+                error = "Path not valid, expected ']' at position " + std::to_string(*pos);
+                return false;
+            }
+            (*pos)++;
+            return true;
+        }
+    } // namespace
+
+    bool path_compile(const std::string &text, CompiledPath &path, std::string &error)
+    {
+        PROTOBUF_TRACE_SPAN("path_compile");
+        path.steps.clear();
+        path.filters.clear();
+        path.multi = false;
+
+        // Check that the path begins with $, representing the root of the tree
+        if (text.length() == 0 || text[0] != '$')
+        {
+            error = "Path not valid, path should start with $";
+            return false;
+        }
+
+        size_t pos = 1;
+        while (pos < text.size())
+        {
+            Path step = empty_step();
+
+            if (text[pos] != '.')
+            {
+                error = "Path not valid, expected '.' at position " + std::to_string(pos);
+                return false;
+            }
+            pos++;
+
+            // Recursive descent, field at any depth
+            if (pos < text.size() && text[pos] == '.')
+            {
+                step.descendant = true;
+                pos++;
+            }
+
+            if (!parse_simple_step(text, &pos, step, error)) {return false;}
+
+            if (pos < text.size() && text[pos] == '[')
+            {
+                if (!parse_selector(text, &pos, step, path, error)) {return false;}
+            }
+            else if (step.descendant)
+            {
+                // "..N" without selector matches every occurrence at any depth
+                step.selector = SELECT_ALL;
+            }
+
+            path.multi = path.multi || step.descendant || step.selector != SELECT_INDEX;
+            path.steps.push_back(step);
+        }
+
+        // Set fieldNumber to the reserved number 0 to indicate end of path
+        path.steps.push_back(empty_step());
+        return true;
+    }
+
+    PathCache* path_cache_acquire(sqlite3 *db)
+    {
+        std::lock_guard<std::mutex> lock(cachesMutex);
+        PathCache *&cache = caches[db];
+        if (cache == nullptr)
+        {
+            cache = new PathCache();
+            cache->refs = 0;
+            cache->db = db;
+        }
+        cache->refs++;
+        return cache;
+    }
+
+    void path_cache_release(void *p)
+    {
+        PathCache *cache = (PathCache *)p;
+        std::lock_guard<std::mutex> lock(cachesMutex);
+        if (--cache->refs > 0)
+        {
+            return;
+        }
+
+        caches.erase(cache->db);
+        for (CompiledPath *path : cache->lru)
+        {
+            path_release(path);
+        }
+        delete cache;
+    }
+
+    CompiledPath* path_lookup(PathCache *cache, const std::string &text, std::string &error)
+    {
+        // Cache hit -> move path to front of the list
+        PROTOBUF_STATS(StatsScope stats(STATS_PATH_CACHE, 0));
+        auto it = cache->paths.find(text);
+        if (it != cache->paths.end())
+        {
+            PROTOBUF_STATS(stats_add(STATS_PATH_CACHE, STATS_CACHE_HITS, 1));
+            cache->lru.splice(cache->lru.begin(), cache->lru, it->second);
+            CompiledPath *path = *it->second;
+            path->refs++;
+            return path;
+        }
+
+        // Cache miss -> compile path and add it to the cache
+        PROTOBUF_STATS(stats_add(STATS_PATH_CACHE, STATS_CACHE_MISSES, 1));
+        CompiledPath *path = new CompiledPath();
+        path->refs = 1;
+        path->text = text;
+        if (!path_compile(text, *path, error))
+        {
+            delete path;
+            return nullptr;
+        }
+
+        if (cache->lru.size() >= PROTOBUF_PATH_CACHE_SIZE)
+        {
+            // Evict least recently used path, it is deleted when no longer in use
+            PROTOBUF_STATS(stats_add(STATS_PATH_CACHE, STATS_CACHE_EVICTIONS, 1));
+            CompiledPath *evicted = cache->lru.back();
+            cache->paths.erase(evicted->text);
+            cache->lru.pop_back();
+            path_release(evicted);
+        }
+
+        cache->lru.push_front(path);
+        cache->paths[text] = cache->lru.begin();
+        path->refs++;
+        return path;
+    }
+
+    void path_release(void *p)
+    {
+        CompiledPath *path = (CompiledPath *)p;
+        if (--path->refs == 0)
+        {
+            delete path;
+        }
+    }
+
+    namespace
+    {
+        const WireType messageWireTypes[] = {WIRETYPE_LEN, WIRETYPE_SGROUP};
+        const WireType anyWireTypes[] = {WIRETYPE_LEN, WIRETYPE_SGROUP, WIRETYPE_VARINT, WIRETYPE_I64, WIRETYPE_I32};
+
+        struct Matcher
+        {
+            const CompiledPath *path;
+            const WireType *wireTypes;
+            size_t numWireTypes;
+            int packed;
+            size_t last; // Index of the last entry of the path
+            std::vector<Field> *matches;
+        };
+
+        bool is_message(const Field &field)
+        {
+            return field.wireType == WIRETYPE_SGROUP || (field.wireType == WIRETYPE_LEN && isMessage(field.value));
+        }
+
+        /// Check if the wire type of a field is accepted by the path entry at position k
+        bool accepts(const Matcher &m, const Field &field, size_t k)
+        {
+            if (k < m.last)
+            {
+                return field.wireType == WIRETYPE_LEN || field.wireType == WIRETYPE_SGROUP;
+            }
+            for (size_t i = 0; i < m.numWireTypes; i++)
+            {
+                if (field.wireType == (uint32_t)m.wireTypes[i]) {return true;}
+            }
+            return false;
+        }
+
+        /// Count the values of a packed repeated field, or -1 if the buffer is not a packed field
+        int64_t packed_count(const Buffer &value, WireType wireType)
+        {
+            Buffer b = value, v;
+            int64_t count = 0;
+            while (b.start < b.end)
+            {
+                if (!readPacked(&b, wireType, &v)) {return -1;}
+                count++;
+            }
+            return count;
+        }
+
+        /// Number of occurrences a field contributes to the path entry at position k
+        int64_t occurrences(const Matcher &m, const Field &field, size_t k)
+        {
+            if (accepts(m, field, k)) {return 1;}
+            if (k == m.last && m.packed >= 0 && field.wireType == WIRETYPE_LEN)
+            {
+                int64_t count = packed_count(field.value, (WireType)m.packed);
+                return count < 0 ? 0 : count;
+            }
+            return 0;
+        }
+
+        template <typename T>
+        int compare(T a, T b)
+        {
+            return a < b ? -1 : (b < a ? 1 : 0);
+        }
+
+        bool filter_matches(const Filter &filter, const Field &field)
+        {
+            // Follow the relative path from the field to the compared value
+            Field target = field;
+            for (size_t i = 0; i < filter.steps.size(); i++)
+            {
+                if (!is_message(target)) {return false;}
+                Buffer b = target.value;
+                bool last = i + 1 == filter.steps.size();
+                if (!findField(&b, filter.steps[i].fieldNumber, last ? anyWireTypes : messageWireTypes, last ? 5 : 2, filter.steps[i].fieldIndex, &target))
+                {
+                    return false;
+                }
+            }
+
+            int c;
+            double number;
+            switch (target.wireType)
+            {
+            case WIRETYPE_VARINT:
+            {
+                int64_t value;
+                if (!getInt64(&target.value, &value, 0)) {return false;}
+                if (filter.literalType == SQLITE_INTEGER) {c = compare(value, filter.literalInt); break;}
+                if (filter.literalType != SQLITE_FLOAT) {return false;}
+                c = compare((double)value, filter.literalFloat);
+                break;
+            }
+            case WIRETYPE_I64:
+            case WIRETYPE_I32:
+            {
+                if (target.wireType == WIRETYPE_I64)
+                {
+                    if (!getDouble(&target.value, &number, 0)) {return false;}
+                }
+                else
+                {
+                    float value;
+                    if (!getFloat(&target.value, &value, 0)) {return false;}
+                    number = value;
+                }
+                double literal = filter.literalType == SQLITE_INTEGER ? (double)filter.literalInt : filter.literalFloat;
+                if (filter.literalType == SQLITE_TEXT || number != number) {return false;}
+                c = compare(number, literal);
+                break;
+            }
+            case WIRETYPE_LEN:
+            {
+                if (filter.literalType != SQLITE_TEXT) {return false;}
+                std::string value((const char *)target.value.start, target.value.size());
+                c = value.compare(filter.literalText);
+                break;
+            }
+            default:
+                return false;
+            }
+
+            switch (filter.op)
+            {
+            case FILTER_EQ: return c == 0;
+            case FILTER_NE: return c != 0;
+            case FILTER_LT: return c < 0;
+            case FILTER_LE: return c <= 0;
+            case FILTER_GT: return c > 0;
+            case FILTER_GE: return c >= 0;
+            }
+            return false;
+        }
+
+        /// Resolve a possibly negative position against the number of occurrences, python style
+        int64_t resolve(int64_t position, int64_t total)
+        {
+            return position < 0 ? position + total : position;
+        }
+
+        bool selected(const Matcher &m, const Path &step, int64_t index, int64_t total, const Field &field)
+        {
+            switch (step.selector)
+            {
+            case SELECT_INDEX:
+                return index == resolve(step.fieldIndex, total);
+            case SELECT_ALL:
+                return true;
+            case SELECT_SLICE:
+                return (!step.hasSliceStart || index >= resolve(step.fieldIndex, total)) &&
+                       (!step.hasSliceEnd || index < resolve(step.sliceEnd, total));
+            case SELECT_FILTER:
+                return filter_matches(m.path->filters[step.filter], field);
+            }
+            return false;
+        }
+
+        /// Path entries whose selector depends on the total number of occurrences
+        bool needs_total(const Path &step)
+        {
+            return (step.selector == SELECT_INDEX && step.fieldIndex < 0) ||
+                   (step.selector == SELECT_SLICE && ((step.hasSliceStart && step.fieldIndex < 0) || (step.hasSliceEnd && step.sliceEnd < 0)));
+        }
+
+        /// Match the fields of a message against a set of active path entries, the message
+        /// is traversed once in message order and sub messages are only entered when needed
+        void match_message(const Matcher &m, const Buffer &message, uint32_t depth, const std::vector<size_t> &states)
+        {
+            std::vector<int64_t> counts(states.size(), 0);
+            std::vector<int64_t> totals(states.size(), 0);
+            std::vector<size_t> next;
+            Buffer b;
+            Field field{};
+
+            // Count occurrences up front only for entries selecting from the end
+            bool needTotals = false;
+            for (size_t j = 0; j < states.size(); j++)
+            {
+                needTotals = needTotals || needs_total(m.path->steps[states[j]]);
+            }
+            if (needTotals)
+            {
+                b = message;
+                while (b.start < b.end && readField(&b, &field))
+                {
+                    for (size_t j = 0; j < states.size(); j++)
+                    {
+                        if (field.fieldNum == m.path->steps[states[j]].fieldNumber)
+                        {
+                            totals[j] += occurrences(m, field, states[j]);
+                        }
+                    }
+                }
+            }
+
+            b = message;
+            while (b.start < b.end && readField(&b, &field))
+            {
+                field.depth = depth;
+                next.clear();
+                for (size_t j = 0; j < states.size(); j++)
+                {
+                    size_t k = states[j];
+                    const Path &step = m.path->steps[k];
+
+                    // Keep looking for the entry at deeper levels
+                    if (step.descendant) {next.push_back(k);}
+
+                    if (field.fieldNum != step.fieldNumber) {continue;}
+
+                    if (accepts(m, field, k))
+                    {
+                        if (!selected(m, step, counts[j]++, totals[j], field)) {continue;}
+                        if (k == m.last)
+                        {
+                            m.matches->push_back(field);
+                        }
+                        else
+                        {
+                            next.push_back(k + 1);
+                        }
+                    }
+                    else if (k == m.last && m.packed >= 0 && field.wireType == WIRETYPE_LEN && packed_count(field.value, (WireType)m.packed) >= 0)
+                    {
+                        // Values of packed repeated fields count as separate occurrences
+                        Buffer p = field.value;
+                        Field value{};
+                        value.tag = (field.fieldNum << 3) | (uint32_t)m.packed;
+                        value.wireType = (uint32_t)m.packed;
+                        value.fieldNum = field.fieldNum;
+                        value.depth = depth;
+                        while (p.start < p.end && readPacked(&p, (WireType)m.packed, &value.value))
+                        {
+                            if (selected(m, step, counts[j]++, totals[j], value))
+                            {
+                                m.matches->push_back(value);
+                            }
+                        }
+                    }
+                }
+
+                if (!next.empty() && is_message(field))
+                {
+                    std::sort(next.begin(), next.end());
+                    next.erase(std::unique(next.begin(), next.end()), next.end());
+                    match_message(m, field.value, depth + 1, next);
+                }
+            }
+        }
+    } // namespace
+
+    void path_match(const CompiledPath *path, const Buffer &message, const WireType *wireTypes, size_t numWireTypes, int packed, std::vector<Field> &matches)
+    {
+        PROTOBUF_TRACE_SPAN("path_match");
+
+        // Path "$" has no field entries and matches no field, column_extract returns the message
+        // itself for it. A buffer that is not a message has no fields either.
+        if (path->steps.size() < 2 || !isMessage(message)) {return;}
+
+        Matcher m = {path, wireTypes, numWireTypes, packed, path->steps.size() - 2, &matches};
+        std::vector<size_t> states(1, 0);
+        match_message(m, message, 1, states);
+    }
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "protodec.h"
+
+struct sqlite3;
+
+namespace sqlite_protobuf
+{
+
+    enum Selector
+    {
+        SELECT_INDEX,  // .N[i] single occurrence, negative indexes count from the end
+        SELECT_ALL,    // .N[*] all occurrences
+        SELECT_SLICE,  // .N[a:b] occurrences from a up to but not including b
+        SELECT_FILTER, // .N[?(.2 == 5)] occurrences matching a predicate
+    };
+
+    struct Path
+    {
+        uint32_t fieldNumber;
+        int32_t fieldIndex;
+        uint8_t selector;    // Selector for the occurrences of the field
+        bool descendant;     // Field at any depth (..N) rather than a direct sub field (.N)
+        bool hasSliceStart;
+        bool hasSliceEnd;
+        int32_t sliceEnd;    // Slice start is stored in fieldIndex
+        uint32_t filter;     // Index of the predicate in CompiledPath::filters
+    };
+
+    enum FilterOp
+    {
+        FILTER_EQ,
+        FILTER_NE,
+        FILTER_LT,
+        FILTER_LE,
+        FILTER_GT,
+        FILTER_GE,
+    };
+
+    struct Filter
+    {
+        std::vector<Path> steps; // Relative path to the compared field, empty for the field itself
+        FilterOp op;
+        int literalType;         // SQLITE_INTEGER, SQLITE_FLOAT or SQLITE_TEXT
+        int64_t literalInt;
+        double literalFloat;
+        std::string literalText;
+    };
+
+    /// Compiled path, shared between statements through the per connection path cache
+    struct CompiledPath
+    {
+        int refs;                    // Number of references, the path is deleted when it reaches 0
+        bool multi;                  // Path can select more than one field (wildcards, slices, filters or ..)
+        std::string text;            // Path string the path was compiled from
+        std::vector<Path> steps;     // Path entries, terminated by an entry with the reserved field number 0
+        std::vector<Filter> filters; // Predicates used by the path entries
+    };
+
+    struct PathCache;
+
+    /// Compile a path of the form "$.1.2[0].3", the syntax is checked strictly. Besides
+    /// indexes, path entries may select all occurrences "[*]", a slice "[a:b]" or the
+    /// occurrences matching a predicate "[?(@.2 == 5)]", and "..N" matches field N at any depth
+    ///
+    /// @param[out] error description of the syntax error if the path is invalid
+    /// @returns true if the path is valid
+    bool path_compile(const std::string &text, CompiledPath &path, std::string &error);
+
+    /// Get the path cache of a connection, the cache is shared by all functions and 
+    /// modules of the connection and must be released with path_cache_release
+    PathCache* path_cache_acquire(sqlite3 *db);
+    void path_cache_release(void *cache);
+
+    /// Look up a compiled path in the cache, the path is compiled and added to the 
+    /// cache if it is not found, evicting the least recently used path if the cache is full
+    ///
+    /// @param[out] error description of the syntax error if the path is invalid
+    /// @returns a reference to the compiled path that must be released with path_release, 
+    ///          or nullptr if the path is invalid
+    CompiledPath* path_lookup(PathCache *cache, const std::string &text, std::string &error);
+    void path_release(void *path);
+
+    /// Find all fields matching the path in a single traversal of the message. Fields
+    /// are matched in message order, and occurrences are counted per parent message.
+    ///
+    /// @param[in] wireTypes wire types accepted by the last entry of the path
+    /// @param[in] packed wire type of packed repeated values accepted by the last entry, or -1
+    /// @param[out] matches matching fields, packed values are returned as fields of the packed wire type
+    void path_match(const CompiledPath *path, const Buffer &message, const WireType *wireTypes, size_t numWireTypes, int packed, std::vector<Field> &matches);
+
+} // namespace sqlite_protobuf
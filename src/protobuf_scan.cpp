@@ -0,0 +1,631 @@
+#include "protobuf_scan.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <new>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "protodec.h"
+#include "protobuf_type.h"
+#include "protobuf_column.h"
+#include "thread_pool.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    /* Rows of the source table are read and decoded in pages of this many rows */
+    #define PROTOBUF_SCAN_PAGE_SIZE 1024
+
+    /* Number of pages read ahead of the cursor for each worker thread */
+    #define PROTOBUF_SCAN_PAGES_PER_THREAD 4
+
+    /* Columns used by a query are flagged in idxNum, the last flag covers the columns from there on */
+    #define PROTOBUF_SCAN_USED_FLAGS 31
+
+    /* Milliseconds the read connection waits for a lock on the database file */
+    #define PROTOBUF_SCAN_BUSY_TIMEOUT 5000
+
+    /*
+    ** Define virtual table data structure containg data needed for virtual table
+    */
+    typedef struct ProtobufScanVtab ProtobufScanVtab;
+    struct ProtobufScanVtab
+    {
+        sqlite3_vtab base;          // Base class - must be first
+        sqlite3 *db;                // Database connection
+        std::string schema;         // Schema of the source table, the schema of the table unless the source is qualified
+        std::string source;         // Source table
+        std::string column;         // Column of the source table holding the messages
+        std::vector<ColumnDefinition> columns;
+        ThreadPool *pool;           // Worker threads decoding the pages, started by the first scan
+    };
+
+    /*
+    ** Page of source rows, the messages are copied out of the read connection and the
+    ** values of row i are values[i * columns ... (i + 1) * columns - 1] once decoded
+    */
+    typedef struct ProtobufScanPage ProtobufScanPage;
+    struct ProtobufScanPage
+    {
+        std::vector<sqlite3_int64> rowids;
+        std::string data;           // Messages of the rows, back to back
+        std::vector<size_t> ends;   // End of the message of each row in data
+        std::vector<Value> values;
+        std::vector<std::string> texts; // JSON arrays for paths matching several fields
+        bool decoded;
+    };
+
+    /*
+    ** Define cursor data structure. A reader thread steps through the source table on a
+    ** read connection of its own and queues the pages, which the pool decodes while the
+    ** cursor returns the rows of the pages in front of the queue
+    */
+    typedef struct ProtobufScanCursor ProtobufScanCursor;
+    struct ProtobufScanCursor
+    {
+        sqlite3_vtab_cursor base;   // Base class - must be first
+        sqlite3 *reader;            // Read only connection to the database file of the source table
+        std::thread thread;         // Reader thread
+        std::mutex mutex;           // Protects the fields below, up to page
+        std::condition_variable changed; // Signals pages that are read, decoded or consumed
+        std::deque<ProtobufScanPage*> pages; // Pages in rowid order
+        bool reading;               // Reader thread has more pages to queue
+        bool stop;                  // Reader thread should stop
+        int rc;                     // Error of the reader thread
+        std::string error;
+        ProtobufScanPage *page;     // Current page
+        size_t iRow;                // Current row in the page
+        sqlite3_int64 minRowid;     // Smallest rowid to return
+        sqlite3_int64 maxRowid;     // Largest rowid to return
+        std::vector<bool> used;     // Columns used by the query, the others are not decoded
+        bool eof;
+    };
+
+    /*
+    ** Constructor for ProtobufScanVtab objects, the arguments are the source table, the
+    ** column holding the messages and one column definition for each column of the table.
+    */
+    static int protobufScanConnect(sqlite3 *db, void *pAux, int argc, const char *const*argv, sqlite3_vtab **ppVtab, char **pzErr)
+    {
+        if (argc < 6)
+        {
+            *pzErr = sqlite3_mprintf("protobuf_scan requires a source table, a column and at least one column definition");
+            return SQLITE_ERROR;
+        }
+
+        ProtobufScanVtab *pNew = new (std::nothrow) ProtobufScanVtab();
+        if (pNew == nullptr) {return SQLITE_NOMEM;}
+        pNew->db = db;
+        pNew->schema = argv[1];
+        pNew->source = sql_dequote(argv[3]);
+
+        // The source table may be qualified with its schema, such as main.messages for a table in temp
+        std::string source = argv[3];
+        size_t dot = source.find('.');
+        if (dot != std::string::npos && source[0] != '"' && source[0] != '[' && source[0] != '`' && source[0] != '\'')
+        {
+            pNew->schema = source.substr(0, dot);
+            pNew->source = sql_dequote(source.substr(dot + 1));
+        }
+        pNew->column = sql_dequote(argv[4]);
+        pNew->pool = nullptr;
+
+        std::string error;
+        char *zSchema = sqlite3_mprintf("CREATE TABLE x(");
+        for (int i = 5; i < argc && error.empty(); i++)
+        {
+            ColumnDefinition column;
+            if (!column_parse(argv[i], column, error)) {break;}
+            pNew->columns.push_back(column);
+            zSchema = sqlite3_mprintf("%z%s\"%w\"", zSchema, i > 5 ? "," : "", column.name.c_str());
+        }
+        zSchema = sqlite3_mprintf("%z)", zSchema);
+
+        int rc = SQLITE_OK;
+        if (!error.empty())
+        {
+            *pzErr = sqlite3_mprintf("%s", error.c_str());
+            rc = SQLITE_ERROR;
+        }
+        else if (zSchema == nullptr)
+        {
+            rc = SQLITE_NOMEM;
+        }
+        else
+        {
+            rc = sqlite3_declare_vtab(db, zSchema);
+        }
+        sqlite3_free(zSchema);
+
+        if (rc != SQLITE_OK)
+        {
+            delete pNew;
+            return rc;
+        }
+        *ppVtab = &pNew->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for ProtobufScanVtab objects, the worker threads are stopped.
+    */
+    static int protobufScanDisconnect(sqlite3_vtab *pVtab)
+    {
+        ProtobufScanVtab *p = (ProtobufScanVtab*)pVtab;
+        delete p->pool;
+        sqlite3_free(p->base.zErrMsg);
+        delete p;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Decode the values of the used columns for the rows of a page, this runs on a worker thread
+    ** and only uses the page, the columns and the used flags, which are not modified while scanning
+    */
+    static void protobufScanDecode(const std::vector<ColumnDefinition> &columns, const std::vector<bool> &used, ProtobufScanPage *page)
+    {
+        size_t numMulti = 0;
+        bool decode = false; // Single field paths are looked up in the decoded message
+        for (size_t c = 0; c < columns.size(); c++)
+        {
+            numMulti += columns[c].path.multi ? 1 : 0;
+            decode = decode || (used[c] && !columns[c].path.multi);
+        }
+        page->values.resize(page->rowids.size() * columns.size());
+        page->texts.reserve(page->rowids.size() * numMulti); // Values point into the texts, so they must not be reallocated
+
+        std::vector<Field> matches;
+        std::string unused; // Paths matching one field do not write JSON
+        for (size_t i = 0; i < page->rowids.size(); i++)
+        {
+            Buffer message;
+            message.start = (const uint8_t *)page->data.data() + (i > 0 ? page->ends[i - 1] : 0);
+            message.end = (const uint8_t *)page->data.data() + page->ends[i];
+            Field root = decode ? decodeProtobuf(message, false) : Field();
+            for (size_t c = 0; c < columns.size(); c++)
+            {
+                if (!used[c]) {page->values[i * columns.size() + c].type = SQLITE_NULL; continue;}
+                if (columns[c].path.multi) {page->texts.push_back(std::string());}
+                std::string &json = columns[c].path.multi ? page->texts.back() : unused;
+                column_extract(columns[c], message, &root, matches, &page->values[i * columns.size() + c], json);
+            }
+        }
+    }
+
+    /*
+    ** Queue a page for the cursor and decode it on the pool, waiting while the cursor is
+    ** enough pages behind. Returns false if the cursor asked the reader to stop.
+    */
+    static bool protobufScanQueue(ProtobufScanCursor *pCur, ProtobufScanVtab *p, ProtobufScanPage *page)
+    {
+        size_t maxPages = p->pool->size() * PROTOBUF_SCAN_PAGES_PER_THREAD;
+        {
+            std::unique_lock<std::mutex> lock(pCur->mutex);
+            while (!pCur->stop && pCur->pages.size() >= maxPages) {condition_wait(pCur->changed, lock);}
+            if (pCur->stop) {return false;}
+            pCur->pages.push_back(page);
+        }
+        p->pool->submit([pCur, p, page]()
+        {
+            protobufScanDecode(p->columns, pCur->used, page);
+            std::lock_guard<std::mutex> lock(pCur->mutex);
+            page->decoded = true;
+            pCur->changed.notify_all();
+        });
+        return true;
+    }
+
+    /*
+    ** Body of the reader thread, the source rows in the rowid range are read in one statement,
+    ** which keeps a consistent snapshot of the database file for the whole scan
+    */
+    static void protobufScanRead(ProtobufScanCursor *pCur, ProtobufScanVtab *p)
+    {
+        sqlite3_stmt *pStmt = nullptr;
+        char *zSql = sqlite3_mprintf("SELECT rowid, \"%w\".\"%w\" FROM \"%w\" WHERE rowid BETWEEN ? AND ? ORDER BY rowid",
+                                     p->source.c_str(), p->column.c_str(), p->source.c_str());
+        int rc = zSql == nullptr ? SQLITE_NOMEM : sqlite3_prepare_v2(pCur->reader, zSql, -1, &pStmt, 0);
+        sqlite3_free(zSql);
+        if (rc == SQLITE_OK)
+        {
+            sqlite3_bind_int64(pStmt, 1, pCur->minRowid);
+            sqlite3_bind_int64(pStmt, 2, pCur->maxRowid);
+        }
+
+        ProtobufScanPage *page = nullptr;
+        while (rc == SQLITE_OK)
+        {
+            int step = sqlite3_step(pStmt);
+            if (step == SQLITE_ROW)
+            {
+                if (page == nullptr)
+                {
+                    page = new ProtobufScanPage();
+                    page->decoded = false;
+                }
+                page->rowids.push_back(sqlite3_column_int64(pStmt, 0));
+                const char *message = (const char *)sqlite3_column_blob(pStmt, 1);
+                page->data.append(message != nullptr ? message : "", (size_t)sqlite3_column_bytes(pStmt, 1));
+                page->ends.push_back(page->data.size());
+                if (page->rowids.size() < PROTOBUF_SCAN_PAGE_SIZE) {continue;}
+            }
+            else if (step != SQLITE_DONE)
+            {
+                rc = step;
+                break;
+            }
+
+            if (page != nullptr && !protobufScanQueue(pCur, p, page))
+            {
+                delete page;
+                page = nullptr;
+                break;
+            }
+            page = nullptr;
+            if (step == SQLITE_DONE) {break;}
+        }
+        delete page;
+
+        std::string error = rc != SQLITE_OK ? sqlite3_errmsg(pCur->reader) : "";
+        sqlite3_finalize(pStmt);
+
+        std::lock_guard<std::mutex> lock(pCur->mutex);
+        pCur->reading = false;
+        pCur->rc = rc;
+        pCur->error = error;
+        pCur->changed.notify_all();
+    }
+
+    /*
+    ** Stop the reader thread and wait for the queued pages to be decoded, as the pool still
+    ** refers to them, before the pages are freed
+    */
+    static void protobufScanStop(ProtobufScanCursor *pCur)
+    {
+        {
+            std::lock_guard<std::mutex> lock(pCur->mutex);
+            pCur->stop = true;
+        }
+        pCur->changed.notify_all();
+        if (pCur->thread.joinable()) {pCur->thread.join();}
+
+        std::unique_lock<std::mutex> lock(pCur->mutex);
+        while (!pCur->pages.empty())
+        {
+            ProtobufScanPage *page = pCur->pages.front();
+            if (!page->decoded)
+            {
+                condition_wait(pCur->changed, lock);
+                continue;
+            }
+            pCur->pages.pop_front();
+            delete page;
+        }
+        delete pCur->page;
+        pCur->page = nullptr;
+    }
+
+    /*
+    ** Constructor for a new ProtobufScanCursor object.
+    */
+    static int protobufScanOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+    {
+        ProtobufScanCursor *pCur = new (std::nothrow) ProtobufScanCursor();
+        if (pCur == nullptr) {return SQLITE_NOMEM;}
+        pCur->reader = nullptr;
+        pCur->reading = false;
+        pCur->stop = false;
+        pCur->rc = SQLITE_OK;
+        pCur->page = nullptr;
+        pCur->iRow = 0;
+        pCur->eof = true;
+        *ppCursor = &pCur->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for a ProtobufScanCursor.
+    */
+    static int protobufScanClose(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufScanCursor *pCur = (ProtobufScanCursor*)cur;
+        protobufScanStop(pCur);
+        sqlite3_close(pCur->reader);
+        delete pCur;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Move to the next decoded page, waiting for the pool if it is not decoded yet
+    */
+    static int protobufScanNextPage(ProtobufScanCursor *pCur)
+    {
+        delete pCur->page;
+        pCur->page = nullptr;
+        pCur->iRow = 0;
+
+        std::unique_lock<std::mutex> lock(pCur->mutex);
+        for (;;)
+        {
+            if (!pCur->pages.empty() && pCur->pages.front()->decoded)
+            {
+                pCur->page = pCur->pages.front();
+                pCur->pages.pop_front();
+                pCur->changed.notify_all();
+                return SQLITE_OK;
+            }
+            if (pCur->pages.empty() && !pCur->reading)
+            {
+                pCur->eof = true;
+                if (pCur->rc != SQLITE_OK)
+                {
+                    ProtobufScanVtab *p = (ProtobufScanVtab*)pCur->base.pVtab;
+                    sqlite3_free(p->base.zErrMsg);
+                    p->base.zErrMsg = sqlite3_mprintf("protobuf_scan: %s", pCur->error.c_str());
+                }
+                return pCur->rc;
+            }
+            condition_wait(pCur->changed, lock);
+        }
+    }
+
+    /*
+    ** Advance a ProtobufScanCursor to its next row of output.
+    */
+    static int protobufScanNext(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufScanCursor *pCur = (ProtobufScanCursor*)cur;
+        pCur->iRow++;
+        if (pCur->iRow < pCur->page->rowids.size()) {return SQLITE_OK;}
+        return protobufScanNextPage(pCur);
+    }
+
+    /*
+    ** Return value at given column and row (ProtobufScanCursor), the values are already decoded.
+    */
+    static int protobufScanColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+    {
+        ProtobufScanCursor *pCur = (ProtobufScanCursor *)cur;
+        ProtobufScanVtab *p = (ProtobufScanVtab*)cur->pVtab;
+        if (col < 0 || (size_t)col >= p->columns.size()) {return SQLITE_OK;}
+
+        result_from_value(ctx, pCur->page->values[pCur->iRow * p->columns.size() + col], SQLITE_TRANSIENT);
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return the rowid for the current row, which is the rowid of the source row.
+    */
+    static int protobufScanRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+    {
+        ProtobufScanCursor *pCur = (ProtobufScanCursor*)cur;
+        *pRowid = pCur->page->rowids[pCur->iRow];
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return TRUE if the cursor has been moved off of the last row of output.
+    */
+    static int protobufScanEof(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufScanCursor *pCur = (ProtobufScanCursor*)cur;
+        return pCur->eof;
+    }
+
+    /*
+    ** Narrow the rowid range with a constraint on the rowid, only numeric values are used
+    */
+    static void protobufScanLimitRowid(ProtobufScanCursor *pCur, char op, sqlite3_value *value)
+    {
+        int type = sqlite3_value_type(value);
+        if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) {return;}
+
+        double x = sqlite3_value_double(value);
+        sqlite3_int64 i = sqlite3_value_int64(value);
+        bool integral = type == SQLITE_INTEGER;
+        if (!integral && fabs(x) >= 9e18) {return;}
+        sqlite3_int64 lower = integral ? i : (sqlite3_int64)ceil(x);
+        sqlite3_int64 upper = integral ? i : (sqlite3_int64)floor(x);
+
+        switch (op)
+        {
+        case 'e':
+            if (pCur->minRowid < lower) {pCur->minRowid = lower;}
+            if (pCur->maxRowid > upper) {pCur->maxRowid = upper;}
+            break;
+        case 'g':
+            if (upper == INT64_MAX) {pCur->eof = true; break;}
+            if (pCur->minRowid < upper + 1) {pCur->minRowid = upper + 1;}
+            break;
+        case 'G':
+            if (pCur->minRowid < lower) {pCur->minRowid = lower;}
+            break;
+        case 'l':
+            if (lower == INT64_MIN) {pCur->eof = true; break;}
+            if (pCur->maxRowid > lower - 1) {pCur->maxRowid = lower - 1;}
+            break;
+        case 'L':
+            if (pCur->maxRowid > upper) {pCur->maxRowid = upper;}
+            break;
+        default:
+            break;
+        }
+    }
+
+    /*
+    ** This method is called to "rewind" the ProtobufScanCursor object back
+    ** to the first row of output. A previous scan is stopped, and the reader
+    ** thread is started on the rowid range.
+    */
+    static int protobufScanFilter(sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv)
+    {
+        ProtobufScanCursor *pCur = (ProtobufScanCursor *)cur;
+        ProtobufScanVtab *p = (ProtobufScanVtab*)cur->pVtab;
+        protobufScanStop(pCur);
+        pCur->minRowid = INT64_MIN;
+        pCur->maxRowid = INT64_MAX;
+        pCur->eof = false;
+
+        for (int i = 0; idxStr != nullptr && idxStr[i] != 0 && i < argc; i++)
+        {
+            protobufScanLimitRowid(pCur, idxStr[i], argv[i]);
+        }
+        if (pCur->eof || pCur->minRowid > pCur->maxRowid)
+        {
+            pCur->eof = true;
+            return SQLITE_OK;
+        }
+        pCur->used.resize(p->columns.size());
+        for (size_t c = 0; c < p->columns.size(); c++)
+        {
+            int flag = c < PROTOBUF_SCAN_USED_FLAGS - 1 ? (int)c : PROTOBUF_SCAN_USED_FLAGS - 1;
+            pCur->used[c] = (idxNum & (1 << flag)) != 0;
+        }
+
+        if (sqlite3_threadsafe() == 0)
+        {
+            sqlite3_free(p->base.zErrMsg);
+            p->base.zErrMsg = sqlite3_mprintf("protobuf_scan requires SQLite to be compiled with thread support");
+            return SQLITE_ERROR;
+        }
+        if (!sqlite3_get_autocommit(p->db))
+        {
+            // The read connection only sees committed rows, not the changes of the open transaction
+            sqlite3_free(p->base.zErrMsg);
+            p->base.zErrMsg = sqlite3_mprintf("protobuf_scan can not be used inside a transaction, since the rows are read on another connection");
+            return SQLITE_ERROR;
+        }
+        if (pCur->reader == nullptr)
+        {
+            const char *zFile = sqlite3_db_filename(p->db, p->schema.c_str());
+            if (zFile == nullptr || zFile[0] == 0)
+            {
+                sqlite3_free(p->base.zErrMsg);
+                p->base.zErrMsg = sqlite3_mprintf("protobuf_scan requires the source table \"%s\" to be in a database file", p->source.c_str());
+                return SQLITE_ERROR;
+            }
+            int rc = sqlite3_open_v2(zFile, &pCur->reader, SQLITE_OPEN_READONLY, nullptr);
+            if (rc != SQLITE_OK)
+            {
+                sqlite3_free(p->base.zErrMsg);
+                p->base.zErrMsg = sqlite3_mprintf("protobuf_scan: %s", sqlite3_errmsg(pCur->reader));
+                sqlite3_close(pCur->reader);
+                pCur->reader = nullptr;
+                return rc;
+            }
+            sqlite3_busy_timeout(pCur->reader, PROTOBUF_SCAN_BUSY_TIMEOUT);
+        }
+        if (p->pool == nullptr)
+        {
+            p->pool = new (std::nothrow) ThreadPool();
+            if (p->pool == nullptr) {return SQLITE_NOMEM;}
+        }
+
+        pCur->reading = true;
+        pCur->stop = false;
+        pCur->rc = SQLITE_OK;
+        pCur->error.clear();
+        pCur->thread = std::thread(protobufScanRead, pCur, p);
+        return protobufScanNextPage(pCur);
+    }
+
+    /*
+    ** SQLite will invoke this method one or more times while planning a query
+    ** that uses the virtual table. Constraints on the rowid limit the rows that
+    ** are read, they are listed in idxStr and still checked by SQLite. Only the
+    ** columns flagged in idxNum are decoded.
+    */
+    static int protobufScanBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo)
+    {
+        std::string idxStr;
+        double nRows = 1000000.0;
+        const struct sqlite3_index_info::sqlite3_index_constraint *pConstraint = pIdxInfo->aConstraint;
+        for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++)
+        {
+            if (pConstraint->usable == 0 || pConstraint->iColumn >= 0) {continue;}
+
+            char c = 0;
+            switch (pConstraint->op)
+            {
+            case SQLITE_INDEX_CONSTRAINT_EQ: c = 'e'; nRows = 1; break;
+            case SQLITE_INDEX_CONSTRAINT_GT: c = 'g'; nRows *= 0.25; break;
+            case SQLITE_INDEX_CONSTRAINT_GE: c = 'G'; nRows *= 0.25; break;
+            case SQLITE_INDEX_CONSTRAINT_LT: c = 'l'; nRows *= 0.25; break;
+            case SQLITE_INDEX_CONSTRAINT_LE: c = 'L'; nRows *= 0.25; break;
+            default: break;
+            }
+            if (c == 0) {continue;}
+            idxStr += c;
+            pIdxInfo->aConstraintUsage[i].argvIndex = (int)idxStr.size();
+        }
+        if (!idxStr.empty())
+        {
+            pIdxInfo->idxStr = sqlite3_mprintf("%s", idxStr.c_str());
+            pIdxInfo->needToFreeIdxStr = 1;
+            if (pIdxInfo->idxStr == nullptr) {return SQLITE_NOMEM;}
+        }
+
+        // Rows are returned in rowid order
+        if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn < 0 && pIdxInfo->aOrderBy[0].desc == 0)
+        {
+            pIdxInfo->orderByConsumed = 1;
+        }
+        // Flag the columns used by the query, before SQLite 3.10.0 all columns are decoded
+        sqlite3_uint64 colUsed = sqlite3_libversion_number() >= 3010000 ? pIdxInfo->colUsed : ~(sqlite3_uint64)0;
+        pIdxInfo->idxNum = 0;
+        for (int c = 0; c < 64; c++)
+        {
+            if ((colUsed & ((sqlite3_uint64)1 << c)) == 0) {continue;}
+            int flag = c < PROTOBUF_SCAN_USED_FLAGS - 1 ? c : PROTOBUF_SCAN_USED_FLAGS - 1;
+            pIdxInfo->idxNum |= 1 << flag;
+        }
+
+        pIdxInfo->estimatedCost = nRows;
+        pIdxInfo->estimatedRows = (sqlite3_int64)nRows + 1;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Define all the methods for the module (virtual table).
+    */
+    static sqlite3_module protobufScanModule = {
+        /* iVersion    */ 0,
+        /* xCreate     */ protobufScanConnect,
+        /* xConnect    */ protobufScanConnect,
+        /* xBestIndex  */ protobufScanBestIndex,
+        /* xDisconnect */ protobufScanDisconnect,
+        /* xDestroy    */ protobufScanDisconnect,
+        /* xOpen       */ protobufScanOpen,
+        /* xClose      */ protobufScanClose,
+        /* xFilter     */ protobufScanFilter,
+        /* xNext       */ protobufScanNext,
+        /* xEof        */ protobufScanEof,
+        /* xColumn     */ protobufScanColumn,
+        /* xRowid      */ protobufScanRowid,
+        /* xUpdate     */ 0,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ 0,
+        /* xSavepoint  */ 0, // iVersion >= 2
+        /* xRelease    */ 0, // iVersion >= 2
+        /* xRollbackTo */ 0, // iVersion >= 2
+        /* xShadowName */ 0, // iVersion >= 3
+        /* xIntegrity  */ //0, // iVersion >= 4
+    };
+
+    int register_protobuf_scan(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        return sqlite3_create_module(db, "protobuf_scan", &protobufScanModule, 0);
+    }
+
+} // namespace sqlite_protobuf
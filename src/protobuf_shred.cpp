@@ -0,0 +1,873 @@
+#include "protobuf_shred.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <vector>
+#include <new>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstring>
+
+#include "protodec.h"
+#include "protobuf_path.h"
+#include "protobuf_type.h"
+#include "protobuf_column.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    /* Rows of the source table are shredded in chunks of 2^SHIFT consecutive rowids */
+    #define PROTOBUF_SHRED_CHUNK_SHIFT 10
+    #define PROTOBUF_SHRED_CHUNK_SIZE  ((sqlite3_int64)1 << PROTOBUF_SHRED_CHUNK_SHIFT)
+
+    /* Levels of a value in a column chunk, stored in one byte together with the wire type */
+    #define PROTOBUF_SHRED_REPEATED 1 // Repetition level, the value belongs to the same row as the previous value
+    #define PROTOBUF_SHRED_DEFINED  2 // Definition level, the row has a value (otherwise the path matched nothing)
+
+    /*
+    ** Define virtual table data structure containg data needed for virtual table
+    */
+    typedef struct ProtobufShredVtab ProtobufShredVtab;
+    struct ProtobufShredVtab
+    {
+        sqlite3_vtab base;          // Base class - must be first
+        sqlite3 *db;                // Database connection
+        std::string schema;         // Schema of the table, the source table and the shadow tables
+        std::string name;           // Name of the table, prefix of the shadow tables
+        std::string source;         // Source table
+        std::string column;         // Column of the source table holding the messages
+        std::vector<ColumnDefinition> columns;
+    };
+
+    /*
+    ** Column chunk, the values of one column for a chunk of source rows. Each value is
+    ** stored as a level byte (repetition and definition level, and wire type << 2) followed
+    ** by the length and bytes of the value when it is defined. Rows without a value are
+    ** stored as a single undefined level byte, so that all columns have an entry for every row
+    */
+    typedef struct ProtobufShredChunk ProtobufShredChunk;
+    struct ProtobufShredChunk
+    {
+        sqlite3_int64 id;           // Chunk number, rowid >> PROTOBUF_SHRED_CHUNK_SHIFT
+        std::string rowids;         // Offset of each rowid from the first rowid of the chunk, as varints
+        std::vector<std::string> columns; // Column chunks
+        size_t count;               // Number of rows
+    };
+
+    /*
+    ** Column being scanned, the column chunk is only loaded when the column is used
+    */
+    typedef struct ProtobufShredScan ProtobufShredScan;
+    struct ProtobufShredScan
+    {
+        bool loaded;                // Column chunk is loaded
+        std::string data;           // Column chunk
+        size_t row;                 // Row at the start of remaining
+        Buffer remaining;           // Unread part of the column chunk
+    };
+
+    /*
+    ** Define cursor data structure, used to scan the rows one chunk at a time
+    */
+    typedef struct ProtobufShredCursor ProtobufShredCursor;
+    struct ProtobufShredCursor
+    {
+        sqlite3_vtab_cursor base;   // Base class - must be first
+        std::vector<sqlite3_int64> chunks; // Chunks to scan
+        std::vector<bool> dirty;    // Chunk has changed since it was shredded
+        size_t iChunk;              // Current chunk
+        sqlite3_int64 minRowid;     // Smallest rowid to return
+        sqlite3_int64 maxRowid;     // Largest rowid to return
+        std::vector<sqlite3_int64> rowids; // Rowids of the current chunk
+        size_t iRow;                // Current row in the chunk
+        std::vector<ProtobufShredScan> scans; // Columns of the current chunk
+        sqlite3_stmt *pLoad;        // Statement loading a column chunk
+        bool eof;
+    };
+
+    static void protobufShredPutVarint(std::string &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out += (char)((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        out += (char)value;
+    }
+
+    static bool protobufShredGetVarint(Buffer *in, uint64_t *value)
+    {
+        *value = 0;
+        for (int shift = 0; in->start < in->end && shift < 64; shift += 7)
+        {
+            uint8_t byte = *in->start++;
+            *value |= (uint64_t)(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {return true;}
+        }
+        return false;
+    }
+
+    /*
+    ** Return the end of the values of the row starting at the beginning of the buffer
+    */
+    static const uint8_t* protobufShredRowEnd(Buffer row)
+    {
+        bool first = true;
+        while (row.start < row.end)
+        {
+            uint8_t levels = *row.start;
+            if (!first && (levels & PROTOBUF_SHRED_REPEATED) == 0) {break;}
+            first = false;
+            row.start++;
+
+            uint64_t length = 0;
+            if ((levels & PROTOBUF_SHRED_DEFINED) == 0) {continue;}
+            if (!protobufShredGetVarint(&row, &length) || length > row.size()) {return row.end;}
+            row.start += length;
+        }
+        return row.start;
+    }
+
+    /*
+    ** Run an SQL statement formatted with sqlite3_mprintf
+    */
+    static int protobufShredExec(sqlite3 *db, char **pzErr, const char *zFormat, ...)
+    {
+        va_list ap;
+        va_start(ap, zFormat);
+        char *zSql = sqlite3_vmprintf(zFormat, ap);
+        va_end(ap);
+        if (zSql == nullptr) {return SQLITE_NOMEM;}
+
+        int rc = sqlite3_exec(db, zSql, 0, 0, pzErr);
+        sqlite3_free(zSql);
+        return rc;
+    }
+
+    /*
+    ** Prepare an SQL statement formatted with sqlite3_mprintf
+    */
+    static int protobufShredPrepare(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zFormat, ...)
+    {
+        va_list ap;
+        va_start(ap, zFormat);
+        char *zSql = sqlite3_vmprintf(zFormat, ap);
+        va_end(ap);
+        if (zSql == nullptr) {return SQLITE_NOMEM;}
+
+        int rc = sqlite3_prepare_v2(db, zSql, -1, ppStmt, 0);
+        sqlite3_free(zSql);
+        return rc;
+    }
+
+    /*
+    ** Constructor for ProtobufShredVtab objects, the arguments are the source table, the
+    ** column holding the messages and one column definition for each column of the table.
+    */
+    static int protobufShredConnect(sqlite3 *db, void *pAux, int argc, const char *const*argv, sqlite3_vtab **ppVtab, char **pzErr)
+    {
+        if (argc < 6)
+        {
+            *pzErr = sqlite3_mprintf("protobuf_shred requires a source table, a column and at least one column definition");
+            return SQLITE_ERROR;
+        }
+
+        ProtobufShredVtab *pNew = new (std::nothrow) ProtobufShredVtab();
+        if (pNew == nullptr) {return SQLITE_NOMEM;}
+        pNew->db = db;
+        pNew->schema = argv[1];
+        pNew->name = argv[2];
+        pNew->source = sql_dequote(argv[3]);
+        pNew->column = sql_dequote(argv[4]);
+
+        // The table has one column for each column definition, and a hidden column with the name of the table for commands
+        std::string error;
+        char *zSchema = sqlite3_mprintf("CREATE TABLE x(");
+        for (int i = 5; i < argc && error.empty(); i++)
+        {
+            ColumnDefinition column;
+            if (!column_parse(argv[i], column, error)) {break;}
+            if (sqlite3_stricmp(column.name.c_str(), argv[2]) == 0) {error = "Column name must differ from the table name: " + column.name; break;}
+            pNew->columns.push_back(column);
+            zSchema = sqlite3_mprintf("%z\"%w\",", zSchema, column.name.c_str());
+        }
+        zSchema = sqlite3_mprintf("%z\"%w\" HIDDEN)", zSchema, argv[2]);
+
+        int rc = SQLITE_OK;
+        if (!error.empty())
+        {
+            *pzErr = sqlite3_mprintf("%s", error.c_str());
+            rc = SQLITE_ERROR;
+        }
+        else if (zSchema == nullptr)
+        {
+            rc = SQLITE_NOMEM;
+        }
+        else
+        {
+            rc = sqlite3_declare_vtab(db, zSchema);
+        }
+        sqlite3_free(zSchema);
+
+        if (rc != SQLITE_OK)
+        {
+            delete pNew;
+            return rc;
+        }
+        *ppVtab = &pNew->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for ProtobufShredVtab objects.
+    */
+    static int protobufShredDisconnect(sqlite3_vtab *pVtab)
+    {
+        ProtobufShredVtab *p = (ProtobufShredVtab*)pVtab;
+        sqlite3_free(p->base.zErrMsg);
+        delete p;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Create the triggers that mark the chunks of changed source rows as dirty. They write the
+    ** dirty table directly rather than through the table, which is not innocuous, so that the
+    ** source table can still be written with trusted_schema=OFF
+    */
+    static int protobufShredCreateTriggers(ProtobufShredVtab *p, const char *zName, char **pzErr)
+    {
+        const char *zSchema = p->schema.c_str();
+        const char *zSource = p->source.c_str();
+        int rc = protobufShredExec(p->db, pzErr,
+            "CREATE TRIGGER \"%w\".\"%w_insert\" AFTER INSERT ON \"%w\" BEGIN "
+            "INSERT OR IGNORE INTO \"%w_dirty\"(chunk) VALUES (new.rowid >> %d); END;"
+            "CREATE TRIGGER \"%w\".\"%w_update\" AFTER UPDATE ON \"%w\" BEGIN "
+            "INSERT OR IGNORE INTO \"%w_dirty\"(chunk) VALUES (old.rowid >> %d), (new.rowid >> %d); END;"
+            "CREATE TRIGGER \"%w\".\"%w_delete\" AFTER DELETE ON \"%w\" BEGIN "
+            "INSERT OR IGNORE INTO \"%w_dirty\"(chunk) VALUES (old.rowid >> %d); END;",
+            zSchema, zName, zSource, zName, PROTOBUF_SHRED_CHUNK_SHIFT,
+            zSchema, zName, zSource, zName, PROTOBUF_SHRED_CHUNK_SHIFT, PROTOBUF_SHRED_CHUNK_SHIFT,
+            zSchema, zName, zSource, zName, PROTOBUF_SHRED_CHUNK_SHIFT);
+        return rc;
+    }
+
+    static int protobufShredDropTriggers(ProtobufShredVtab *p, const char *zName, char **pzErr)
+    {
+        const char *zSchema = p->schema.c_str();
+        return protobufShredExec(p->db, pzErr,
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_insert\";"
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_update\";"
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_delete\";",
+            zSchema, zName, zSchema, zName, zSchema, zName);
+    }
+
+    /*
+    ** Shred a message into the column chunks of a chunk
+    */
+    static void protobufShredRow(ProtobufShredVtab *p, ProtobufShredChunk &chunk, sqlite3_int64 rowid, const Buffer &message, std::vector<Field> &matches)
+    {
+        protobufShredPutVarint(chunk.rowids, (uint64_t)(rowid - chunk.id * PROTOBUF_SHRED_CHUNK_SIZE));
+        chunk.count++;
+
+        for (size_t c = 0; c < p->columns.size(); c++)
+        {
+            const ColumnDefinition &column = p->columns[c];
+            std::string &out = chunk.columns[c];
+
+            matches.clear();
+            path_match(&column.path, message, column.wireTypes, column.numWireTypes, column.packed, matches);
+            if (matches.empty())
+            {
+                out += (char)0;
+                continue;
+            }
+            for (size_t i = 0; i < matches.size(); i++)
+            {
+                out += (char)((matches[i].wireType << 2) | PROTOBUF_SHRED_DEFINED | (i > 0 ? PROTOBUF_SHRED_REPEATED : 0));
+                protobufShredPutVarint(out, matches[i].value.size());
+                out.append((const char *)matches[i].value.start, matches[i].value.size());
+            }
+        }
+    }
+
+    /*
+    ** Store the column chunks of a chunk in the data shadow table
+    */
+    static int protobufShredWrite(ProtobufShredVtab *p, const ProtobufShredChunk &chunk)
+    {
+        sqlite3_stmt *pStmt = nullptr;
+        int rc = protobufShredPrepare(p->db, &pStmt, "INSERT INTO \"%w\".\"%w_data\"(chunk, col, data) VALUES (?, ?, ?)", p->schema.c_str(), p->name.c_str());
+        for (size_t c = 0; rc == SQLITE_OK && c <= p->columns.size(); c++)
+        {
+            const std::string &data = c == 0 ? chunk.rowids : chunk.columns[c - 1];
+            sqlite3_bind_int64(pStmt, 1, chunk.id);
+            sqlite3_bind_int64(pStmt, 2, (sqlite3_int64)c);
+            sqlite3_bind_blob(pStmt, 3, data.data(), (int)data.size(), SQLITE_STATIC);
+            sqlite3_step(pStmt);
+            rc = sqlite3_reset(pStmt);
+        }
+        sqlite3_finalize(pStmt);
+        return rc;
+    }
+
+    /*
+    ** Shred the source rows with rowids from iFirst to iLast. With write set, every chunk is
+    ** written to the data shadow table as it is completed, otherwise the rows are shredded into
+    ** the given chunk, which must then cover the whole range.
+    */
+    static int protobufShredSource(ProtobufShredVtab *p, sqlite3_int64 iFirst, sqlite3_int64 iLast, ProtobufShredChunk &chunk, bool write)
+    {
+        sqlite3_stmt *pStmt = nullptr;
+        int rc = protobufShredPrepare(p->db, &pStmt, "SELECT rowid, \"%w\".\"%w\" FROM \"%w\".\"%w\" WHERE rowid BETWEEN ? AND ? ORDER BY rowid",
+                                      p->source.c_str(), p->column.c_str(), p->schema.c_str(), p->source.c_str());
+        if (rc != SQLITE_OK) {return rc;}
+        sqlite3_bind_int64(pStmt, 1, iFirst);
+        sqlite3_bind_int64(pStmt, 2, iLast);
+
+        std::vector<Field> matches;
+        chunk.id = iFirst >> PROTOBUF_SHRED_CHUNK_SHIFT;
+        chunk.count = 0;
+        chunk.rowids.clear();
+        chunk.columns.assign(p->columns.size(), std::string());
+        while (rc == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW)
+        {
+            sqlite3_int64 rowid = sqlite3_column_int64(pStmt, 0);
+            if (write && (rowid >> PROTOBUF_SHRED_CHUNK_SHIFT) != chunk.id)
+            {
+                if (chunk.count > 0) {rc = protobufShredWrite(p, chunk);}
+                chunk.id = rowid >> PROTOBUF_SHRED_CHUNK_SHIFT;
+                chunk.count = 0;
+                chunk.rowids.clear();
+                chunk.columns.assign(p->columns.size(), std::string());
+            }
+
+            Buffer message;
+            message.start = static_cast<const uint8_t*>(sqlite3_column_blob(pStmt, 1));
+            message.end = message.start + static_cast<size_t>(sqlite3_column_bytes(pStmt, 1));
+            protobufShredRow(p, chunk, rowid, message, matches);
+        }
+        if (rc == SQLITE_OK) {rc = sqlite3_finalize(pStmt);} else {sqlite3_finalize(pStmt);}
+        if (rc == SQLITE_OK && write && chunk.count > 0) {rc = protobufShredWrite(p, chunk);}
+        return rc;
+    }
+
+    /*
+    ** Shred the whole source table, replacing all chunks
+    */
+    static int protobufShredRebuild(ProtobufShredVtab *p, char **pzErr)
+    {
+        int rc = protobufShredExec(p->db, pzErr, "DELETE FROM \"%w\".\"%w_data\"; DELETE FROM \"%w\".\"%w_dirty\";",
+                                   p->schema.c_str(), p->name.c_str(), p->schema.c_str(), p->name.c_str());
+        ProtobufShredChunk chunk;
+        if (rc == SQLITE_OK) {rc = protobufShredSource(p, INT64_MIN, INT64_MAX, chunk, true);}
+        return rc;
+    }
+
+    /*
+    ** Shred the chunks marked as dirty again
+    */
+    static int protobufShredRefresh(ProtobufShredVtab *p, char **pzErr)
+    {
+        std::vector<sqlite3_int64> dirty;
+        sqlite3_stmt *pStmt = nullptr;
+        int rc = protobufShredPrepare(p->db, &pStmt, "SELECT chunk FROM \"%w\".\"%w_dirty\" ORDER BY chunk", p->schema.c_str(), p->name.c_str());
+        while (rc == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW)
+        {
+            dirty.push_back(sqlite3_column_int64(pStmt, 0));
+        }
+        if (rc == SQLITE_OK) {rc = sqlite3_finalize(pStmt);}
+
+        ProtobufShredChunk chunk;
+        for (size_t i = 0; rc == SQLITE_OK && i < dirty.size(); i++)
+        {
+            rc = protobufShredExec(p->db, pzErr, "DELETE FROM \"%w\".\"%w_data\" WHERE chunk = %lld; DELETE FROM \"%w\".\"%w_dirty\" WHERE chunk = %lld;",
+                                   p->schema.c_str(), p->name.c_str(), dirty[i], p->schema.c_str(), p->name.c_str(), dirty[i]);
+            sqlite3_int64 iFirst = dirty[i] * PROTOBUF_SHRED_CHUNK_SIZE;
+            if (rc == SQLITE_OK) {rc = protobufShredSource(p, iFirst, iFirst + (PROTOBUF_SHRED_CHUNK_SIZE - 1), chunk, true);}
+        }
+        return rc;
+    }
+
+    /*
+    ** Create a new table, the shadow tables and triggers are created and the source table is shredded
+    */
+    static int protobufShredCreate(sqlite3 *db, void *pAux, int argc, const char *const*argv, sqlite3_vtab **ppVtab, char **pzErr)
+    {
+        int rc = protobufShredConnect(db, pAux, argc, argv, ppVtab, pzErr);
+        if (rc != SQLITE_OK) {return rc;}
+
+        ProtobufShredVtab *p = (ProtobufShredVtab*)*ppVtab;
+        rc = protobufShredExec(db, pzErr,
+            "CREATE TABLE \"%w\".\"%w_data\"(chunk INTEGER, col INTEGER, data BLOB, PRIMARY KEY(chunk, col)) WITHOUT ROWID;"
+            "CREATE TABLE \"%w\".\"%w_dirty\"(chunk INTEGER PRIMARY KEY);",
+            p->schema.c_str(), p->name.c_str(), p->schema.c_str(), p->name.c_str());
+        if (rc == SQLITE_OK) {rc = protobufShredCreateTriggers(p, p->name.c_str(), pzErr);}
+        if (rc == SQLITE_OK) {rc = protobufShredRebuild(p, pzErr);}
+        if (rc != SQLITE_OK)
+        {
+            if (*pzErr == nullptr) {*pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));}
+            protobufShredDisconnect(*ppVtab);
+            *ppVtab = nullptr;
+        }
+        return rc;
+    }
+
+    /*
+    ** Drop the table together with the shadow tables and triggers
+    */
+    static int protobufShredDestroy(sqlite3_vtab *pVtab)
+    {
+        ProtobufShredVtab *p = (ProtobufShredVtab*)pVtab;
+        int rc = protobufShredDropTriggers(p, p->name.c_str(), nullptr);
+        if (rc == SQLITE_OK)
+        {
+            rc = protobufShredExec(p->db, nullptr, "DROP TABLE IF EXISTS \"%w\".\"%w_data\"; DROP TABLE IF EXISTS \"%w\".\"%w_dirty\";",
+                                   p->schema.c_str(), p->name.c_str(), p->schema.c_str(), p->name.c_str());
+        }
+        if (rc == SQLITE_OK) {protobufShredDisconnect(pVtab);}
+        return rc;
+    }
+
+    /*
+    ** Rename the shadow tables and triggers together with the table
+    */
+    static int protobufShredRename(sqlite3_vtab *pVtab, const char *zNew)
+    {
+        ProtobufShredVtab *p = (ProtobufShredVtab*)pVtab;
+        int rc = protobufShredDropTriggers(p, p->name.c_str(), nullptr);
+        if (rc == SQLITE_OK)
+        {
+            rc = protobufShredExec(p->db, nullptr,
+                "ALTER TABLE \"%w\".\"%w_data\" RENAME TO \"%w_data\"; ALTER TABLE \"%w\".\"%w_dirty\" RENAME TO \"%w_dirty\";",
+                p->schema.c_str(), p->name.c_str(), zNew, p->schema.c_str(), p->name.c_str(), zNew);
+        }
+        if (rc == SQLITE_OK) {rc = protobufShredCreateTriggers(p, zNew, nullptr);}
+        if (rc == SQLITE_OK) {p->name = zNew;}
+        return rc;
+    }
+
+    /*
+    ** Shadow tables are only modified by the table itself. The dirty table is written by the
+    ** triggers on the source table, so it is not a shadow table, which defensive mode protects
+    */
+    static int protobufShredShadowName(const char *zName)
+    {
+        return sqlite3_stricmp(zName, "data") == 0;
+    }
+
+    /*
+    ** The table is read only, except for the commands 'refresh', which shreds the source rows
+    ** that changed since they were last shredded, and 'rebuild', which shreds all source rows
+    **
+    **     INSERT INTO shred(shred) VALUES ('refresh');
+    */
+    static int protobufShredUpdate(sqlite3_vtab *pVtab, int argc, sqlite3_value **argv, sqlite3_int64 *pRowid)
+    {
+        ProtobufShredVtab *p = (ProtobufShredVtab*)pVtab;
+        sqlite3_free(p->base.zErrMsg);
+        p->base.zErrMsg = nullptr;
+
+        size_t iCommand = 2 + p->columns.size();
+        const char *zCommand = nullptr;
+        if (argc > 1 && sqlite3_value_type(argv[0]) == SQLITE_NULL && (size_t)argc > iCommand)
+        {
+            zCommand = (const char *)sqlite3_value_text(argv[iCommand]);
+        }
+
+        if (zCommand != nullptr && sqlite3_stricmp(zCommand, "refresh") == 0)
+        {
+            return protobufShredRefresh(p, &p->base.zErrMsg);
+        }
+        if (zCommand != nullptr && sqlite3_stricmp(zCommand, "rebuild") == 0)
+        {
+            return protobufShredRebuild(p, &p->base.zErrMsg);
+        }
+        p->base.zErrMsg = sqlite3_mprintf(zCommand != nullptr ? "Unknown protobuf_shred command: %s" : "protobuf_shred tables are read only, modify the source table \"%s\" instead",
+                                          zCommand != nullptr ? zCommand : p->source.c_str());
+        return SQLITE_ERROR;
+    }
+
+    /*
+    ** Constructor for a new ProtobufShredCursor object.
+    */
+    static int protobufShredOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+    {
+        ProtobufShredVtab *p = (ProtobufShredVtab*)pVtab;
+        ProtobufShredCursor *pCur = new (std::nothrow) ProtobufShredCursor();
+        if (pCur == nullptr) {return SQLITE_NOMEM;}
+
+        int rc = protobufShredPrepare(p->db, &pCur->pLoad, "SELECT data FROM \"%w\".\"%w_data\" WHERE chunk = ? AND col = ?", p->schema.c_str(), p->name.c_str());
+        if (rc != SQLITE_OK)
+        {
+            delete pCur;
+            return rc;
+        }
+        pCur->scans.resize(p->columns.size());
+        pCur->eof = true;
+        *ppCursor = &pCur->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for a ProtobufShredCursor.
+    */
+    static int protobufShredClose(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufShredCursor *pCur = (ProtobufShredCursor*)cur;
+        sqlite3_finalize(pCur->pLoad);
+        delete pCur;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Load a column chunk of the current chunk from the data shadow table
+    */
+    static int protobufShredLoad(ProtobufShredCursor *pCur, int col, std::string &data)
+    {
+        sqlite3_bind_int64(pCur->pLoad, 1, pCur->chunks[pCur->iChunk]);
+        sqlite3_bind_int(pCur->pLoad, 2, col);
+        data.clear();
+        if (sqlite3_step(pCur->pLoad) == SQLITE_ROW)
+        {
+            data.assign((const char *)sqlite3_column_blob(pCur->pLoad, 0), sqlite3_column_bytes(pCur->pLoad, 0));
+        }
+        return sqlite3_reset(pCur->pLoad);
+    }
+
+    /*
+    ** Move to the first row of the next chunk with rows in the rowid range. The rowids are
+    ** read from the data shadow table, or the source rows are shredded if the chunk is dirty
+    */
+    static int protobufShredNextChunk(ProtobufShredCursor *pCur)
+    {
+        ProtobufShredVtab *p = (ProtobufShredVtab*)pCur->base.pVtab;
+        for (pCur->iChunk++; pCur->iChunk < pCur->chunks.size(); pCur->iChunk++)
+        {
+            sqlite3_int64 id = pCur->chunks[pCur->iChunk];
+            std::string rowids;
+            int rc = SQLITE_OK;
+            for (size_t c = 0; c < pCur->scans.size(); c++)
+            {
+                pCur->scans[c].loaded = false;
+            }
+            if (pCur->dirty[pCur->iChunk])
+            {
+                ProtobufShredChunk chunk;
+                rc = protobufShredSource(p, id * PROTOBUF_SHRED_CHUNK_SIZE, id * PROTOBUF_SHRED_CHUNK_SIZE + (PROTOBUF_SHRED_CHUNK_SIZE - 1), chunk, false);
+                for (size_t c = 0; c < pCur->scans.size(); c++)
+                {
+                    pCur->scans[c].loaded = true;
+                    pCur->scans[c].data.swap(chunk.columns[c]);
+                }
+                rowids.swap(chunk.rowids);
+            }
+            else
+            {
+                rc = protobufShredLoad(pCur, 0, rowids);
+            }
+            if (rc != SQLITE_OK) {return rc;}
+
+            pCur->rowids.clear();
+            Buffer in;
+            in.start = (const uint8_t *)rowids.data();
+            in.end = in.start + rowids.size();
+            uint64_t offset;
+            while (protobufShredGetVarint(&in, &offset))
+            {
+                pCur->rowids.push_back(id * PROTOBUF_SHRED_CHUNK_SIZE + (sqlite3_int64)offset);
+            }
+
+            // Skip to the first row in the rowid range
+            for (pCur->iRow = 0; pCur->iRow < pCur->rowids.size() && pCur->rowids[pCur->iRow] < pCur->minRowid; pCur->iRow++);
+            for (size_t c = 0; c < pCur->scans.size(); c++)
+            {
+                ProtobufShredScan &scan = pCur->scans[c];
+                scan.row = 0;
+                scan.remaining.start = (const uint8_t *)scan.data.data();
+                scan.remaining.end = scan.remaining.start + (scan.loaded ? scan.data.size() : 0);
+            }
+            if (pCur->iRow < pCur->rowids.size())
+            {
+                pCur->eof = pCur->rowids[pCur->iRow] > pCur->maxRowid;
+                return SQLITE_OK;
+            }
+        }
+        pCur->eof = true;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Advance a ProtobufShredCursor to its next row of output.
+    */
+    static int protobufShredNext(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufShredCursor *pCur = (ProtobufShredCursor*)cur;
+        pCur->iRow++;
+        if (pCur->iRow < pCur->rowids.size())
+        {
+            pCur->eof = pCur->rowids[pCur->iRow] > pCur->maxRowid;
+            return SQLITE_OK;
+        }
+        return protobufShredNextChunk(pCur);
+    }
+
+    /*
+    ** Return value at given column and row (ProtobufShredCursor). The column chunk is loaded
+    ** the first time the column is used in a chunk, and only the values of the current row are decoded
+    */
+    static int protobufShredColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+    {
+        ProtobufShredCursor *pCur = (ProtobufShredCursor *)cur;
+        ProtobufShredVtab *p = (ProtobufShredVtab*)cur->pVtab;
+        if (col < 0 || (size_t)col >= p->columns.size()) {return SQLITE_OK;}
+
+        ProtobufShredScan &scan = pCur->scans[col];
+        if (!scan.loaded)
+        {
+            int rc = protobufShredLoad(pCur, col + 1, scan.data);
+            if (rc != SQLITE_OK) {return rc;}
+            scan.loaded = true;
+            scan.row = 0;
+            scan.remaining.start = (const uint8_t *)scan.data.data();
+            scan.remaining.end = scan.remaining.start + scan.data.size();
+        }
+        for (; scan.row < pCur->iRow; scan.row++)
+        {
+            scan.remaining.start = protobufShredRowEnd(scan.remaining);
+        }
+
+        Buffer row = scan.remaining;
+        row.end = protobufShredRowEnd(scan.remaining);
+
+        const ColumnDefinition &column = p->columns[col];
+        std::string json = "[";
+        while (row.start < row.end)
+        {
+            uint8_t levels = *row.start++;
+            if ((levels & PROTOBUF_SHRED_DEFINED) == 0) {continue;}
+
+            uint64_t length = 0;
+            protobufShredGetVarint(&row, &length);
+            Field field;
+            field.tag = 0;
+            field.fieldNum = 0;
+            field.depth = 0;
+            field.parent = nullptr;
+            field.wireType = levels >> 2;
+            field.value.start = row.start;
+            field.value.end = row.start + (length < row.size() ? length : row.size());
+            row.start = field.value.end;
+
+            if (!column.path.multi)
+            {
+                result_from_buffer(ctx, column.type, field.value, 0, SQLITE_TRANSIENT);
+                return SQLITE_OK;
+            }
+            if (json.size() > 1) {json += ',';}
+            json_append_value(json, column.type, field);
+        }
+        if (column.path.multi)
+        {
+            json += ']';
+            sqlite3_result_text(ctx, json.data(), (int)json.size(), SQLITE_TRANSIENT);
+        }
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return the rowid for the current row, which is the rowid of the source row.
+    */
+    static int protobufShredRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+    {
+        ProtobufShredCursor *pCur = (ProtobufShredCursor*)cur;
+        *pRowid = pCur->rowids[pCur->iRow];
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return TRUE if the cursor has been moved off of the last row of output.
+    */
+    static int protobufShredEof(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufShredCursor *pCur = (ProtobufShredCursor*)cur;
+        return pCur->eof;
+    }
+
+    /*
+    ** Narrow the rowid range with a constraint on the rowid, only numeric values are used
+    */
+    static void protobufShredLimitRowid(ProtobufShredCursor *pCur, char op, sqlite3_value *value)
+    {
+        int type = sqlite3_value_type(value);
+        if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) {return;}
+
+        double x = sqlite3_value_double(value);
+        sqlite3_int64 i = sqlite3_value_int64(value);
+        bool integral = type == SQLITE_INTEGER;
+        if (!integral && fabs(x) >= 9e18) {return;}
+        sqlite3_int64 lower = integral ? i : (sqlite3_int64)ceil(x);
+        sqlite3_int64 upper = integral ? i : (sqlite3_int64)floor(x);
+
+        switch (op)
+        {
+        case 'e':
+            if (pCur->minRowid < lower) {pCur->minRowid = lower;}
+            if (pCur->maxRowid > upper) {pCur->maxRowid = upper;}
+            break;
+        case 'g':
+            if (upper == INT64_MAX) {pCur->eof = true; break;}
+            if (pCur->minRowid < upper + 1) {pCur->minRowid = upper + 1;}
+            break;
+        case 'G':
+            if (pCur->minRowid < lower) {pCur->minRowid = lower;}
+            break;
+        case 'l':
+            if (lower == INT64_MIN) {pCur->eof = true; break;}
+            if (pCur->maxRowid > lower - 1) {pCur->maxRowid = lower - 1;}
+            break;
+        case 'L':
+            if (pCur->maxRowid > upper) {pCur->maxRowid = upper;}
+            break;
+        default:
+            break;
+        }
+    }
+
+    /*
+    ** This method is called to "rewind" the ProtobufShredCursor object back
+    ** to the first row of output. The chunks in the rowid range are listed, both
+    ** the shredded chunks and the chunks marked as dirty.
+    */
+    static int protobufShredFilter(sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv)
+    {
+        ProtobufShredCursor *pCur = (ProtobufShredCursor *)cur;
+        ProtobufShredVtab *p = (ProtobufShredVtab*)cur->pVtab;
+        pCur->chunks.clear();
+        pCur->dirty.clear();
+        pCur->rowids.clear();
+        pCur->iRow = 0;
+        pCur->minRowid = INT64_MIN;
+        pCur->maxRowid = INT64_MAX;
+        pCur->eof = false;
+
+        for (int i = 0; idxStr != nullptr && idxStr[i] != 0 && i < argc; i++)
+        {
+            protobufShredLimitRowid(pCur, idxStr[i], argv[i]);
+        }
+        if (pCur->eof || pCur->minRowid > pCur->maxRowid)
+        {
+            pCur->eof = true;
+            return SQLITE_OK;
+        }
+
+        sqlite3_stmt *pStmt = nullptr;
+        int rc = protobufShredPrepare(p->db, &pStmt,
+            "SELECT chunk, 0 FROM \"%w\".\"%w_data\" WHERE col = 0 AND chunk BETWEEN ?1 AND ?2 "
+            "UNION SELECT chunk, 1 FROM \"%w\".\"%w_dirty\" WHERE chunk BETWEEN ?1 AND ?2 ORDER BY 1, 2",
+            p->schema.c_str(), p->name.c_str(), p->schema.c_str(), p->name.c_str());
+        if (rc != SQLITE_OK) {return rc;}
+        sqlite3_bind_int64(pStmt, 1, pCur->minRowid >> PROTOBUF_SHRED_CHUNK_SHIFT);
+        sqlite3_bind_int64(pStmt, 2, pCur->maxRowid >> PROTOBUF_SHRED_CHUNK_SHIFT);
+        while (sqlite3_step(pStmt) == SQLITE_ROW)
+        {
+            sqlite3_int64 id = sqlite3_column_int64(pStmt, 0);
+            bool dirty = sqlite3_column_int(pStmt, 1) != 0;
+            if (!pCur->chunks.empty() && pCur->chunks.back() == id)
+            {
+                pCur->dirty.back() = pCur->dirty.back() || dirty;
+                continue;
+            }
+            pCur->chunks.push_back(id);
+            pCur->dirty.push_back(dirty);
+        }
+        rc = sqlite3_finalize(pStmt);
+        if (rc != SQLITE_OK) {return rc;}
+
+        pCur->iChunk = (size_t)-1;
+        return protobufShredNextChunk(pCur);
+    }
+
+    /*
+    ** SQLite will invoke this method one or more times while planning a query
+    ** that uses the virtual table. Constraints on the rowid limit the chunks that
+    ** are read, they are listed in idxStr and still checked by SQLite.
+    */
+    static int protobufShredBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo)
+    {
+        std::string idxStr;
+        double nRows = 1000000.0;
+        const struct sqlite3_index_info::sqlite3_index_constraint *pConstraint = pIdxInfo->aConstraint;
+        for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++)
+        {
+            if (pConstraint->usable == 0 || pConstraint->iColumn >= 0) {continue;}
+
+            char c = 0;
+            switch (pConstraint->op)
+            {
+            case SQLITE_INDEX_CONSTRAINT_EQ: c = 'e'; nRows = 1; break;
+            case SQLITE_INDEX_CONSTRAINT_GT: c = 'g'; nRows *= 0.25; break;
+            case SQLITE_INDEX_CONSTRAINT_GE: c = 'G'; nRows *= 0.25; break;
+            case SQLITE_INDEX_CONSTRAINT_LT: c = 'l'; nRows *= 0.25; break;
+            case SQLITE_INDEX_CONSTRAINT_LE: c = 'L'; nRows *= 0.25; break;
+            default: break;
+            }
+            if (c == 0) {continue;}
+            idxStr += c;
+            pIdxInfo->aConstraintUsage[i].argvIndex = (int)idxStr.size();
+        }
+        if (!idxStr.empty())
+        {
+            pIdxInfo->idxStr = sqlite3_mprintf("%s", idxStr.c_str());
+            pIdxInfo->needToFreeIdxStr = 1;
+            if (pIdxInfo->idxStr == nullptr) {return SQLITE_NOMEM;}
+        }
+
+        // Rows are returned in rowid order
+        if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn < 0 && pIdxInfo->aOrderBy[0].desc == 0)
+        {
+            pIdxInfo->orderByConsumed = 1;
+        }
+        pIdxInfo->estimatedCost = nRows;
+        pIdxInfo->estimatedRows = (sqlite3_int64)nRows + 1;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Define all the methods for the module (virtual table).
+    */
+    static sqlite3_module protobufShredModule = {
+        /* iVersion    */ 3,
+        /* xCreate     */ protobufShredCreate,
+        /* xConnect    */ protobufShredConnect,
+        /* xBestIndex  */ protobufShredBestIndex,
+        /* xDisconnect */ protobufShredDisconnect,
+        /* xDestroy    */ protobufShredDestroy,
+        /* xOpen       */ protobufShredOpen,
+        /* xClose      */ protobufShredClose,
+        /* xFilter     */ protobufShredFilter,
+        /* xNext       */ protobufShredNext,
+        /* xEof        */ protobufShredEof,
+        /* xColumn     */ protobufShredColumn,
+        /* xRowid      */ protobufShredRowid,
+        /* xUpdate     */ protobufShredUpdate,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ protobufShredRename,
+        /* xSavepoint  */ 0, // iVersion >= 2
+        /* xRelease    */ 0, // iVersion >= 2
+        /* xRollbackTo */ 0, // iVersion >= 2
+        /* xShadowName */ protobufShredShadowName, // iVersion >= 3
+        /* xIntegrity  */ //0, // iVersion >= 4
+    };
+
+    int register_protobuf_shred(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        return sqlite3_create_module(db, "protobuf_shred", &protobufShredModule, 0);
+    }
+
+} // namespace sqlite_protobuf
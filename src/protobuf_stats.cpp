@@ -0,0 +1,620 @@
+#include "protobuf_stats.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <tuple>
+#include <cstring>
+#include <new>
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    /* Number of buckets of the histogram of call times, bucket i counts the calls shorter than
+    ** 2^(i + 7) nanoseconds that are not in a lower bucket, and the last bucket the rest */
+    #define PROTOBUF_STATS_BUCKETS 20
+    #define PROTOBUF_STATS_BUCKET_SHIFT 7
+
+    /* Number of paths each thread keeps statistics for, calls with other paths are only counted for the function */
+    #define PROTOBUF_STATS_MAX_PATHS 1024
+
+    /* Number of recently used paths each thread finds without looking them up */
+    #define PROTOBUF_STATS_RECENT_PATHS 8
+
+    /* Number of slow calls logged each second by default */
+    #define PROTOBUF_STATS_SLOW_PER_SECOND 10
+
+    /* Columns of the table */
+    #define PROTOBUF_STATS_FUNCTION 0
+    #define PROTOBUF_STATS_PATH 1
+    #define PROTOBUF_STATS_CALLS 2
+    #define PROTOBUF_STATS_BYTES 3
+    #define PROTOBUF_STATS_NANOSECONDS 4
+    #define PROTOBUF_STATS_HISTOGRAM 5
+    #define PROTOBUF_STATS_CACHE_HITS 6
+    #define PROTOBUF_STATS_CACHE_MISSES 7
+    #define PROTOBUF_STATS_CACHE_EVICTIONS 8
+    #define PROTOBUF_STATS_SPECULATIVE_FAILURES 9
+    #define PROTOBUF_STATS_MAX_DEPTH 10
+    #define PROTOBUF_STATS_ALLOC_BYTES 11
+
+    static const char *statsFunctionNames[STATS_NUM_FUNCTIONS] = {
+        "protobuf_extract",
+        "protobuf_locate",
+        "protobuf_to_json",
+        "protobuf_each",
+        "protobuf_contains_text",
+        "path_cache",
+    };
+
+    /*
+    ** Counters of a function or path. Each thread only writes the counters of its own shard, so
+    ** they are updated with relaxed loads and stores rather than atomic read-modify-write
+    ** instructions, while they can still be read by other threads at any time.
+    */
+    struct StatsCounters
+    {
+        std::atomic<uint64_t> counters[STATS_NUM_COUNTERS];
+        std::atomic<uint64_t> histogram[PROTOBUF_STATS_BUCKETS];
+        std::atomic<uint64_t> maxDepth;
+
+        StatsCounters()
+        {
+            for (int i = 0; i < STATS_NUM_COUNTERS; i++) {counters[i].store(0, std::memory_order_relaxed);}
+            for (int i = 0; i < PROTOBUF_STATS_BUCKETS; i++) {histogram[i].store(0, std::memory_order_relaxed);}
+            maxDepth.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    /*
+    ** Statistics of a thread, the paths are only locked when a path is added and when they are read
+    */
+    struct StatsShard
+    {
+        StatsCounters functions[STATS_NUM_FUNCTIONS];
+        std::mutex pathsMutex;
+        std::unordered_map<std::string, StatsCounters> paths;
+        std::string recentPaths[PROTOBUF_STATS_RECENT_PATHS]; // Paths looked up recently, queries use a few paths over and over
+        StatsCounters *recentCounters[PROTOBUF_STATS_RECENT_PATHS];
+        size_t nextRecent;
+
+        StatsShard() : recentCounters(), nextRecent(0) {}
+    };
+
+    /*
+    ** Row of the table, the statistics of all threads summed up
+    */
+    struct StatsRow
+    {
+        int function;
+        bool hasPath;
+        std::string path;
+        uint64_t counters[STATS_NUM_COUNTERS];
+        uint64_t histogram[PROTOBUF_STATS_BUCKETS];
+        uint64_t maxDepth;
+    };
+
+    namespace
+    {
+        std::mutex shardsMutex;
+        std::vector<StatsShard *> shards; // Shards of the running threads
+        StatsShard retired;               // Statistics of the threads that have exited
+
+        inline void add(std::atomic<uint64_t> &counter, uint64_t n)
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        inline void update_max(std::atomic<uint64_t> &counter, uint64_t n)
+        {
+            if (n > counter.load(std::memory_order_relaxed)) {counter.store(n, std::memory_order_relaxed);}
+        }
+
+        void merge(StatsCounters &to, const StatsCounters &from)
+        {
+            for (int i = 0; i < STATS_NUM_COUNTERS; i++) {add(to.counters[i], from.counters[i].load(std::memory_order_relaxed));}
+            for (int i = 0; i < PROTOBUF_STATS_BUCKETS; i++) {add(to.histogram[i], from.histogram[i].load(std::memory_order_relaxed));}
+            update_max(to.maxDepth, from.maxDepth.load(std::memory_order_relaxed));
+        }
+
+        void merge(StatsRow &to, const StatsCounters &from)
+        {
+            for (int i = 0; i < STATS_NUM_COUNTERS; i++) {to.counters[i] += from.counters[i].load(std::memory_order_relaxed);}
+            for (int i = 0; i < PROTOBUF_STATS_BUCKETS; i++) {to.histogram[i] += from.histogram[i].load(std::memory_order_relaxed);}
+            uint64_t depth = from.maxDepth.load(std::memory_order_relaxed);
+            if (depth > to.maxDepth) {to.maxDepth = depth;}
+        }
+
+        /// Counters of a path in a shard, added when the path is first seen
+        StatsCounters* path_counters(StatsShard &shard, const std::string &path)
+        {
+            for (size_t i = 0; i < PROTOBUF_STATS_RECENT_PATHS; i++)
+            {
+                if (shard.recentCounters[i] != nullptr && shard.recentPaths[i] == path) {return shard.recentCounters[i];}
+            }
+
+            std::lock_guard<std::mutex> lock(shard.pathsMutex);
+            auto it = shard.paths.find(path);
+            if (it == shard.paths.end())
+            {
+                if (shard.paths.size() >= PROTOBUF_STATS_MAX_PATHS) {return nullptr;}
+                it = shard.paths.emplace(std::piecewise_construct, std::forward_as_tuple(path), std::forward_as_tuple()).first;
+            }
+            size_t i = shard.nextRecent++ % PROTOBUF_STATS_RECENT_PATHS;
+            shard.recentPaths[i] = path;
+            shard.recentCounters[i] = &it->second;
+            return &it->second;
+        }
+
+        /// Shard of the current thread, created on first use and retired when the thread exits
+        struct StatsThread
+        {
+            StatsShard *shard;
+
+            ~StatsThread()
+            {
+                if (shard == nullptr) {return;}
+                std::lock_guard<std::mutex> lock(shardsMutex);
+                for (int i = 0; i < STATS_NUM_FUNCTIONS; i++) {merge(retired.functions[i], shard->functions[i]);}
+                for (auto &entry : shard->paths)
+                {
+                    StatsCounters *counters = path_counters(retired, entry.first);
+                    if (counters != nullptr) {merge(*counters, entry.second);}
+                }
+                for (size_t i = 0; i < shards.size(); i++)
+                {
+                    if (shards[i] == shard) {shards.erase(shards.begin() + i); break;}
+                }
+                delete shard;
+            }
+        };
+
+        thread_local StatsThread statsThread = {nullptr};
+
+        StatsShard& stats_shard()
+        {
+            if (statsThread.shard == nullptr)
+            {
+                statsThread.shard = new StatsShard();
+                std::lock_guard<std::mutex> lock(shardsMutex);
+                shards.push_back(statsThread.shard);
+            }
+            return *statsThread.shard;
+        }
+
+        thread_local StatsScope *currentScope = nullptr;
+
+        // Thresholds of the slow log, 0 if not set, and the number of records per second
+        std::atomic<uint64_t> slowNanoseconds(0);
+        std::atomic<uint64_t> slowBytes(0);
+        std::atomic<uint64_t> slowPerSecond(PROTOBUF_STATS_SLOW_PER_SECOND);
+        std::atomic<uint64_t> slowSecond(0);     // Second of the records counted in slowCount
+        std::atomic<uint64_t> slowCount(0);
+        std::atomic<uint64_t> slowSuppressed(0); // Records left out since the last record
+
+        void record_call(StatsCounters &counters, uint64_t bytes, uint64_t nanoseconds, int bucket)
+        {
+            add(counters.counters[STATS_CALLS], 1);
+            add(counters.counters[STATS_BYTES], bytes);
+            add(counters.counters[STATS_NANOSECONDS], nanoseconds);
+            add(counters.histogram[bucket], 1);
+        }
+
+        /// Walk a decoded message, length delimited fields without sub fields failed to decode as messages
+        void walk_decoded(const Field &field, uint64_t &nodes, uint64_t &failures, uint64_t &allocated, uint64_t &depth)
+        {
+            nodes += field.subFields.size();
+            allocated += field.subFields.capacity() * sizeof(Field);
+            for (const Field &sub : field.subFields)
+            {
+                if (sub.depth > depth) {depth = sub.depth;}
+                if (sub.wireType == WIRETYPE_LEN && sub.subFields.empty() && sub.value.size() > 0) {failures++;}
+                if (!sub.subFields.empty()) {walk_decoded(sub, nodes, failures, allocated, depth);}
+            }
+        }
+
+        /// Write a slow call to the log, at most slowPerSecond records are written each second
+        void slow_log(const StatsCall &call)
+        {
+            uint64_t second = stats_clock() / 1000000000ull;
+            if (slowSecond.load(std::memory_order_relaxed) != second)
+            {
+                slowSecond.store(second, std::memory_order_relaxed);
+                slowCount.store(0, std::memory_order_relaxed);
+            }
+            if (slowCount.fetch_add(1, std::memory_order_relaxed) >= slowPerSecond.load(std::memory_order_relaxed))
+            {
+                slowSuppressed.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            std::string suppressed;
+            uint64_t numSuppressed = slowSuppressed.exchange(0, std::memory_order_relaxed);
+            if (numSuppressed > 0) {suppressed = ", " + std::to_string(numSuppressed) + " records suppressed";}
+            sqlite3_log(SQLITE_WARNING, "%s slow decode: path %s, %llu bytes, %llu us, %llu nodes, %llu speculative failures, %s%s",
+                        statsFunctionNames[call.function], call.path.empty() ? "none" : call.path.c_str(),
+                        (unsigned long long)call.bytes, (unsigned long long)(call.nanoseconds / 1000),
+                        (unsigned long long)call.nodes, (unsigned long long)call.failures,
+                        call.cache < 0 ? "no cache" : call.cache > 0 ? "cache hit" : "cache miss", suppressed.c_str());
+        }
+
+        /// Sum up the statistics of all threads, a row for each function and for each path of protobuf_extract
+        void stats_collect(std::vector<StatsRow> &rows)
+        {
+            std::vector<StatsShard *> all;
+            std::lock_guard<std::mutex> lock(shardsMutex);
+            all.push_back(&retired);
+            all.insert(all.end(), shards.begin(), shards.end());
+
+            rows.resize(STATS_NUM_FUNCTIONS);
+            for (int i = 0; i < STATS_NUM_FUNCTIONS; i++)
+            {
+                StatsRow &row = rows[i];
+                memset(row.counters, 0, sizeof(row.counters));
+                memset(row.histogram, 0, sizeof(row.histogram));
+                row.function = i;
+                row.hasPath = false;
+                row.maxDepth = 0;
+                for (StatsShard *shard : all) {merge(row, shard->functions[i]);}
+            }
+
+            std::map<std::string, StatsRow> paths;
+            for (StatsShard *shard : all)
+            {
+                std::lock_guard<std::mutex> pathsLock(shard->pathsMutex);
+                for (auto &entry : shard->paths)
+                {
+                    auto it = paths.find(entry.first);
+                    if (it == paths.end())
+                    {
+                        StatsRow &row = paths[entry.first];
+                        memset(row.counters, 0, sizeof(row.counters));
+                        memset(row.histogram, 0, sizeof(row.histogram));
+                        row.function = STATS_EXTRACT;
+                        row.hasPath = true;
+                        row.path = entry.first;
+                        row.maxDepth = 0;
+                        it = paths.find(entry.first);
+                    }
+                    merge(it->second, entry.second);
+                }
+            }
+            for (auto &entry : paths) {rows.push_back(entry.second);}
+        }
+    } // namespace
+
+    uint64_t stats_clock()
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void stats_add(StatsFunction function, StatsCounter counter, uint64_t n)
+    {
+        add(stats_shard().functions[function].counters[counter], n);
+        if (currentScope != nullptr && currentScope->call.function == function)
+        {
+            if (counter == STATS_CACHE_HITS) {currentScope->call.cache = 1;}
+            if (counter == STATS_CACHE_MISSES) {currentScope->call.cache = 0;}
+        }
+    }
+
+    void stats_decoded(StatsFunction function, const Field &root)
+    {
+        uint64_t nodes = 0, failures = 0, allocated = 0, depth = 0;
+        walk_decoded(root, nodes, failures, allocated, depth);
+
+        StatsCounters &counters = stats_shard().functions[function];
+        add(counters.counters[STATS_SPECULATIVE_FAILURES], failures);
+        add(counters.counters[STATS_ALLOC_BYTES], allocated);
+        update_max(counters.maxDepth, depth);
+        if (currentScope != nullptr && currentScope->call.function == function)
+        {
+            currentScope->call.nodes += nodes;
+            currentScope->call.failures += failures;
+        }
+    }
+
+    void stats_begin(StatsCall &call, StatsFunction function, uint64_t bytes)
+    {
+        call.function = function;
+        call.bytes = bytes;
+        call.nanoseconds = 0;
+        call.nodes = 0;
+        call.failures = 0;
+        call.cache = -1;
+        call.path.clear();
+        call.pathCounters = nullptr;
+    }
+
+    void stats_path(StatsCall &call, const std::string &path)
+    {
+        // Only the calls of protobuf_extract are broken down by path
+        if (call.function == STATS_EXTRACT) {call.pathCounters = path_counters(stats_shard(), path);}
+
+        // The path is only copied when it may be logged
+        if (slowNanoseconds.load(std::memory_order_relaxed) != 0 || slowBytes.load(std::memory_order_relaxed) != 0) {call.path = path;}
+    }
+
+    void stats_record(StatsCall &call)
+    {
+        int bucket = 0;
+        while (bucket < PROTOBUF_STATS_BUCKETS - 1 && call.nanoseconds >= (1ull << (bucket + PROTOBUF_STATS_BUCKET_SHIFT))) {bucket++;}
+
+        record_call(stats_shard().functions[call.function], call.bytes, call.nanoseconds, bucket);
+        if (call.pathCounters != nullptr) {record_call(*call.pathCounters, call.bytes, call.nanoseconds, bucket);}
+
+        uint64_t nanoseconds = slowNanoseconds.load(std::memory_order_relaxed);
+        uint64_t bytes = slowBytes.load(std::memory_order_relaxed);
+        if ((nanoseconds != 0 && call.nanoseconds >= nanoseconds) || (bytes != 0 && call.bytes >= bytes)) {slow_log(call);}
+    }
+
+    StatsScope::StatsScope(StatsFunction function, uint64_t bytes) : start(stats_clock()), previous(currentScope)
+    {
+        stats_begin(call, function, bytes);
+        currentScope = this;
+    }
+
+    void StatsScope::set_path(const std::string &path)
+    {
+        stats_path(call, path);
+    }
+
+    StatsScope::~StatsScope()
+    {
+        call.nanoseconds = stats_clock() - start;
+        currentScope = previous;
+        stats_record(call);
+    }
+
+    /// Log the calls of protobuf_extract, protobuf_to_json and protobuf_each that take longer than
+    /// a number of microseconds or are given a message larger than a number of bytes, NULL or 0
+    /// leaves a threshold out. At most per_second records are written each second, 10 by default.
+    ///
+    ///     SELECT protobuf_slow_log(microseconds, bytes, per_second);
+    static void protobuf_slow_log(sqlite3_context *context, int argc, sqlite3_value **argv)
+    {
+        for (int i = 0; i < argc; i++)
+        {
+            if (sqlite3_value_type(argv[i]) != SQLITE_NULL && sqlite3_value_int64(argv[i]) < 0)
+            {
+                sqlite3_result_error(context, "Thresholds of the slow log must not be negative", -1);
+                return;
+            }
+        }
+        #ifdef SQLITE_PROTOBUF_NO_STATS
+        sqlite3_result_error(context, "The slow log requires statistics, which are compiled out", -1);
+        #else
+        slowNanoseconds.store((uint64_t)sqlite3_value_int64(argv[0]) * 1000, std::memory_order_relaxed);
+        slowBytes.store((uint64_t)sqlite3_value_int64(argv[1]), std::memory_order_relaxed);
+        bool perSecond = argc > 2 && sqlite3_value_type(argv[2]) != SQLITE_NULL;
+        slowPerSecond.store(perSecond ? (uint64_t)sqlite3_value_int64(argv[2]) : PROTOBUF_STATS_SLOW_PER_SECOND, std::memory_order_relaxed);
+        #endif
+    }
+
+    /*
+    ** Define virtual table data structure, the table has no state
+    */
+    typedef struct ProtobufStatsVtab ProtobufStatsVtab;
+    struct ProtobufStatsVtab
+    {
+        sqlite3_vtab base;  // Base class - must be first
+    };
+
+    /*
+    ** Define cursor data structure, the statistics are collected when the cursor is rewound
+    */
+    typedef struct ProtobufStatsCursor ProtobufStatsCursor;
+    struct ProtobufStatsCursor
+    {
+        sqlite3_vtab_cursor base;   // Base class - must be first
+        std::vector<StatsRow> rows;
+        size_t row;
+    };
+
+    /*
+    ** Constructor for ProtobufStatsVtab objects.
+    */
+    static int protobufStatsConnect(sqlite3 *db, void *pAux, int argc, const char *const*argv, sqlite3_vtab **ppVtab, char **pzErr)
+    {
+        int rc = sqlite3_declare_vtab(db,
+            "CREATE TABLE x(function TEXT, path TEXT, calls INTEGER, bytes INTEGER, nanoseconds INTEGER, histogram TEXT,"
+            " cache_hits INTEGER, cache_misses INTEGER, cache_evictions INTEGER, speculative_failures INTEGER,"
+            " max_depth INTEGER, alloc_bytes INTEGER)");
+        if (rc != SQLITE_OK) {return rc;}
+
+        ProtobufStatsVtab *pNew = new (std::nothrow) ProtobufStatsVtab();
+        if (pNew == nullptr) {return SQLITE_NOMEM;}
+        *ppVtab = &pNew->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for ProtobufStatsVtab objects.
+    */
+    static int protobufStatsDisconnect(sqlite3_vtab *pVtab)
+    {
+        delete (ProtobufStatsVtab*)pVtab;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Constructor for a new ProtobufStatsCursor object.
+    */
+    static int protobufStatsOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+    {
+        ProtobufStatsCursor *pCur = new (std::nothrow) ProtobufStatsCursor();
+        if (pCur == nullptr) {return SQLITE_NOMEM;}
+        pCur->row = 0;
+        *ppCursor = &pCur->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for a ProtobufStatsCursor.
+    */
+    static int protobufStatsClose(sqlite3_vtab_cursor *cur)
+    {
+        delete (ProtobufStatsCursor*)cur;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Advance a ProtobufStatsCursor to its next row of output.
+    */
+    static int protobufStatsNext(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufStatsCursor *pCur = (ProtobufStatsCursor*)cur;
+        pCur->row++;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return values of columns for the row at which the ProtobufStatsCursor is currently pointing.
+    */
+    static int protobufStatsColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+    {
+        ProtobufStatsCursor *pCur = (ProtobufStatsCursor*)cur;
+        const StatsRow &row = pCur->rows[pCur->row];
+        switch (col)
+        {
+        case PROTOBUF_STATS_FUNCTION:
+            sqlite3_result_text(ctx, statsFunctionNames[row.function], -1, SQLITE_STATIC);
+            break;
+        case PROTOBUF_STATS_PATH:
+            if (row.hasPath) {sqlite3_result_text(ctx, row.path.data(), (int)row.path.size(), SQLITE_TRANSIENT);}
+            break;
+        case PROTOBUF_STATS_CALLS:
+            sqlite3_result_int64(ctx, (sqlite3_int64)row.counters[STATS_CALLS]);
+            break;
+        case PROTOBUF_STATS_BYTES:
+            sqlite3_result_int64(ctx, (sqlite3_int64)row.counters[STATS_BYTES]);
+            break;
+        case PROTOBUF_STATS_NANOSECONDS:
+            sqlite3_result_int64(ctx, (sqlite3_int64)row.counters[STATS_NANOSECONDS]);
+            break;
+        case PROTOBUF_STATS_HISTOGRAM:
+        {
+            // JSON object with the number of calls shorter than each upper bound in nanoseconds
+            std::string json = "{";
+            for (int i = 0; i < PROTOBUF_STATS_BUCKETS; i++)
+            {
+                if (row.histogram[i] == 0) {continue;}
+                if (json.size() > 1) {json += ',';}
+                json += i < PROTOBUF_STATS_BUCKETS - 1 ? "\"" + std::to_string(1ull << (i + PROTOBUF_STATS_BUCKET_SHIFT)) + "\":" : "\"inf\":";
+                json += std::to_string(row.histogram[i]);
+            }
+            json += '}';
+            sqlite3_result_text(ctx, json.data(), (int)json.size(), SQLITE_TRANSIENT);
+            break;
+        }
+        case PROTOBUF_STATS_CACHE_HITS:
+        case PROTOBUF_STATS_CACHE_MISSES:
+        case PROTOBUF_STATS_CACHE_EVICTIONS:
+        case PROTOBUF_STATS_SPECULATIVE_FAILURES:
+        case PROTOBUF_STATS_ALLOC_BYTES:
+        {
+            // The decoding of the messages is only counted for the function, not for each path
+            static const StatsCounter counters[] = {STATS_CACHE_HITS, STATS_CACHE_MISSES, STATS_CACHE_EVICTIONS, STATS_SPECULATIVE_FAILURES};
+            StatsCounter counter = col == PROTOBUF_STATS_ALLOC_BYTES ? STATS_ALLOC_BYTES : counters[col - PROTOBUF_STATS_CACHE_HITS];
+            if (!row.hasPath) {sqlite3_result_int64(ctx, (sqlite3_int64)row.counters[counter]);}
+            break;
+        }
+        case PROTOBUF_STATS_MAX_DEPTH:
+            if (!row.hasPath) {sqlite3_result_int64(ctx, (sqlite3_int64)row.maxDepth);}
+            break;
+        default:
+            break;
+        }
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return the rowid for the current row.
+    */
+    static int protobufStatsRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+    {
+        ProtobufStatsCursor *pCur = (ProtobufStatsCursor*)cur;
+        *pRowid = (sqlite3_int64)pCur->row + 1;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return TRUE if the cursor has been moved off of the last row of output.
+    */
+    static int protobufStatsEof(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufStatsCursor *pCur = (ProtobufStatsCursor*)cur;
+        return pCur->row >= pCur->rows.size();
+    }
+
+    /*
+    ** Rewind the cursor, the statistics of all threads are summed up at this point. When the
+    ** statistics are compiled out the table is empty.
+    */
+    static int protobufStatsFilter(sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv)
+    {
+        ProtobufStatsCursor *pCur = (ProtobufStatsCursor*)cur;
+        pCur->rows.clear();
+        pCur->row = 0;
+        PROTOBUF_STATS(stats_collect(pCur->rows));
+        return SQLITE_OK;
+    }
+
+    /*
+    ** The table is small and always scanned in full.
+    */
+    static int protobufStatsBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo)
+    {
+        pIdxInfo->estimatedCost = (double)STATS_NUM_FUNCTIONS;
+        pIdxInfo->estimatedRows = STATS_NUM_FUNCTIONS;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Define all the methods for the module (virtual table).
+    */
+    static sqlite3_module protobufStatsModule = {
+        /* iVersion    */ 0,
+        /* xCreate     */ 0,
+        /* xConnect    */ protobufStatsConnect,
+        /* xBestIndex  */ protobufStatsBestIndex,
+        /* xDisconnect */ protobufStatsDisconnect,
+        /* xDestroy    */ 0,
+        /* xOpen       */ protobufStatsOpen,
+        /* xClose      */ protobufStatsClose,
+        /* xFilter     */ protobufStatsFilter,
+        /* xNext       */ protobufStatsNext,
+        /* xEof        */ protobufStatsEof,
+        /* xColumn     */ protobufStatsColumn,
+        /* xRowid      */ protobufStatsRowid,
+        /* xUpdate     */ 0,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ 0,
+        /* xSavepoint  */ //0, // iVersion >= 2
+        /* xRelease    */ //0, // iVersion >= 2
+        /* xRollbackTo */ //0, // iVersion >= 2
+        /* xShadowName */ //0, // iVersion >= 3
+        /* xIntegrity  */ //0, // iVersion >= 4
+    };
+
+    int register_protobuf_stats(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        // The slow log is global, so it can only be set directly in SQL statements
+        int flags = SQLITE_UTF8 | (sqlite3_libversion_number() >= 3030000 ? SQLITE_DIRECTONLY : 0);
+        int rc = sqlite3_create_module(db, "protobuf_stats", &protobufStatsModule, 0);
+        if (rc == SQLITE_OK) {rc = sqlite3_create_function(db, "protobuf_slow_log", 2, flags, nullptr, protobuf_slow_log, nullptr, nullptr);}
+        if (rc == SQLITE_OK) {rc = sqlite3_create_function(db, "protobuf_slow_log", 3, flags, nullptr, protobuf_slow_log, nullptr, nullptr);}
+        return rc;
+    }
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "protodec.h"
+
+struct sqlite3;
+struct sqlite3_api_routines;
+
+// Statements only compiled when statistics are enabled, build with -DSQLITE_PROTOBUF_NO_STATS to remove them
+#ifndef SQLITE_PROTOBUF_NO_STATS
+#define PROTOBUF_STATS(statement) statement
+#else
+#define PROTOBUF_STATS(statement)
+#endif
+
+namespace sqlite_protobuf
+{
+
+    /// Functions that statistics are collected for, rows of protobuf_stats
+    enum StatsFunction
+    {
+        STATS_EXTRACT,
+        STATS_LOCATE,
+        STATS_TO_JSON,
+        STATS_EACH,
+        STATS_CONTAINS_TEXT,
+        STATS_PATH_CACHE,
+        STATS_NUM_FUNCTIONS,
+    };
+
+    /// Counters summed over the calls of a function
+    enum StatsCounter
+    {
+        STATS_CALLS,
+        STATS_BYTES,                // Size of the messages
+        STATS_NANOSECONDS,          // Time spent in the function
+        STATS_CACHE_HITS,
+        STATS_CACHE_MISSES,
+        STATS_CACHE_EVICTIONS,
+        STATS_SPECULATIVE_FAILURES, // Length delimited fields that could not be decoded as sub messages
+        STATS_ALLOC_BYTES,          // Bytes allocated for decoded fields
+        STATS_NUM_COUNTERS,
+    };
+
+    /// Add to a counter of a function in the statistics of the current thread, cache hits and
+    /// misses are also noted in the details of the current call
+    void stats_add(StatsFunction function, StatsCounter counter, uint64_t n);
+
+    /// Record the decoded message of a function: the fields that were not sub messages, the
+    /// memory allocated for the fields and the depth of the message
+    void stats_decoded(StatsFunction function, const Field &root);
+
+    struct StatsCounters;
+
+    /// Details of a call of a function, which are added to the statistics and written to the log
+    /// with sqlite3_log when the call is slower or the message is larger than the thresholds set
+    /// with protobuf_slow_log
+    struct StatsCall
+    {
+        StatsFunction function;
+        uint64_t bytes;             // Size of the message
+        uint64_t nanoseconds;       // Time spent in the call
+        uint64_t nodes;             // Fields decoded
+        uint64_t failures;          // Fields that could not be decoded as sub messages
+        int cache;                  // 1 if the decoded message was found in the cache, 0 if not, -1 if not looked up
+        std::string path;           // Path of the call, only kept while slow calls are logged
+        StatsCounters *pathCounters;
+    };
+
+    /// Current time in nanoseconds, for timing calls
+    uint64_t stats_clock();
+
+    /// Start a call with a message of the given size
+    void stats_begin(StatsCall &call, StatsFunction function, uint64_t bytes);
+
+    /// Set the path of a call, calls of protobuf_extract are also counted for the path
+    void stats_path(StatsCall &call, const std::string &path);
+
+    /// Add the call to the statistics of the current thread, and log it if it is slow
+    void stats_record(StatsCall &call);
+
+    /// Times a call of a function, the call is recorded when the scope ends. The counters added
+    /// for the function while the scope is active also update the details of the call.
+    class StatsScope
+    {
+    public:
+        StatsScope(StatsFunction function, uint64_t bytes);
+        ~StatsScope();
+
+        /// Also record the call for the path, for the breakdown by path
+        void set_path(const std::string &path);
+
+        StatsCall call;
+
+    private:
+        uint64_t start;
+        StatsScope *previous;
+    };
+
+    /// Adds the time until the end of the scope to a call that spans several methods of a virtual table
+    class StatsTimer
+    {
+    public:
+        StatsTimer(StatsCall &call) : call(call), start(stats_clock()) {}
+        ~StatsTimer() {call.nanoseconds += stats_clock() - start;}
+
+    private:
+        StatsCall &call;
+        uint64_t start;
+    };
+
+    int register_protobuf_stats(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi);
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,218 @@
+#include "protobuf_tokenizer.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <vector>
+#include <new>
+
+#include "protodec.h"
+#include "protobuf_path.h"
+#include "protobuf_column.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    namespace
+    {
+        /// Tokenizer created for each FTS5 table, from the arguments of the tokenize option
+        struct ProtobufTokenizer
+        {
+            std::vector<CompiledPath> paths; // Paths of the fields to index, all text fields if empty
+            bool fields;                     // Also index each word prefixed with its field number
+        };
+
+        /// Token callback of FTS5 with its context
+        struct TokenizeContext
+        {
+            const ProtobufTokenizer *tokenizer;
+            void *pCtx;
+            int (*xToken)(void*, int, const char*, int, int, int);
+            const char *pText;  // Start of the text, token offsets are relative to it
+            int flags;          // FTS5_TOKENIZE_* flags
+            std::string token;  // Buffer holding the folded token
+        };
+
+        bool is_word(uint8_t c)
+        {
+            return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c >= 0x80;
+        }
+
+        bool is_digit(uint8_t c)
+        {
+            return c >= '0' && c <= '9';
+        }
+
+        /// Split text into words, which are runs of ASCII letters, digits and underscores or of
+        /// non ASCII characters, ASCII letters are folded to lower case. When field numbers are
+        /// indexed, each word of a document is followed by the same word prefixed by the field
+        /// number, such as "2:hello", at the same position. Queries may use the prefixed words.
+        int tokenize_text(TokenizeContext &ctx, const Buffer &text, uint32_t fieldNum)
+        {
+            bool query = (ctx.flags & FTS5_TOKENIZE_QUERY) != 0;
+            std::string prefix = std::to_string(fieldNum) + ":";
+
+            const uint8_t *p = text.start;
+            while (p < text.end)
+            {
+                while (p < text.end && !is_word(*p)) {p++;}
+                const uint8_t *start = p;
+
+                // Prefixed words of queries are kept as one token
+                if (query && ctx.tokenizer->fields)
+                {
+                    const uint8_t *q = p;
+                    while (q < text.end && is_digit(*q)) {q++;}
+                    if (q > p && q + 1 < text.end && *q == ':' && is_word(q[1])) {p = q + 1;}
+                }
+                while (p < text.end && is_word(*p)) {p++;}
+                if (p == start) {break;}
+
+                ctx.token.assign((const char *)start, p - start);
+                for (size_t i = 0; i < ctx.token.size(); i++)
+                {
+                    if (ctx.token[i] >= 'A' && ctx.token[i] <= 'Z') {ctx.token[i] += 'a' - 'A';}
+                }
+
+                int iStart = (int)((const char *)start - ctx.pText);
+                int iEnd = (int)((const char *)p - ctx.pText);
+                int rc = ctx.xToken(ctx.pCtx, 0, ctx.token.data(), (int)ctx.token.size(), iStart, iEnd);
+                if (rc == SQLITE_OK && !query && ctx.tokenizer->fields)
+                {
+                    ctx.token.insert(0, prefix);
+                    rc = ctx.xToken(ctx.pCtx, FTS5_TOKEN_COLOCATED, ctx.token.data(), (int)ctx.token.size(), iStart, iEnd);
+                }
+                if (rc != SQLITE_OK) {return rc;}
+            }
+            return SQLITE_OK;
+        }
+
+        /// Tokenize all text fields of a message, tags, lengths and numeric fields are skipped
+        /// like in protobuf_contains_text, and length delimited fields that parse as messages
+        /// are tokenized as sub messages, like the decoder does even if they are also text
+        int tokenize_message(TokenizeContext &ctx, const Buffer &message)
+        {
+            Buffer b = message;
+            Field field;
+            int rc = SQLITE_OK;
+            while (rc == SQLITE_OK && b.start < b.end && readField(&b, &field))
+            {
+                switch (field.wireType)
+                {
+                case WIRETYPE_LEN:
+                    if (field.value.size() > 0 && isMessage(field.value)) {rc = tokenize_message(ctx, field.value);}
+                    else if (isText(field.value)) {rc = tokenize_text(ctx, field.value, field.fieldNum);}
+                    break;
+                case WIRETYPE_SGROUP:
+                    rc = tokenize_message(ctx, field.value);
+                    break;
+                default:
+                    break;
+                }
+            }
+            return rc;
+        }
+
+        /// Create a tokenizer, the arguments are the paths of the fields to index and the
+        /// option "fields" to index the words prefixed with their field number
+        ///
+        ///     CREATE VIRTUAL TABLE docs USING fts5(data, tokenize = "protobuf fields '$.2' '$.3[*].1'");
+        int protobuf_tokenizer_create(void *pUserData, const char **azArg, int nArg, Fts5Tokenizer **ppOut)
+        {
+            ProtobufTokenizer *tokenizer = new (std::nothrow) ProtobufTokenizer();
+            if (tokenizer == nullptr) {return SQLITE_NOMEM;}
+            tokenizer->fields = false;
+
+            for (int i = 0; i < nArg; i++)
+            {
+                std::string arg = sql_dequote(azArg[i]);
+                std::string error;
+                if (arg == "fields")
+                {
+                    tokenizer->fields = true;
+                    continue;
+                }
+                tokenizer->paths.push_back(CompiledPath());
+                if (!path_compile(arg, tokenizer->paths.back(), error))
+                {
+                    delete tokenizer;
+                    return SQLITE_ERROR;
+                }
+            }
+
+            *ppOut = (Fts5Tokenizer *)tokenizer;
+            return SQLITE_OK;
+        }
+
+        void protobuf_tokenizer_delete(Fts5Tokenizer *pTok)
+        {
+            delete (ProtobufTokenizer *)pTok;
+        }
+
+        /// Tokenize a document, which is a protobuf message, or a query, which is text
+        int protobuf_tokenizer_tokenize(Fts5Tokenizer *pTok, void *pCtx, int flags, const char *pText, int nText,
+                                        int (*xToken)(void*, int, const char*, int, int, int))
+        {
+            TokenizeContext ctx;
+            ctx.tokenizer = (const ProtobufTokenizer *)pTok;
+            ctx.pCtx = pCtx;
+            ctx.xToken = xToken;
+            ctx.pText = pText;
+            ctx.flags = flags;
+
+            Buffer buffer;
+            buffer.start = (const uint8_t *)pText;
+            buffer.end = buffer.start + (nText > 0 ? nText : 0);
+            if (flags & FTS5_TOKENIZE_QUERY)
+            {
+                return tokenize_text(ctx, buffer, 0);
+            }
+            if (ctx.tokenizer->paths.empty())
+            {
+                return tokenize_message(ctx, buffer);
+            }
+
+            // Tokenize the fields matched by each path, text fields or all text fields of sub messages
+            static const WireType wireTypes[] = {WIRETYPE_LEN, WIRETYPE_SGROUP};
+            std::vector<Field> matches;
+            int rc = SQLITE_OK;
+            for (size_t i = 0; i < ctx.tokenizer->paths.size() && rc == SQLITE_OK; i++)
+            {
+                matches.clear();
+                path_match(&ctx.tokenizer->paths[i], buffer, wireTypes, 2, -1, matches);
+                for (size_t j = 0; j < matches.size() && rc == SQLITE_OK; j++)
+                {
+                    const Field &field = matches[j];
+                    if (field.wireType == WIRETYPE_SGROUP || (field.value.size() > 0 && isMessage(field.value))) {rc = tokenize_message(ctx, field.value);}
+                    else if (isText(field.value)) {rc = tokenize_text(ctx, field.value, field.fieldNum);}
+                }
+            }
+            return rc;
+        }
+
+        /// Get the FTS5 API of the connection, or nullptr if SQLite is built without FTS5
+        fts5_api* fts5_api_from_db(sqlite3 *db)
+        {
+            fts5_api *api = nullptr;
+            sqlite3_stmt *stmt = nullptr;
+            if (sqlite3_libversion_number() >= 3020000 && sqlite3_prepare_v2(db, "SELECT fts5(?1)", -1, &stmt, 0) == SQLITE_OK)
+            {
+                sqlite3_bind_pointer(stmt, 1, (void *)&api, "fts5_api_ptr", nullptr);
+                sqlite3_step(stmt);
+            }
+            sqlite3_finalize(stmt);
+            return api;
+        }
+    } // namespace
+
+    int register_protobuf_tokenizer(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        // The tokenizer is only available when SQLite is built with FTS5
+        fts5_api *api = fts5_api_from_db(db);
+        if (api == nullptr || api->iVersion < 2) {return SQLITE_OK;}
+
+        fts5_tokenizer tokenizer = {protobuf_tokenizer_create, protobuf_tokenizer_delete, protobuf_tokenizer_tokenize};
+        return api->xCreateTokenizer(api, "protobuf", nullptr, &tokenizer, nullptr);
+    }
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,58 @@
+#include "protobuf_trace.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <cstdio>
+
+#include "trace.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    namespace
+    {
+        /// Write the spans recorded around the phases of decoding to a file as Chrome trace
+        /// event JSON. The spans are only recorded when the extension is built with tracing.
+        ///
+        ///     SELECT protobuf_trace_dump('trace.json');
+        ///
+        /// @returns the number of spans written
+        void protobuf_trace_dump(sqlite3_context *context, int argc, sqlite3_value **argv)
+        {
+            #ifndef SQLITE_PROTOBUF_TRACE
+            sqlite3_result_error(context, "Tracing is compiled out, configure with -DSQLITE_PROTOBUF_TRACE=ON", -1);
+            #else
+            const char *path = (const char *)sqlite3_value_text(argv[0]);
+            if (path == nullptr)
+            {
+                sqlite3_result_error(context, "File name must not be NULL", -1);
+                return;
+            }
+
+            std::string json;
+            size_t numSpans = trace_to_json(json);
+
+            FILE *file = fopen(path, "wb");
+            bool ok = file != nullptr && fwrite(json.data(), 1, json.size(), file) == json.size();
+            if (file != nullptr && fclose(file) != 0) {ok = false;}
+            if (!ok)
+            {
+                char *error = sqlite3_mprintf("Could not write file: %s", path);
+                sqlite3_result_error(context, error != nullptr ? error : "Could not write file", -1);
+                sqlite3_free(error);
+                return;
+            }
+            sqlite3_result_int64(context, (sqlite3_int64)numSpans);
+            #endif
+        }
+    } // namespace
+
+    int register_protobuf_trace(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        // Writing files is only allowed from top level SQL, not from triggers and views in the schema
+        int flags = SQLITE_UTF8 | (sqlite3_libversion_number() >= 3030000 ? SQLITE_DIRECTONLY : 0);
+        return sqlite3_create_function(db, "protobuf_trace_dump", 1, flags, nullptr, protobuf_trace_dump, nullptr, nullptr);
+    }
+
+} // namespace sqlite_protobuf
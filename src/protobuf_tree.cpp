@@ -0,0 +1,575 @@
+#include "protobuf_tree.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <new>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "protodec.h"
+#include "protobuf_path.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    namespace
+    {
+        std::string string_from_sqlite3_value(sqlite3_value *value)
+        {
+            const char *text = static_cast<const char *>(sqlite3_value_blob(value));
+            size_t text_size = static_cast<size_t>(sqlite3_value_bytes(value));
+            return std::string(text, text_size);
+        }
+    } // namespace
+
+    /*
+    ** Define virtual table data structure containg data needed for virtual table
+    */
+    typedef struct ProtobufTreeVtab ProtobufTreeVtab;
+    struct ProtobufTreeVtab
+    {
+        sqlite3_vtab base;  // Base class - must be first
+        PathCache *cache;   // Path cache of the connection
+    };
+
+    /*
+    ** Message being walked, there is one for each message between the root and the current row
+    */
+    typedef struct ProtobufTreeFrame ProtobufTreeFrame;
+    struct ProtobufTreeFrame
+    {
+        Buffer remaining;           // Unread part of the message
+        size_t pathLength;          // Length of the path of the message
+        sqlite3_int64 id;           // Id of the message
+        int depth;                  // Depth of the message, the root has depth 0
+        std::map<uint32_t, uint32_t> occurrences; // Number of fields read so far for each field number and wire type
+    };
+
+    /*
+    ** Define cursor data structure, used to walk the message depth first. The fields are
+    ** read one at a time as the cursor advances, and sub messages are entered as they are
+    ** reached, so the message is decoded once no matter how deep it is
+    */
+    typedef struct ProtobufTreeCursor ProtobufTreeCursor;
+    struct ProtobufTreeCursor
+    {
+        sqlite3_vtab_cursor base;   // Base class - must be first
+        Buffer buffer;              // Protobuf message
+        std::string root;           // Path to root field
+        std::vector<ProtobufTreeFrame> stack; // Messages between the root and the current row
+        bool eof;                   // Walk is done
+
+        // Current row
+        std::string path;           // Path of the field
+        int depth;                  // Depth of the field, the root has depth 0
+        bool hasField;              // Field has a field number and wire type (false for the whole message)
+        uint32_t field;             // Field number
+        uint32_t wireType;          // Wire type
+        Buffer value;               // Value of the field
+        sqlite3_int64 id;           // Offset of the value in the message, unique for each field
+        sqlite3_int64 parentId;     // Id of the message the field belongs to, or -1 for the root
+        bool message;               // Field is a message that can be walked
+
+        // Pushed down constraints
+        int maxDepth;               // Fields deeper than this are skipped, or -1 if unlimited
+        std::vector<std::string> prefixes; // Fields must have a path that starts with, or is the start of, each prefix
+    };
+
+    /*
+    ** Constructor for ProtobufTreeVtab objects.
+    */
+    static int protobufTreeConnect(sqlite3 *db, void *pAux, int argc, const char *const*argv, sqlite3_vtab **ppVtab, char **pzErr)
+    {
+        /* For convenience, define symbolic names for the index to each column. */
+        #define PROTOBUF_TREE_PATH      0
+        #define PROTOBUF_TREE_DEPTH     1
+        #define PROTOBUF_TREE_FIELD     2
+        #define PROTOBUF_TREE_WIRETYPE  3
+        #define PROTOBUF_TREE_VALUE     4
+        #define PROTOBUF_TREE_PARENT_ID 5
+        #define PROTOBUF_TREE_ID        6
+        #define PROTOBUF_TREE_BUFFER    7 // First argument (marked as HIDDEN) protobuf buffer
+        #define PROTOBUF_TREE_ROOT      8 // Second argument (marked as HIDDEN) root path
+
+        /* Flags of idxNum, telling xFilter which arguments are supplied */
+        #define PROTOBUF_TREE_PLAN_BUFFER 1
+        #define PROTOBUF_TREE_PLAN_ROOT   2
+
+        /* Characters of idxStr for the constraints on DEPTH and PATH that prune the walk */
+        #define PROTOBUF_TREE_DEPTH_LE 'd'
+        #define PROTOBUF_TREE_DEPTH_LT 'l'
+        #define PROTOBUF_TREE_DEPTH_EQ 'e'
+        #define PROTOBUF_TREE_PATH_EQ  'p'
+        #define PROTOBUF_TREE_PATH_LIKE 'k'
+        #define PROTOBUF_TREE_PATH_GLOB 'g'
+
+        /* Size of a message assumed when planning without the actual message, and average size of a field */
+        #define PROTOBUF_TREE_DEFAULT_BYTES    1024.0
+        #define PROTOBUF_TREE_BYTES_PER_FIELD  8.0
+
+        // Tell SQLite what the result set of queries against the virtual table will look like.
+        ProtobufTreeVtab *pNew;
+        int rc = sqlite3_declare_vtab(db,"CREATE TABLE x(path,depth,field,wiretype,value,parent_id,id,buffer HIDDEN,root HIDDEN)");
+
+        if( rc==SQLITE_OK )
+        {
+            // Allocate the ProtobufTreeVtab object and initialize all fields
+            pNew = (ProtobufTreeVtab *)sqlite3_malloc( sizeof(*pNew) );
+            *ppVtab = (sqlite3_vtab*)pNew;
+            if( pNew==0 ) return SQLITE_NOMEM;
+            memset(pNew, 0, sizeof(*pNew));
+            pNew->cache = (PathCache *)pAux;
+        }
+
+        return rc;
+    }
+
+    /*
+    ** Destructor for ProtobufTreeVtab objects.
+    */
+    static int protobufTreeDisconnect(sqlite3_vtab *pVtab)
+    {
+        ProtobufTreeVtab *p = (ProtobufTreeVtab*)pVtab;
+        sqlite3_free(p);
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Constructor for a new ProtobufTreeCursor object.
+    */
+    static int protobufTreeOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+    {
+        ProtobufTreeCursor *pCur;
+        pCur = new (std::nothrow) ProtobufTreeCursor();
+        if( pCur==0 ) return SQLITE_NOMEM;
+        *ppCursor = &pCur->base;
+        pCur->eof = true;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for a ProtobufTreeCursor.
+    */
+    static int protobufTreeClose(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufTreeCursor *pCur = (ProtobufTreeCursor*)cur;
+        delete pCur;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Check if fields below a path can match the path constraints, the path must start
+    ** with each prefix, or be the start of it (the field is an ancestor of the matches).
+    */
+    static bool protobufTreeCompatible(const ProtobufTreeCursor *pCur, const std::string &path)
+    {
+        for (size_t i = 0; i < pCur->prefixes.size(); i++)
+        {
+            const std::string &prefix = pCur->prefixes[i];
+            size_t n = path.size() < prefix.size() ? path.size() : prefix.size();
+            if (path.compare(0, n, prefix, 0, n) != 0) {return false;}
+        }
+        return true;
+    }
+
+    /*
+    ** Advance a ProtobufTreeCursor to its next row of output, which is the first sub field
+    ** of the current row if it is a message, and otherwise the next field of the closest
+    ** message that has fields left.
+    */
+    static int protobufTreeNext(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufTreeCursor *pCur = (ProtobufTreeCursor*)cur;
+
+        // Enter the current row if it is a message, unless the sub fields are too deep
+        if (pCur->message && (pCur->maxDepth < 0 || pCur->depth < pCur->maxDepth))
+        {
+            ProtobufTreeFrame frame;
+            frame.remaining = pCur->value;
+            frame.pathLength = pCur->path.size();
+            frame.id = pCur->id;
+            frame.depth = pCur->depth;
+            pCur->stack.push_back(frame);
+        }
+
+        while (!pCur->stack.empty())
+        {
+            ProtobufTreeFrame &frame = pCur->stack.back();
+            Field field;
+            if (frame.remaining.start >= frame.remaining.end || !readField(&frame.remaining, &field))
+            {
+                pCur->stack.pop_back();
+                continue;
+            }
+
+            // Index of the field among the fields with the same number, LEN and SGROUP are counted
+            // together like path_match and traverse_path count the entries leading to a field,
+            // so the paths inside sub messages resolve with protobuf_extract. Other wire types are
+            // counted separately like the typed values of protobuf_extract.
+            uint32_t wireType = field.wireType == WIRETYPE_SGROUP ? (uint32_t)WIRETYPE_LEN : field.wireType;
+            uint32_t index = frame.occurrences[(field.fieldNum << 3) | wireType]++;
+
+            pCur->path.resize(frame.pathLength);
+            pCur->path += "." + std::to_string(field.fieldNum) + "[" + std::to_string(index) + "]";
+            if (!protobufTreeCompatible(pCur, pCur->path)) {continue;}
+
+            pCur->depth = frame.depth + 1;
+            pCur->hasField = true;
+            pCur->field = field.fieldNum;
+            pCur->wireType = field.wireType;
+            pCur->value = field.value;
+            pCur->id = field.value.start - pCur->buffer.start;
+            pCur->parentId = frame.id;
+            pCur->message = field.wireType == WIRETYPE_SGROUP || (field.wireType == WIRETYPE_LEN && isMessage(field.value));
+            return SQLITE_OK;
+        }
+
+        pCur->eof = true;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return value at given column and row (ProtobufTreeCursor).
+    */
+    static int protobufTreeColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+    {
+        ProtobufTreeCursor *pCur = (ProtobufTreeCursor *)cur;
+
+        switch (col)
+        {
+        case PROTOBUF_TREE_PATH:
+            sqlite3_result_text(ctx, pCur->path.c_str(), pCur->path.size(), SQLITE_TRANSIENT);
+            break;
+        case PROTOBUF_TREE_DEPTH:
+            sqlite3_result_int(ctx, pCur->depth);
+            break;
+        case PROTOBUF_TREE_FIELD:
+            if (pCur->hasField) {sqlite3_result_int64(ctx, pCur->field);}
+            break;
+        case PROTOBUF_TREE_WIRETYPE:
+            if (pCur->hasField) {sqlite3_result_int64(ctx, pCur->wireType);}
+            break;
+        case PROTOBUF_TREE_VALUE:
+            sqlite3_result_blob(ctx, (char*)pCur->value.start, pCur->value.size(), SQLITE_STATIC);
+            break;
+        case PROTOBUF_TREE_PARENT_ID:
+            if (pCur->parentId >= 0) {sqlite3_result_int64(ctx, pCur->parentId);}
+            break;
+        case PROTOBUF_TREE_ID:
+            sqlite3_result_int64(ctx, pCur->id);
+            break;
+        case PROTOBUF_TREE_BUFFER:
+            sqlite3_result_blob(ctx, (char*)pCur->buffer.start, pCur->buffer.size(), SQLITE_STATIC);
+            break;
+        case PROTOBUF_TREE_ROOT:
+            sqlite3_result_text(ctx, pCur->root.c_str(), pCur->root.size(), SQLITE_TRANSIENT);
+            break;
+        default:
+            break;
+        }
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return the rowid for the current row.
+    */
+    static int protobufTreeRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+    {
+        ProtobufTreeCursor *pCur = (ProtobufTreeCursor*)cur;
+        *pRowid = pCur->id;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return TRUE if the cursor has been moved off of the last row of output.
+    */
+    static int protobufTreeEof(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufTreeCursor *pCur = (ProtobufTreeCursor*)cur;
+        return pCur->eof;
+    }
+
+    /*
+    ** Apply a constraint on DEPTH, the walk does not enter messages deeper than needed.
+    ** Only numeric values are used, since any number compares less than text in SQLite.
+    */
+    static void protobufTreeLimitDepth(ProtobufTreeCursor *pCur, char op, sqlite3_value *value)
+    {
+        int type = sqlite3_value_type(value);
+        if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) {return;}
+
+        double limit = sqlite3_value_double(value);
+        double maxDepth = op == PROTOBUF_TREE_DEPTH_LT ? ceil(limit) - 1 : floor(limit);
+        if (maxDepth > INT32_MAX) {return;}
+        int depth = maxDepth < -1 ? -1 : (int)maxDepth;
+
+        // A negative depth means that no row can match, which is different from unlimited
+        if (depth < 0) {pCur->eof = true;}
+        if (pCur->maxDepth < 0 || depth < pCur->maxDepth) {pCur->maxDepth = depth;}
+    }
+
+    /*
+    ** Apply a constraint on PATH, the part of the pattern before the first wildcard is the
+    ** prefix that all matching paths start with.
+    */
+    static void protobufTreeLimitPath(ProtobufTreeCursor *pCur, char op, sqlite3_value *value)
+    {
+        if (sqlite3_value_type(value) != SQLITE_TEXT) {return;}
+
+        std::string pattern = string_from_sqlite3_value(value);
+        const char *wildcards = op == PROTOBUF_TREE_PATH_LIKE ? "%_" : (op == PROTOBUF_TREE_PATH_GLOB ? "*?[" : "");
+        size_t end = *wildcards ? pattern.find_first_of(wildcards) : std::string::npos;
+        pCur->prefixes.push_back(pattern.substr(0, end));
+    }
+
+    /*
+    ** This method is called to "rewind" the ProtobufTreeCursor object back
+    ** to the first row of output.  This method is always called at least
+    ** once prior to any call to protobufTreeColumn() or protobufTreeRowid() or
+    ** protobufTreeEof().
+    */
+    static int protobufTreeFilter(sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv)
+    {
+        ProtobufTreeCursor *pCur = (ProtobufTreeCursor *)cur;
+        pCur->stack.clear();
+        pCur->prefixes.clear();
+        pCur->maxDepth = -1;
+        pCur->eof = true;
+        pCur->root = "$";
+
+        // Query strategy 0, no buffer supplied
+        if((idxNum & PROTOBUF_TREE_PLAN_BUFFER) == 0)
+        {
+            return SQLITE_OK;
+        }
+        pCur->eof = false;
+
+        // Constraints that prune the walk, one character per argument in idxStr
+        int iArg = (idxNum & PROTOBUF_TREE_PLAN_ROOT) ? 2 : 1;
+        for (const char *c = idxStr; c != nullptr && *c != 0 && iArg < argc; c++, iArg++)
+        {
+            if (*c == PROTOBUF_TREE_DEPTH_LE || *c == PROTOBUF_TREE_DEPTH_LT || *c == PROTOBUF_TREE_DEPTH_EQ)
+            {
+                protobufTreeLimitDepth(pCur, *c, argv[iArg]);
+            }
+            else
+            {
+                protobufTreeLimitPath(pCur, *c, argv[iArg]);
+            }
+        }
+
+        Buffer buffer;
+        buffer.start = static_cast<const uint8_t*>(sqlite3_value_blob(argv[0]));
+        buffer.end = buffer.start + static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+        pCur->buffer = buffer;
+
+        // The root row is the whole message, or the field at the root path
+        pCur->depth = 0;
+        pCur->hasField = false;
+        pCur->value = buffer;
+        pCur->message = isMessage(buffer);
+
+        const std::string path = (idxNum & PROTOBUF_TREE_PLAN_ROOT) ? string_from_sqlite3_value(argv[1]) : std::string();
+        if (path.length() != 0)
+        {
+            // Look up compiled path in the path cache of the connection
+            std::string error;
+            CompiledPath *compiled = path_lookup(((ProtobufTreeVtab *)cur->pVtab)->cache, path, error);
+            if (compiled == nullptr || compiled->multi)
+            {
+                if (compiled != nullptr) {error = "Path not valid, protobuf_tree does not support wildcards, slices, filters or '..'";}
+                if (compiled != nullptr) {path_release(compiled);}
+                sqlite3_free(cur->pVtab->zErrMsg);
+                cur->pVtab->zErrMsg = sqlite3_mprintf("%s", error.c_str());
+                return SQLITE_ERROR;
+            }
+            pCur->root = path;
+
+            // Traverse the message, only the field headers along the path are read
+            static const WireType message[] = {WIRETYPE_LEN, WIRETYPE_SGROUP};
+            Field field;
+            for (size_t i = 0; compiled->steps[i].fieldNumber != 0 && !pCur->eof; i++)
+            {
+                pCur->eof = !pCur->message || !findField(&pCur->value, compiled->steps[i].fieldNumber, message, 2, compiled->steps[i].fieldIndex, &field);
+                if (pCur->eof) {break;}
+                pCur->hasField = true;
+                pCur->field = field.fieldNum;
+                pCur->wireType = field.wireType;
+                pCur->value = field.value;
+                pCur->message = field.wireType == WIRETYPE_SGROUP || isMessage(field.value);
+            }
+            path_release(compiled);
+        }
+
+        pCur->path = pCur->root;
+        pCur->id = pCur->value.start - buffer.start;
+        pCur->parentId = -1;
+        pCur->eof = pCur->eof || !protobufTreeCompatible(pCur, pCur->path);
+        return SQLITE_OK;
+    }
+
+    /*
+    ** SQLite will invoke this method one or more times while planning a query
+    ** that uses the virtual table.  This routine needs to create a query plan
+    ** for each invocation and compute an estimated cost for that plan.
+    ** The query strategy here is to look for an equality constraint on the buffer
+    ** column.  Without such a constraint, the table cannot operate.  idxNum
+    ** represents the strategy, and is 1 if the constraint is found, 3 if the
+    ** constraint and root are found, and 0 otherwise. Constraints on depth and
+    ** path are passed on to xFilter to prune the walk, they are listed in idxStr
+    ** and still checked by SQLite.
+    */
+    static int protobufTreeBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo)
+    {
+        int aIdx[2];          // Index of constraints for BUFFER and ROOT
+        int unusableMask = 0; // Mask of unusable BUFFER and ROOT constraints
+        int idxMask = 0;      // Mask of usable == constraints BUFFER and ROOT
+        std::string idxStr;   // Constraints on DEPTH and PATH
+        std::vector<int> aPrune; // Index of constraints on DEPTH and PATH
+        const struct sqlite3_index_info::sqlite3_index_constraint *pConstraint;
+
+        // This implementation assumes that BUFFER and ROOT are the last two columns in the table
+        aIdx[0] = aIdx[1] = -1;
+        pConstraint = pIdxInfo->aConstraint;
+        for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++)
+        {
+            int iCol = pConstraint->iColumn - PROTOBUF_TREE_BUFFER;
+            int iMask = 1 << iCol;
+            if (iCol >= 0)
+            {
+                if (pConstraint->usable == 0)
+                {
+                    unusableMask |= iMask;
+                }
+                else if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ)
+                {
+                    aIdx[iCol] = i;
+                    idxMask |= iMask;
+                }
+                continue;
+            }
+            if (pConstraint->usable == 0) {continue;}
+
+            char c = 0;
+            if (pConstraint->iColumn == PROTOBUF_TREE_DEPTH)
+            {
+                if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_LE) {c = PROTOBUF_TREE_DEPTH_LE;}
+                if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_LT) {c = PROTOBUF_TREE_DEPTH_LT;}
+                if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {c = PROTOBUF_TREE_DEPTH_EQ;}
+            }
+            else if (pConstraint->iColumn == PROTOBUF_TREE_PATH)
+            {
+                if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {c = PROTOBUF_TREE_PATH_EQ;}
+                if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_LIKE) {c = PROTOBUF_TREE_PATH_LIKE;}
+                if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_GLOB) {c = PROTOBUF_TREE_PATH_GLOB;}
+            }
+            if (c != 0)
+            {
+                idxStr += c;
+                aPrune.push_back(i);
+            }
+        }
+
+        if ((unusableMask & ~idxMask) != 0)
+        {
+            // If there are any unusable constraints on BUFFER or ROOT, then reject this entire plan
+            return SQLITE_CONSTRAINT;
+        }
+        if (aIdx[0] < 0)
+        {
+            // No BUFFER input. Leave estimatedCost at the huge initial value to discourage query planner from using this plan.
+            pIdxInfo->idxNum = 0;
+            return SQLITE_OK;
+        }
+
+        pIdxInfo->aConstraintUsage[aIdx[0]].argvIndex = 1;
+        pIdxInfo->aConstraintUsage[aIdx[0]].omit = 1;
+        if (aIdx[1] < 0)
+        {
+            pIdxInfo->idxNum = 1; // Only BUFFER supplied.  Plan 1
+        }
+        else
+        {
+            pIdxInfo->aConstraintUsage[aIdx[1]].argvIndex = 2;
+            pIdxInfo->aConstraintUsage[aIdx[1]].omit = 1;
+            pIdxInfo->idxNum = 3; // Both BUFFER and ROOT are supplied.  Plan 3
+        }
+
+        // Constraints on DEPTH and PATH are not omitted, they only tell the cursor which messages it can skip
+        int argvIndex = pIdxInfo->idxNum == 3 ? 3 : 2;
+        for (size_t i = 0; i < aPrune.size(); i++)
+        {
+            pIdxInfo->aConstraintUsage[aPrune[i]].argvIndex = argvIndex++;
+        }
+        if (!idxStr.empty())
+        {
+            pIdxInfo->idxStr = sqlite3_mprintf("%s", idxStr.c_str());
+            pIdxInfo->needToFreeIdxStr = 1;
+            if (pIdxInfo->idxStr == nullptr) {return SQLITE_NOMEM;}
+        }
+
+        // Rows are returned depth first in message order, which is the order of the id
+        if (pIdxInfo->nOrderBy == 1 && (pIdxInfo->aOrderBy[0].iColumn < 0 || pIdxInfo->aOrderBy[0].iColumn == PROTOBUF_TREE_ID) && pIdxInfo->aOrderBy[0].desc == 0)
+        {
+            pIdxInfo->orderByConsumed = 1;
+        }
+
+        // Estimate the number of fields from the size of the message when it is known up front
+        double nBytes = PROTOBUF_TREE_DEFAULT_BYTES;
+        sqlite3_value *pBuffer = nullptr;
+        if (sqlite3_libversion_number() >= 3038000 && sqlite3_vtab_rhs_value(pIdxInfo, aIdx[0], &pBuffer) == SQLITE_OK && pBuffer != nullptr)
+        {
+            nBytes = sqlite3_value_bytes(pBuffer);
+        }
+        double nRows = nBytes / PROTOBUF_TREE_BYTES_PER_FIELD + 1;
+        for (size_t i = 0; i < aPrune.size(); i++)
+        {
+            nRows *= 0.25;
+        }
+
+        pIdxInfo->estimatedCost = nRows;
+        pIdxInfo->estimatedRows = (sqlite3_int64)nRows + 1;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Define all the methods for the module (virtual table).
+    */
+    static sqlite3_module protobufTreeModule = {
+        /* iVersion    */ 0,
+        /* xCreate     */ 0,
+        /* xConnect    */ protobufTreeConnect,
+        /* xBestIndex  */ protobufTreeBestIndex,
+        /* xDisconnect */ protobufTreeDisconnect,
+        /* xDestroy    */ 0,
+        /* xOpen       */ protobufTreeOpen,
+        /* xClose      */ protobufTreeClose,
+        /* xFilter     */ protobufTreeFilter,
+        /* xNext       */ protobufTreeNext,
+        /* xEof        */ protobufTreeEof,
+        /* xColumn     */ protobufTreeColumn,
+        /* xRowid      */ protobufTreeRowid,
+        /* xUpdate     */ 0,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ 0,
+        /* xSavepoint  */ //0, // iVersion >= 2
+        /* xRelease    */ //0, // iVersion >= 2
+        /* xRollbackTo */ //0, // iVersion >= 2
+        /* xShadowName */ //0, // iVersion >= 3
+        /* xIntegrity  */ //0, // iVersion >= 4
+    };
+
+    int register_protobuf_tree(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        return sqlite3_create_module_v2(db, "protobuf_tree", &protobufTreeModule, path_cache_acquire(db), path_cache_release);
+    }
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,384 @@
+#include "protobuf_type.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+
+#include "protodec.h"
+#include "protobuf_path.h"
+#include "trace.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    Type type_from_string(const std::string &type)
+    {
+        
+        switch (type.length())
+        {
+        case 0: // ""
+            return TYPE_BUFFER;
+        case 4: // bool
+            if (type == "bool") {return TYPE_BOOL;}
+            if (type == "enum") {return TYPE_ENUM;}
+            return TYPE_UNKNOWN;
+        case 5: // bytes, int32, int64, float
+            if (type == "bytes") {return TYPE_BYTES;}
+            if (type == "int32") {return TYPE_INT32;}
+            if (type == "int64") {return TYPE_INT64;}
+            if (type == "float") {return TYPE_FLOAT;}
+            return TYPE_UNKNOWN;
+        case 6: // string, uint32, uint64, sint32, sint64, double
+            if (type == "string") {return TYPE_STRING;}
+            if (type == "uint32") {return TYPE_UINT32;}
+            if (type == "uint64") {return TYPE_UINT64;}
+            if (type == "sint32") {return TYPE_SINT32;}
+            if (type == "sint64") {return TYPE_SINT64;}
+            if (type == "double") {return TYPE_DOUBLE;}
+            return TYPE_UNKNOWN;
+        case 7: // fixed64, fixed32
+            if (type == "fixed64") {return TYPE_FIXED64;}
+            if (type == "fixed32") {return TYPE_FIXED32;}
+            return TYPE_UNKNOWN;
+        case 8: // sfixed64, sfixed32
+            if (type == "sfixed64") {return TYPE_SFIXED64;}
+            if (type == "sfixed32") {return TYPE_SFIXED32;}
+            return TYPE_UNKNOWN;
+        default:
+            return TYPE_UNKNOWN;
+        }
+    }
+
+    bool value_from_buffer(Type type, const Buffer &buffer, int32_t index, Value *value)
+    {
+        int32_t valueInt32 = 0;
+        uint32_t valueUint32 = 0;
+        uint64_t valueUint64 = 0;
+        float valueFloat = 0;
+        bool valueBool = 0;
+        bool ok = false;
+
+        value->type = SQLITE_INTEGER;
+        value->integer = 0;
+        value->real = 0;
+        value->bytes = buffer;
+        switch (type)
+        {
+        case TYPE_BUFFER:
+        case TYPE_BYTES:
+            value->type = SQLITE_BLOB;
+            return true;
+        case TYPE_STRING:
+            value->type = SQLITE_TEXT;
+            return true;
+        case TYPE_ENUM:
+        case TYPE_INT32:
+            ok = getInt32(&buffer, &valueInt32, index);
+            value->integer = valueInt32;
+            break;
+        case TYPE_INT64:
+            ok = getInt64(&buffer, &value->integer, index);
+            break;
+        case TYPE_UINT32:
+            ok = getUint32(&buffer, &valueUint32, index);
+            value->integer = valueUint32;
+            break;
+        case TYPE_UINT64:
+            ok = getUint64(&buffer, &valueUint64, index);
+            value->integer = (int64_t)valueUint64;
+            if (valueUint64 > INT64_MAX) {sqlite3_log(SQLITE_WARNING,"Protobuf type is unsigned, but SQLite does not support unsigned types. Value %llu doesn't fit in an int64.", valueUint64);}
+            break;
+        case TYPE_SINT32:
+            ok = getSint32(&buffer, &valueInt32, index);
+            value->integer = valueInt32;
+            break;
+        case TYPE_SINT64:
+            ok = getSint64(&buffer, &value->integer, index);
+            break;
+        case TYPE_BOOL:
+            ok = getBool(&buffer, &valueBool, index);
+            value->integer = valueBool ? 1 : 0;
+            break;
+        case TYPE_FIXED64:
+            ok = getFixed64(&buffer, &valueUint64, index);
+            value->integer = (int64_t)valueUint64;
+            if (valueUint64 > INT64_MAX) {sqlite3_log(SQLITE_WARNING,"Protobuf type is unsigned, but SQLite does not support unsigned types. Value %llu doesn't fit in an int64.", valueUint64);}
+            break;
+        case TYPE_SFIXED64:
+            ok = getSfixed64(&buffer, &value->integer, index);
+            break;
+        case TYPE_DOUBLE:
+            value->type = SQLITE_FLOAT;
+            ok = getDouble(&buffer, &value->real, index);
+            break;
+        case TYPE_FIXED32:
+            ok = getFixed32(&buffer, &valueUint32, index);
+            value->integer = valueUint32;
+            break;
+        case TYPE_SFIXED32:
+            ok = getSfixed32(&buffer, &valueInt32, index);
+            value->integer = valueInt32;
+            break;
+        case TYPE_FLOAT:
+            value->type = SQLITE_FLOAT;
+            ok = getFloat(&buffer, &valueFloat, index);
+            value->real = valueFloat;
+            break;
+        default:
+            break;
+        }
+        if (!ok) {value->type = SQLITE_NULL;}
+        return ok;
+    }
+
+    void result_from_value(sqlite3_context *context, const Value &value, void (*destructor)(void*))
+    {
+        switch (value.type)
+        {
+        case SQLITE_INTEGER:
+            sqlite3_result_int64(context, value.integer);
+            return;
+        case SQLITE_FLOAT:
+            sqlite3_result_double(context, value.real);
+            return;
+        case SQLITE_TEXT:
+            sqlite3_result_text(context, (char *)value.bytes.start, value.bytes.size(), destructor);
+            return;
+        case SQLITE_BLOB:
+            sqlite3_result_blob(context, (char *)value.bytes.start, value.bytes.size(), destructor);
+            return;
+        default:
+            return;
+        }
+    }
+
+    void result_from_buffer(sqlite3_context *context, Type type, const Buffer &result, int32_t index, void (*destructor)(void*))
+    {
+        Value value;
+        value_from_buffer(type, result, index, &value);
+        result_from_value(context, value, destructor);
+    }
+
+    Field* traverse_path(Field *root, const Path *path, Type type, int32_t *index)
+    {
+        PROTOBUF_TRACE_SPAN("traverse_path");
+        static const WireType any[] = {WIRETYPE_LEN, WIRETYPE_SGROUP, WIRETYPE_VARINT, WIRETYPE_I64, WIRETYPE_I32};
+
+        Field *field = root;
+        Field *parent = nullptr;
+        *index = 0;
+        for (size_t i = 0; path[i].fieldNumber != 0; i++)
+        {
+            parent = field;
+            field = nullptr;
+            if (path[i+1].fieldNumber != 0) // Not at end of path
+            {
+                field = parent->getSubMessage(path[i].fieldNumber, path[i].fieldIndex);
+            }
+            else
+            {
+                switch (type)
+                {
+                case TYPE_BUFFER:
+                    // We don't know the wire type, so match all in one scan and pick by priority
+                    field = parent->getSubField(path[i].fieldNumber, any, 5, path[i].fieldIndex);
+                    break;
+                case TYPE_STRING:
+                case TYPE_BYTES:
+                    field = parent->getSubField(path[i].fieldNumber, WIRETYPE_LEN, path[i].fieldIndex);
+                    break;
+                case TYPE_INT32:
+                case TYPE_INT64:
+                case TYPE_UINT32:
+                case TYPE_UINT64:
+                case TYPE_SINT32:
+                case TYPE_SINT64:
+                case TYPE_BOOL:
+                case TYPE_ENUM:
+                    field = parent->getSubField(path[i].fieldNumber, WIRETYPE_VARINT, path[i].fieldIndex);
+                    if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_LEN, 0); *index = path[i].fieldIndex;} // Packed repeated
+                    break;
+                case TYPE_FIXED64:
+                case TYPE_SFIXED64:
+                case TYPE_DOUBLE:
+                    field = parent->getSubField(path[i].fieldNumber, WIRETYPE_I64, path[i].fieldIndex);
+                    if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_LEN, 0); *index = path[i].fieldIndex;} // Packed repeated
+                    break;
+                case TYPE_FIXED32:
+                case TYPE_SFIXED32:
+                case TYPE_FLOAT:
+                    field = parent->getSubField(path[i].fieldNumber, WIRETYPE_I32, path[i].fieldIndex);
+                    if (field == nullptr) {field = parent->getSubField(path[i].fieldNumber, WIRETYPE_LEN, 0); *index = path[i].fieldIndex;} // Packed repeated
+                    break;
+                default:
+                    field = nullptr;
+                    break;
+                }
+            }
+
+            if (field == nullptr) {break;}
+        }
+        return field;
+    }
+
+    const WireType* wire_types_from_type(Type type, size_t *numWireTypes, int *packed)
+    {
+        static const WireType any[] = {WIRETYPE_LEN, WIRETYPE_SGROUP, WIRETYPE_VARINT, WIRETYPE_I64, WIRETYPE_I32};
+        static const WireType len[] = {WIRETYPE_LEN};
+        static const WireType varint[] = {WIRETYPE_VARINT};
+        static const WireType i64[] = {WIRETYPE_I64};
+        static const WireType i32[] = {WIRETYPE_I32};
+
+        *numWireTypes = 1;
+        *packed = -1;
+        switch (type)
+        {
+        case TYPE_BUFFER:
+            *numWireTypes = 5;
+            return any;
+        case TYPE_STRING:
+        case TYPE_BYTES:
+            return len;
+        case TYPE_FIXED64:
+        case TYPE_SFIXED64:
+        case TYPE_DOUBLE:
+            *packed = WIRETYPE_I64;
+            return i64;
+        case TYPE_FIXED32:
+        case TYPE_SFIXED32:
+        case TYPE_FLOAT:
+            *packed = WIRETYPE_I32;
+            return i32;
+        default:
+            *packed = WIRETYPE_VARINT;
+            return varint;
+        }
+    }
+
+    void json_append_string(std::string &out, const Buffer &value)
+    {
+        out += '"';
+        for (const uint8_t *p = value.start; p < value.end; p++)
+        {
+            switch (*p)
+            {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (*p < 0x20)
+                {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", *p);
+                    out += escaped;
+                }
+                else
+                {
+                    out += (char)*p;
+                }
+                break;
+            }
+        }
+        out += '"';
+    }
+
+    void json_append_double(std::string &out, double value, int digits)
+    {
+        if (value != value || value - value != 0) {out += "null"; return;} // NaN and infinity
+        char number[32];
+        snprintf(number, sizeof(number), "%.*g", digits, value);
+        out += number;
+    }
+
+    void json_append_value(std::string &out, Type type, const Field &field)
+    {
+        int32_t valueInt32 = 0;
+        int64_t valueInt64 = 0;
+        uint32_t valueUint32 = 0;
+        uint64_t valueUint64 = 0;
+        double valueDouble = 0;
+        float valueFloat = 0;
+        bool valueBool = 0;
+
+        switch (type)
+        {
+        case TYPE_BUFFER:
+        {
+            // Unknown type, render sub messages as objects and guess scalar types like protobuf_to_json
+            std::ostringstream os;
+            if (field.wireType == WIRETYPE_LEN || field.wireType == WIRETYPE_SGROUP)
+            {
+                Field message = decodeProtobuf(field.value, false);
+                toJson(&message, os);
+            }
+            else
+            {
+                Field value = field;
+                toJson(&value, os);
+            }
+            out += os.str();
+            return;
+        }
+        case TYPE_STRING:
+            json_append_string(out, field.value);
+            return;
+        case TYPE_BYTES:
+        {
+            std::ostringstream os;
+            Field value = field; // Non printable bytes are base64 encoded by toJson
+            toJson(&value, os);
+            out += os.str();
+            return;
+        }
+        case TYPE_ENUM:
+        case TYPE_INT32:
+            if (getInt32(&field.value, &valueInt32, 0)) {out += std::to_string(valueInt32); return;}
+            break;
+        case TYPE_INT64:
+            if (getInt64(&field.value, &valueInt64, 0)) {out += std::to_string(valueInt64); return;}
+            break;
+        case TYPE_UINT32:
+            if (getUint32(&field.value, &valueUint32, 0)) {out += std::to_string(valueUint32); return;}
+            break;
+        case TYPE_UINT64:
+            if (getUint64(&field.value, &valueUint64, 0)) {out += std::to_string(valueUint64); return;}
+            break;
+        case TYPE_SINT32:
+            if (getSint32(&field.value, &valueInt32, 0)) {out += std::to_string(valueInt32); return;}
+            break;
+        case TYPE_SINT64:
+            if (getSint64(&field.value, &valueInt64, 0)) {out += std::to_string(valueInt64); return;}
+            break;
+        case TYPE_BOOL:
+            if (getBool(&field.value, &valueBool, 0)) {out += valueBool ? "1" : "0"; return;}
+            break;
+        case TYPE_FIXED64:
+            if (getFixed64(&field.value, &valueUint64, 0)) {out += std::to_string(valueUint64); return;}
+            break;
+        case TYPE_SFIXED64:
+            if (getSfixed64(&field.value, &valueInt64, 0)) {out += std::to_string(valueInt64); return;}
+            break;
+        case TYPE_DOUBLE:
+            if (getDouble(&field.value, &valueDouble, 0)) {json_append_double(out, valueDouble, 17); return;}
+            break;
+        case TYPE_FIXED32:
+            if (getFixed32(&field.value, &valueUint32, 0)) {out += std::to_string(valueUint32); return;}
+            break;
+        case TYPE_SFIXED32:
+            if (getSfixed32(&field.value, &valueInt32, 0)) {out += std::to_string(valueInt32); return;}
+            break;
+        case TYPE_FLOAT:
+            if (getFloat(&field.value, &valueFloat, 0)) {json_append_double(out, valueFloat, 9); return;}
+            break;
+        default:
+            break;
+        }
+        out += "null";
+    }
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "protodec.h"
+
+struct sqlite3_context;
+
+namespace sqlite_protobuf
+{
+    struct Path;
+
+    /// Protobuf types that values can be decoded as, the type names are the ones used in .proto files
+    enum Type
+    {
+        // SPECIAL TYPES
+        TYPE_UNKNOWN,
+        TYPE_BUFFER,
+        // WIRETYPE VARINT
+        TYPE_INT32,
+        TYPE_INT64,
+        TYPE_UINT32,
+        TYPE_UINT64,
+        TYPE_SINT32,
+        TYPE_SINT64,
+        TYPE_BOOL,
+        TYPE_ENUM,
+        // WIRETYPE I64
+        TYPE_FIXED64,
+        TYPE_SFIXED64,
+        TYPE_DOUBLE,
+        // WIRETYPE LEN
+        TYPE_STRING,
+        TYPE_BYTES,
+        // WIRETYPE I32
+        TYPE_FIXED32, 
+        TYPE_SFIXED32, 
+        TYPE_FLOAT,
+    };
+
+    /// Look up a type by name, the empty name "" is the raw buffer
+    ///
+    /// @returns the type or TYPE_UNKNOWN if the name is not a valid type
+    Type type_from_string(const std::string &type);
+
+    /// Value decoded as a type, without an sqlite3_context so that it can be decoded on any thread
+    struct Value
+    {
+        int type;       // SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT, SQLITE_BLOB or SQLITE_NULL
+        int64_t integer;
+        double real;
+        Buffer bytes;   // Text or blob, points into the decoded buffer
+    };
+
+    /// Decode the value in the buffer as the given type
+    ///
+    /// @param[in] index index into the buffer when it is a packed repeated field
+    /// @returns false if the buffer does not hold a value of the type, the value is then NULL
+    bool value_from_buffer(Type type, const Buffer &buffer, int32_t index, Value *value);
+
+    /// Set the sqlite result to a decoded value, NULL values leave the result unchanged
+    void result_from_value(sqlite3_context *context, const Value &value, void (*destructor)(void*));
+
+    /// Set the sqlite result to the value in the buffer decoded as the given type
+    void result_from_buffer(sqlite3_context *context, Type type, const Buffer &result, int32_t index, void (*destructor)(void*));
+
+    /// Traverse path to the desired field of a decoded message, decoding the sub messages on the way
+    ///
+    /// @param[out] index index into the field when it is a packed repeated field
+    /// @returns the field at the end of path or nullptr if not found
+    Field* traverse_path(Field *root, const Path *path, Type type, int32_t *index);
+
+    /// Wire types accepted by the last entry of a path for the given type
+    ///
+    /// @param[out] packed wire type of packed repeated values of the type, or -1
+    const WireType* wire_types_from_type(Type type, size_t *numWireTypes, int *packed);
+
+    void json_append_string(std::string &out, const Buffer &value);
+    void json_append_double(std::string &out, double value, int digits);
+
+    /// Append the value of a matched field decoded as the given type to a JSON array
+    void json_append_value(std::string &out, Type type, const Field &field);
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,686 @@
+#include "protobuf_view.h"
+#include "sqlite3ext.h"
+
+#include <string>
+#include <vector>
+#include <new>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#include "protodec.h"
+#include "protobuf_type.h"
+#include "protobuf_column.h"
+
+namespace sqlite_protobuf
+{
+    SQLITE_EXTENSION_INIT3
+
+    /* Estimated number of rows of the source table, and of the rows matching an indexed equality */
+    #define PROTOBUF_VIEW_ROWS 1000000.0
+    #define PROTOBUF_VIEW_INDEXED_EQ_ROWS 10.0
+
+    /*
+    ** Column of the view, a column definition and the protobuf type it was declared with, which
+    ** is spelled out in the protobuf_extract calls that are matched against expression indexes
+    */
+    typedef struct ProtobufViewColumn ProtobufViewColumn;
+    struct ProtobufViewColumn
+    {
+        ColumnDefinition definition;
+        std::string type;
+    };
+
+    typedef struct ProtobufViewCursor ProtobufViewCursor;
+
+    /*
+    ** Define virtual table data structure containg data needed for virtual table
+    */
+    typedef struct ProtobufViewVtab ProtobufViewVtab;
+    struct ProtobufViewVtab
+    {
+        sqlite3_vtab base;          // Base class - must be first
+        sqlite3 *db;                // Database connection
+        std::string schema;         // Schema of the source table
+        std::string source;         // Source table
+        std::string column;         // Column of the source table holding the messages, the hidden column of the view
+        std::vector<ProtobufViewColumn> columns;
+        ProtobufViewCursor *pCurrent; // Cursor that last returned its message, see protobufViewExtract
+        std::vector<bool> indexed;  // Columns leading an expression index, see protobufViewFindIndexes
+        int schemaVersion;          // Schema version the indexed columns were found at, -1 before
+    };
+
+    /*
+    ** Define cursor data structure, the rows are read from the source table with a statement
+    ** on the same connection and each message is decoded at most once, when a column needs it
+    */
+    struct ProtobufViewCursor
+    {
+        sqlite3_vtab_cursor base;   // Base class - must be first
+        sqlite3_stmt *pStmt;        // Statement reading the rowid and message of the source rows
+        std::string sql;            // SQL of the statement, which is reused while it does not change
+        Buffer message;             // Message of the current row
+        bool null;                  // Message of the current row is NULL
+        Field root;                 // Decoded message of the current row
+        bool decoded;
+        std::vector<Field> matches;
+        std::string json;           // JSON array of the last column matching several fields
+        bool eof;
+    };
+
+    /*
+    ** Token of the SQL of an index, kind is 'w' for words and identifiers, 'q' for double quoted
+    ** identifiers, which may also be strings, 's' for strings and 'p' for punctuation
+    */
+    typedef struct ProtobufViewToken ProtobufViewToken;
+    struct ProtobufViewToken
+    {
+        char kind;
+        std::string text;
+    };
+
+    /*
+    ** Split the SQL of a CREATE INDEX statement into tokens, quotes are removed
+    */
+    static std::vector<ProtobufViewToken> protobufViewTokenize(const char *z)
+    {
+        std::vector<ProtobufViewToken> tokens;
+        while (*z != 0)
+        {
+            if (isspace((unsigned char)*z)) {z++; continue;}
+            if (z[0] == '-' && z[1] == '-')
+            {
+                while (*z != 0 && *z != '\n') {z++;}
+                continue;
+            }
+            if (z[0] == '/' && z[1] == '*')
+            {
+                const char *end = strstr(z + 2, "*/");
+                z = end != nullptr ? end + 2 : z + strlen(z);
+                continue;
+            }
+
+            ProtobufViewToken token;
+            char quote = *z == '[' ? ']' : *z;
+            if (quote == '\'' || quote == '"' || quote == '`' || quote == ']')
+            {
+                token.kind = quote == '\'' ? 's' : (quote == '"' ? 'q' : 'w');
+                for (z++; *z != 0; z++)
+                {
+                    if (*z != quote) {token.text += *z; continue;}
+                    if (quote != ']' && z[1] == quote) {token.text += *z++; continue;}
+                    z++;
+                    break;
+                }
+            }
+            else if (isalnum((unsigned char)*z) || *z == '_' || *z == '$')
+            {
+                token.kind = 'w';
+                while (isalnum((unsigned char)*z) || *z == '_' || *z == '$') {token.text += *z++;}
+            }
+            else
+            {
+                token.kind = 'p';
+                token.text = *z++;
+            }
+            tokens.push_back(token);
+        }
+        return tokens;
+    }
+
+    static bool protobufViewIsWord(const std::vector<ProtobufViewToken> &tokens, size_t i, const char *word)
+    {
+        return i < tokens.size() && tokens[i].kind != 's' && sqlite3_stricmp(tokens[i].text.c_str(), word) == 0;
+    }
+
+    static bool protobufViewIsLiteral(const std::vector<ProtobufViewToken> &tokens, size_t i, const std::string &text)
+    {
+        return i < tokens.size() && (tokens[i].kind == 's' || tokens[i].kind == 'q') && tokens[i].text == text;
+    }
+
+    /*
+    ** Check if the first expression of an index is protobuf_extract(column, 'path', 'type') on the
+    ** message column with the path and type of a column of the view. Partial indexes are not used.
+    */
+    static bool protobufViewMatchIndex(const std::vector<ProtobufViewToken> &tokens, ProtobufViewVtab *p, const ProtobufViewColumn &column)
+    {
+        size_t i = 0;
+        while (i < tokens.size() && !(tokens[i].kind == 'w' && sqlite3_stricmp(tokens[i].text.c_str(), "on") == 0)) {i++;}
+        while (i < tokens.size() && tokens[i].text != "(") {i++;}
+        for (size_t k = i; k < tokens.size(); k++)
+        {
+            if (tokens[k].kind == 'w' && sqlite3_stricmp(tokens[k].text.c_str(), "where") == 0) {return false;}
+        }
+
+        i++;
+        if (!protobufViewIsWord(tokens, i++, "protobuf_extract") || !protobufViewIsWord(tokens, i++, "(")) {return false;}
+        if (protobufViewIsWord(tokens, i + 1, ".")) {i += 2;}
+        if (!protobufViewIsWord(tokens, i++, p->column.c_str()) || !protobufViewIsWord(tokens, i++, ",")) {return false;}
+        if (!protobufViewIsLiteral(tokens, i++, column.definition.path.text) || !protobufViewIsWord(tokens, i++, ",")) {return false;}
+        if (!protobufViewIsLiteral(tokens, i++, column.type) || !protobufViewIsWord(tokens, i++, ")")) {return false;}
+        return protobufViewIsWord(tokens, i, ",") || protobufViewIsWord(tokens, i, ")") || protobufViewIsWord(tokens, i, "collate")
+            || protobufViewIsWord(tokens, i, "asc") || protobufViewIsWord(tokens, i, "desc");
+    }
+
+    /*
+    ** Flag the columns of the view that lead an expression index on the source table. The
+    ** flags are kept in the table and only found again when the schema version changes.
+    */
+    static int protobufViewFindIndexes(ProtobufViewVtab *p)
+    {
+        sqlite3_stmt *pStmt = nullptr;
+        char *zSql = sqlite3_mprintf("PRAGMA \"%w\".schema_version", p->schema.c_str());
+        int rc = zSql == nullptr ? SQLITE_NOMEM : sqlite3_prepare_v2(p->db, zSql, -1, &pStmt, 0);
+        sqlite3_free(zSql);
+        int schemaVersion = rc == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW ? sqlite3_column_int(pStmt, 0) : -1;
+        if (pStmt != nullptr) {rc = sqlite3_finalize(pStmt);}
+        if (rc != SQLITE_OK) {return rc;}
+        if (schemaVersion >= 0 && schemaVersion == p->schemaVersion) {return SQLITE_OK;}
+
+        p->indexed.assign(p->columns.size(), false);
+        p->schemaVersion = -1;
+        pStmt = nullptr;
+        zSql = sqlite3_mprintf("SELECT sql FROM \"%w\".sqlite_master WHERE type = 'index' AND tbl_name = %Q COLLATE NOCASE AND sql IS NOT NULL",
+                               p->schema.c_str(), p->source.c_str());
+        rc = zSql == nullptr ? SQLITE_NOMEM : sqlite3_prepare_v2(p->db, zSql, -1, &pStmt, 0);
+        sqlite3_free(zSql);
+        while (rc == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW)
+        {
+            std::vector<ProtobufViewToken> tokens = protobufViewTokenize((const char *)sqlite3_column_text(pStmt, 0));
+            for (size_t c = 0; c < p->columns.size(); c++)
+            {
+                p->indexed[c] = p->indexed[c] || protobufViewMatchIndex(tokens, p, p->columns[c]);
+            }
+        }
+        if (pStmt != nullptr) {rc = sqlite3_finalize(pStmt);}
+        if (rc == SQLITE_OK) {p->schemaVersion = schemaVersion;}
+        return rc;
+    }
+
+    /*
+    ** Storage class of the values of a column, constraints are only passed on to the source table
+    ** when the value compared with has the same class, as the values of protobuf_extract have no
+    ** affinity while the columns of the view have the affinity of their declared type
+    */
+    static int protobufViewStorageClass(const ColumnDefinition &column)
+    {
+        if (column.path.multi) {return SQLITE_NULL;}
+        switch (column.type)
+        {
+        case TYPE_STRING: return SQLITE_TEXT;
+        case TYPE_BYTES: return SQLITE_BLOB;
+        case TYPE_UNKNOWN: case TYPE_BUFFER: return SQLITE_NULL;
+        default: return SQLITE_INTEGER;
+        }
+    }
+
+    static bool protobufViewComparable(const ColumnDefinition &column, sqlite3_value *value)
+    {
+        int type = sqlite3_value_type(value);
+        switch (protobufViewStorageClass(column))
+        {
+        case SQLITE_INTEGER: return type == SQLITE_INTEGER || type == SQLITE_FLOAT;
+        case SQLITE_TEXT: return type == SQLITE_TEXT;
+        case SQLITE_BLOB: return type == SQLITE_BLOB;
+        default: return false;
+        }
+    }
+
+    /*
+    ** Constructor for ProtobufViewVtab objects, the arguments are the source table, the column
+    ** holding the messages and one column definition for each column of the view.
+    */
+    static int protobufViewConnect(sqlite3 *db, void *pAux, int argc, const char *const*argv, sqlite3_vtab **ppVtab, char **pzErr)
+    {
+        if (argc < 6)
+        {
+            *pzErr = sqlite3_mprintf("protobuf_view requires a source table, a column and at least one column definition");
+            return SQLITE_ERROR;
+        }
+
+        ProtobufViewVtab *pNew = new (std::nothrow) ProtobufViewVtab();
+        if (pNew == nullptr) {return SQLITE_NOMEM;}
+        pNew->db = db;
+        pNew->schema = argv[1];
+        pNew->source = sql_dequote(argv[3]);
+
+        // The source table may be qualified with its schema, such as main.messages for a view in temp
+        std::string source = argv[3];
+        size_t dot = source.find('.');
+        if (dot != std::string::npos && source[0] != '"' && source[0] != '[' && source[0] != '`' && source[0] != '\'')
+        {
+            pNew->schema = source.substr(0, dot);
+            pNew->source = sql_dequote(source.substr(dot + 1));
+        }
+        pNew->column = sql_dequote(argv[4]);
+        pNew->pCurrent = nullptr;
+        pNew->schemaVersion = -1;
+
+        std::string error;
+        char *zSchema = sqlite3_mprintf("CREATE TABLE x(");
+        for (int i = 5; i < argc && error.empty(); i++)
+        {
+            ProtobufViewColumn column;
+            std::string declared;
+            if (!column_parse_declared(argv[i], column.definition, declared, column.type, error)) {break;}
+            pNew->columns.push_back(column);
+            zSchema = sqlite3_mprintf("%z\"%w\" %s,", zSchema, column.definition.name.c_str(), declared.c_str());
+        }
+        zSchema = sqlite3_mprintf("%z\"%w\" HIDDEN)", zSchema, pNew->column.c_str());
+
+        int rc = SQLITE_OK;
+        if (!error.empty())
+        {
+            *pzErr = sqlite3_mprintf("%s", error.c_str());
+            rc = SQLITE_ERROR;
+        }
+        else if (zSchema == nullptr)
+        {
+            rc = SQLITE_NOMEM;
+        }
+        else
+        {
+            rc = sqlite3_declare_vtab(db, zSchema);
+        }
+        sqlite3_free(zSchema);
+
+        if (rc != SQLITE_OK)
+        {
+            delete pNew;
+            return rc;
+        }
+        *ppVtab = &pNew->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for ProtobufViewVtab objects.
+    */
+    static int protobufViewDisconnect(sqlite3_vtab *pVtab)
+    {
+        ProtobufViewVtab *p = (ProtobufViewVtab*)pVtab;
+        sqlite3_free(p->base.zErrMsg);
+        delete p;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Constructor for a new ProtobufViewCursor object.
+    */
+    static int protobufViewOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+    {
+        ProtobufViewCursor *pCur = new (std::nothrow) ProtobufViewCursor();
+        if (pCur == nullptr) {return SQLITE_NOMEM;}
+        pCur->pStmt = nullptr;
+        pCur->null = true;
+        pCur->decoded = false;
+        pCur->eof = true;
+        *ppCursor = &pCur->base;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Destructor for a ProtobufViewCursor.
+    */
+    static int protobufViewClose(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufViewCursor *pCur = (ProtobufViewCursor*)cur;
+        ProtobufViewVtab *p = (ProtobufViewVtab*)cur->pVtab;
+        if (p->pCurrent == pCur) {p->pCurrent = nullptr;}
+        sqlite3_finalize(pCur->pStmt);
+        delete pCur;
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return the decoded message of the current row, the message is decoded by the first call for the row
+    */
+    static Field* protobufViewRoot(ProtobufViewCursor *pCur)
+    {
+        if (!pCur->decoded)
+        {
+            pCur->root = decodeProtobuf(pCur->message, false);
+            pCur->decoded = true;
+        }
+        return &pCur->root;
+    }
+
+    /*
+    ** Advance a ProtobufViewCursor to its next row of output.
+    */
+    static int protobufViewNext(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufViewCursor *pCur = (ProtobufViewCursor*)cur;
+        pCur->decoded = false;
+        int rc = sqlite3_step(pCur->pStmt);
+        if (rc == SQLITE_ROW)
+        {
+            pCur->null = sqlite3_column_type(pCur->pStmt, 1) == SQLITE_NULL;
+            pCur->message.start = (const uint8_t *)sqlite3_column_blob(pCur->pStmt, 1);
+            pCur->message.end = pCur->message.start + sqlite3_column_bytes(pCur->pStmt, 1);
+            return SQLITE_OK;
+        }
+
+        pCur->eof = true;
+        if (rc == SQLITE_DONE) {return SQLITE_OK;}
+        ProtobufViewVtab *p = (ProtobufViewVtab*)cur->pVtab;
+        sqlite3_free(p->base.zErrMsg);
+        p->base.zErrMsg = sqlite3_mprintf("protobuf_view: %s", sqlite3_errmsg(p->db));
+        return rc;
+    }
+
+    /*
+    ** Return value at given column and row (ProtobufViewCursor), the hidden column is the message.
+    */
+    static int protobufViewColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+    {
+        ProtobufViewCursor *pCur = (ProtobufViewCursor *)cur;
+        ProtobufViewVtab *p = (ProtobufViewVtab*)cur->pVtab;
+        if (pCur->null || col < 0) {return SQLITE_OK;}
+
+        if ((size_t)col >= p->columns.size())
+        {
+            p->pCurrent = pCur;
+            sqlite3_result_blob(ctx, pCur->message.start, (int)pCur->message.size(), SQLITE_TRANSIENT);
+            return SQLITE_OK;
+        }
+
+        const ColumnDefinition &column = p->columns[col].definition;
+        bool decode = !column.path.multi && column.path.steps[0].fieldNumber != 0;
+        Value value;
+        column_extract(column, pCur->message, decode ? protobufViewRoot(pCur) : nullptr, pCur->matches, &value, pCur->json);
+        result_from_value(ctx, value, SQLITE_TRANSIENT);
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return the rowid for the current row, which is the rowid of the source row.
+    */
+    static int protobufViewRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+    {
+        ProtobufViewCursor *pCur = (ProtobufViewCursor*)cur;
+        *pRowid = sqlite3_column_int64(pCur->pStmt, 0);
+        return SQLITE_OK;
+    }
+
+    /*
+    ** Return TRUE if the cursor has been moved off of the last row of output.
+    */
+    static int protobufViewEof(sqlite3_vtab_cursor *cur)
+    {
+        ProtobufViewCursor *pCur = (ProtobufViewCursor*)cur;
+        return pCur->eof;
+    }
+
+    /*
+    ** This method is called to "rewind" the ProtobufViewCursor object back to the first row of
+    ** output. The constraints listed in idxStr are added to the query of the source table, where
+    ** the constraints on view columns are answered by the expression indexes on protobuf_extract.
+    */
+    static int protobufViewFilter(sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv)
+    {
+        ProtobufViewCursor *pCur = (ProtobufViewCursor *)cur;
+        ProtobufViewVtab *p = (ProtobufViewVtab*)cur->pVtab;
+
+        // idxStr lists an operator and a column for each argument, such as "e0;G-1;"
+        std::vector<sqlite3_value*> values;
+        char *zSql = sqlite3_mprintf("SELECT rowid, \"%w\".\"%w\" FROM \"%w\".\"%w\" WHERE 1", p->source.c_str(), p->column.c_str(), p->schema.c_str(), p->source.c_str());
+        const char *z = idxStr != nullptr ? idxStr : "";
+        for (int i = 0; *z != 0 && i < argc; i++)
+        {
+            char op = *z++;
+            int col = (int)strtol(z, (char **)&z, 10);
+            if (*z == ';') {z++;}
+
+            const char *zOp = op == 'e' ? "=" : op == 'g' ? ">" : op == 'G' ? ">=" : op == 'l' ? "<" : "<=";
+            int type = sqlite3_value_type(argv[i]);
+            if (col < 0 && (type == SQLITE_INTEGER || type == SQLITE_FLOAT))
+            {
+                zSql = sqlite3_mprintf("%z AND rowid %s ?", zSql, zOp);
+            }
+            else if (col >= 0 && (size_t)col < p->columns.size() && protobufViewComparable(p->columns[col].definition, argv[i]))
+            {
+                const ProtobufViewColumn &column = p->columns[col];
+                zSql = sqlite3_mprintf("%z AND protobuf_extract(\"%w\".\"%w\", %Q, %Q) %s ?", zSql, p->source.c_str(), p->column.c_str(),
+                                       column.definition.path.text.c_str(), column.type.c_str(), zOp);
+            }
+            else
+            {
+                continue;
+            }
+            values.push_back(argv[i]);
+        }
+        if (zSql == nullptr) {return SQLITE_NOMEM;}
+
+        // Statements of joins are filtered once for each outer row, and are only prepared once
+        int rc = SQLITE_OK;
+        if (pCur->pStmt == nullptr || pCur->sql != zSql)
+        {
+            sqlite3_finalize(pCur->pStmt);
+            pCur->pStmt = nullptr;
+            pCur->sql = zSql;
+            rc = sqlite3_prepare_v2(p->db, zSql, -1, &pCur->pStmt, 0);
+        }
+        else
+        {
+            sqlite3_reset(pCur->pStmt);
+        }
+        sqlite3_free(zSql);
+        if (rc != SQLITE_OK)
+        {
+            pCur->sql.clear();
+            sqlite3_free(p->base.zErrMsg);
+            p->base.zErrMsg = sqlite3_mprintf("protobuf_view: %s", sqlite3_errmsg(p->db));
+            return rc;
+        }
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            sqlite3_bind_value(pCur->pStmt, (int)i + 1, values[i]);
+        }
+
+        pCur->eof = false;
+        return protobufViewNext(cur);
+    }
+
+    /*
+    ** SQLite will invoke this method one or more times while planning a query that uses the
+    ** virtual table. Constraints on the rowid, and on one view column that leads an expression
+    ** index of the source table, are listed in idxStr and still checked by SQLite. Other
+    ** constraints are checked by SQLite on the decoded rows.
+    */
+    static int protobufViewBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo)
+    {
+        ProtobufViewVtab *p = (ProtobufViewVtab*)tab;
+        int rc = protobufViewFindIndexes(p);
+        if (rc != SQLITE_OK) {return rc;}
+        const std::vector<bool> &indexed = p->indexed;
+
+        // Pick the indexed column to search, an equality is preferred over a range
+        int best = -1;
+        bool equality = false;
+        const struct sqlite3_index_info::sqlite3_index_constraint *pConstraint = pIdxInfo->aConstraint;
+        for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++)
+        {
+            int col = pConstraint->iColumn;
+            if (pConstraint->usable == 0 || col < 0 || (size_t)col >= p->columns.size() || !indexed[col]) {continue;}
+            int storage = protobufViewStorageClass(p->columns[col].definition);
+            if (storage == SQLITE_NULL) {continue;}
+            if (storage == SQLITE_TEXT && sqlite3_libversion_number() >= 3022000 && sqlite3_stricmp(sqlite3_vtab_collation(pIdxInfo, i), "BINARY") != 0) {continue;}
+            if (storage == SQLITE_TEXT && sqlite3_libversion_number() < 3022000) {continue;}
+
+            bool eq = pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ;
+            bool range = pConstraint->op == SQLITE_INDEX_CONSTRAINT_GT || pConstraint->op == SQLITE_INDEX_CONSTRAINT_GE
+                      || pConstraint->op == SQLITE_INDEX_CONSTRAINT_LT || pConstraint->op == SQLITE_INDEX_CONSTRAINT_LE;
+            if ((eq && !equality) || (range && best < 0))
+            {
+                best = col;
+                equality = eq;
+            }
+        }
+
+        std::string idxStr;
+        int numArgs = 0;
+        double nRows = PROTOBUF_VIEW_ROWS;
+        pConstraint = pIdxInfo->aConstraint;
+        for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++)
+        {
+            if (pConstraint->usable == 0 || (pConstraint->iColumn >= 0 && pConstraint->iColumn != best)) {continue;}
+
+            // Text compared with another collation than the index is left to SQLite, like when choosing the column
+            if (pConstraint->iColumn >= 0 && protobufViewStorageClass(p->columns[best].definition) == SQLITE_TEXT
+                && sqlite3_stricmp(sqlite3_vtab_collation(pIdxInfo, i), "BINARY") != 0) {continue;}
+
+            char c = 0;
+            switch (pConstraint->op)
+            {
+            case SQLITE_INDEX_CONSTRAINT_EQ: c = 'e'; break;
+            case SQLITE_INDEX_CONSTRAINT_GT: c = 'g'; break;
+            case SQLITE_INDEX_CONSTRAINT_GE: c = 'G'; break;
+            case SQLITE_INDEX_CONSTRAINT_LT: c = 'l'; break;
+            case SQLITE_INDEX_CONSTRAINT_LE: c = 'L'; break;
+            default: break;
+            }
+            if (c == 0) {continue;}
+            if (c == 'e') {nRows = pConstraint->iColumn < 0 ? 1 : (nRows < PROTOBUF_VIEW_INDEXED_EQ_ROWS ? nRows : PROTOBUF_VIEW_INDEXED_EQ_ROWS);}
+            else {nRows *= 0.25;}
+
+            idxStr += c + std::to_string(pConstraint->iColumn < 0 ? -1 : pConstraint->iColumn) + ";";
+            pIdxInfo->aConstraintUsage[i].argvIndex = ++numArgs;
+        }
+        if (!idxStr.empty())
+        {
+            pIdxInfo->idxStr = sqlite3_mprintf("%s", idxStr.c_str());
+            pIdxInfo->needToFreeIdxStr = 1;
+            if (pIdxInfo->idxStr == nullptr) {return SQLITE_NOMEM;}
+        }
+
+        pIdxInfo->estimatedCost = nRows;
+        pIdxInfo->estimatedRows = (sqlite3_int64)nRows + 1;
+        return SQLITE_OK;
+    }
+
+    static std::string protobufViewString(sqlite3_value *value)
+    {
+        const char *text = (const char *)sqlite3_value_text(value);
+        return std::string(text != nullptr ? text : "", (size_t)sqlite3_value_bytes(value));
+    }
+
+    static void protobufViewFreeColumn(void *column)
+    {
+        delete (ColumnDefinition*)column;
+    }
+
+    /*
+    ** Overload of protobuf_extract for calls on the columns of the view. When the message is the
+    ** message of the current row of a cursor, the cursor's decoded message is used, so the row
+    ** is not decoded again. The column definition is kept while the path and type are constant.
+    */
+    static void protobufViewExtract(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+    {
+        ProtobufViewVtab *p = (ProtobufViewVtab*)sqlite3_user_data(ctx);
+        ColumnDefinition *column = (ColumnDefinition*)sqlite3_get_auxdata(ctx, 1);
+        bool constant = column != nullptr && sqlite3_get_auxdata(ctx, 2) != nullptr;
+        if (!constant)
+        {
+            column = new (std::nothrow) ColumnDefinition();
+            if (column == nullptr)
+            {
+                sqlite3_result_error_nomem(ctx);
+                return;
+            }
+            std::string error;
+            if (!column_init(*column, protobufViewString(argv[1]), protobufViewString(argv[2]), error))
+            {
+                delete column;
+                sqlite3_result_error(ctx, error.c_str(), -1);
+                return;
+            }
+        }
+
+        if (sqlite3_value_type(argv[0]) != SQLITE_NULL)
+        {
+            Buffer message;
+            message.start = (const uint8_t *)sqlite3_value_blob(argv[0]);
+            message.end = message.start + sqlite3_value_bytes(argv[0]);
+
+            Field local;
+            Field *root = nullptr;
+            if (!column->path.multi && column->path.steps[0].fieldNumber != 0)
+            {
+                ProtobufViewCursor *pCur = p->pCurrent;
+                if (pCur != nullptr && !pCur->eof && !pCur->null && pCur->message.size() == message.size()
+                    && (message.size() == 0 || memcmp(pCur->message.start, message.start, message.size()) == 0))
+                {
+                    message = pCur->message;
+                    root = protobufViewRoot(pCur);
+                }
+                else
+                {
+                    local = decodeProtobuf(message, false);
+                    root = &local;
+                }
+            }
+
+            Value value;
+            std::vector<Field> matches;
+            std::string json;
+            column_extract(*column, message, root, matches, &value, json);
+            result_from_value(ctx, value, SQLITE_TRANSIENT);
+        }
+
+        // Set aux data after the column is no longer needed, as SQLite may free it right away
+        if (!constant)
+        {
+            sqlite3_set_auxdata(ctx, 1, column, protobufViewFreeColumn);
+            sqlite3_set_auxdata(ctx, 2, p, nullptr);
+        }
+    }
+
+    /*
+    ** Overload protobuf_extract when its first argument is a column of the view.
+    */
+    static int protobufViewFindFunction(sqlite3_vtab *pVtab, int nArg, const char *zName, void (**pxFunc)(sqlite3_context*, int, sqlite3_value**), void **ppArg)
+    {
+        if (nArg != 3 || sqlite3_stricmp(zName, "protobuf_extract") != 0) {return 0;}
+        *pxFunc = protobufViewExtract;
+        *ppArg = pVtab;
+        return 1;
+    }
+
+    /*
+    ** Define all the methods for the module (virtual table).
+    */
+    static sqlite3_module protobufViewModule = {
+        /* iVersion    */ 0,
+        /* xCreate     */ protobufViewConnect,
+        /* xConnect    */ protobufViewConnect,
+        /* xBestIndex  */ protobufViewBestIndex,
+        /* xDisconnect */ protobufViewDisconnect,
+        /* xDestroy    */ protobufViewDisconnect,
+        /* xOpen       */ protobufViewOpen,
+        /* xClose      */ protobufViewClose,
+        /* xFilter     */ protobufViewFilter,
+        /* xNext       */ protobufViewNext,
+        /* xEof        */ protobufViewEof,
+        /* xColumn     */ protobufViewColumn,
+        /* xRowid      */ protobufViewRowid,
+        /* xUpdate     */ 0,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ protobufViewFindFunction,
+        /* xRename     */ 0,
+        /* xSavepoint  */ 0, // iVersion >= 2
+        /* xRelease    */ 0, // iVersion >= 2
+        /* xRollbackTo */ 0, // iVersion >= 2
+        /* xShadowName */ 0, // iVersion >= 3
+        /* xIntegrity  */ //0, // iVersion >= 4
+    };
+
+    int register_protobuf_view(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+    {
+        return sqlite3_create_module(db, "protobuf_view", &protobufViewModule, 0);
+    }
+
+} // namespace sqlite_protobuf
@@ -2,6 +2,8 @@
 
 #include <cstring>
 
+#include "trace.h"
+
 #define DECODE_ERROR 0
 #define DECODE_OK 1
 
@@ -62,6 +64,58 @@ Field* Field::getSubField(uint32_t fieldNumber, WireType wireType, int64_t index
     return nullptr;
 }
 
+Field* Field::getSubField(uint32_t fieldNumber, const WireType *wireTypes, size_t numWireTypes, int64_t index)
+{
+    Field* candidates[8] = {nullptr};
+    int64_t counts[8] = {0};
+    int64_t target = index >= 0 ? index : -index - 1;
+    size_t n = subFields.size();
+
+    // Single scan matching on field number, keeping the candidate for each wire type
+    for (size_t i = 0; i < n && candidates[0] == nullptr; i++)
+    {
+        Field *f = &subFields[index >= 0 ? i : n - i - 1]; // Negative index iterate backward through list
+        if (f->fieldNum != fieldNumber)
+        {
+            continue;
+        }
+
+        for (size_t p = 0; p < numWireTypes; p++)
+        {
+            if (f->wireType == (uint32_t)wireTypes[p] && counts[p]++ == target)
+            {
+                candidates[p] = f;
+            }
+        }
+    }
+
+    // Pick the candidate with the highest priority
+    for (size_t p = 0; p < numWireTypes; p++)
+    {
+        if (candidates[p] != nullptr)
+        {
+            return candidates[p];
+        }
+    }
+    return nullptr;
+}
+
+// LEN and SGROUP fields are counted together, like path_match counts the entries leading to a field
+Field* Field::getSubMessage(uint32_t fieldNumber, int64_t index)
+{
+    size_t n = subFields.size();
+    int64_t target = index >= 0 ? index : -index - 1;
+    for (size_t i = 0; i < n; i++)
+    {
+        Field *f = &subFields[index >= 0 ? i : n - i - 1]; // Negative index iterate backward through list
+        if (f->fieldNum == fieldNumber && (f->wireType == WIRETYPE_LEN || f->wireType == WIRETYPE_SGROUP) && target-- == 0)
+        {
+            return f;
+        }
+    }
+    return nullptr;
+}
+
 static inline const uint8_t *readVarint(const Buffer *in, int64_t *out, size_t maxBytes)
 {
     *out = 0;
@@ -212,6 +266,7 @@ static inline int decodeSubField(Field *field, bool packed)
 
 static inline int decodePacked(Field *field, WireType wireType)
 {
+    PROTOBUF_TRACE_SPAN("decodePacked");
     Buffer b = field->value;
 
     // Check if buffer data fits with packed wiretype
@@ -295,9 +350,13 @@ static inline int decodeField(Field *field, Buffer *in, bool packed)
         }
 
         // Try decoding as sub fields
-        if (DECODE_OK == decodeSubField(field, packed))
         {
-            return DECODE_OK;
+            PROTOBUF_TRACE(sqlite_protobuf::TraceSpan span("decodeSubField"));
+            if (DECODE_OK == decodeSubField(field, packed))
+            {
+                return DECODE_OK;
+            }
+            PROTOBUF_TRACE(span.rename("decodeSubField failed"));
         }
 
         // Try decoding as packed repeated fields
@@ -325,6 +384,7 @@ static inline int decodeField(Field *field, Buffer *in, bool packed)
 
 Field decodeProtobuf(const Buffer &in, bool packed)
 {
+    PROTOBUF_TRACE_SPAN("decodeProtobuf");
     Field field;
     memset(&field, 0, sizeof(Field));
     field.wireType = WIRETYPE_LEN;
@@ -333,6 +393,265 @@ Field decodeProtobuf(const Buffer &in, bool packed)
     return field;
 }
 
+static inline int readTag(Buffer *in, Field *field)
+{
+    int64_t tag;
+    const uint8_t *ptr = readVarint(in, &tag, MAX_VARINT_32BYTES);
+    if (!ptr)
+    {
+        return DECODE_ERROR;
+    }
+
+    field->tag = (uint32_t)tag;
+    field->fieldNum = getFieldNumber(field->tag);
+    field->wireType = getWireType(field->tag);
+
+    // Check validity of field tag
+    if (field->fieldNum == 0)
+    {
+        return DECODE_ERROR;
+    }
+
+    in->start = ptr;
+    return DECODE_OK;
+}
+
+static inline int skipGroup(Field *field, Buffer *in)
+{
+    Buffer b = *in;
+    Field subField;
+
+    field->value.start = b.start;
+    while (b.start < b.end)
+    {
+        const uint8_t *tagStart = b.start;
+        if (DECODE_OK != readTag(&b, &subField))
+        {
+            return DECODE_ERROR;
+        }
+
+        // Check if we have reached end of the group, and that it matches group start tag
+        if (subField.wireType == WIRETYPE_EGROUP)
+        {
+            if (subField.tag != getTag(field->fieldNum, WIRETYPE_EGROUP))
+            {
+                return DECODE_ERROR;
+            }
+            field->value.end = tagStart;
+            in->start = b.start;
+            return DECODE_OK;
+        }
+
+        b.start = tagStart;
+        if (DECODE_OK != readField(&b, &subField))
+        {
+            return DECODE_ERROR;
+        }
+    }
+
+    return DECODE_ERROR;
+}
+
+int readField(Buffer *in, Field *field)
+{
+    Buffer b = *in;
+    if (DECODE_OK != readTag(&b, field))
+    {
+        return DECODE_ERROR;
+    }
+
+    int rc;
+    switch (field->wireType)
+    {
+    case WIRETYPE_VARINT:
+        rc = decodeVarint(field, &b);
+        break;
+    case WIRETYPE_I64:
+        rc = decodeFixed64(field, &b);
+        break;
+    case WIRETYPE_LEN:
+        rc = decodeString(field, &b);
+        break;
+    case WIRETYPE_I32:
+        rc = decodeFixed32(field, &b);
+        break;
+    case WIRETYPE_SGROUP:
+        rc = skipGroup(field, &b);
+        break;
+    default:
+        rc = DECODE_ERROR;
+        break;
+    }
+
+    if (rc == DECODE_OK)
+    {
+        in->start = b.start;
+    }
+    return rc;
+}
+
+int readPacked(Buffer *in, WireType wireType, Buffer *value)
+{
+    Field field;
+    Buffer b = *in;
+    int rc;
+
+    switch (wireType)
+    {
+    case WIRETYPE_VARINT:
+        rc = decodeVarint(&field, &b);
+        break;
+    case WIRETYPE_I64:
+        rc = decodeFixed64(&field, &b);
+        break;
+    case WIRETYPE_I32:
+        rc = decodeFixed32(&field, &b);
+        break;
+    default:
+        rc = DECODE_ERROR;
+        break;
+    }
+
+    if (rc == DECODE_OK)
+    {
+        *value = field.value;
+        in->start = b.start;
+    }
+    return rc;
+}
+
+int findField(const Buffer *in, uint32_t fieldNumber, WireType wireType, int64_t index, Field *field)
+{
+    return findField(in, fieldNumber, &wireType, 1, index, field);
+}
+
+int findField(const Buffer *in, uint32_t fieldNumber, const WireType *wireTypes, size_t numWireTypes, int64_t index, Field *field)
+{
+    Buffer candidates[8];
+    int64_t targets[8];
+    int64_t counts[8] = {0};
+    bool found[8] = {false};
+    Buffer b;
+    Field f;
+
+    for (size_t p = 0; p < numWireTypes; p++)
+    {
+        targets[p] = index;
+    }
+
+    // Negative index, count the number of matching fields of each wire type and wrap arround
+    if (index < 0)
+    {
+        int64_t lengths[8] = {0};
+        b = *in;
+        while (b.start < b.end && DECODE_OK == readField(&b, &f))
+        {
+            lengths[f.wireType] += f.fieldNum == fieldNumber;
+        }
+        for (size_t p = 0; p < numWireTypes; p++)
+        {
+            targets[p] += lengths[wireTypes[p]];
+        }
+    }
+
+    // Single scan matching on field number, keeping the candidate for each wire type
+    b = *in;
+    while (!found[0] && b.start < b.end && DECODE_OK == readField(&b, &f))
+    {
+        if (f.fieldNum != fieldNumber)
+        {
+            continue;
+        }
+
+        for (size_t p = 0; p < numWireTypes; p++)
+        {
+            if (f.wireType == (uint32_t)wireTypes[p] && counts[p]++ == targets[p])
+            {
+                found[p] = true;
+                candidates[p] = f.value;
+            }
+        }
+    }
+
+    // Pick the candidate with the highest priority
+    for (size_t p = 0; p < numWireTypes; p++)
+    {
+        if (found[p])
+        {
+            field->tag = getTag(fieldNumber, wireTypes[p]);
+            field->fieldNum = fieldNumber;
+            field->wireType = wireTypes[p];
+            field->value = candidates[p];
+            return DECODE_OK;
+        }
+    }
+
+    return DECODE_ERROR;
+}
+
+bool isMessage(const Buffer &in)
+{
+    Buffer b = in;
+    Field field;
+    while (b.start < b.end)
+    {
+        if (DECODE_OK != readField(&b, &field))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool isText(const Buffer &in)
+{
+    const uint8_t *p = in.start;
+    while (p < in.end)
+    {
+        uint8_t c = *p;
+        size_t n;
+        uint32_t codepoint;
+
+        if (c < 0x80)
+        {
+            // ASCII, reject control characters except common white space
+            if ((c < 0x20 && c != '\t' && c != '\n' && c != '\r') || c == 0x7f)
+            {
+                return false;
+            }
+            p++;
+            continue;
+        }
+        else if ((c & 0xe0) == 0xc0) {n = 1; codepoint = c & 0x1f;}
+        else if ((c & 0xf0) == 0xe0) {n = 2; codepoint = c & 0x0f;}
+        else if ((c & 0xf8) == 0xf0) {n = 3; codepoint = c & 0x07;}
+        else {return false;}
+
+        // Check that the continuation bytes are inside the buffer
+        if ((size_t)(in.end - p) <= n)
+        {
+            return false;
+        }
+        for (size_t i = 1; i <= n; i++)
+        {
+            if ((p[i] & 0xc0) != 0x80)
+            {
+                return false;
+            }
+            codepoint = (codepoint << 6) | (p[i] & 0x3f);
+        }
+
+        // Reject overlong encodings, surrogates and code points outside of unicode
+        static const uint32_t minimum[] = {0, 0x80, 0x800, 0x10000};
+        if (codepoint < minimum[n] || (codepoint >= 0xd800 && codepoint <= 0xdfff) || codepoint > 0x10ffff)
+        {
+            return false;
+        }
+        p += n + 1;
+    }
+    return true;
+}
+
 static inline void base64Encode(const Buffer &in, std::ostream &os)
 {
     int val = 0, valb = -6, size = 0;
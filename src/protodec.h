@@ -41,6 +41,8 @@ struct Field
 
     std::map< uint32_t, std::vector<Field *> > subFieldMap();
     Field* getSubField(uint32_t fieldNumber, WireType wireType, int64_t index);
+    Field* getSubField(uint32_t fieldNumber, const WireType *wireTypes, size_t numWireTypes, int64_t index);
+    Field* getSubMessage(uint32_t fieldNumber, int64_t index);
 };
 
 /**
@@ -62,6 +64,66 @@ Field decodeProtobuf(const Buffer &in, bool packed = false);
  */
 void toJson(Field *field, std::ostream &os, bool showType = false);
 
+/**
+ * @brief Read the next field from a message buffer without decoding sub fields
+ *
+ * @param[in,out] in message buffer, start is advanced past the field on success
+ * @param[out] field tag, wire type, field number and value of the field
+ * @return int success
+ */
+int readField(Buffer *in, Field *field);
+
+/**
+ * @brief Read the next value from a packed repeated field
+ *
+ * @param[in,out] in packed field buffer, start is advanced past the value on success
+ * @param[in] wireType wire type of the packed values
+ * @param[out] value buffer containing the encoded value
+ * @return int success
+ */
+int readPacked(Buffer *in, WireType wireType, Buffer *value);
+
+/**
+ * @brief Find a sub field in a message buffer without decoding the message
+ *
+ * @param[in] in message buffer
+ * @param[in] fieldNumber field number to look for
+ * @param[in] wireType wire type to look for
+ * @param[in] index occurrence of the field, negative indexes count from the end
+ * @param[out] field the matching field
+ * @return int success
+ */
+int findField(const Buffer *in, uint32_t fieldNumber, WireType wireType, int64_t index, Field *field);
+
+/**
+ * @brief Find a sub field in a message buffer, trying several wire types in a single scan
+ *
+ * @param[in] in message buffer
+ * @param[in] fieldNumber field number to look for
+ * @param[in] wireTypes wire types to look for, in order of priority
+ * @param[in] numWireTypes number of wire types
+ * @param[in] index occurrence of the field, negative indexes count from the end
+ * @param[out] field the matching field with the wire type of highest priority
+ * @return int success
+ */
+int findField(const Buffer *in, uint32_t fieldNumber, const WireType *wireTypes, size_t numWireTypes, int64_t index, Field *field);
+
+/**
+ * @brief Check if buffer can be decoded as a message
+ *
+ * @param[in] in protobuf buffer
+ * @return true if every field in the buffer is well formed
+ */
+bool isMessage(const Buffer &in);
+
+/**
+ * @brief Check if buffer looks like a text string
+ *
+ * @param[in] in protobuf buffer
+ * @return true if buffer is valid UTF-8 without control characters
+ */
+bool isText(const Buffer &in);
+
 /**
  * @brief Get specific type form buffer
  *
@@ -0,0 +1,92 @@
+#include "thread_pool.h"
+
+namespace sqlite_protobuf
+{
+
+    namespace
+    {
+        // Pool and queue of the worker thread running the current task
+        thread_local const void *current_pool = nullptr;
+        thread_local size_t current_queue = 0;
+    } // namespace
+
+    ThreadPool::ThreadPool(size_t numThreads) : next(0), pending(0), stopping(false)
+    {
+        if (numThreads == 0) {numThreads = std::thread::hardware_concurrency();}
+        if (numThreads == 0) {numThreads = 1;}
+        for (size_t i = 0; i < numThreads; i++)
+        {
+            this->queues.push_back(std::unique_ptr<Queue>(new Queue()));
+        }
+        for (size_t i = 0; i < numThreads; i++)
+        {
+            this->threads.push_back(std::thread(&ThreadPool::work, this, i));
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->available.notify_all();
+        for (size_t i = 0; i < this->threads.size(); i++)
+        {
+            this->threads[i].join();
+        }
+    }
+
+    void ThreadPool::submit(std::function<void()> task)
+    {
+        size_t index = current_pool == this ? current_queue : this->next++ % this->queues.size();
+        {
+            // Count the task before a worker can take it, so pending never drops below the queued tasks.
+            // Workers never hold a queue lock while taking the pool lock, so the nesting can not deadlock.
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->pending++;
+            std::lock_guard<std::mutex> queueLock(this->queues[index]->mutex);
+            this->queues[index]->tasks.push_back(std::move(task));
+        }
+        this->available.notify_one();
+    }
+
+    /// Take the oldest task of the worker's own queue, or steal the oldest task of another queue
+    bool ThreadPool::take(size_t index, std::function<void()> &task)
+    {
+        for (size_t i = 0; i < this->queues.size(); i++)
+        {
+            Queue &queue = *this->queues[(index + i) % this->queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) {continue;}
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void ThreadPool::work(size_t index)
+    {
+        current_pool = this;
+        current_queue = index;
+        for (;;)
+        {
+            std::function<void()> task;
+            if (this->take(index, task))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    this->pending--;
+                }
+                task();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(this->mutex);
+            while (!this->stopping && this->pending == 0) {condition_wait(this->available, lock);}
+            if (this->stopping && this->pending == 0) {return;}
+        }
+    }
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+namespace sqlite_protobuf
+{
+
+    /// Wait until the condition variable is notified or a second has passed, the caller checks
+    /// its condition again. condition_variable::wait is versioned GLIBCXX_3.4.30 since GCC 12,
+    /// while wait_for is inline, so this keeps the extension loadable into hosts that ship an
+    /// older libstdc++ (such as conda Python)
+    inline void condition_wait(std::condition_variable &condition, std::unique_lock<std::mutex> &lock)
+    {
+        condition.wait_for(lock, std::chrono::seconds(1));
+    }
+
+    /// Pool of worker threads with one task queue per thread. Tasks submitted by a worker go to
+    /// its own queue, other tasks are spread over the queues, and a worker whose queue is empty
+    /// steals from the others, so uneven tasks keep every thread busy. Each queue runs its tasks
+    /// in the order they are submitted. The tasks must not use the SQLite connection.
+    class ThreadPool
+    {
+    public:
+        /// Start the worker threads
+        ///
+        /// @param[in] numThreads number of threads, or 0 for the number of cores
+        explicit ThreadPool(size_t numThreads = 0);
+
+        /// Wait for the queued tasks to finish and stop the worker threads
+        ~ThreadPool();
+
+        void submit(std::function<void()> task);
+        size_t size() const { return this->threads.size(); }
+
+    private:
+        struct Queue
+        {
+            std::mutex mutex;
+            std::deque< std::function<void()> > tasks;
+        };
+
+        ThreadPool(const ThreadPool &);
+        ThreadPool& operator=(const ThreadPool &);
+        bool take(size_t index, std::function<void()> &task);
+        void work(size_t index);
+
+        std::vector<std::thread> threads;
+        std::vector< std::unique_ptr<Queue> > queues;
+        std::atomic<size_t> next;       // Queue of the next task submitted from outside the pool
+        std::mutex mutex;               // Protects pending and stopping, and wakes idle workers
+        std::condition_variable available;
+        size_t pending;                 // Number of queued tasks
+        bool stopping;
+    };
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,158 @@
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <cstdio>
+#include <algorithm>
+
+namespace sqlite_protobuf
+{
+
+    // Number of spans kept for each thread, older spans are overwritten
+    #define TRACE_RING_SIZE 16384
+
+    namespace
+    {
+        /// Span in a ring buffer, the fields are atomic since they are read by other threads
+        struct TraceEvent
+        {
+            std::atomic<const char *> name;
+            std::atomic<uint64_t> start;
+            std::atomic<uint64_t> end;
+        };
+
+        /// Ring buffer of a thread. Only the thread writes it, each span is written before the
+        /// head is advanced, so readers know which spans are complete without taking a lock.
+        struct TraceRing
+        {
+            uint32_t tid;
+            std::atomic<uint64_t> head; // Number of spans written
+            TraceEvent events[TRACE_RING_SIZE];
+        };
+
+        /// Span copied out of a ring buffer
+        struct TraceCopy
+        {
+            const char *name;
+            uint64_t start;
+            uint64_t end;
+            uint32_t tid;
+        };
+
+        std::mutex ringsMutex;
+        std::vector<TraceRing *> rings;     // Ring buffers of all threads that recorded spans
+        std::vector<TraceRing *> freeRings; // Ring buffers of threads that have exited, reused by new threads
+
+        /// Ring buffer of the current thread, kept with its spans when the thread exits
+        struct TraceThread
+        {
+            TraceRing *ring;
+
+            ~TraceThread()
+            {
+                if (ring == nullptr) {return;}
+                std::lock_guard<std::mutex> lock(ringsMutex);
+                freeRings.push_back(ring);
+            }
+        };
+
+        thread_local TraceThread traceThread = {nullptr};
+
+        TraceRing* trace_ring()
+        {
+            if (traceThread.ring == nullptr)
+            {
+                std::lock_guard<std::mutex> lock(ringsMutex);
+                if (!freeRings.empty())
+                {
+                    traceThread.ring = freeRings.back();
+                    freeRings.pop_back();
+                }
+                else
+                {
+                    traceThread.ring = new TraceRing();
+                    traceThread.ring->tid = (uint32_t)rings.size() + 1;
+                    traceThread.ring->head.store(0, std::memory_order_relaxed);
+                    rings.push_back(traceThread.ring);
+                }
+            }
+            return traceThread.ring;
+        }
+
+        uint64_t trace_clock()
+        {
+            return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        /// Copy the complete spans of a ring buffer, spans that were overwritten while copying are left out
+        void trace_copy(TraceRing *ring, std::vector<TraceCopy> &out)
+        {
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+            size_t size = out.size();
+            for (uint64_t i = first; i < head; i++)
+            {
+                const TraceEvent &event = ring->events[i % TRACE_RING_SIZE];
+                TraceCopy copy;
+                copy.name = event.name.load(std::memory_order_relaxed);
+                copy.start = event.start.load(std::memory_order_relaxed);
+                copy.end = event.end.load(std::memory_order_relaxed);
+                copy.tid = ring->tid;
+                out.push_back(copy);
+            }
+
+            // The writer may have reused the slots of the oldest spans in the meantime
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t after = ring->head.load(std::memory_order_relaxed);
+            uint64_t overwritten = after >= first + TRACE_RING_SIZE ? after - TRACE_RING_SIZE - first + 1 : 0;
+            if (overwritten > 0) {out.erase(out.begin() + size, out.begin() + size + (size_t)std::min<uint64_t>(overwritten, head - first));}
+        }
+    } // namespace
+
+    TraceSpan::TraceSpan(const char *name) : name(name), start(trace_clock())
+    {
+    }
+
+    TraceSpan::~TraceSpan()
+    {
+        uint64_t end = trace_clock();
+        TraceRing *ring = trace_ring();
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        TraceEvent &event = ring->events[head % TRACE_RING_SIZE];
+        event.name.store(name, std::memory_order_relaxed);
+        event.start.store(start, std::memory_order_relaxed);
+        event.end.store(end, std::memory_order_relaxed);
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+
+    size_t trace_to_json(std::string &json)
+    {
+        std::vector<TraceCopy> spans;
+        {
+            std::lock_guard<std::mutex> lock(ringsMutex);
+            for (TraceRing *ring : rings) {trace_copy(ring, spans);}
+        }
+
+        // Times are in microseconds since the first span
+        uint64_t origin = UINT64_MAX;
+        for (const TraceCopy &span : spans) {origin = span.start < origin ? span.start : origin;}
+
+        char buffer[128];
+        json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        for (size_t i = 0; i < spans.size(); i++)
+        {
+            const TraceCopy &span = spans[i];
+            if (i > 0) {json += ',';}
+            json += "{\"name\":\"";
+            json += span.name;
+            snprintf(buffer, sizeof(buffer), "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                     span.tid, (span.start - origin) / 1000.0, (span.end - span.start) / 1000.0);
+            json += buffer;
+        }
+        json += "]}";
+        return spans.size();
+    }
+
+} // namespace sqlite_protobuf
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Timed spans around the phases of decoding, only compiled when configured with -DSQLITE_PROTOBUF_TRACE=ON
+#ifdef SQLITE_PROTOBUF_TRACE
+#define PROTOBUF_TRACE_CONCAT_(a, b) a##b
+#define PROTOBUF_TRACE_CONCAT(a, b) PROTOBUF_TRACE_CONCAT_(a, b)
+#define PROTOBUF_TRACE_SPAN(name) sqlite_protobuf::TraceSpan PROTOBUF_TRACE_CONCAT(traceSpan, __LINE__)(name)
+#define PROTOBUF_TRACE(statement) statement
+#else
+#define PROTOBUF_TRACE_SPAN(name)
+#define PROTOBUF_TRACE(statement)
+#endif
+
+namespace sqlite_protobuf
+{
+
+    /// Span recorded in the ring buffer of the thread when it goes out of scope. The name must
+    /// be a string literal, since only the pointer is kept.
+    class TraceSpan
+    {
+    public:
+        explicit TraceSpan(const char *name);
+        ~TraceSpan();
+
+        /// Change the name of the span before it ends, such as to tell a failed attempt
+        void rename(const char *name) {this->name = name;}
+
+    private:
+        const char *name;
+        uint64_t start;
+    };
+
+    /// Write the spans in the ring buffers of all threads as Chrome trace event JSON, which can
+    /// be opened in chrome://tracing or https://ui.perfetto.dev. Spans are not removed.
+    ///
+    /// @returns the number of spans written
+    size_t trace_to_json(std::string &json);
+
+} // namespace sqlite_protobuf
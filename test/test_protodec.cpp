@@ -849,6 +849,204 @@ int test_type_float(void)
 }
 
 
+int test_read_field(void)
+{
+    Buffer buffer;
+    Field field;
+
+    std::string data;
+    data.append(utils::encodeInt(1, 42));
+    data.append(utils::encodeStr(2, "hello"));
+    data.append(utils::encodeGroup(3, utils::encodeGroup(1, utils::encodeFloat(2, 1.0f))));
+    data.append(utils::encodeDouble(4, 2.0));
+
+    buffer.start = (const uint8_t*)data.c_str();
+    buffer.end = buffer.start + data.length();
+
+    ASSERT(readField(&buffer, &field) != 0);
+    ASSERT(field.fieldNum == 1 && field.wireType == WIRETYPE_VARINT && field.value.size() == 1);
+    ASSERT(readField(&buffer, &field) != 0);
+    ASSERT(field.fieldNum == 2 && field.wireType == WIRETYPE_LEN);
+    ASSERT(std::string((const char*)field.value.start, field.value.size()) == "hello");
+    ASSERT(readField(&buffer, &field) != 0);
+    ASSERT(field.fieldNum == 3 && field.wireType == WIRETYPE_SGROUP);
+    ASSERT(field.value.size() == utils::encodeGroup(1, utils::encodeFloat(2, 1.0f)).size());
+    ASSERT(readField(&buffer, &field) != 0);
+    ASSERT(field.fieldNum == 4 && field.wireType == WIRETYPE_I64 && field.value.size() == 8);
+    ASSERT(buffer.start == buffer.end);
+    ASSERT(readField(&buffer, &field) == 0);
+
+    // Group with mismatching end tag
+    data = utils::encodeGroup(1, "");
+    data[1] = (char)((2 << 3) | WIRETYPE_EGROUP);
+    buffer.start = (const uint8_t*)data.c_str();
+    buffer.end = buffer.start + data.length();
+    ASSERT(readField(&buffer, &field) == 0);
+
+    // Truncated length delimited field
+    data = utils::encodeStr(1, "hello");
+    buffer.start = (const uint8_t*)data.c_str();
+    buffer.end = buffer.start + data.length() - 1;
+    ASSERT(readField(&buffer, &field) == 0);
+    ASSERT(!isMessage(buffer));
+
+    return 0;
+}
+
+int test_find_field(void)
+{
+    int length = 100;
+
+    std::string data;
+    Buffer buffer;
+    Field field;
+    int64_t out;
+
+    for (int i = 0; i < length; i++)
+    {
+        data.append(utils::encodeInt(1, i));
+        data.append(utils::encodeStr(1, "test"));
+    }
+
+    buffer.start = (const uint8_t*)data.c_str();
+    buffer.end = buffer.start + data.length();
+    Field decoded = decodeProtobuf(buffer);
+
+    for (int i = -length - 1; i <= length; i++)
+    {
+        Field *f = decoded.getSubField(1, WIRETYPE_VARINT, i);
+        int found = findField(&buffer, 1, WIRETYPE_VARINT, i, &field);
+        ASSERT((f != nullptr) == (found != 0));
+        if (f != nullptr)
+        {
+            ASSERT(f->value.start == field.value.start && f->value.end == field.value.end);
+            ASSERT(getInt64(&field.value, &out, 0) != 0);
+            ASSERT(out == (i < 0 ? i + length : i));
+        }
+    }
+
+    ASSERT(findField(&buffer, 2, WIRETYPE_VARINT, 0, &field) == 0);
+    ASSERT(findField(&buffer, 1, WIRETYPE_I32, 0, &field) == 0);
+
+    return 0;
+}
+
+int test_is_text(void)
+{
+    Buffer buffer;
+    const char *text[] = {"", "hello world", "tab\tnew line\n", "\xc3\xa6\xc3\xb8\xc3\xa5", "\xe2\x82\xac", "\xf0\x9f\x98\x80"};
+    const char *binary[] = {"\x01", "hello\x7f", "\xc3", "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xff"};
+
+    for (size_t i = 0; i < sizeof(text)/sizeof(text[0]); i++)
+    {
+        buffer.start = (const uint8_t*)text[i];
+        buffer.end = buffer.start + strlen(text[i]);
+        ASSERT(isText(buffer));
+    }
+
+    for (size_t i = 0; i < sizeof(binary)/sizeof(binary[0]); i++)
+    {
+        buffer.start = (const uint8_t*)binary[i];
+        buffer.end = buffer.start + strlen(binary[i]);
+        ASSERT(!isText(buffer));
+    }
+
+    return 0;
+}
+
+int test_multiple_wire_types(void)
+{
+    std::string data;
+    Buffer buffer;
+    Field field;
+
+    const WireType wireTypes[] = {WIRETYPE_LEN, WIRETYPE_SGROUP, WIRETYPE_VARINT, WIRETYPE_I64, WIRETYPE_I32};
+    const size_t numWireTypes = sizeof(wireTypes)/sizeof(wireTypes[0]);
+
+    // Mix of wire types for the same field numbers, with different number of occurrences
+    for (int i = 0; i < 10; i++)
+    {
+        data.append(utils::encodeInt(1, i));
+        if (i % 2 == 0) {data.append(utils::encodeFloat(1, (float)i));}
+        if (i % 3 == 0) {data.append(utils::encodeStr(1, "test"));}
+        if (i % 4 == 0) {data.append(utils::encodeGroup(2, utils::encodeInt(1, i)));}
+        if (i % 5 == 0) {data.append(utils::encodeDouble(2, i));}
+        data.append(utils::encodeInt(3, i));
+    }
+
+    buffer.start = (const uint8_t*)data.c_str();
+    buffer.end = buffer.start + data.length();
+    Field decoded = decodeProtobuf(buffer);
+
+    for (uint32_t fieldNumber = 1; fieldNumber <= 4; fieldNumber++)
+    {
+        for (size_t n = 1; n <= numWireTypes; n++)
+        {
+            for (int64_t index = -12; index <= 12; index++)
+            {
+                // Single scan should give the same result as trying each wire type in turn
+                Field *expected = nullptr;
+                for (size_t p = 0; p < n && expected == nullptr; p++)
+                {
+                    expected = decoded.getSubField(fieldNumber, wireTypes[p], index);
+                }
+
+                Field *f = decoded.getSubField(fieldNumber, wireTypes, n, index);
+                int found = findField(&buffer, fieldNumber, wireTypes, n, index, &field);
+
+                ASSERT(f == expected);
+                ASSERT((found != 0) == (expected != nullptr));
+                if (expected != nullptr)
+                {
+                    ASSERT(field.tag == expected->tag);
+                    ASSERT(field.value.start == expected->value.start && field.value.end == expected->value.end);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+int test_read_packed(void)
+{
+    Buffer buffer, value;
+
+    std::string data;
+    utils::appendVarint(1, data);
+    utils::appendVarint(300, data);
+    utils::appendVarint(-1, data);
+
+    buffer.start = (const uint8_t*)data.c_str();
+    buffer.end = buffer.start + data.length();
+
+    int64_t number;
+    ASSERT(readPacked(&buffer, WIRETYPE_VARINT, &value) != 0);
+    ASSERT(getInt64(&value, &number, 0) != 0 && number == 1);
+    ASSERT(readPacked(&buffer, WIRETYPE_VARINT, &value) != 0);
+    ASSERT(getInt64(&value, &number, 0) != 0 && number == 300);
+    ASSERT(readPacked(&buffer, WIRETYPE_VARINT, &value) != 0);
+    ASSERT(getInt64(&value, &number, 0) != 0 && number == -1);
+    ASSERT(buffer.start == buffer.end);
+    ASSERT(readPacked(&buffer, WIRETYPE_VARINT, &value) == 0);
+
+    // Fixed size values must fit in the buffer
+    data.clear();
+    utils::appendI32(1.5f, data);
+    utils::appendI32(2.5f, data);
+    buffer.start = (const uint8_t*)data.c_str();
+    buffer.end = buffer.start + data.length();
+
+    float f;
+    ASSERT(readPacked(&buffer, WIRETYPE_I32, &value) != 0);
+    ASSERT(getFloat(&value, &f, 0) != 0 && f == 1.5f);
+    buffer.end--;
+    ASSERT(readPacked(&buffer, WIRETYPE_I32, &value) == 0);
+    ASSERT(readPacked(&buffer, WIRETYPE_LEN, &value) == 0);
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {  
     // Create list of tests
@@ -879,7 +1077,12 @@ int main(int argc, char *argv[])
         test_type_double,
         test_type_fixed32,
         test_type_sfixed32,
-        test_type_float
+        test_type_float,
+        test_read_field,
+        test_find_field,
+        test_is_text,
+        test_multiple_wire_types,
+        test_read_packed
     };
 
     // Run tests
@@ -1,6 +1,10 @@
 #!/usr/bin/env python3
+import json
+import os
 import sqlite3
 import struct
+import tempfile
+import threading
 
 def varint(num):
     if num < 0:
@@ -325,6 +329,985 @@ def test_protobuf_each(db):
     assert res.fetchone()[1:4] == (4, 1, b"\x05\x00\x00\x00\x00\x00\x00\x00")
     assert res.fetchone() is None
 
+    # LIMIT and OFFSET stop the cursor early, rows are still returned in message order
+    res = cur.execute("SELECT field, value FROM protobuf_each(?) LIMIT 2 OFFSET 1", [encode_int(2, 0) + encode_int(2, 1) + encode_i32(3, 2) + encode_i64(4, 4)])
+    assert res.fetchall() == [(2, b"\x01"), (3, b"\x02\x00\x00\x00")]
+    res = cur.execute("SELECT rowid, field FROM protobuf_each(?) LIMIT 1", [input + b"\xff"])
+    assert res.fetchall() == [] # Malformed messages have no rows
+
+    # Constraints on field, tag and wiretype are checked while reading the message
+    numbers = encode_i64(4, 4) + encode_int(2, 0) + encode_i32(3, 2) + encode_int(2, 1) + encode_i32(3, 3) + encode_i64(4, 5)
+    query = "SELECT rowid, field, value FROM protobuf_each(?) WHERE field IN (2, 4) AND wiretype = 0"
+    plan = cur.execute("EXPLAIN QUERY PLAN " + query, [numbers]).fetchone()[3]
+    assert plan.endswith("Fw") or plan.endswith("fw")
+    assert cur.execute(query, [numbers]).fetchall() == [(1, 2, b"\x00"), (3, 2, b"\x01")]
+    res = cur.execute("SELECT field FROM protobuf_each(?) WHERE tag = 29 OR tag = 33", [numbers])
+    assert res.fetchall() == [(4,), (3,), (3,), (4,)]
+
+    # Ordering by field number keeps the message order of each field
+    res = cur.execute("SELECT rowid, field FROM protobuf_each(?) ORDER BY field DESC", [numbers])
+    assert res.fetchall() == [(0, 4), (5, 4), (2, 3), (4, 3), (1, 2), (3, 2)]
+    res = cur.execute("SELECT rowid FROM protobuf_each(?, '$') WHERE field > 2 ORDER BY field", [numbers])
+    assert res.fetchall() == [(2,), (4,), (0,), (5,)]
+
+    # Typed columns decode the value of each row, NULL when the wire type does not match
+    typed = encode_int(1, 5) + encode_i64(2, 1.5) + encode_i32(3, 2.5) + encode_str(4, "é".encode()) + varint((5 << 3) | 5) + struct.pack("<I", 4000000000)
+    res = cur.execute("SELECT as_int, as_sint, as_double, as_float, as_text, as_fixed FROM protobuf_each(?)", [typed])
+    assert res.fetchall() == [(5, -3, None, None, None, None), 
+                              (None, None, 1.5, None, None, struct.unpack("<q", struct.pack("<d", 1.5))[0]),
+                              (None, None, None, 2.5, None, struct.unpack("<I", struct.pack("<f", 2.5))[0]),
+                              (None, None, None, None, "é", None),
+                              (None, None, None, struct.unpack("<f", struct.pack("<I", 4000000000))[0], None, 4000000000)]
+    assert cur.execute("SELECT * FROM protobuf_each(?)", [typed]).fetchone() == (8, 1, 0, varint(5), typed)
+
+    # LIMIT is only pushed down when the rows come in the requested order, otherwise SQLite sorts all rows first
+    res = cur.execute("SELECT field, as_int FROM protobuf_each(?) ORDER BY as_int DESC LIMIT 3", [encode_int(1, 0) + encode_int(2, 1) + encode_int(3, 2) + encode_int(4, 9) + encode_int(5, 7)])
+    assert res.fetchall() == [(4, 9), (5, 7), (3, 2)]
+    res = cur.execute("SELECT rowid FROM protobuf_each(?) WHERE field IN (2, 3) ORDER BY rowid DESC LIMIT 3", [numbers])
+    assert res.fetchall() == [(4,), (3,), (2,)]
+    res = cur.execute("SELECT rowid FROM protobuf_each(?) ORDER BY field DESC LIMIT 2 OFFSET 1", [numbers])
+    assert res.fetchall() == [(5,), (2,)]
+
+    # Packed repeated values are returned before the length delimited field
+    res = cur.execute("SELECT field, wiretype, value FROM protobuf_each(?)", [encode_str(5, b"\x01\x02")])
+    assert res.fetchall() == [(5, 0, b"\x01"), (5, 0, b"\x02"), (5, 2, b"\x01\x02")]
+
+def test_protobuf_contains_text(db):
+    cur = db.cursor()
+
+    # Make input buffer
+    input = b""
+    input += encode_str(1, b"Hello World")
+    input += encode_int(2, ord("#"))
+    input += encode_str(3, encode_str(1, b"nested text") + encode_i32(2, 1.0))
+    input += encode_group(4, encode_str(1, b"grouped text"))
+    input += encode_str(5, bytes([0, 1, 2]) + b"binary")
+
+    # Find text in top level, nested message and group
+    for needle, expected in [("World", 1), ("nested", 1), ("grouped", 1), ("missing", 0), ("", 1)]:
+        res = cur.execute("SELECT protobuf_contains_text(?, ?);", [input, needle])
+        assert res.fetchone()[0] == expected
+
+    # Numeric fields, tags and lengths never match
+    for needle in ["#", "\x0b", "\x0a\x0b", "binary"]:
+        res = cur.execute("SELECT protobuf_contains_text(?, ?);", [input, needle])
+        assert res.fetchone()[0] == 0
+
+    # Bytes that are both text and a message are a message like in protobuf_to_json, so the tag and length do not match
+    text = encode_str(4, b"Hello World, this is some text!!")
+    assert text.startswith(b'" ')
+    for needle, expected in [('" Hello', 0), ("Hello", 1)]:
+        res = cur.execute("SELECT protobuf_contains_text(?, ?);", [encode_str(1, text), needle])
+        assert res.fetchone()[0] == expected
+
+    # Search only in sub tree
+    res = cur.execute("SELECT protobuf_contains_text(?, 'nested', '$.3');", [input])
+    assert res.fetchone()[0] == 1
+    res = cur.execute("SELECT protobuf_contains_text(?, 'Hello', '$.3');", [input])
+    assert res.fetchone()[0] == 0
+    res = cur.execute("SELECT protobuf_contains_text(?, 'grouped', '$.4');", [input])
+    assert res.fetchone()[0] == 1
+    res = cur.execute("SELECT protobuf_contains_text(?, 'nested', '$.9');", [input])
+    assert res.fetchone()[0] == 0
+
+    # NULL input
+    res = cur.execute("SELECT protobuf_contains_text(NULL, 'text');")
+    assert res.fetchone()[0] is None
+
+def test_protobuf_locate(db):
+    cur = db.cursor()
+
+    # Make input buffer
+    nested = encode_int(1, 150) + encode_str(2, b"nested")
+    input = b""
+    input += encode_str(1, b"Hello")
+    input += encode_str(2, nested)
+    input += encode_i64(3, 1.5)
+    input += encode_str(1, b"World")
+
+    # Locate fields and check that the located bytes match the field values
+    for path, expected in [("$.1", b"Hello"), ("$.1[1]", b"World"), ("$.1[-1]", b"World"), ("$.2", nested), 
+                           ("$.2.2", b"nested"), ("$.2.1", varint(150)), ("$.3", struct.pack("<d", 1.5)), ("$", input)]:
+        res = cur.execute("SELECT protobuf_locate(?1, ?2), substr(?1, json_extract(protobuf_locate(?1, ?2), '$[0]') + 1, json_extract(protobuf_locate(?1, ?2), '$[1]'));", [input, path])
+        location, value = res.fetchone()
+        offset, length = json.loads(location)
+        assert input[offset:offset+length] == expected
+        assert value == expected
+
+    # Missing fields return NULL
+    res = cur.execute("SELECT protobuf_locate(?, '$.4');", [input])
+    assert res.fetchone()[0] is None
+    res = cur.execute("SELECT protobuf_locate(?, '$.1[2]');", [input])
+    assert res.fetchone()[0] is None
+
+def test_protobuf_extract_blob(db):
+    cur = db.cursor()
+
+    # Make input buffer with a large field that should be skipped
+    input = b""
+    input += encode_str(1, b"Header")
+    input += encode_str(2, bytes(1000000))
+    input += encode_str(3, encode_int(1, 42) + encode_str(2, b"nested"))
+    input += encode_group(4, encode_i32(1, 1.5))
+    input += encode_str(5, bytes([i for i in range(100)]))
+    input += encode_int(6, -1)
+    input += encode_str(1, b"Footer")
+
+    cur.execute("CREATE TEMP TABLE blobs(id INTEGER PRIMARY KEY, data BLOB)")
+    cur.execute("INSERT INTO blobs VALUES (1, ?), (2, NULL)", [input])
+
+    # Result should be the same as protobuf_extract
+    for path, type in [("$.1", "string"), ("$.1[1]", "string"), ("$.1[-2]", "string"), ("$.1[2]", "string"), ("$.3.1", "int32"), 
+                       ("$.3.2", "string"), ("$.3", ""), ("$.4.1", "float"), ("$.5[10]", "int32"), ("$.5[-1]", "int64"), 
+                       ("$.6", "int64"), ("$.6", "sint64"), ("$.6", ""), ("$.7", "int32"), ("$", "")]:
+        res = cur.execute("SELECT protobuf_extract_blob('blobs', 'data', 1, ?1, ?2), protobuf_extract(data, ?1, ?2) FROM blobs WHERE id = 1", [path, type])
+        output, expected = res.fetchone()
+        assert output == expected
+
+    # NULL values return NULL
+    res = cur.execute("SELECT protobuf_extract_blob('blobs', 'data', 2, '$.1', 'string')")
+    assert res.fetchone()[0] is None
+
+    # Missing rows raise an error
+    try:
+        cur.execute("SELECT protobuf_extract_blob('blobs', 'data', 3, '$.1', 'string')")
+        assert False
+    except sqlite3.OperationalError:
+        pass
+
+    cur.execute("DROP TABLE blobs")
+
+def test_protobuf_path(db):
+    cur = db.cursor()
+    input = encode_str(1, encode_int(2, 42))
+
+    # Valid paths
+    for path, expected in [("$.1.2", 42), ("$.1[0].2[0]", 42), ("$.1[-1].2", 42), ("$.1[1].2", None), ("$.3", None)]:
+        res = cur.execute("SELECT protobuf_extract(?, ?, 'int32');", [input, path])
+        assert res.fetchone()[0] == expected
+
+    # Invalid paths raise an error instead of being silently misread
+    for path in ["", "1", "$1", "$.", "$.a", "$.1.", "$.0", "$.1[", "$.1[a]", "$.1[0", "$.1[0]x", "$.1 ", "$...1", "$.1[*", "$.1[:", "$.1[?(.2 = 1)]", "$.1[?(.2 == x)]", "$.1[?(.2 == 'a)]", "$.536870912", "$.1[2147483648]"]:
+        for query in ["SELECT protobuf_extract(?, ?, 'int32');", "SELECT protobuf_locate(?, ?);", 
+                      "SELECT protobuf_contains_text(?1, 'text', ?2);", "SELECT * FROM protobuf_each(?, ?);"]:
+            if "each" in query and path == "":
+                continue # Empty path refers to the root in protobuf_each
+            try:
+                cur.execute(query, [input, path]).fetchall()
+                assert False, path
+            except sqlite3.OperationalError as e:
+                assert "Path not valid" in str(e)
+
+    # Same path in many statements and rows
+    for i in range(200):
+        path = "$.1.{}".format(i % 100 + 1)
+        res = cur.execute("SELECT protobuf_extract(?, ?, 'int32'), count(*) FROM protobuf_each(?, '$.1');", [input, path, input])
+        assert res.fetchone() == (42 if path == "$.1.2" else None, 1)
+
+def test_protobuf_path_extensions(db):
+    cur = db.cursor()
+    item = lambda id, name: encode_int(1, id) + encode_str(2, name)
+    input = encode_str(1, item(1, b"a")) + encode_str(1, item(2, b"b")) + encode_str(1, item(3, b"c")) + encode_str(3, encode_str(1, item(4, b"d")))
+
+    # Wildcards, slices and recursive descent return a JSON array of all matches
+    for path, type, expected in [
+        ("$.1[*].1", "int32", [1, 2, 3]),
+        ("$.1[1:].1", "int32", [2, 3]),
+        ("$.1[:-1].2", "string", ["a", "b"]),
+        ("$.1[-2:].1", "int32", [2, 3]),
+        ("$.1[5:].1", "int32", []),
+        ("$..1.1", "int32", [1, 2, 3, 4]),
+        ("$..2", "string", ["a", "b", "c", "d"]),
+        ("$.3..2", "string", ["d"]),
+        ("$.1[*]", "", [{"1": 1, "2": "a"}, {"1": 2, "2": "b"}, {"1": 3, "2": "c"}]),
+    ]:
+        res = cur.execute("SELECT protobuf_extract(?, ?, ?);", [input, path, type])
+        assert json.loads(res.fetchone()[0]) == expected, path
+
+    # Filters compare a field of each occurrence with a literal
+    for path, expected in [
+        ("$.1[?(@.1 == 2)].2", ["b"]),
+        ("$.1[?(.1 >= 2)].2", ["b", "c"]),
+        ("$.1[?(@.1 != 2)].2", ["a", "c"]),
+        ("$.1[?(@.2 == 'c')].2", ["c"]),
+        ("$..1[?(@.2 > \"b\")].2", ["c", "d"]),
+        ("$.1[?(@.3 == 1)].2", []),
+        ("$.1[?(@.1 < 2.5e0)].2", ["a", "b"]),
+        ("$.1[?(@.1 > +1.)].2", ["b", "c"]),
+    ]:
+        res = cur.execute("SELECT protobuf_extract(?, ?, 'string');", [input, path])
+        assert json.loads(res.fetchone()[0]) == expected, path
+
+    # Numbers are decimal, other syntax and numbers out of range are errors at the position of the literal
+    for path, position in [
+        ("$.1[?(@.1 == 0x2)].2", 14),
+        ("$.1[?(@.1 == inf)].2", 13),
+        ("$.1[?(@.1 == nan)].2", 13),
+        ("$.1[?(@.1 == -infinity)].2", 13),
+        ("$.1[?(@.1 == 1e)].2", 15),
+        ("$.1[?(@.1 == 1.2.3)].2", 16),
+        ("$.1[?(@.1 == 9223372036854775808)].2", 13),
+        ("$.1[?(@.1 == 1e400)].2", 13),
+    ]:
+        try:
+            cur.execute("SELECT protobuf_extract(?, ?, 'string');", [input, path])
+            assert False, path
+        except sqlite3.OperationalError as e:
+            assert "Path not valid" in str(e) and str(e).endswith("position %d" % position), (path, str(e))
+    res = cur.execute("SELECT protobuf_extract(?, '$.1[?(@.1 > -9223372036854775808)].1', 'int32');", [input])
+    assert json.loads(res.fetchone()[0]) == [1, 2, 3]
+
+    # Packed repeated values are matched one by one, and floats use the precision of the type
+    packed = encode_str(4, varint(1) + varint(2) + varint(3)) + encode_i64(5, 0.5) + encode_i64(5, 1.5)
+    res = cur.execute("SELECT protobuf_extract(?, '$.4[1:]', 'int32'), protobuf_extract(?, '$.5[*]', 'double');", [packed, packed])
+    assert res.fetchone() == ("[2,3]", "[0.5,1.5]")
+
+    # Locate, contains_text and each accept the same paths
+    res = cur.execute("SELECT protobuf_locate(?, '$.1[*].1');", [input])
+    assert [input[o:o + n] for o, n in json.loads(res.fetchone()[0])] == [varint(1), varint(2), varint(3)]
+    res = cur.execute("SELECT protobuf_contains_text(?1, 'd', '$..1'), protobuf_contains_text(?1, 'd', '$.1[*]');", [input])
+    assert res.fetchone() == (1, 0)
+    res = cur.execute("SELECT value FROM protobuf_each(?, '$.1[1:]') WHERE field = 2 AND wiretype = 2;", [input])
+    assert res.fetchall() == [(b"b",), (b"c",)]
+
+    # Incremental blob reads follow a single field
+    try:
+        cur.execute("SELECT protobuf_extract_blob('blobs', 'data', 1, '$.1[*]', '')")
+        assert False
+    except sqlite3.OperationalError as e:
+        assert "Path not valid" in str(e)
+
+def test_protobuf_tree(db):
+    cur = db.cursor()
+
+    # Message with a nested message, a string that is not a message and a group
+    inner = encode_int(2, 7) + encode_str(3, encode_int(4, 9))
+    input = encode_str(1, inner) + encode_int(5, 1) + encode_str(1, b"\xff") + encode_group(6, encode_int(1, 2))
+
+    # Walk the whole message depth first
+    res = cur.execute("SELECT path, depth, field, wiretype, parent_id, id FROM protobuf_tree(?)", [input])
+    assert res.fetchall() == [
+        ("$", 0, None, None, None, 0),
+        ("$.1[0]", 1, 1, 2, 0, 2),
+        ("$.1[0].2[0]", 2, 2, 0, 2, 3),
+        ("$.1[0].3[0]", 2, 3, 2, 2, 6),
+        ("$.1[0].3[0].4[0]", 3, 4, 0, 6, 7),
+        ("$.5[0]", 1, 5, 0, 0, 9),
+        ("$.1[1]", 1, 1, 2, 0, 12),
+        ("$.6[0]", 1, 6, 3, 0, 14),
+        ("$.6[0].1[0]", 2, 1, 0, 14, 15),
+    ]
+
+    # Paths can be used with protobuf_extract
+    res = cur.execute("SELECT protobuf_extract(?, path, 'int32') FROM protobuf_tree(?) WHERE wiretype = 0", [input, input])
+    assert res.fetchall() == [(7,), (9,), (1,), (2,)]
+
+    # Sub messages with the same field number as LEN and as SGROUP share their indexes, also with protobuf_extract
+    mixed = encode_group(1, encode_int(2, 5)) + encode_str(1, encode_int(2, 6)) + encode_group(1, encode_int(2, 7))
+    res = cur.execute("SELECT path, protobuf_extract(?, path, 'int64') FROM protobuf_tree(?) WHERE wiretype = 0", [mixed, mixed])
+    assert res.fetchall() == [("$.1[0].2[0]", 5), ("$.1[1].2[0]", 6), ("$.1[2].2[0]", 7)]
+    res = cur.execute("SELECT protobuf_extract(?, '$.1[*].2', 'int64'), protobuf_extract(?, '$.1[-2].2', 'int64')", [mixed, mixed])
+    assert res.fetchone() == ("[5,6,7]", 6)
+
+    # Rows join to their parents
+    res = cur.execute("SELECT p.path FROM protobuf_tree(?) t JOIN protobuf_tree(?) p ON p.id = t.parent_id WHERE t.field = 4", [input, input])
+    assert res.fetchall() == [("$.1[0].3[0]",)]
+
+    # Start at a root path
+    res = cur.execute("SELECT path, depth, field, value FROM protobuf_tree(?, '$.1[0].3')", [input])
+    assert res.fetchall() == [("$.1[0].3", 0, 3, encode_int(4, 9)), ("$.1[0].3.4[0]", 1, 4, b"\x09")]
+    res = cur.execute("SELECT * FROM protobuf_tree(?, '$.7')", [input])
+    assert res.fetchall() == []
+
+    # Depth and path constraints prune the walk
+    res = cur.execute("SELECT path FROM protobuf_tree(?) WHERE depth <= 1", [input])
+    assert res.fetchall() == [("$",), ("$.1[0]",), ("$.5[0]",), ("$.1[1]",), ("$.6[0]",)]
+    res = cur.execute("SELECT path FROM protobuf_tree(?) WHERE depth < 0", [input])
+    assert res.fetchall() == []
+    res = cur.execute("SELECT count(*) FROM protobuf_tree(?) WHERE depth <= 'a'", [input])
+    assert res.fetchone()[0] == 9
+    res = cur.execute("SELECT path FROM protobuf_tree(?) WHERE path LIKE '$.1[0].3%'", [input])
+    assert res.fetchall() == [("$.1[0].3[0]",), ("$.1[0].3[0].4[0]",)]
+    res = cur.execute("SELECT path FROM protobuf_tree(?) WHERE path = '$.6[0].1[0]'", [input])
+    assert res.fetchall() == [("$.6[0].1[0]",)]
+    res = cur.execute("EXPLAIN QUERY PLAN SELECT path FROM protobuf_tree(?) WHERE depth <= 1 AND path LIKE '$.1%'", [input])
+    assert res.fetchone()[3].endswith("dk")
+
+    # Invalid messages only have the root row
+    res = cur.execute("SELECT path FROM protobuf_tree(?)", [b"\xff"])
+    assert res.fetchall() == [("$",)]
+
+    # Root paths select a single field
+    try:
+        cur.execute("SELECT * FROM protobuf_tree(?, '$.1[*]')", [input])
+        assert False
+    except sqlite3.OperationalError as e:
+        assert "Path not valid" in str(e)
+
+def test_protobuf_shred(db):
+    cur = db.cursor()
+    cur.execute("CREATE TEMP TABLE messages(id INTEGER PRIMARY KEY, data BLOB)")
+    for i in range(1, 2001):
+        message = encode_int(1, i) + encode_str(2, b"name%d" % i) + encode_i64(3, i / 2)
+        if i % 3 == 0:
+            message += encode_int(4, i) + encode_int(4, i + 1)
+        cur.execute("INSERT INTO messages VALUES (?, ?)", [i, message])
+
+    # Shred the messages into columns
+    cur.execute("CREATE VIRTUAL TABLE temp.report USING protobuf_shred(messages, data, id '$.1' int64, name '$.2' string, score '$.3' double, tags '$.4[*]' int64)")
+    res = cur.execute("SELECT rowid, * FROM report LIMIT 3")
+    assert res.fetchall() == [(1, 1, "name1", 0.5, "[]"), (2, 2, "name2", 1.0, "[]"), (3, 3, "name3", 1.5, "[3,4]")]
+    res = cur.execute("SELECT count(*), sum(id), sum(score) FROM report")
+    assert res.fetchone() == (2000, 2001000, 1000500.0)
+    res = cur.execute("SELECT id FROM report WHERE rowid BETWEEN 1500 AND 1502")
+    assert res.fetchall() == [(1500,), (1501,), (1502,)]
+
+    # Changes to the source table are visible right away, and are shredded again by 'refresh'
+    cur.execute("UPDATE messages SET data = ? WHERE id = 2", [encode_int(1, 99)])
+    cur.execute("DELETE FROM messages WHERE id = 1")
+    cur.execute("INSERT INTO messages VALUES (5000, ?)", [encode_str(2, b"new")])
+    expected = [(2, 99, None, None, "[]"), (3, 3, "name3", 1.5, "[3,4]"), (5000, None, "new", None, "[]")]
+    res = cur.execute("SELECT rowid, * FROM report WHERE rowid < 4 OR rowid > 2000")
+    assert res.fetchall() == expected
+    assert cur.execute("SELECT count(*) FROM report_dirty").fetchone()[0] == 2
+    cur.execute("INSERT INTO report(report) VALUES ('refresh')")
+    assert cur.execute("SELECT count(*) FROM report_dirty").fetchone()[0] == 0
+    res = cur.execute("SELECT rowid, * FROM report WHERE rowid < 4 OR rowid > 2000")
+    assert res.fetchall() == expected
+
+    # The triggers only write the dirty table, so they also work when the schema is not trusted
+    cur.execute("PRAGMA trusted_schema=OFF")
+    try:
+        cur.execute("UPDATE messages SET data = ? WHERE id = 3", [encode_int(1, 97)])
+        cur.execute("INSERT INTO messages VALUES (5001, ?)", [encode_int(1, 5001)])
+        cur.execute("DELETE FROM messages WHERE id = 5001")
+        assert cur.execute("SELECT id FROM report WHERE rowid = 3").fetchone() == (97,)
+        cur.execute("INSERT INTO report(report) VALUES ('refresh')")
+        assert cur.execute("SELECT count(*) FROM report_dirty").fetchone()[0] == 0
+    finally:
+        cur.execute("PRAGMA trusted_schema=ON")
+
+    # The dirty table is not a shadow table, so the triggers also work when the shadow tables are read only
+    if hasattr(db, "setconfig"):
+        db.setconfig(sqlite3.SQLITE_DBCONFIG_DEFENSIVE, True)
+        try:
+            cur.execute("UPDATE messages SET data = ? WHERE id = 3", [encode_int(1, 98)])
+            assert cur.execute("SELECT count(*) FROM report_dirty").fetchone()[0] == 1
+            try:
+                cur.execute("DELETE FROM report_data")
+                assert False
+            except sqlite3.OperationalError as e:
+                assert "may not be modified" in str(e)
+            cur.execute("INSERT INTO report(report) VALUES ('refresh')")
+            assert cur.execute("SELECT count(*) FROM report_dirty").fetchone()[0] == 0
+            assert cur.execute("SELECT id FROM report WHERE rowid = 3").fetchone() == (98,)
+        finally:
+            db.setconfig(sqlite3.SQLITE_DBCONFIG_DEFENSIVE, False)
+
+    # The table itself is read only
+    try:
+        cur.execute("DELETE FROM report")
+        assert False
+    except sqlite3.OperationalError as e:
+        assert "read only" in str(e)
+
+    # Invalid column definitions
+    for column in ["id", "id '$.1' int128", "id '$.x' int64"]:
+        try:
+            cur.execute("CREATE VIRTUAL TABLE temp.invalid USING protobuf_shred(messages, data, %s)" % column)
+            assert False
+        except sqlite3.OperationalError as e:
+            pass
+
+    # A missing column is an error, not a string literal
+    try:
+        cur.execute("CREATE VIRTUAL TABLE temp.invalid USING protobuf_shred(messages, missing, id '$.1' int64)")
+        assert False
+    except sqlite3.OperationalError as e:
+        assert "missing" in str(e)
+
+    cur.execute("DROP TABLE report")
+    cur.execute("DROP TABLE messages")
+    assert cur.execute("SELECT count(*) FROM temp.sqlite_master").fetchone()[0] == 0
+
+def test_protobuf_file(db):
+    cur = db.cursor()
+    messages = [encode_int(1, i) + encode_str(2, b"x" * (i % 7)) for i in range(3000)]
+    framings = {
+        "varint": b"".join(varint(len(m)) + m for m in messages),
+        "fixed32": b"".join(struct.pack("<I", len(m)) + m for m in messages),
+        "fixed32be": b"".join(struct.pack(">I", len(m)) + m for m in messages) + b"\x00\x00\x00\x09ab", # Truncated message
+    }
+
+    with tempfile.TemporaryDirectory() as directory:
+        for framing, data in framings.items():
+            path = os.path.join(directory, framing + ".bin")
+            with open(path, "wb") as f:
+                f.write(data)
+
+            # One row for each message
+            res = cur.execute("SELECT count(*), sum(protobuf_extract(message, '$.1', 'int64')) FROM protobuf_file(?, ?)", [path, framing])
+            assert res.fetchone() == (3000, sum(range(3000)))
+
+        # Default framing is varint
+        path = os.path.join(directory, "varint.bin")
+        res = cur.execute("SELECT rowid, offset, size, message FROM protobuf_file(?) LIMIT 2", [path])
+        assert res.fetchall() == [(1, 1, 4, messages[0]), (2, 6, 5, messages[1])]
+
+        # Seek to rowids
+        res = cur.execute("SELECT rowid, protobuf_extract(message, '$.1', 'int64') FROM protobuf_file(?) WHERE rowid = 2500", [path])
+        assert res.fetchall() == [(2500, 2499)]
+        res = cur.execute("SELECT rowid FROM protobuf_file(?) WHERE rowid BETWEEN 1023 AND 1026", [path])
+        assert res.fetchall() == [(1023,), (1024,), (1025,), (1026,)]
+        res = cur.execute("SELECT rowid FROM protobuf_file(?) WHERE rowid > 2998", [path])
+        assert res.fetchall() == [(2999,), (3000,)]
+
+        # Rowids below 1, down to the smallest integer, match no message or do not limit the range
+        for where, count in [("rowid = -9223372036854775808", 0), ("rowid < -9223372036854775807", 0), ("rowid <= -9223372036854775808", 0),
+                             ("rowid < 1", 0), ("rowid = 0", 0), ("rowid >= -9223372036854775808", 3000), ("rowid > -9223372036854775808", 3000)]:
+            res = cur.execute("SELECT count(*) FROM protobuf_file(?) WHERE %s" % where, [path])
+            assert res.fetchone()[0] == count, where
+
+        # Changes to the file are seen by the next query
+        with open(path, "ab") as f:
+            f.write(varint(2) + encode_int(1, 7))
+        res = cur.execute("SELECT count(*) FROM protobuf_file(?)", [path])
+        assert res.fetchone()[0] == 3001
+
+        # Changes within the same second of the modification time, the sparse index of the old file is not used
+        path = os.path.join(directory, "changed.bin")
+        second = (os.stat(directory).st_mtime_ns // 1000000000 - 10) * 1000000000
+        with open(path, "wb") as f:
+            f.write((varint(7) + encode_str(2, b"x" * 5)) * 1100)
+        os.utime(path, ns=(second, second + 100))
+        res = cur.execute("SELECT count(*) FROM protobuf_file(?) WHERE rowid = 1050", [path])
+        assert res.fetchone()[0] == 1
+        with open(path, "r+b") as f:
+            f.write((varint(15) + encode_str(2, b"y" * 13)) * 550)
+        os.utime(path, ns=(second, second + 200))
+        res = cur.execute("SELECT count(*) FROM protobuf_file(?) WHERE rowid = 1050", [path])
+        assert res.fetchone()[0] == 0
+
+        # A file replaced by one of the same size and modification time, and more versions than are pinned
+        for i in range(20):
+            with open(path + ".new", "wb") as f:
+                f.write((varint(15) + encode_str(2, b"%13d" % i)) * 550)
+            os.utime(path + ".new", ns=(second, second + 200))
+            os.replace(path + ".new", path)
+            res = cur.execute("SELECT message FROM protobuf_file(?) WHERE rowid = 1", [path])
+            assert res.fetchone()[0] == encode_str(2, b"%13d" % i)
+
+        # Errors
+        for args in [[os.path.join(directory, "missing.bin"), "varint"], [directory, "varint"], [path, "varint32"]]:
+            try:
+                cur.execute("SELECT * FROM protobuf_file(?, ?)", args)
+                assert False
+            except sqlite3.OperationalError as e:
+                pass
+
+
+def test_protobuf_import(db):
+    cur = db.cursor()
+    messages = [encode_int(1, i) + encode_str(2, b"n%d" % i) + encode_int(3, i) + encode_int(3, i + 1) for i in range(3000)]
+    cur.execute("CREATE TEMP TABLE imported(id INTEGER UNIQUE, name TEXT, tags TEXT, message BLOB)")
+
+    with tempfile.TemporaryDirectory() as directory:
+        path = os.path.join(directory, "varint.bin")
+        with open(path, "wb") as f:
+            f.write(b"".join(varint(len(m)) + m for m in messages))
+
+        # One row for each message, in file order
+        res = cur.execute("SELECT protobuf_import(?, 'varint', 'imported', 'id', '$.1', 'int64', 'name', '$.2', 'string', 'tags', '$.3[*]', 'int64', 'message', '$', '')", [path])
+        assert res.fetchone()[0] == 3000
+        res = cur.execute("SELECT id, name, tags, message FROM imported WHERE rowid = 2")
+        assert res.fetchone() == (1, "n1", "[1,2]", messages[1])
+        res = cur.execute("SELECT count(*), sum(id) FROM imported WHERE id = rowid - 1")
+        assert res.fetchone() == (3000, sum(range(3000)))
+
+        # Constraint failures stop the import
+        try:
+            cur.execute("SELECT protobuf_import(?, 'varint', 'imported', 'id', '$.1', 'int64')", [path])
+            assert False
+        except sqlite3.IntegrityError as e:
+            pass
+        res = cur.execute("SELECT count(*) FROM imported")
+        assert res.fetchone()[0] == 3000
+
+        # The import is atomic, a constraint failure on the last message leaves none of the rows
+        cur.execute("CREATE TEMP TABLE atomic(id INTEGER UNIQUE)")
+        cur.execute("INSERT INTO atomic VALUES (2999)")
+        db.commit()
+        try:
+            cur.execute("SELECT protobuf_import(?, 'varint', 'atomic', 'id', '$.1', 'int64')", [path])
+            assert False
+        except sqlite3.IntegrityError as e:
+            pass
+        res = cur.execute("SELECT count(*), sum(id) FROM atomic")
+        assert res.fetchone() == (1, 2999)
+        cur.execute("DROP TABLE atomic")
+
+        # Errors
+        for args in [[path, "varint", "missing", "id", "$.1", "int64"], [path, "varint32", "imported", "id", "$.1", "int64"],
+                     [os.path.join(directory, "missing.bin"), "varint", "imported", "id", "$.1", "int64"], [path, "varint", "imported", "id", "$.1"]]:
+            try:
+                cur.execute("SELECT protobuf_import(%s)" % ",".join("?" * len(args)), args)
+                assert False
+            except sqlite3.OperationalError as e:
+                pass
+
+    cur.execute("DROP TABLE imported")
+
+
+def test_protobuf_scan(db):
+    cur = db.cursor()
+    cur.execute("CREATE TABLE scan_source(data BLOB)")
+    messages = [encode_int(1, i) + encode_str(2, b"n%d" % i) + encode_int(3, i) + encode_int(3, i + 1) for i in range(3000)]
+    cur.executemany("INSERT INTO scan_source(rowid, data) VALUES (?, ?)", [(2 * i + 1, m) for i, m in enumerate(messages)])
+    db.commit() # The scan reads the committed rows through its own connection
+    cur.execute("CREATE VIRTUAL TABLE temp.scan USING protobuf_scan(main.scan_source, data, id '$.1' int64, name '$.2' string, tags '$.3[*]' int64, message '$' '')")
+
+    # Same values as protobuf_extract, in rowid order
+    res = cur.execute("SELECT rowid, id, name, tags, message FROM scan LIMIT 2")
+    assert res.fetchall() == [(1, 0, "n0", "[0,1]", messages[0]), (3, 1, "n1", "[1,2]", messages[1])]
+    expected = cur.execute("SELECT count(*), sum(protobuf_extract(data, '$.1', 'int64')), sum(length(protobuf_extract(data, '$.2', 'string'))) FROM scan_source").fetchone()
+    res = cur.execute("SELECT count(*), sum(id), sum(length(name)) FROM scan")
+    assert res.fetchone() == expected
+    res = cur.execute("SELECT group_concat(rowid) = (SELECT group_concat(rowid) FROM scan_source) FROM scan")
+    assert res.fetchone()[0] == 1
+
+    # Constraints on the rowid
+    res = cur.execute("SELECT rowid, id FROM scan WHERE rowid BETWEEN 2000 AND 2004")
+    assert res.fetchall() == [(2001, 1000), (2003, 1001)]
+    res = cur.execute("SELECT id FROM scan WHERE rowid = 5999")
+    assert res.fetchall() == [(2999,)]
+
+    # Rows the transaction has not committed are not visible to the read connection, so transactions are refused
+    cur.execute("INSERT INTO scan_source(data) VALUES (?)", [messages[0]])
+    try:
+        cur.execute("SELECT count(*) FROM scan").fetchall()
+        assert False
+    except sqlite3.OperationalError as e:
+        assert "inside a transaction" in str(e)
+    db.rollback()
+
+    # The source table must be in a database file
+    try:
+        cur.execute("CREATE TEMP TABLE scan_memory(data BLOB)")
+        cur.execute("CREATE VIRTUAL TABLE temp.scan_bad USING protobuf_scan(scan_memory, data, id '$.1' int64)")
+        cur.execute("SELECT * FROM scan_bad")
+        assert False
+    except sqlite3.OperationalError as e:
+        pass
+
+    cur.execute("DROP TABLE scan_bad")
+
+    # A missing column is an error, not a string literal
+    try:
+        cur.execute("CREATE VIRTUAL TABLE temp.scan_missing USING protobuf_scan(main.scan_source, missing, id '$.1' int64)")
+        cur.execute("SELECT * FROM scan_missing").fetchall()
+        assert False
+    except sqlite3.OperationalError as e:
+        assert "missing" in str(e)
+
+    cur.execute("DROP TABLE scan_missing")
+    cur.execute("DROP TABLE scan_memory")
+    cur.execute("DROP TABLE scan")
+    cur.execute("DROP TABLE scan_source")
+    db.commit()
+
+
+def test_protobuf_convert_table(db):
+    cur = db.cursor()
+    db.commit()
+    cur.execute("PRAGMA journal_mode=WAL") # The messages are read through other connections while the calling connection writes
+    cur.execute("CREATE TABLE convert_source(data BLOB, json TEXT)")
+    cur.execute("CREATE TABLE convert_target(json TEXT)")
+    messages = [encode_int(1, i) + encode_str(2, b"n%d" % i) + encode_int(3, i) for i in range(3000)]
+    cur.executemany("INSERT INTO convert_source(rowid, data) VALUES (?, ?)", [(3 * i + 1, m) for i, m in enumerate(messages)])
+    db.commit()
+
+    # Same JSON as protobuf_to_json, written to a column of the same table or to a target table
+    res = cur.execute("SELECT protobuf_convert_table('convert_source', 'data', 'convert_source', 'json', 'json', 3)")
+    assert res.fetchone()[0] == 3000
+    res = cur.execute("SELECT count(*) FROM convert_source WHERE json = protobuf_to_json(data)")
+    assert res.fetchone()[0] == 3000
+    res = cur.execute("SELECT protobuf_convert_table('convert_source', 'data', 'convert_target', 'json')")
+    assert res.fetchone()[0] == 3000
+    res = cur.execute("SELECT count(*) FROM convert_source s JOIN convert_target t ON s.rowid = t.rowid WHERE s.json = t.json")
+    assert res.fetchone()[0] == 3000
+    db.commit()
+
+    # Too many threads are clamped to a few for each core
+    cur.execute("DELETE FROM convert_target")
+    db.commit()
+    res = cur.execute("SELECT protobuf_convert_table('convert_source', 'data', 'convert_target', 'json', 'json', ?)", (1 << 62,))
+    assert res.fetchone()[0] == 3000
+    db.commit()
+
+    # Errors roll back the whole conversion
+    try:
+        cur.execute("SELECT protobuf_convert_table('convert_source', 'data', 'convert_target', 'json')")
+        assert False
+    except sqlite3.IntegrityError as e:
+        pass
+    res = cur.execute("SELECT count(*) FROM convert_target")
+    assert res.fetchone()[0] == 3000
+    for args in [["convert_source", "missing", "convert_source", "json"], ["missing", "data", "convert_source", "json"], ["convert_source", "data", "convert_source", "json", "xml"]]:
+        try:
+            cur.execute("SELECT protobuf_convert_table(?, ?, ?, ?%s)" % (", ?" * (len(args) - 4)), args)
+            assert False
+        except sqlite3.OperationalError as e:
+            pass
+
+    # Rows the transaction has not committed are not visible to the readers, so transactions are refused
+    cur.execute("INSERT INTO convert_source(data) VALUES (?)", [messages[0]])
+    try:
+        cur.execute("SELECT protobuf_convert_table('convert_source', 'data', 'convert_source', 'json')")
+        assert False
+    except sqlite3.OperationalError as e:
+        assert "inside a transaction" in str(e)
+    db.rollback()
+
+    cur.execute("DROP TABLE convert_source")
+    cur.execute("DROP TABLE convert_target")
+    db.commit()
+    cur.execute("PRAGMA journal_mode=DELETE")
+
+
+def test_protobuf_view(db):
+    cur = db.cursor()
+    cur.execute("CREATE TABLE view_source(data BLOB)")
+    messages = [encode_int(1, i) + encode_str(2, b"n%d" % i) + encode_int(3, i) + encode_int(3, i + 1) for i in range(1000)]
+    cur.executemany("INSERT INTO view_source(rowid, data) VALUES (?, ?)", [(i + 1, m) for i, m in enumerate(messages)])
+    cur.execute("CREATE VIRTUAL TABLE temp.view USING protobuf_view(main.view_source, data, id INTEGER '$.1', name TEXT '$.2', tags TEXT '$.3[*]' int64)")
+
+    # Same values as protobuf_extract, the message is the hidden column
+    res = cur.execute("SELECT rowid, id, name, tags, data FROM view LIMIT 2")
+    assert res.fetchall() == [(1, 0, "n0", "[0,1]", messages[0]), (2, 1, "n1", "[1,2]", messages[1])]
+    res = cur.execute("SELECT count(*), sum(id) FROM view WHERE name LIKE 'n1%'")
+    assert res.fetchone() == (111, sum(i for i in range(1000) if str(i).startswith("1")))
+
+    # Constraints on indexed columns are answered by the expression index of the source table
+    cur.execute("CREATE INDEX view_source_id ON view_source(protobuf_extract(data, '$.1', 'int64'))")
+    cur.execute("CREATE INDEX view_source_name ON view_source(protobuf_extract(\"data\", '$.2', 'string'))")
+    res = cur.execute("SELECT rowid, name FROM view WHERE id = 500")
+    assert res.fetchall() == [(501, "n500")]
+    res = cur.execute("SELECT rowid, name FROM view WHERE id = '500'") # Compared with the affinity of the column
+    assert res.fetchall() == [(501, "n500")]
+    res = cur.execute("SELECT id FROM view WHERE id >= 997 ORDER BY id")
+    assert res.fetchall() == [(997,), (998,), (999,)]
+    res = cur.execute("SELECT id FROM view WHERE name = 'n42'")
+    assert res.fetchall() == [(42,)]
+    res = cur.execute("SELECT id FROM view WHERE name = 'N42' COLLATE NOCASE")
+    assert res.fetchall() == [(42,)]
+    res = cur.execute("SELECT id FROM view WHERE name = 'N42' COLLATE NOCASE AND name >= 'n'")
+    assert res.fetchall() == [(42,)]
+    res = cur.execute("SELECT count(*) FROM view_source s JOIN view v ON v.id = protobuf_extract(s.data, '$.1', 'int64') + 1")
+    assert res.fetchone()[0] == 999
+
+    # The indexes are found again when the schema changes
+    def plan(id):
+        return cur.execute("EXPLAIN QUERY PLAN SELECT name FROM view WHERE id = %d" % id).fetchall()[0][-1]
+    assert plan(500).endswith("e0;")
+    cur.execute("DROP INDEX view_source_id")
+    assert not plan(501).endswith("e0;")
+    cur.execute("CREATE INDEX view_source_id ON view_source(protobuf_extract(data, '$.1', 'int64'))")
+    assert plan(502).endswith("e0;")
+
+    # protobuf_extract on the message of the view uses the decoded row
+    res = cur.execute("SELECT protobuf_extract(data, '$.2', 'string'), protobuf_extract(data, '$.3[*]', 'int64'), protobuf_extract(data, '$.4', 'int64') FROM view WHERE id = 7")
+    assert res.fetchall() == [("n7", "[7,8]", None)]
+    expected = cur.execute("SELECT sum(protobuf_extract(data, '$.3', 'int64')) FROM view_source").fetchone()
+    res = cur.execute("SELECT sum(protobuf_extract(data, '$.3', 'int64')) FROM view")
+    assert res.fetchone() == expected
+
+    cur.execute("DROP TABLE view")
+    cur.execute("DROP TABLE view_source")
+    db.commit()
+
+
+def test_protobuf_materialize(db):
+    cur = db.cursor()
+    cur.execute("CREATE TABLE materialize_source(data BLOB)")
+    messages = [encode_int(1, i) + encode_str(2, b"n%d" % i) + encode_int(3, i) + encode_int(3, i + 1) for i in range(10)]
+    cur.executemany("INSERT INTO materialize_source(rowid, data) VALUES (?, ?)", [(i + 1, m) for i, m in enumerate(messages)])
+    spec = "'$.1:int64 AS user_id, $.2:string AS name, $.3[*]:int64 AS tags'"
+
+    # The rows are backfilled in batches, and the triggers keep the side table in sync meanwhile
+    res = cur.execute("SELECT protobuf_materialize('materialize_source', 'data', %s, 4)" % spec)
+    assert res.fetchone()[0] == 4
+    res = cur.execute("SELECT rowid, user_id, name, tags FROM materialize_source_materialized LIMIT 2")
+    assert res.fetchall() == [(1, 0, "n0", "[0,1]"), (2, 1, "n1", "[1,2]")]
+    cur.execute("INSERT INTO materialize_source(rowid, data) VALUES (11, ?)", (encode_int(1, 100),))
+    cur.execute("UPDATE materialize_source SET data = ? WHERE rowid = 2", (encode_int(1, 200),))
+    cur.execute("UPDATE materialize_source SET data = ? WHERE rowid = 6", (encode_int(1, 600),))
+    cur.execute("DELETE FROM materialize_source WHERE rowid = 3")
+    res = cur.execute("SELECT protobuf_materialize('materialize_source', 'data', %s, 4)" % spec)
+    assert res.fetchone()[0] == 3 # Row 6 was written by the trigger
+    res = cur.execute("SELECT protobuf_materialize('materialize_source', 'data', %s)" % spec)
+    assert res.fetchone()[0] == 2
+    res = cur.execute("SELECT protobuf_materialize('materialize_source', 'data', %s)" % spec)
+    assert res.fetchone()[0] == 0
+
+    # Same values as protobuf_extract
+    res = cur.execute("SELECT count(*) FROM materialize_source_materialized")
+    assert res.fetchone()[0] == 10
+    res = cur.execute("""SELECT count(*) FROM materialize_source s JOIN materialize_source_materialized m ON s.rowid = m.rowid
+                         WHERE m.user_id = protobuf_extract(s.data, '$.1', 'int64') AND m.name IS protobuf_extract(s.data, '$.2', 'string')
+                         AND m.tags = protobuf_extract(s.data, '$.3[*]', 'int64')""")
+    assert res.fetchone()[0] == 10
+    res = cur.execute("SELECT user_id FROM materialize_source_materialized WHERE rowid IN (2, 6, 11)")
+    assert res.fetchall() == [(200,), (600,), (100,)]
+
+    # The projection decodes a message as a table valued function
+    res = cur.execute("SELECT user_id, name FROM materialize_source_materialized_decode(?)", (messages[7],))
+    assert res.fetchall() == [(7, "n7")]
+
+    # Errors
+    try:
+        cur.execute("SELECT protobuf_materialize('materialize_source', 'data', '$.1:int64')")
+        assert False
+    except sqlite3.OperationalError as e:
+        assert str(e).startswith("Projection not valid")
+
+    # A NULL projection drops the side table and the triggers
+    cur.execute("SELECT protobuf_materialize('materialize_source', 'data', NULL)")
+    res = cur.execute("SELECT count(*) FROM sqlite_master WHERE name LIKE 'materialize_source_%'")
+    assert res.fetchone()[0] == 0
+    cur.execute("DROP TABLE materialize_source")
+    db.commit()
+
+
+def test_protobuf_index(db):
+    cur = db.cursor()
+    cur.execute("CREATE TABLE index_source(data BLOB)")
+    messages = [encode_int(1, i) + b"".join(encode_int(3, (i * 7 + j) % 20) for j in range(i % 4)) for i in range(50)]
+    cur.executemany("INSERT INTO index_source(rowid, data) VALUES (?, ?)", [(i + 1, m) for i, m in enumerate(messages)])
+    cur.execute("CREATE VIRTUAL TABLE index_tags USING protobuf_index(index_source, data, '$.3[*]', 'int64')")
+
+    values = {i + 1: [(i * 7 + j) % 20 for j in range(i % 4)] for i in range(50)}
+
+    def expected(test):
+        return sorted((v, rowid, k) for rowid, tags in values.items() for k, v in enumerate(tags) if test(v))
+
+    def lookup(where):
+        return cur.execute("SELECT value, rowid, occurrence FROM index_tags WHERE %s ORDER BY value" % where).fetchall()
+
+    # Equality and range lookups give the same values as protobuf_each
+    tests = {"value = 5": lambda v: v == 5, "value > 15": lambda v: v > 15, "value >= 3 AND value < 7": lambda v: 3 <= v < 7,
+             "value <= 2": lambda v: v <= 2, "value = '5'": lambda v: v == 5, "1": lambda v: True}
+    for where, test in tests.items():
+        assert lookup(where) == expected(test), where
+    plan = cur.execute("EXPLAIN QUERY PLAN SELECT rowid FROM index_tags WHERE value = 5").fetchall()
+    assert "e0;" in str(plan)
+    res = cur.execute("SELECT value, occurrence FROM index_tags WHERE rowid = 4 ORDER BY occurrence")
+    assert res.fetchall() == [(1, 0), (2, 1), (3, 2)]
+
+    # The triggers keep the index in sync with the source table
+    cur.execute("INSERT INTO index_source(rowid, data) VALUES (100, ?)", (encode_int(3, 1000) + encode_int(3, 1001),))
+    cur.execute("UPDATE index_source SET data = ? WHERE rowid = 4", (encode_int(3, 1000),))
+    cur.execute("DELETE FROM index_source WHERE rowid = 100")
+    cur.execute("UPDATE index_source SET rowid = 200 WHERE rowid = 4")
+    values[200] = [1000]
+    del values[4]
+    assert lookup("value >= 1000") == [(1000, 200, 0)]
+    assert lookup("value > 15") == expected(tests["value > 15"])
+
+    # The triggers decode the values with an innocuous function, so they also work when the schema is not trusted
+    res = cur.execute("SELECT value, occurrence FROM protobuf_index_decode(?, '$.3[*]', 'int64')", (encode_int(3, 8) + encode_int(3, 9),))
+    assert res.fetchall() == [(8, 0), (9, 1)]
+    cur.execute("PRAGMA trusted_schema=OFF")
+    try:
+        cur.execute("INSERT INTO index_source(rowid, data) VALUES (300, ?)", (encode_int(3, 2000),))
+        cur.execute("UPDATE index_source SET data = ? WHERE rowid = 300", (encode_int(3, 2001),))
+        assert lookup("value >= 2000") == [(2001, 300, 0)]
+        cur.execute("DELETE FROM index_source WHERE rowid = 300")
+        assert lookup("value >= 2000") == []
+    finally:
+        cur.execute("PRAGMA trusted_schema=ON")
+
+    # The values table is not a shadow table, so the triggers also work when the shadow tables are read only
+    if hasattr(db, "setconfig"):
+        db.setconfig(sqlite3.SQLITE_DBCONFIG_DEFENSIVE, True)
+        try:
+            cur.execute("INSERT INTO index_source(rowid, data) VALUES (300, ?)", (encode_int(3, 2000),))
+            assert lookup("value >= 2000") == [(2000, 300, 0)]
+            cur.execute("DELETE FROM index_source WHERE rowid = 300")
+            assert lookup("value >= 2000") == []
+        finally:
+            db.setconfig(sqlite3.SQLITE_DBCONFIG_DEFENSIVE, False)
+
+    # Commands
+    cur.execute("DELETE FROM index_tags_values")
+    cur.execute("INSERT INTO index_tags(index_tags) VALUES ('rebuild')")
+    assert lookup("1") == expected(tests["1"])
+    try:
+        cur.execute("DELETE FROM index_tags")
+        assert False
+    except sqlite3.OperationalError as e:
+        assert "modify the source table" in str(e)
+
+    # Dropping the table drops the values table and the triggers
+    cur.execute("DROP TABLE index_tags")
+    res = cur.execute("SELECT count(*) FROM sqlite_master WHERE name LIKE 'index_tags%'")
+    assert res.fetchone()[0] == 0
+    cur.execute("DROP TABLE index_source")
+    db.commit()
+
+
+def test_protobuf_tokenizer(db):
+    cur = db.cursor()
+    messages = [
+        encode_str(1, b"Hello world") + encode_int(2, 7) + encode_str(3, encode_str(1, b"nested Text")),
+        encode_str(2, b"hello again") + encode_str(3, encode_str(1, b"world")),
+        encode_int(1, 42) + encode_str(2, b"\x00\x01binary"),
+    ]
+
+    # All text fields, including the ones of sub messages, and no numeric fields
+    cur.execute("CREATE VIRTUAL TABLE tokenizer_docs USING fts5(data, tokenize = 'protobuf')")
+    cur.executemany("INSERT INTO tokenizer_docs(rowid, data) VALUES (?, ?)", [(i + 1, m) for i, m in enumerate(messages)])
+    def match(table, query):
+        return [r[0] for r in cur.execute("SELECT rowid FROM %s WHERE %s MATCH ? ORDER BY rowid" % (table, table), (query,))]
+    assert match("tokenizer_docs", "hello") == [1, 2]
+    assert match("tokenizer_docs", "WORLD") == [1, 2]
+    assert match("tokenizer_docs", "text") == [1]
+    assert match("tokenizer_docs", "hel*") == [1, 2]
+    assert match("tokenizer_docs", "binary") == []
+    assert match("tokenizer_docs", "42") == []
+    res = cur.execute("SELECT CAST(highlight(tokenizer_docs, 0, '[', ']') AS BLOB) FROM tokenizer_docs WHERE tokenizer_docs MATCH 'again'")
+    assert res.fetchone()[0] == messages[1].replace(b"again", b"[again]")
+
+    # Field numbers and paths
+    cur.execute("""CREATE VIRTUAL TABLE tokenizer_fields USING fts5(data, tokenize = "protobuf fields '$.1' '$.3'")""")
+    cur.executemany("INSERT INTO tokenizer_fields(rowid, data) VALUES (?, ?)", [(i + 1, m) for i, m in enumerate(messages)])
+    assert match("tokenizer_fields", "hello") == [1]
+    assert match("tokenizer_fields", "world") == [1, 2]
+    assert match("tokenizer_fields", '"1:world"') == [1, 2]
+    assert match("tokenizer_fields", '"1:hello" AND "1:nested"') == [1]
+    assert match("tokenizer_fields", '"3:world"') == []
+
+    # Bytes that are both text and a message are a message like in protobuf_to_json
+    document = encode_str(5, encode_str(4, b"Hello World, this is some text!!"))
+    cur.execute("""CREATE VIRTUAL TABLE tokenizer_nested USING fts5(data, tokenize = "protobuf fields")""")
+    cur.execute("""CREATE VIRTUAL TABLE tokenizer_nested_path USING fts5(data, tokenize = "protobuf fields '$.5'")""")
+    for table in ["tokenizer_nested", "tokenizer_nested_path"]:
+        cur.execute("INSERT INTO %s(rowid, data) VALUES (1, ?)" % table, [document])
+        assert match(table, '"4:hello"') == [1]
+        assert match(table, '"5:hello"') == []
+
+    cur.execute("DROP TABLE tokenizer_docs")
+    cur.execute("DROP TABLE tokenizer_fields")
+    cur.execute("DROP TABLE tokenizer_nested")
+    cur.execute("DROP TABLE tokenizer_nested_path")
+    db.commit()
+
+
+def test_protobuf_stats(db):
+    cur = db.cursor()
+    def stats(function, path=None):
+        res = cur.execute("SELECT calls, bytes, cache_hits, cache_misses, speculative_failures, max_depth, histogram FROM protobuf_stats WHERE function = ? AND path IS ?", (function, path))
+        return res.fetchone()
+
+    # The table is empty when the statistics are compiled out
+    if stats("protobuf_extract") is None:
+        return
+
+    message = encode_int(1, 5) + encode_str(2, b"hello") + encode_str(3, encode_str(1, encode_int(1, 7)))
+    before = stats("protobuf_extract")
+    before_path = stats("protobuf_extract", "$.3.1.1") or (0, 0)
+    cur.execute("CREATE TABLE stats_source(data BLOB)")
+    cur.executemany("INSERT INTO stats_source(data) VALUES (?)", [(message,)] * 10)
+    res = cur.execute("SELECT sum(protobuf_extract(data, '$.3.1.1', 'int64')) FROM stats_source")
+    assert res.fetchone()[0] == 70
+
+    # Calls are counted for the function and for the path, the same message is only decoded once
+    after = stats("protobuf_extract")
+    assert after[0] - before[0] == 10
+    assert after[1] - before[1] == 10 * len(message)
+    assert after[2] - before[2] >= 9
+    assert after[4] >= 1 # "hello" is not a sub message
+    assert after[5] >= 3
+    assert sum(json.loads(after[6]).values()) == after[0]
+    after_path = stats("protobuf_extract", "$.3.1.1")
+    assert after_path[0] - before_path[0] == 10
+    assert after_path[1] - before_path[1] == 10 * len(message)
+
+    before = stats("protobuf_to_json")
+    cur.execute("SELECT protobuf_to_json(data) FROM stats_source").fetchall()
+    assert stats("protobuf_to_json")[0] - before[0] == 10
+    assert stats("path_cache")[0] > 0
+
+    # Calls of protobuf_each are recorded once all rows are read
+    before = stats("protobuf_each")
+    res = cur.execute("SELECT count(*) FROM stats_source, protobuf_each(stats_source.data, '$.3.1')")
+    assert res.fetchone()[0] == 10
+    after = stats("protobuf_each")
+    assert after[0] - before[0] == 10
+    assert after[4] >= before[4]
+
+    # Slow calls are logged, the log cannot be read from Python so only the arguments are checked
+    cur.execute("SELECT protobuf_slow_log(1000000, 1000000, 1)")
+    cur.execute("SELECT protobuf_slow_log(NULL, NULL)")
+    try:
+        cur.execute("SELECT protobuf_slow_log(-1, NULL)")
+        assert False
+    except sqlite3.OperationalError as e:
+        assert "must not be negative" in str(e)
+    cur.execute("DROP TABLE stats_source")
+    db.commit()
+
+
+def test_protobuf_trace(db):
+    cur = db.cursor()
+    message = encode_int(1, 5) + encode_str(2, b"hello") + encode_str(3, encode_str(1, encode_int(1, 7)))
+    cur.execute("SELECT protobuf_to_json(?), protobuf_extract(?, '$.3.1.1', 'int64')", (message, message)).fetchall()
+
+    # Spans are only recorded when tracing is compiled in
+    try:
+        res = cur.execute("SELECT protobuf_trace_dump('trace.json')")
+    except sqlite3.OperationalError as e:
+        assert "compiled out" in str(e)
+        return
+    count = res.fetchone()[0]
+    with open("trace.json") as f:
+        trace = json.load(f)
+    assert len(trace["traceEvents"]) == count
+    names = set(event["name"] for event in trace["traceEvents"])
+    assert {"decodeProtobuf", "toJson", "traverse_path"} <= names
+    assert all(event["ph"] == "X" and event["dur"] >= 0 for event in trace["traceEvents"])
+    os.remove("trace.json")
+
+
+def test_protobuf_extract_threads(db):
+    cur = db.cursor()
+    messages = [encode_int(1, i) + encode_str(2, ("message %d" % i).encode()) + encode_str(3, encode_int(1, i * 2)) for i in range(500)]
+    cur.execute("CREATE TABLE threads_source(id INTEGER PRIMARY KEY, data BLOB)")
+    cur.executemany("INSERT INTO threads_source(id, data) VALUES (?, ?)", list(enumerate(messages)))
+    db.commit()
+
+    # Threads with their own connections extract several fields of the same rows at the same time
+    errors = []
+    def run():
+        conn = sqlite3.connect("test.db")
+        conn.enable_load_extension(True)
+        conn.load_extension("./sqlite_protobuf")
+        try:
+            for _ in range(20):
+                res = conn.execute("SELECT id, protobuf_extract(data, '$.1', 'int64'), protobuf_extract(data, '$.2', 'string'), protobuf_locate(data, '$.3.1') FROM threads_source")
+                for id, number, text, location in res:
+                    if number != id or text != "message %d" % id or json.loads(location)[0] != len(messages[id]) - len(encode_int(1, id * 2)) + 1:
+                        errors.append((id, number, text, location))
+        finally:
+            conn.close()
+    threads = [threading.Thread(target=run) for _ in range(4)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert errors == []
+    cur.execute("DROP TABLE threads_source")
+    db.commit()
+
 
 def main():
     # Load data base and sqlite_protobuf extension
@@ -336,6 +1319,24 @@ def main():
     test_protobuf_to_json(db)
     test_protobuf_to_extract(db)
     test_protobuf_each(db)
+    test_protobuf_contains_text(db)
+    test_protobuf_locate(db)
+    test_protobuf_extract_blob(db)
+    test_protobuf_path(db)
+    test_protobuf_path_extensions(db)
+    test_protobuf_tree(db)
+    test_protobuf_shred(db)
+    test_protobuf_file(db)
+    test_protobuf_import(db)
+    test_protobuf_scan(db)
+    test_protobuf_convert_table(db)
+    test_protobuf_view(db)
+    test_protobuf_materialize(db)
+    test_protobuf_index(db)
+    test_protobuf_tokenizer(db)
+    test_protobuf_stats(db)
+    test_protobuf_trace(db)
+    test_protobuf_extract_threads(db)
 
 
 if __name__ == "__main__":